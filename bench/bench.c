@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * ttree_bench: throughput and latency of T*-tree against reference
+ * indexes. For every combination of index, key distribution,
+ * tree size and number of keys per node the following phases are run
+ * on the same index one after another:
+ *  insert - all items are inserted into an empty index
+ *  lookup - point lookups of existing keys
+ *  range  - scans of RANGE_LEN items starting from existing keys
+ *  mixed  - lookups half of the time, otherwise a new key is inserted
+ *           and the one inserted MIXED_WINDOW operations ago is deleted
+ *  delete - items are removed in order they were inserted
+ *
+ * Distribution defines both order of keys on insertion and the pattern
+ * of accessing them later: "seq" inserts ascending keys and walks
+ * over them sequentially, "uniform" uses pseudo random distinct keys
+ * accessed uniformly and "zipf" uses the same keys accessed with
+ * zipfian distribution, so a few of them are hot.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "ttree_defs.h"
+#include "bench.h"
+
+#define RANGE_LEN      100
+#define MIXED_WINDOW   1024
+#define SAMPLE_SHIFT   4    /* latency of every 16th operation is sampled */
+#define ZIPF_THETA     0.99
+#define SARRAY_MAX     100000
+#define MAX_LIST       32
+
+enum distribution {
+    DIST_SEQ,
+    DIST_UNIFORM,
+    DIST_ZIPF,
+};
+
+static const char *dist_names[] = { "seq", "uniform", "zipf" };
+
+static const struct bench_index *indexes[] = {
+    &bench_ttree,
+    &bench_ttree_inline,
+    &bench_rbtree,
+    &bench_bptree,
+    &bench_sarray,
+};
+
+#define NUM_INDEXES (sizeof(indexes) / sizeof(indexes[0]))
+
+struct key_gen {
+    enum distribution dist;
+    uint64_t n;
+    uint64_t seed;
+
+    /* zipfian generator state */
+    double zetan, alpha, eta;
+};
+
+struct phase_stats {
+    uint64_t ops;
+    double secs;
+    uint64_t *samples;
+    size_t num_samples;
+};
+
+static uint64_t sink;
+static size_t max_ops = 1000000;
+static size_t sarray_max = SARRAY_MAX;
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t next_random(struct key_gen *gen)
+{
+    gen->seed = splitmix64(gen->seed);
+    return gen->seed;
+}
+
+/*
+ * Key of i-th item. splitmix64 is a bijection, so keys of
+ * different items never collide.
+ */
+static inline uint64_t item_key(struct key_gen *gen, uint64_t i)
+{
+    return (gen->dist == DIST_SEQ) ? i : splitmix64(i);
+}
+
+static double zeta(uint64_t n, double theta)
+{
+    double sum = 0;
+    uint64_t i;
+
+    for (i = 1; i <= n; i++) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+
+    return sum;
+}
+
+static void key_gen_init(struct key_gen *gen, enum distribution dist,
+                         uint64_t n)
+{
+    memset(gen, 0, sizeof(*gen));
+    gen->dist = dist;
+    gen->n = n;
+    gen->seed = n;
+    if (dist == DIST_ZIPF) {
+        double zeta2 = zeta(2, ZIPF_THETA);
+
+        gen->zetan = zeta(n, ZIPF_THETA);
+        gen->alpha = 1.0 / (1.0 - ZIPF_THETA);
+        gen->eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) /
+            (1.0 - zeta2 / gen->zetan);
+    }
+}
+
+/* Index of an existing item the j-th access goes to. */
+static uint64_t next_access(struct key_gen *gen, uint64_t j)
+{
+    double u, uz;
+    uint64_t i;
+
+    switch (gen->dist) {
+    case DIST_SEQ:
+        return j % gen->n;
+    case DIST_UNIFORM:
+        return next_random(gen) % gen->n;
+    case DIST_ZIPF:
+        u = (double)(next_random(gen) >> 11) / (double)(1ULL << 53);
+        uz = u * gen->zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, ZIPF_THETA)) {
+            return 1;
+        }
+
+        i = (uint64_t)(gen->n * pow(gen->eta * u - gen->eta + 1.0,
+                                    gen->alpha));
+        return (i < gen->n) ? i : gen->n - 1;
+    }
+
+    abort();
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_samples(const void *a, const void *b)
+{
+    uint64_t s1 = *(const uint64_t *)a, s2 = *(const uint64_t *)b;
+
+    return (s1 > s2) - (s1 < s2);
+}
+
+static uint64_t percentile(struct phase_stats *ps, int pct)
+{
+    if (!ps->num_samples) {
+        return 0;
+    }
+
+    return ps->samples[(ps->num_samples - 1) * pct / 100];
+}
+
+static void phase_begin(struct phase_stats *ps, uint64_t ops)
+{
+    ps->ops = ops;
+    ps->num_samples = 0;
+    ps->secs = (double)now_ns();
+}
+
+static void phase_end(struct phase_stats *ps)
+{
+    ps->secs = ((double)now_ns() - ps->secs) / 1e9;
+    qsort(ps->samples, ps->num_samples, sizeof(*ps->samples), cmp_samples);
+}
+
+static void phase_report(const struct bench_index *idx, struct key_gen *gen,
+                         int fanout, const char *phase,
+                         struct phase_stats *ps)
+{
+    printf("%-13s %-8s %10llu %6d %-7s %10llu %10.3f %8llu %8llu\n",
+           idx->name, dist_names[gen->dist], (unsigned long long)gen->n,
+           fanout, phase, (unsigned long long)ps->ops,
+           ps->secs ? ps->ops / ps->secs / 1e6 : 0.0,
+           (unsigned long long)percentile(ps, 50),
+           (unsigned long long)percentile(ps, 99));
+}
+
+/*
+ * Run operation @op_expr @ops times sampling latency of every
+ * (1 << SAMPLE_SHIFT)-th one.
+ */
+#define RUN_PHASE(ps, ops, j, op_expr)                                  \
+    do {                                                                \
+        phase_begin(ps, ops);                                           \
+        for (j = 0; j < (ops); j++) {                                   \
+            if (!(j & ((1 << SAMPLE_SHIFT) - 1))) {                     \
+                uint64_t __t = now_ns();                                \
+                op_expr;                                                \
+                (ps)->samples[(ps)->num_samples++] = now_ns() - __t;    \
+            }                                                           \
+            else {                                                      \
+                op_expr;                                                \
+            }                                                           \
+        }                                                               \
+        phase_end(ps);                                                  \
+    } while (0)
+
+static int bench_one(const struct bench_index *idx, enum distribution dist,
+                     uint64_t n, int fanout)
+{
+    struct key_gen gen;
+    struct phase_stats ps;
+    struct bench_item *items;
+    uint64_t ops = (n < max_ops) ? n : max_ops, j, errors = 0;
+    void *index;
+
+    key_gen_init(&gen, dist, n);
+    items = malloc(sizeof(*items) * (n + ops));
+    ps.samples = malloc(sizeof(*ps.samples) *
+                        ((((n > ops) ? n : ops) >> SAMPLE_SHIFT) + 1));
+    index = idx->create(fanout);
+    if (!items || !ps.samples || !index) {
+        fprintf(stderr, "%s: not enough memory for %llu items\n",
+                idx->name, (unsigned long long)n);
+        free(items);
+        free(ps.samples);
+        if (index) {
+            idx->destroy(index);
+        }
+
+        return -1;
+    }
+    for (j = 0; j < n + ops; j++) {
+        items[j].key = item_key(&gen, j);
+    }
+
+    RUN_PHASE(&ps, n, j, errors += (idx->insert(index, &items[j]) < 0));
+    phase_report(idx, &gen, fanout, "insert", &ps);
+
+    RUN_PHASE(&ps, ops, j, {
+            uint64_t i = next_access(&gen, j);
+
+            errors += (idx->lookup(index, items[i].key) != &items[i]);
+        });
+    phase_report(idx, &gen, fanout, "lookup", &ps);
+
+    RUN_PHASE(&ps, ops, j,
+              sink += idx->scan(index, items[next_access(&gen, j)].key,
+                                RANGE_LEN));
+    phase_report(idx, &gen, fanout, "range", &ps);
+
+    /*
+     * Items inserted by mixed phase stay in the index for
+     * MIXED_WINDOW operations, so the size of the index keeps close
+     * to n. The latter ones are removed after the phase.
+     */
+    RUN_PHASE(&ps, ops, j, {
+            uint64_t r = next_random(&gen);
+
+            if (r & 1) {
+                uint64_t i = next_access(&gen, j);
+
+                errors += (idx->lookup(index, items[i].key) != &items[i]);
+            }
+            else {
+                errors += (idx->insert(index, &items[n + j]) < 0);
+                if (j >= MIXED_WINDOW) {
+                    idx->remove(index, items[n + j - MIXED_WINDOW].key);
+                }
+            }
+        });
+    phase_report(idx, &gen, fanout, "mixed", &ps);
+    for (j = (ops > MIXED_WINDOW) ? ops - MIXED_WINDOW : 0; j < ops; j++) {
+        idx->remove(index, items[n + j].key);
+    }
+
+    RUN_PHASE(&ps, n, j, errors += (idx->remove(index, items[j].key) !=
+                                    &items[j]));
+    phase_report(idx, &gen, fanout, "delete", &ps);
+    errors += (idx->lookup(index, items[0].key) != NULL);
+
+    idx->destroy(index);
+    free(ps.samples);
+    free(items);
+    if (errors) {
+        fprintf(stderr, "%s: %llu operations gave wrong results\n",
+                idx->name, (unsigned long long)errors);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_list(char *str, char **list)
+{
+    int num = 0;
+    char *tok;
+
+    for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+        if (num == MAX_LIST) {
+            fprintf(stderr, "Too many values in a list\n");
+            exit(EXIT_FAILURE);
+        }
+
+        list[num++] = tok;
+    }
+
+    return num;
+}
+
+static int lookup_name(const char *name, const char **names, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (!strcmp(name, names[i])) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "Unknown name: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-s structs] [-d dists] [-n sizes] [-k keys] "
+           "[-o ops] [-a max]\n", prog);
+    printf("  -s  comma separated indexes: ttree,ttree-inline,rbtree,"
+           "bptree,sarray (default all)\n");
+    printf("  -d  key distributions: seq,uniform,zipf (default all)\n");
+    printf("  -n  number of items, e.g. 1e3,1e6,1e8 (default 1e3,1e4,1e5,1e6)\n");
+    printf("  -k  keys per T*-tree node or B+-tree fanout (default 8,32,128)\n");
+    printf("  -o  maximum number of operations in lookup, range and"
+           " mixed phases (default %zu)\n", max_ops);
+    printf("  -a  maximum number of items in sorted array, insertion"
+           " is quadratic (default %d)\n", SARRAY_MAX);
+}
+
+int main(int argc, char *argv[])
+{
+    char *list[MAX_LIST], *structs = NULL, *dists = NULL;
+    char sizes[] = "1e3,1e4,1e5,1e6", fanouts[] = "8,32,128";
+    char *sizes_arg = sizes, *fanouts_arg = fanouts;
+    const char *index_names[NUM_INDEXES];
+    bool use_index[NUM_INDEXES], use_dist[3];
+    uint64_t nums[MAX_LIST];
+    int keys[MAX_LIST], num_sizes, num_keys, opt, i, d, s, k, ret = 0;
+
+    while ((opt = getopt(argc, argv, "s:d:n:k:o:a:h")) != -1) {
+        switch (opt) {
+        case 's':
+            structs = optarg;
+            break;
+        case 'd':
+            dists = optarg;
+            break;
+        case 'n':
+            sizes_arg = optarg;
+            break;
+        case 'k':
+            fanouts_arg = optarg;
+            break;
+        case 'o':
+            max_ops = (size_t)strtod(optarg, NULL);
+            break;
+        case 'a':
+            sarray_max = (size_t)strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < (int)NUM_INDEXES; i++) {
+        index_names[i] = indexes[i]->name;
+        use_index[i] = !structs;
+    }
+    if (structs) {
+        for (s = parse_list(structs, list), i = 0; i < s; i++) {
+            use_index[lookup_name(list[i], index_names, NUM_INDEXES)] = true;
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        use_dist[i] = !dists;
+    }
+    if (dists) {
+        for (d = parse_list(dists, list), i = 0; i < d; i++) {
+            use_dist[lookup_name(list[i], dist_names, 3)] = true;
+        }
+    }
+
+    num_sizes = parse_list(sizes_arg, list);
+    for (i = 0; i < num_sizes; i++) {
+        nums[i] = (uint64_t)strtod(list[i], NULL);
+        if (nums[i] < 2) {
+            fprintf(stderr, "Invalid number of items: %s\n", list[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    num_keys = parse_list(fanouts_arg, list);
+    for (i = 0; i < num_keys; i++) {
+        keys[i] = atoi(list[i]);
+        if ((keys[i] < TNODE_ITEMS_MIN) || (keys[i] > TNODE_ITEMS_MAX)) {
+            fprintf(stderr, "Invalid number of keys: %s\n", list[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_ops == 0) {
+        max_ops = 1;
+    }
+
+    printf("%-13s %-8s %10s %6s %-7s %10s %10s %8s %8s\n",
+           "index", "dist", "items", "keys", "phase", "ops",
+           "Mops/s", "p50(ns)", "p99(ns)");
+    for (s = 0; s < (int)NUM_INDEXES; s++) {
+        if (!use_index[s]) {
+            continue;
+        }
+        for (d = 0; d < 3; d++) {
+            if (!use_dist[d]) {
+                continue;
+            }
+            for (i = 0; i < num_sizes; i++) {
+                if ((indexes[s] == &bench_sarray) && (nums[i] > sarray_max)) {
+                    continue;
+                }
+                for (k = 0; k < num_keys; k++) {
+                    /* RB-tree and sorted array have no fanout */
+                    bool no_fanout = ((indexes[s] == &bench_rbtree) ||
+                                      (indexes[s] == &bench_sarray));
+
+                    if (no_fanout && (k > 0)) {
+                        break;
+                    }
+                    if (bench_one(indexes[s], d, nums[i],
+                                  no_fanout ? 0 : keys[k]) < 0) {
+                        ret = EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "checksum: %llx\n", (unsigned long long)sink);
+    return ret;
+}
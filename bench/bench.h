@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * @file bench.h
+ * @brief Common interface of indexes compared by ttree_bench
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct bench_item {
+    uint64_t key;
+};
+
+/*
+ * Every index keeps pointers to items, so that all of them do the
+ * same amount of work per item. Unique keys are assumed.
+ */
+struct bench_index {
+    const char *name;
+
+    /* @fanout is a number of keys per node, ignored if not applicable */
+    void *(*create)(int fanout);
+    void (*destroy)(void *index);
+
+    /* returns 0 on success, -1 if key exists or memory is exhausted */
+    int (*insert)(void *index, struct bench_item *item);
+    struct bench_item *(*lookup)(void *index, uint64_t key);
+    struct bench_item *(*remove)(void *index, uint64_t key);
+
+    /*
+     * Visit up to @count items starting from the first one with key
+     * not less than @from. Returns sum of visited keys.
+     */
+    uint64_t (*scan)(void *index, uint64_t from, size_t count);
+};
+
+extern const struct bench_index bench_ttree;
+extern const struct bench_index bench_ttree_inline;
+extern const struct bench_index bench_rbtree;
+extern const struct bench_index bench_bptree;
+extern const struct bench_index bench_sarray;
+
+#endif /* !__BENCH_H__ */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * T*-tree adapters of the benchmark: one with keys referenced from
+ * nodes as the classic T*-tree does and one with inline 64-bit keys
+ * searched by the typed lookup.
+ */
+
+#include <stdlib.h>
+#include "ttree.h"
+#include "bench.h"
+
+static int cmp_keys(void *key1, void *key2)
+{
+    uint64_t k1 = *(uint64_t *)key1, k2 = *(uint64_t *)key2;
+
+    return (k1 > k2) - (k1 < k2);
+}
+
+static void *ttree_create_kind(int fanout, bool inline_keys)
+{
+    Ttree *tree = malloc(sizeof(*tree));
+    int ret;
+
+    if (!tree) {
+        return NULL;
+    }
+    if (inline_keys) {
+        ret = ttree_init_inline(tree, fanout, true, cmp_keys,
+                                struct bench_item, key);
+    }
+    else {
+        ret = ttree_init(tree, fanout, true, cmp_keys,
+                         struct bench_item, key);
+    }
+    if ((ret < 0) || (ttree_use_slab(tree, 0) < 0)) {
+        free(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+static void *ttree_create(int fanout)
+{
+    return ttree_create_kind(fanout, false);
+}
+
+static void *ttree_create_inline(int fanout)
+{
+    return ttree_create_kind(fanout, true);
+}
+
+static void ttree_bench_destroy(void *index)
+{
+    ttree_destroy(index);
+    free(index);
+}
+
+static int ttree_bench_insert(void *index, struct bench_item *item)
+{
+    return ttree_insert(index, item);
+}
+
+static struct bench_item *ttree_bench_lookup(void *index, uint64_t key)
+{
+    return ttree_lookup(index, &key, NULL);
+}
+
+static struct bench_item *ttree_bench_lookup_u64(void *index, uint64_t key)
+{
+    return ttree_lookup_u64(index, key, NULL);
+}
+
+static struct bench_item *ttree_bench_remove(void *index, uint64_t key)
+{
+    return ttree_delete(index, &key);
+}
+
+static uint64_t ttree_bench_scan(void *index, uint64_t from, size_t count)
+{
+    TtreeCursor cursor;
+    struct bench_item *item;
+    uint64_t sum = 0;
+
+    ttree_lookup(index, &from, &cursor);
+    if (!cursor.tnode) {
+        return 0;
+    }
+    if ((cursor.state == CURSOR_PENDING) &&
+        (ttree_cursor_next(&cursor) != TCSR_OK)) {
+        return 0;
+    }
+
+    while (count--) {
+        item = ttree_item_from_cursor(&cursor);
+        if (!item) {
+            break;
+        }
+
+        sum += item->key;
+        if (ttree_cursor_next(&cursor) != TCSR_OK) {
+            break;
+        }
+    }
+
+    return sum;
+}
+
+const struct bench_index bench_ttree = {
+    .name = "ttree",
+    .create = ttree_create,
+    .destroy = ttree_bench_destroy,
+    .insert = ttree_bench_insert,
+    .lookup = ttree_bench_lookup,
+    .remove = ttree_bench_remove,
+    .scan = ttree_bench_scan,
+};
+
+const struct bench_index bench_ttree_inline = {
+    .name = "ttree-inline",
+    .create = ttree_create_inline,
+    .destroy = ttree_bench_destroy,
+    .insert = ttree_bench_insert,
+    .lookup = ttree_bench_lookup_u64,
+    .remove = ttree_bench_remove,
+    .scan = ttree_bench_scan,
+};
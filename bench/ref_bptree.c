@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * B+-tree reference index. Inner nodes keep separator keys and
+ * children, leafs keep keys next to item pointers and are chained
+ * for scans. Nodes hold up to fanout keys and at least a half of it,
+ * except the root.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "bench.h"
+
+struct bp_node {
+    bool leaf;
+    int num;                /* number of keys */
+    struct bp_node *next;   /* next leaf */
+    uint64_t *keys;         /* room for fanout + 1 keys */
+    void **ptrs;            /* children or items, fanout + 2 rooms */
+};
+
+struct bp_tree {
+    struct bp_node *root;
+    int fanout;
+};
+
+#define bp_min_keys(t) ((t)->fanout >> 1)
+
+static struct bp_node *bp_alloc(struct bp_tree *t, bool leaf)
+{
+    struct bp_node *n;
+    size_t keys = sizeof(uint64_t) * (t->fanout + 1);
+
+    n = malloc(sizeof(*n) + keys + sizeof(void *) * (t->fanout + 2));
+    if (!n) {
+        return NULL;
+    }
+
+    n->leaf = leaf;
+    n->num = 0;
+    n->next = NULL;
+    n->keys = (uint64_t *)(n + 1);
+    n->ptrs = (void **)((char *)n->keys + keys);
+    return n;
+}
+
+static void *bp_create(int fanout)
+{
+    struct bp_tree *t = malloc(sizeof(*t));
+
+    if (!t) {
+        return NULL;
+    }
+
+    t->fanout = (fanout < 4) ? 4 : fanout;
+    t->root = bp_alloc(t, true);
+    if (!t->root) {
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+static void bp_free(struct bp_node *n)
+{
+    int i;
+
+    if (!n->leaf) {
+        for (i = 0; i <= n->num; i++) {
+            bp_free(n->ptrs[i]);
+        }
+    }
+
+    free(n);
+}
+
+static void bp_destroy(void *index)
+{
+    struct bp_tree *t = index;
+
+    bp_free(t->root);
+    free(t);
+}
+
+/* Index of the first key not less than @key. */
+static int bp_lower_bound(struct bp_node *n, uint64_t key)
+{
+    int lo = 0, hi = n->num, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (n->keys[mid] < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Child of an inner node the key belongs to. */
+static int bp_child(struct bp_node *n, uint64_t key)
+{
+    int i = bp_lower_bound(n, key);
+
+    return ((i < n->num) && (n->keys[i] == key)) ? i + 1 : i;
+}
+
+static void bp_insert_at(struct bp_node *n, int i, uint64_t key, void *ptr)
+{
+    int p = n->leaf ? i : i + 1;
+
+    memmove(n->keys + i + 1, n->keys + i, sizeof(*n->keys) * (n->num - i));
+    memmove(n->ptrs + p + 1, n->ptrs + p,
+            sizeof(*n->ptrs) * (n->num + !n->leaf - p));
+    n->keys[i] = key;
+    n->ptrs[p] = ptr;
+    n->num++;
+}
+
+/*
+ * Split an overflown node. The right half goes to a new node,
+ * @sep gets the key separating the halves.
+ */
+static struct bp_node *bp_split(struct bp_tree *t, struct bp_node *n,
+                                uint64_t *sep)
+{
+    struct bp_node *r = bp_alloc(t, n->leaf);
+    int mid = n->num >> 1;
+
+    if (!r) {
+        return NULL;
+    }
+    if (n->leaf) {
+        r->num = n->num - mid;
+        memcpy(r->keys, n->keys + mid, sizeof(*n->keys) * r->num);
+        memcpy(r->ptrs, n->ptrs + mid, sizeof(*n->ptrs) * r->num);
+        r->next = n->next;
+        n->next = r;
+        *sep = r->keys[0];
+    }
+    else {
+        r->num = n->num - mid - 1;
+        memcpy(r->keys, n->keys + mid + 1, sizeof(*n->keys) * r->num);
+        memcpy(r->ptrs, n->ptrs + mid + 1, sizeof(*n->ptrs) * (r->num + 1));
+        *sep = n->keys[mid];
+    }
+
+    n->num = mid;
+    return r;
+}
+
+/* Returns 1 if @n overflows after the insertion, -1 on failure. */
+static int __bp_insert(struct bp_tree *t, struct bp_node *n,
+                       struct bench_item *item)
+{
+    struct bp_node *c, *r;
+    uint64_t sep;
+    int i, ret;
+
+    if (n->leaf) {
+        i = bp_lower_bound(n, item->key);
+        if ((i < n->num) && (n->keys[i] == item->key)) {
+            return -1;
+        }
+
+        bp_insert_at(n, i, item->key, item);
+        return (n->num > t->fanout);
+    }
+
+    i = bp_child(n, item->key);
+    c = n->ptrs[i];
+    ret = __bp_insert(t, c, item);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    r = bp_split(t, c, &sep);
+    if (!r) {
+        return -1;
+    }
+
+    bp_insert_at(n, i, sep, r);
+    return (n->num > t->fanout);
+}
+
+static int bp_insert(void *index, struct bench_item *item)
+{
+    struct bp_tree *t = index;
+    struct bp_node *root, *r;
+    uint64_t sep;
+    int ret;
+
+    ret = __bp_insert(t, t->root, item);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    root = bp_alloc(t, false);
+    r = root ? bp_split(t, t->root, &sep) : NULL;
+    if (!r) {
+        free(root);
+        return -1;
+    }
+
+    root->num = 1;
+    root->keys[0] = sep;
+    root->ptrs[0] = t->root;
+    root->ptrs[1] = r;
+    t->root = root;
+    return 0;
+}
+
+static struct bp_node *bp_find_leaf(struct bp_tree *t, uint64_t key)
+{
+    struct bp_node *n = t->root;
+
+    while (!n->leaf) {
+        n = n->ptrs[bp_child(n, key)];
+    }
+
+    return n;
+}
+
+static struct bench_item *bp_lookup(void *index, uint64_t key)
+{
+    struct bp_node *n = bp_find_leaf(index, key);
+    int i = bp_lower_bound(n, key);
+
+    return ((i < n->num) && (n->keys[i] == key)) ? n->ptrs[i] : NULL;
+}
+
+static void bp_remove_at(struct bp_node *n, int i)
+{
+    int p = n->leaf ? i : i + 1;
+
+    memmove(n->keys + i, n->keys + i + 1, sizeof(*n->keys) * (n->num - i - 1));
+    memmove(n->ptrs + p, n->ptrs + p + 1,
+            sizeof(*n->ptrs) * (n->num + !n->leaf - p - 1));
+    n->num--;
+}
+
+/* Child @i of @n underflows: borrow a key from a sibling or merge. */
+static void bp_fix_child(struct bp_tree *t, struct bp_node *n, int i)
+{
+    struct bp_node *c = n->ptrs[i], *l, *r;
+
+    l = (i > 0) ? n->ptrs[i - 1] : NULL;
+    r = (i < n->num) ? n->ptrs[i + 1] : NULL;
+    if (l && (l->num > bp_min_keys(t))) {
+        if (c->leaf) {
+            bp_insert_at(c, 0, l->keys[l->num - 1], l->ptrs[l->num - 1]);
+            n->keys[i - 1] = c->keys[0];
+        }
+        else {
+            memmove(c->keys + 1, c->keys, sizeof(*c->keys) * c->num);
+            memmove(c->ptrs + 1, c->ptrs, sizeof(*c->ptrs) * (c->num + 1));
+            c->keys[0] = n->keys[i - 1];
+            c->ptrs[0] = l->ptrs[l->num];
+            c->num++;
+            n->keys[i - 1] = l->keys[l->num - 1];
+        }
+
+        l->num--;
+        return;
+    }
+    if (r && (r->num > bp_min_keys(t))) {
+        if (c->leaf) {
+            c->keys[c->num] = r->keys[0];
+            c->ptrs[c->num] = r->ptrs[0];
+            c->num++;
+            bp_remove_at(r, 0);
+            n->keys[i] = r->keys[0];
+        }
+        else {
+            c->keys[c->num] = n->keys[i];
+            c->ptrs[c->num + 1] = r->ptrs[0];
+            c->num++;
+            n->keys[i] = r->keys[0];
+            memmove(r->keys, r->keys + 1, sizeof(*r->keys) * (r->num - 1));
+            memmove(r->ptrs, r->ptrs + 1, sizeof(*r->ptrs) * r->num);
+            r->num--;
+        }
+
+        return;
+    }
+
+    /* Merge the right one of two neighbours into the left one. */
+    if (l) {
+        r = c;
+        i--;
+    }
+    else {
+        l = c;
+    }
+    if (l->leaf) {
+        memcpy(l->keys + l->num, r->keys, sizeof(*r->keys) * r->num);
+        memcpy(l->ptrs + l->num, r->ptrs, sizeof(*r->ptrs) * r->num);
+        l->num += r->num;
+        l->next = r->next;
+    }
+    else {
+        l->keys[l->num] = n->keys[i];
+        memcpy(l->keys + l->num + 1, r->keys, sizeof(*r->keys) * r->num);
+        memcpy(l->ptrs + l->num + 1, r->ptrs,
+               sizeof(*r->ptrs) * (r->num + 1));
+        l->num += r->num + 1;
+    }
+
+    bp_remove_at(n, i);
+    free(r);
+}
+
+static struct bench_item *__bp_remove(struct bp_tree *t, struct bp_node *n,
+                                      uint64_t key)
+{
+    struct bench_item *item;
+    int i;
+
+    if (n->leaf) {
+        i = bp_lower_bound(n, key);
+        if ((i == n->num) || (n->keys[i] != key)) {
+            return NULL;
+        }
+
+        item = n->ptrs[i];
+        bp_remove_at(n, i);
+        return item;
+    }
+
+    i = bp_child(n, key);
+    item = __bp_remove(t, n->ptrs[i], key);
+    if (item && (((struct bp_node *)n->ptrs[i])->num < bp_min_keys(t))) {
+        bp_fix_child(t, n, i);
+    }
+
+    return item;
+}
+
+static struct bench_item *bp_remove(void *index, uint64_t key)
+{
+    struct bp_tree *t = index;
+    struct bench_item *item = __bp_remove(t, t->root, key);
+    struct bp_node *root = t->root;
+
+    if (!root->leaf && !root->num) {
+        t->root = root->ptrs[0];
+        free(root);
+    }
+
+    return item;
+}
+
+static uint64_t bp_scan(void *index, uint64_t from, size_t count)
+{
+    struct bp_node *n = bp_find_leaf(index, from);
+    int i = bp_lower_bound(n, from);
+    uint64_t sum = 0;
+
+    while (n && count) {
+        for (; (i < n->num) && count; i++, count--) {
+            sum += n->keys[i];
+        }
+
+        n = n->next;
+        i = 0;
+    }
+
+    return sum;
+}
+
+const struct bench_index bench_bptree = {
+    .name = "bptree",
+    .create = bp_create,
+    .destroy = bp_destroy,
+    .insert = bp_insert,
+    .lookup = bp_lookup,
+    .remove = bp_remove,
+    .scan = bp_scan,
+};
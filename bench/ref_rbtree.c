@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Red-black tree reference index. Each item gets its own node
+ * allocated by malloc, the way std::map and most C libraries do.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bench.h"
+
+struct rb_node {
+    struct rb_node *parent, *left, *right;
+    struct bench_item *item;
+    bool red;
+};
+
+struct rb_tree {
+    struct rb_node *root;
+};
+
+static void *rb_create(int fanout)
+{
+    (void)fanout;
+    return calloc(1, sizeof(struct rb_tree));
+}
+
+static void rb_destroy(void *index)
+{
+    struct rb_tree *t = index;
+    struct rb_node *n = t->root, *p;
+
+    /* Free nodes in post-order without recursion. */
+    while (n) {
+        if (n->left) {
+            n = n->left;
+        }
+        else if (n->right) {
+            n = n->right;
+        }
+        else {
+            p = n->parent;
+            if (p) {
+                if (p->left == n) {
+                    p->left = NULL;
+                }
+                else {
+                    p->right = NULL;
+                }
+            }
+
+            free(n);
+            n = p;
+        }
+    }
+
+    free(t);
+}
+
+static void rb_rotate(struct rb_tree *t, struct rb_node *x, bool left)
+{
+    struct rb_node *y = left ? x->right : x->left;
+    struct rb_node *c = left ? y->left : y->right;
+
+    if (left) {
+        x->right = c;
+        y->left = x;
+    }
+    else {
+        x->left = c;
+        y->right = x;
+    }
+    if (c) {
+        c->parent = x;
+    }
+
+    y->parent = x->parent;
+    if (!x->parent) {
+        t->root = y;
+    }
+    else if (x->parent->left == x) {
+        x->parent->left = y;
+    }
+    else {
+        x->parent->right = y;
+    }
+
+    x->parent = y;
+}
+
+static int rb_insert(void *index, struct bench_item *item)
+{
+    struct rb_tree *t = index;
+    struct rb_node *p = NULL, **link = &t->root, *n, *g, *u;
+    bool left;
+
+    while (*link) {
+        p = *link;
+        if (item->key == p->item->key) {
+            return -1;
+        }
+
+        link = (item->key < p->item->key) ? &p->left : &p->right;
+    }
+
+    n = malloc(sizeof(*n));
+    if (!n) {
+        return -1;
+    }
+
+    n->parent = p;
+    n->left = n->right = NULL;
+    n->item = item;
+    n->red = true;
+    *link = n;
+    while ((p = n->parent) && p->red) {
+        g = p->parent;
+        left = (p == g->left);
+        u = left ? g->right : g->left;
+        if (u && u->red) {
+            p->red = u->red = false;
+            g->red = true;
+            n = g;
+            continue;
+        }
+        if (n == (left ? p->right : p->left)) {
+            rb_rotate(t, p, left);
+            n = p;
+            p = n->parent;
+        }
+
+        p->red = false;
+        g->red = true;
+        rb_rotate(t, g, !left);
+    }
+
+    t->root->red = false;
+    return 0;
+}
+
+static struct rb_node *rb_find(struct rb_tree *t, uint64_t key)
+{
+    struct rb_node *n = t->root;
+
+    while (n && (n->item->key != key)) {
+        n = (key < n->item->key) ? n->left : n->right;
+    }
+
+    return n;
+}
+
+static struct bench_item *rb_lookup(void *index, uint64_t key)
+{
+    struct rb_node *n = rb_find(index, key);
+
+    return n ? n->item : NULL;
+}
+
+static void rb_replace(struct rb_tree *t, struct rb_node *u,
+                       struct rb_node *v, struct rb_node *parent)
+{
+    if (!parent) {
+        t->root = v;
+    }
+    else if (parent->left == u) {
+        parent->left = v;
+    }
+    else {
+        parent->right = v;
+    }
+    if (v) {
+        v->parent = parent;
+    }
+}
+
+static void rb_erase_fixup(struct rb_tree *t, struct rb_node *x,
+                           struct rb_node *parent)
+{
+    struct rb_node *w;
+    bool left;
+
+    while ((x != t->root) && (!x || !x->red)) {
+        left = (x == parent->left);
+        w = left ? parent->right : parent->left;
+        if (w->red) {
+            w->red = false;
+            parent->red = true;
+            rb_rotate(t, parent, left);
+            w = left ? parent->right : parent->left;
+        }
+        if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+            w->red = true;
+            x = parent;
+            parent = x->parent;
+            continue;
+        }
+        if (left ? (!w->right || !w->right->red) :
+            (!w->left || !w->left->red)) {
+            (left ? w->left : w->right)->red = false;
+            w->red = true;
+            rb_rotate(t, w, !left);
+            w = left ? parent->right : parent->left;
+        }
+
+        w->red = parent->red;
+        parent->red = false;
+        (left ? w->right : w->left)->red = false;
+        rb_rotate(t, parent, left);
+        x = t->root;
+        break;
+    }
+    if (x) {
+        x->red = false;
+    }
+}
+
+static struct bench_item *rb_remove(void *index, uint64_t key)
+{
+    struct rb_tree *t = index;
+    struct rb_node *z = rb_find(t, key), *y, *x, *parent;
+    struct bench_item *item;
+    bool was_red;
+
+    if (!z) {
+        return NULL;
+    }
+
+    item = z->item;
+    y = z;
+    was_red = y->red;
+    if (!z->left) {
+        x = z->right;
+        parent = z->parent;
+        rb_replace(t, z, x, parent);
+    }
+    else if (!z->right) {
+        x = z->left;
+        parent = z->parent;
+        rb_replace(t, z, x, parent);
+    }
+    else {
+        for (y = z->right; y->left; y = y->left);
+        was_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            parent = y;
+        }
+        else {
+            parent = y->parent;
+            rb_replace(t, y, x, parent);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        rb_replace(t, z, y, z->parent);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    if (!was_red) {
+        rb_erase_fixup(t, x, parent);
+    }
+
+    free(z);
+    return item;
+}
+
+static struct rb_node *rb_next(struct rb_node *n)
+{
+    if (n->right) {
+        for (n = n->right; n->left; n = n->left);
+        return n;
+    }
+    while (n->parent && (n->parent->right == n)) {
+        n = n->parent;
+    }
+
+    return n->parent;
+}
+
+static uint64_t rb_scan(void *index, uint64_t from, size_t count)
+{
+    struct rb_tree *t = index;
+    struct rb_node *n = t->root, *start = NULL;
+    uint64_t sum = 0;
+
+    /* The first node not less than @from. */
+    while (n) {
+        if (n->item->key >= from) {
+            start = n;
+            n = n->left;
+        }
+        else {
+            n = n->right;
+        }
+    }
+    for (n = start; n && count; n = rb_next(n), count--) {
+        sum += n->item->key;
+    }
+
+    return sum;
+}
+
+const struct bench_index bench_rbtree = {
+    .name = "rbtree",
+    .create = rb_create,
+    .destroy = rb_destroy,
+    .insert = rb_insert,
+    .lookup = rb_lookup,
+    .remove = rb_remove,
+    .scan = rb_scan,
+};
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Sorted array reference index: binary search over an array of item
+ * pointers, inserts and deletes shift the tail of the array.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+struct sarray {
+    struct bench_item **items;
+    size_t num, size;
+};
+
+static void *sa_create(int fanout)
+{
+    (void)fanout;
+    return calloc(1, sizeof(struct sarray));
+}
+
+static void sa_destroy(void *index)
+{
+    struct sarray *sa = index;
+
+    free(sa->items);
+    free(sa);
+}
+
+static size_t sa_lower_bound(struct sarray *sa, uint64_t key)
+{
+    size_t lo = 0, hi = sa->num, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (sa->items[mid]->key < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static int sa_insert(void *index, struct bench_item *item)
+{
+    struct sarray *sa = index;
+    size_t i = sa_lower_bound(sa, item->key);
+
+    if ((i < sa->num) && (sa->items[i]->key == item->key)) {
+        return -1;
+    }
+    if (sa->num == sa->size) {
+        size_t size = sa->size ? (sa->size << 1) : 64;
+        struct bench_item **items;
+
+        items = realloc(sa->items, sizeof(*items) * size);
+        if (!items) {
+            return -1;
+        }
+
+        sa->items = items;
+        sa->size = size;
+    }
+
+    memmove(sa->items + i + 1, sa->items + i,
+            sizeof(*sa->items) * (sa->num - i));
+    sa->items[i] = item;
+    sa->num++;
+    return 0;
+}
+
+static struct bench_item *sa_lookup(void *index, uint64_t key)
+{
+    struct sarray *sa = index;
+    size_t i = sa_lower_bound(sa, key);
+
+    return ((i < sa->num) && (sa->items[i]->key == key)) ?
+        sa->items[i] : NULL;
+}
+
+static struct bench_item *sa_remove(void *index, uint64_t key)
+{
+    struct sarray *sa = index;
+    size_t i = sa_lower_bound(sa, key);
+    struct bench_item *item;
+
+    if ((i == sa->num) || (sa->items[i]->key != key)) {
+        return NULL;
+    }
+
+    item = sa->items[i];
+    sa->num--;
+    memmove(sa->items + i, sa->items + i + 1,
+            sizeof(*sa->items) * (sa->num - i));
+    return item;
+}
+
+static uint64_t sa_scan(void *index, uint64_t from, size_t count)
+{
+    struct sarray *sa = index;
+    size_t i = sa_lower_bound(sa, from);
+    uint64_t sum = 0;
+
+    for (; (i < sa->num) && count; i++, count--) {
+        sum += sa->items[i]->key;
+    }
+
+    return sum;
+}
+
+const struct bench_index bench_sarray = {
+    .name = "sarray",
+    .create = sa_create,
+    .destroy = sa_destroy,
+    .insert = sa_insert,
+    .lookup = sa_lookup,
+    .remove = sa_remove,
+    .scan = sa_scan,
+};
@@ -0,0 +1,892 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int key;
+};
+
+struct counting_allocator {
+    int allocated;
+    int freed;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static struct item *alloc_item(int val)
+{
+    struct item *item = malloc(sizeof(*item));
+
+    if (!item) {
+        utest_error("Failed to allocate %zd bytes!", sizeof(*item));
+    }
+
+    item->key = val;
+    return item;
+}
+
+static void *counting_alloc(void *ctx, size_t size, size_t align)
+{
+    struct counting_allocator *ca = ctx;
+    void *ptr;
+
+    ca->allocated++;
+    if (align <= sizeof(void *)) {
+        return malloc(size);
+    }
+
+    return posix_memalign(&ptr, align, size) ? NULL : ptr;
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+    struct counting_allocator *ca = ctx;
+
+    ca->freed++;
+    free(ptr);
+}
+
+static const TtreeNodeAllocator counting_allocator = {
+    .alloc = counting_alloc,
+    .free = counting_free,
+    .release = NULL,
+};
+
+static int slab_num_chunks(Ttree *tree)
+{
+    void *chunk;
+    int num = 0;
+
+    /* The very first field of each chunk is a pointer to the next one. */
+    for (chunk = tree->slab.chunks; chunk; chunk = *(void **)chunk) {
+        num++;
+    }
+
+    return num;
+}
+
+/*
+ * ut_custom_allocator checks that every node allocated through
+ * allocator hooks is freed through them as well.
+ */
+UTEST_FUNCTION(ut_custom_allocator, args)
+{
+    Ttree tree;
+    struct counting_allocator ca = { 0, 0 };
+    int num_keys, num_items, ret, i;
+    struct item *item;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ttree_set_allocator(&tree, &counting_allocator, &ca) == 0);
+    for (i = 0; i < num_items; i++) {
+        item = alloc_item(i);
+        UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    }
+
+    UTEST_ASSERT(ca.allocated > 0);
+    ret = ttree_set_allocator(&tree, &ttree_malloc_allocator, NULL);
+    UTEST_ASSERT((ret < 0) && (errno == EBUSY));
+    for (i = 0; i < num_items; i++) {
+        item = ttree_delete(&tree, &i);
+        UTEST_ASSERT(item != NULL);
+        free(item);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    if (ca.allocated != ca.freed) {
+        UTEST_FAILED("%d nodes were allocated, but %d nodes were freed!",
+                     ca.allocated, ca.freed);
+    }
+
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_slab fills a tree using slab allocator, drains it and fills
+ * it again. Since freed nodes must be reused, the number of
+ * slab chunks shouldn't grow on the second pass.
+ */
+UTEST_FUNCTION(ut_slab, args)
+{
+    Ttree tree;
+    struct balance_info binfo;
+    int num_keys, num_items, chunk_tnodes, ret, i, chunks;
+    struct item *item;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    chunk_tnodes = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ttree_use_slab(&tree, chunk_tnodes) == 0);
+    for (i = 0; i < num_items; i++) {
+        item = alloc_item(i);
+        UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    }
+
+    chunks = slab_num_chunks(&tree);
+    UTEST_ASSERT(chunks > 0);
+    for (i = 0; i < num_items; i++) {
+        item = ttree_delete(&tree, &i);
+        UTEST_ASSERT(item != NULL);
+        free(item);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    for (i = num_items - 1; i >= 0; i--) {
+        item = alloc_item(i);
+        UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    }
+
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is unbalanced on a node %p BFC = %d, %s\n",
+                     binfo.tnode, binfo.tnode->bfc,
+                     balance_name(binfo.balance));
+    }
+    for (i = 0; i < num_items; i++) {
+        item = ttree_lookup(&tree, &i, NULL);
+        UTEST_ASSERT((item != NULL) && (item->key == i));
+    }
+    if (slab_num_chunks(&tree) > chunks) {
+        UTEST_FAILED("Slab grew from %d to %d chunks, but freed nodes should "
+                     "have been reused!", chunks, slab_num_chunks(&tree));
+    }
+
+    ttree_destroy(&tree);
+    UTEST_ASSERT(tree.slab.chunks == NULL);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_pages fills a tree with nodes carved from page sized chunks,
+ * drains and refills it. All mapped bytes must be whole chunks,
+ * accounted for by statistics and unmapped by ttree_destroy. Reserved
+ * huge pages, THP and NUMA binding may be unavailable, so the test
+ * only checks that they don't account for more than is mapped.
+ */
+UTEST_FUNCTION(ut_pages, args)
+{
+    Ttree tree;
+    struct ttree_stats stats;
+    struct item *items;
+    size_t page_size, chunk_size;
+    int num_keys, num_items, page_mb, numa_node, ret, i;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    page_mb = utest_get_arg(args, 2, INT);
+    numa_node = utest_get_arg(args, 3, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    page_size = (size_t)page_mb << 20;
+    chunk_size = page_size ? page_size : TTREE_PAGE_2M;
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+    }
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT((ttree_use_pages(&tree, 4096, numa_node) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT((ttree_use_pages(&tree, page_size, -3) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT(ttree_use_pages(&tree, page_size, numa_node) == 0);
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[(i * 7919L) % num_items])
+                     == 0);
+    }
+
+    UTEST_ASSERT((ttree_use_pages(&tree, page_size, numa_node) < 0) &&
+                 (errno == EBUSY));
+    ttree_stats(&tree, &stats);
+    if (!stats.mapped_bytes || (stats.mapped_bytes % chunk_size) ||
+        (stats.hugetlb_bytes + stats.thp_bytes > stats.mapped_bytes) ||
+        (stats.numa_bytes > stats.mapped_bytes) ||
+        ((numa_node == TTREE_NUMA_ANY) && stats.numa_bytes) ||
+        (!page_size && (stats.hugetlb_bytes || stats.thp_bytes))) {
+        UTEST_FAILED("%zd bytes mapped: %zd hugetlb, %zd THP, %zd bound",
+                     stats.mapped_bytes, stats.hugetlb_bytes,
+                     stats.thp_bytes, stats.numa_bytes);
+    }
+
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_delete(&tree, &i) == &items[i]);
+    }
+    for (i = num_items - 1; i >= 0; i--) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_lookup(&tree, &i, NULL) == &items[i]);
+    }
+
+    ttree_stats(&tree, &stats);
+    UTEST_ASSERT(stats.mapped_bytes % chunk_size == 0);
+    ttree_destroy(&tree);
+    UTEST_ASSERT((tree.slab.chunks == NULL) && !tree.slab.mapped_bytes);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * Every node of a tree with TTREE_CACHE_ALIGNED flag must start
+ * a cache line together with the copy of its minimum key.
+ */
+static const char *check_aligned_tnodes(Ttree *tree)
+{
+    TtreeNode *tnode;
+    char *hot;
+
+    if (!tree->root) {
+        return NULL;
+    }
+    for (tnode = ttree_node_leftmost(tree->root); tnode;
+         tnode = tnode->successor) {
+        hot = (char *)tnode - tree->tnode_hot;
+        if ((uintptr_t)hot % 64) {
+            return "Node is not aligned to a cache line";
+        }
+        if (tree->key_width ?
+            memcmp(hot, tnode_inline_key(tree, tnode, tnode->min_idx),
+                   tree->key_width) :
+            (*(void **)hot != tnode_key_min(tnode))) {
+            return "Copy of the minimum key is out of date";
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_cache_aligned fills and drains a tree with cache aligned nodes
+ * and checks that copies of minimum keys follow all modifications.
+ */
+UTEST_FUNCTION(ut_cache_aligned, args)
+{
+    Ttree tree;
+    struct balance_info binfo;
+    struct item *items, *item;
+    const char *msg;
+    int num_keys, num_items, mode, i, key;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+
+    UTEST_ASSERT(ttree_fit_keys(0, TTREE_CACHE_ALIGNED, 0) < 0);
+    i = ttree_fit_keys(sizeof(int), TTREE_CACHE_ALIGNED, 2);
+    UTEST_ASSERT(i >= TNODE_ITEMS_MIN);
+    UTEST_ASSERT(ttree_init_inline(&tree, i, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CACHE_ALIGNED) == 0);
+    UTEST_ASSERT(tree.tnode_hot + tnode_size(&tree) == 128);
+    ttree_destroy(&tree);
+    UTEST_ASSERT(ttree_init_inline(&tree, i + 1, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CACHE_ALIGNED) == 0);
+    UTEST_ASSERT(tree.tnode_hot + tnode_size(&tree) > 128);
+    ttree_destroy(&tree);
+
+    if (mode == 0) {
+        UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                                struct item, key) == 0);
+    }
+    else {
+        UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                       struct item, key) == 0);
+    }
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CACHE_ALIGNED |
+                                 ((mode == 2) ? TTREE_ORDER_STATS : 0)) == 0);
+    if (mode == 2) {
+        UTEST_ASSERT(ttree_use_slab(&tree, 0) == 0);
+    }
+
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (int)(((long)i * 7919) % num_items);
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    msg = check_aligned_tnodes(&tree);
+    if (msg) {
+        UTEST_FAILED("After insertions: %s", msg);
+    }
+    for (key = 0; key < num_items; key++) {
+        item = ttree_lookup(&tree, &key, NULL);
+        UTEST_ASSERT((item != NULL) && (item->key == key));
+    }
+    for (key = 0; key < num_items; key += 3) {
+        UTEST_ASSERT(ttree_delete(&tree, &key) != NULL);
+    }
+
+    msg = check_aligned_tnodes(&tree);
+    if (msg) {
+        UTEST_FAILED("After deletions: %s", msg);
+    }
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is not balanced: %s", balance_name(binfo.balance));
+    }
+    for (key = -1; key <= num_items; key++) {
+        item = ttree_lookup(&tree, &key, NULL);
+        if ((key >= 0) && (key < num_items) && (key % 3)) {
+            UTEST_ASSERT((item != NULL) && (item->key == key));
+        }
+        else {
+            UTEST_ASSERT(item == NULL);
+        }
+    }
+
+    ttree_destroy(&tree);
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct item, key) == 0);
+    tree.key_width = TTREE_HOT_KEY_MAX + 1;
+    UTEST_ASSERT((ttree_set_flags(&tree, TTREE_CACHE_ALIGNED) < 0) &&
+                 (errno == EINVAL));
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_compact removes three of every four items from a tree in
+ * pseudo-random order, checks that underflown leafs were merged, then
+ * compacts the tree and checks that it holds the minimal number of
+ * nodes and all remaining items.
+ * Mode 0 is a plain tree, 1 has order statistics and 2 has cache
+ * aligned nodes.
+ */
+UTEST_FUNCTION(ut_compact, args)
+{
+    Ttree tree;
+    struct counting_allocator ca = { 0, 0 };
+    struct balance_info binfo;
+    struct item *items, *item;
+    const char *msg;
+    int num_keys, num_items, mode, i, key, left, live;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_keys >= 4) && (num_items >= 1));
+
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, (mode == 1) ? TTREE_ORDER_STATS :
+                                 ((mode == 2) ? TTREE_CACHE_ALIGNED : 0)) == 0);
+    UTEST_ASSERT(ttree_set_allocator(&tree, &counting_allocator, &ca) == 0);
+    UTEST_ASSERT(ttree_compact(&tree, 1.0) == 0);
+    UTEST_ASSERT(ttree_compact(&tree, 0.0) < 0);
+
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (i = 0, left = num_items; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items);
+        if (key % 4) {
+            UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+            left--;
+        }
+    }
+
+    /* Without merges leafs would be left about half-empty. */
+    live = ca.allocated - ca.freed;
+    if ((long)live * (3 * num_keys / 4) > left + num_keys) {
+        UTEST_FAILED("%d nodes hold only %d items", live, left);
+    }
+
+    UTEST_ASSERT(ttree_compact(&tree, 1.0) == live - (left + num_keys - 1) /
+                 num_keys);
+    UTEST_ASSERT(ca.allocated - ca.freed == (left + num_keys - 1) / num_keys);
+    UTEST_ASSERT(ttree_compact(&tree, 1.0) == 0);
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is not balanced: %s", balance_name(binfo.balance));
+    }
+    if (mode == 2) {
+        msg = check_aligned_tnodes(&tree);
+        if (msg) {
+            UTEST_FAILED("After compaction: %s", msg);
+        }
+    }
+    for (key = 0; key < num_items; key++) {
+        item = ttree_lookup(&tree, &key, NULL);
+        UTEST_ASSERT(item == ((key % 4) ? NULL : &items[key]));
+        if (!(key % 4) && (mode == 1)) {
+            UTEST_ASSERT(ttree_rank(&tree, &key) == key / 4);
+        }
+    }
+
+    /* The tree keeps working after compaction. */
+    for (key = 0; key < num_items; key++) {
+        if (key % 4) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+        }
+    }
+    for (key = 0; key < num_items; key++) {
+        UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    UTEST_ASSERT(ca.allocated == ca.freed);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_resize changes capacity of nodes of a tree back and forth,
+ * checking after each rebuild that the tree holds the minimal number
+ * of nodes for the fill, is balanced and has all items. The tree
+ * must keep working after that. Mode 0 is a plain tree with counting
+ * allocator, 1 has order statistics and slab, 2 has cache aligned
+ * nodes with inline keys and slab.
+ */
+UTEST_FUNCTION(ut_resize, args)
+{
+    static const int capacities[] = { 64, 2, 13, 300, 8 };
+    static const double fills[] = { 1.0, 0.5, 0.75, 1.0, 0.3 };
+    Ttree tree;
+    TtreeSnapshot *snap;
+    struct counting_allocator ca = { 0, 0 };
+    struct ttree_stats stats;
+    struct balance_info binfo;
+    struct item *items;
+    const char *msg;
+    int num_keys, num_items, mode, i, j, key, per_tnode;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, (mode == 1) ? TTREE_ORDER_STATS :
+                                 ((mode == 2) ? TTREE_CACHE_ALIGNED : 0)) == 0);
+    if (mode) {
+        UTEST_ASSERT(ttree_use_slab(&tree, 0) == 0);
+    }
+    else {
+        UTEST_ASSERT(ttree_set_allocator(&tree, &counting_allocator,
+                                         &ca) == 0);
+    }
+
+    /* Capacity of an empty tree is just set */
+    UTEST_ASSERT(ttree_set_keys_per_tnode(&tree, num_keys + 1, 1.0) == 0);
+    UTEST_ASSERT(tree.keys_per_tnode == num_keys + 1);
+    UTEST_ASSERT(ttree_set_keys_per_tnode(&tree, 1, 1.0) < 0);
+    UTEST_ASSERT(ttree_set_keys_per_tnode(&tree, num_keys, 0.0) < 0);
+
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i * 2;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[(i * 7919L) % num_items])
+                     == 0);
+    }
+
+    for (j = 0; j < (int)(sizeof(capacities) / sizeof(capacities[0])); j++) {
+        UTEST_ASSERT(ttree_set_keys_per_tnode(&tree, capacities[j],
+                                              fills[j]) == 0);
+        UTEST_ASSERT(tree.keys_per_tnode == capacities[j]);
+        ttree_stats(&tree, &stats);
+        per_tnode = (int)(fills[j] * capacities[j] + 0.5);
+        per_tnode = per_tnode ? per_tnode : 1;
+        if ((stats.num_items != (size_t)num_items) ||
+            (stats.num_tnodes != (size_t)(num_items + per_tnode - 1) /
+             per_tnode)) {
+            UTEST_FAILED("%zd items in %zd nodes of %d keys",
+                         stats.num_items, stats.num_tnodes, capacities[j]);
+        }
+        if (!mode && (ca.allocated - ca.freed != (int)stats.num_tnodes)) {
+            UTEST_FAILED("%d nodes are allocated, tree has %zd",
+                         ca.allocated - ca.freed, stats.num_tnodes);
+        }
+
+        check_tree_balance(&tree, &binfo);
+        UTEST_ASSERT(binfo.balance == TREE_BALANCED);
+        if (mode == 2) {
+            msg = check_aligned_tnodes(&tree);
+            if (msg) {
+                UTEST_FAILED("After resize to %d: %s", capacities[j], msg);
+            }
+        }
+        for (i = 0; i < num_items; i++) {
+            key = i * 2;
+            UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == &items[i]);
+            if (mode == 1) {
+                UTEST_ASSERT(ttree_select(&tree, i, NULL) == &items[i]);
+            }
+        }
+    }
+
+    /* Nodes of snapshots have the size of the tree's nodes */
+    snap = ttree_snapshot(&tree);
+    UTEST_ASSERT(snap != NULL);
+    UTEST_ASSERT((ttree_set_keys_per_tnode(&tree, num_keys, 1.0) < 0) &&
+                 (errno == EBUSY));
+    ttree_snapshot_release(snap);
+
+    /* The tree keeps working after resizing. */
+    for (i = 0; i < num_items; i += 2) {
+        key = i * 2;
+        UTEST_ASSERT(ttree_delete(&tree, &key) == &items[i]);
+    }
+    for (i = 0; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    check_tree_balance(&tree, &binfo);
+    UTEST_ASSERT(binfo.balance == TREE_BALANCED);
+    for (i = 0; i < num_items; i++) {
+        key = i * 2;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == &items[i]);
+        key++;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == NULL);
+    }
+
+    ttree_destroy(&tree);
+    UTEST_ASSERT(ca.allocated == ca.freed);
+    free(items);
+    UTEST_PASSED();
+}
+
+static int sum_keys(void **keys, int num, void *arg)
+{
+    long *sum = arg;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        *sum += *(int *)keys[i];
+    }
+
+    return 0;
+}
+
+/*
+ * A tree with index links must have exactly the same shape as a tree
+ * with pointers @ref built by the same operations, and hold the same
+ * items in the same order.
+ */
+static const char *check_same_trees(Ttree *tree, Ttree *ref)
+{
+    TtreeCursor c1, c2;
+    struct ttree_stats s1, s2;
+    long sum1 = 0, sum2 = 0;
+    int r1, r2, lo = 10, hi = 1000;
+    size_t k;
+
+    ttree_stats(tree, &s1);
+    ttree_stats(ref, &s2);
+    if ((s1.num_items != s2.num_items) || (s1.num_tnodes != s2.num_tnodes) ||
+        (s1.depth != s2.depth)) {
+        return "Trees have different shapes";
+    }
+
+    ttree_cursor_open(&c1, tree);
+    ttree_cursor_open(&c2, ref);
+    r1 = ttree_cursor_first(&c1);
+    r2 = ttree_cursor_first(&c2);
+    for (; (r1 == TCSR_OK) && (r2 == TCSR_OK);
+         r1 = ttree_cursor_next(&c1), r2 = ttree_cursor_next(&c2)) {
+        if (ttree_item_from_cursor(&c1) != ttree_item_from_cursor(&c2)) {
+            return "Forward walks give different items";
+        }
+    }
+    if ((r1 == TCSR_OK) != (r2 == TCSR_OK)) {
+        return "Forward walks have different lengths";
+    }
+
+    r1 = ttree_cursor_last(&c1);
+    r2 = ttree_cursor_last(&c2);
+    for (; (r1 == TCSR_OK) && (r2 == TCSR_OK);
+         r1 = ttree_cursor_prev(&c1), r2 = ttree_cursor_prev(&c2)) {
+        if (ttree_item_from_cursor(&c1) != ttree_item_from_cursor(&c2)) {
+            return "Backward walks give different items";
+        }
+    }
+    if ((r1 == TCSR_OK) != (r2 == TCSR_OK)) {
+        return "Backward walks have different lengths";
+    }
+    if ((ttree_range_scan(tree, &lo, &hi, sum_keys, &sum1) !=
+         ttree_range_scan(ref, &lo, &hi, sum_keys, &sum2)) || (sum1 != sum2)) {
+        return "Range scans give different keys";
+    }
+    if (tree->flags & TTREE_ORDER_STATS) {
+        for (k = 0; k < s1.num_items; k++) {
+            void *item = ttree_select(tree, k, NULL);
+
+            if ((item != ttree_select(ref, k, NULL)) ||
+                (ttree_rank(tree, ttree_item2key(tree, item)) != (ssize_t)k)) {
+                return "Order statistics differ";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_index_links builds a tree with TTREE_INDEX_LINKS and a tree with
+ * pointers side by side: by insertions in pseudo-random order, a batch
+ * insertion, deletions, deletion of a range and compaction. Both must
+ * stay the same after each step. Mode 0 is a plain tree, 1 has inline
+ * keys and order statistics, 2 has relaxed balance and 3 is gapped.
+ */
+UTEST_FUNCTION(ut_index_links, args)
+{
+    static const unsigned int mode_flags[] = {
+        0, TTREE_ORDER_STATS, TTREE_RELAXED_BALANCE, TTREE_GAPPED,
+    };
+    Ttree tree, ref, right;
+    struct item *items;
+    void **batch;
+    const char *msg;
+    unsigned int flags;
+    int num_keys, num_items, mode, i, key, lo, hi, num_batch = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (mode >= 0) && (mode <= 3));
+
+    flags = mode_flags[mode];
+    if (mode == 1) {
+        UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                       struct item, key) == 0);
+        UTEST_ASSERT(ttree_init_inline(&ref, num_keys, true, __cmpfunc,
+                                       struct item, key) == 0);
+    }
+    else {
+        UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                                struct item, key) == 0);
+        UTEST_ASSERT(ttree_init(&ref, num_keys, true, __cmpfunc,
+                                struct item, key) == 0);
+    }
+
+    /* Links are offsets in the address range of the built-in slab */
+    UTEST_ASSERT((ttree_set_flags(&tree, TTREE_INDEX_LINKS) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT(ttree_use_pages(&tree, 0, TTREE_NUMA_ANY) == 0);
+    UTEST_ASSERT((ttree_set_flags(&tree, TTREE_INDEX_LINKS) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT(ttree_use_slab(&tree, 0) == 0);
+    UTEST_ASSERT((ttree_set_flags(&tree, TTREE_INDEX_LINKS |
+                                  TTREE_CACHE_ALIGNED) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_INDEX_LINKS | flags) == 0);
+    UTEST_ASSERT((ttree_set_allocator(&tree, &ttree_malloc_allocator,
+                                      NULL) < 0) && (errno == EINVAL));
+    UTEST_ASSERT(ttree_set_flags(&ref, flags) == 0);
+    UTEST_ASSERT(ttree_use_slab(&ref, 0) == 0);
+
+    items = malloc(num_items * sizeof(*items));
+    batch = malloc(num_items * sizeof(*batch));
+    UTEST_ASSERT((items != NULL) && (batch != NULL));
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i * 2;
+    }
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items);
+        if (key % 3) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+            UTEST_ASSERT(ttree_insert(&ref, &items[key]) == 0);
+        }
+        else {
+            batch[num_batch++] = &items[key];
+        }
+    }
+
+    UTEST_ASSERT(ttree_insert_batch(&tree, batch, num_batch) == num_batch);
+    UTEST_ASSERT(ttree_insert_batch(&ref, batch, num_batch) == num_batch);
+    if (tree.slab.block_size + offsetof(TtreeNode, sides) !=
+        ref.slab.block_size) {
+        UTEST_FAILED("Blocks of %zd bytes instead of %zd",
+                     tree.slab.block_size,
+                     ref.slab.block_size - offsetof(TtreeNode, sides));
+    }
+
+    msg = check_same_trees(&tree, &ref);
+    if (msg) {
+        UTEST_FAILED("After insertions: %s", msg);
+    }
+    for (i = 0; i < num_items; i++) {
+        key = i * 2;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == &items[i]);
+        key++;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == NULL);
+    }
+
+    /* Operations relying on pointers between nodes are refused */
+    UTEST_ASSERT((ttree_snapshot(&tree) == NULL) && (errno == EINVAL));
+    UTEST_ASSERT((ttree_save(&tree, 1, sizeof(struct item), NULL,
+                             NULL) < 0) && (errno == EINVAL));
+    UTEST_ASSERT((ttree_set_keys_per_tnode(&tree, num_keys + 1, 1.0) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT(ttree_init(&right, num_keys, true, __cmpfunc,
+                            struct item, key) == 0);
+    key = num_items;
+    UTEST_ASSERT((ttree_split_at(&tree, &key, &right) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT((ttree_join(&right, &tree) < 0) && (errno == EINVAL));
+    ttree_destroy(&right);
+
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items) * 2;
+        if (key % 4) {
+            UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key / 2]);
+            UTEST_ASSERT(ttree_delete(&ref, &key) == &items[key / 2]);
+        }
+    }
+
+    msg = check_same_trees(&tree, &ref);
+    if (msg) {
+        UTEST_FAILED("After deletions: %s", msg);
+    }
+
+    lo = num_items / 2;
+    hi = num_items;
+    UTEST_ASSERT(ttree_delete_range(&tree, &lo, &hi, NULL, NULL) ==
+                 ttree_delete_range(&ref, &lo, &hi, NULL, NULL));
+    UTEST_ASSERT(ttree_compact(&tree, 1.0) == ttree_compact(&ref, 1.0));
+    msg = check_same_trees(&tree, &ref);
+    if (msg) {
+        UTEST_FAILED("After compaction: %s", msg);
+    }
+
+    /* The tree keeps working and gives all its nodes back. */
+    for (i = 0; i < num_items; i++) {
+        if (!ttree_lookup(&tree, &items[i].key, NULL)) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        }
+    }
+    for (i = num_items - 1; i >= 0; i--) {
+        UTEST_ASSERT(ttree_delete(&tree, &items[i].key) == &items[i]);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    ttree_destroy(&ref);
+    UTEST_ASSERT(!tree.slab.arena && !(tree.flags & TTREE_INDEX_LINKS));
+    free(batch);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_CUSTOM_ALLOCATOR",
+        "Allocate T*-tree nodes through user-defined allocator hooks",
+        ut_custom_allocator,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SLAB",
+        "Allocate T*-tree nodes from the built-in slab allocator",
+        ut_slab,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "chunk_tnodes", UT_ARG_INT, "Number of nodes per slab chunk" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_PAGES",
+        "Allocate T*-tree nodes from huge pages bound to NUMA nodes",
+        ut_pages,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "page_mb", UT_ARG_INT, "Page size in MiB: 0, 2 or 1024" },
+            { "numa", UT_ARG_INT, "NUMA node, -1 - any, -2 - local" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_CACHE_ALIGNED",
+        "Cache aligned T*-tree nodes with hot copies of minimum keys",
+        ut_cache_aligned,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "mode", UT_ARG_INT,
+              "0 - plain keys, 1 - inline keys, 2 - inline keys, "
+              "order statistics and slab" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_COMPACT",
+        "Merge underflown nodes and compact T*-tree",
+        ut_compact,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "mode", UT_ARG_INT,
+              "0 - plain tree, 1 - order statistics, 2 - cache aligned" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_RESIZE",
+        "Change capacity of nodes of a non-empty T*-tree",
+        ut_resize,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "mode", UT_ARG_INT,
+              "0 - counting allocator, 1 - order statistics and slab, "
+              "2 - cache aligned nodes and slab" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_INDEX_LINKS",
+        "Link T*-tree nodes by 32-bit indices in the slab",
+        ut_index_links,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "mode", UT_ARG_INT,
+              "0 - plain tree, 1 - inline keys and order statistics, "
+              "2 - relaxed balance, 3 - gapped" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
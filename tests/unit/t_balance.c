@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "utest.h"
 #include "test_utils.h"
 #include "ttree.h"
@@ -248,6 +251,647 @@ UTEST_FUNCTION(ut_insert_inc, args)
     UTEST_PASSED();
 }
 
+/*
+ * Returns height of a subtree. @ok is cleared if balance factor
+ * of any node in it doesn't match real heights of its subtrees.
+ */
+static int tnode_height(TtreeNode *tnode, bool *ok)
+{
+    int l, r;
+
+    if (!tnode) {
+        return 0;
+    }
+
+    l = tnode_height(tnode->left, ok);
+    r = tnode_height(tnode->right, ok);
+    if (tnode->bfc != r - l) {
+        *ok = false;
+    }
+
+    return ((r > l) ? r : l) + 1;
+}
+
+/*
+ * ut_bulk_load builds a tree from sorted array and checks that
+ * the tree is balanced, all items are reachable both by lookups and by
+ * successor links and that the tree stays correct under
+ * subsequent insertions and deletions.
+ */
+UTEST_FUNCTION(ut_bulk_load, args)
+{
+    Ttree tree;
+    TtreeNode *tnode;
+    int num_keys, num_items, ret, i, idx, prev;
+    double fill;
+    void **items;
+    struct item *item;
+    bool ok = true;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    fill = utest_get_arg(args, 2, DOUBLE);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i] = alloc_item(i * 2);
+    }
+    if (num_items > 1) {
+        /* Unsorted arrays must be rejected. */
+        item = items[0];
+        items[0] = items[1];
+        items[1] = item;
+        UTEST_ASSERT(ttree_bulk_load(&tree, items, num_items, fill) < 0);
+        UTEST_ASSERT(ttree_is_empty(&tree));
+        items[1] = items[0];
+        items[0] = item;
+    }
+
+    ret = ttree_bulk_load(&tree, items, num_items, fill);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ttree_bulk_load(&tree, items, num_items, fill) < 0);
+    UTEST_ASSERT(tree_is_balanced(&tree));
+    tnode_height(tree.root, &ok);
+    if (!ok) {
+        UTEST_FAILED("Balance factors don't match heights of subtrees!");
+    }
+
+    prev = -1;
+    i = 0;
+    for (tnode = ttree_node_leftmost(tree.root); tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, idx) {
+            item = ttree_key2item(&tree, tnode_key(tnode, idx));
+            UTEST_ASSERT(item->key > prev);
+            prev = item->key;
+            i++;
+        }
+    }
+    if (i != num_items) {
+        UTEST_FAILED("%d items are reachable by successors, but %d loaded!",
+                     i, num_items);
+    }
+    for (i = 0; i < num_items * 2; i++) {
+        item = ttree_lookup(&tree, &i, NULL);
+        UTEST_ASSERT((i & 1) ? (item == NULL) :
+                     ((item != NULL) && (item->key == i)));
+    }
+
+    /* Odd keys fill the gaps between loaded ones. */
+    for (i = 1; i < num_items * 2; i += 2) {
+        UTEST_ASSERT(ttree_insert(&tree, alloc_item(i)) == 0);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+    }
+    for (i = 0; i < num_items * 2; i++) {
+        item = ttree_delete(&tree, &i);
+        if (!item || (item->key != i)) {
+            UTEST_FAILED("Failed to delete item %d", i);
+        }
+
+        free(item);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    free(items);
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_insert_batch inserts increasing keys by batches, then fills the
+ * gaps between them with a nearly sorted batch with duplicates.
+ * The tree must stay balanced and ordered.
+ */
+UTEST_FUNCTION(ut_insert_batch, args)
+{
+    Ttree tree;
+    TtreeNode *tnode;
+    int num_keys, num_items, batch, ret, i, j, idx, prev;
+    void **items;
+    struct item *item;
+    ssize_t inserted;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    batch = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (batch >= 1));
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+
+    /* Appends at the rightmost node. */
+    for (i = 0; i < num_items; i += batch) {
+        for (j = 0; (j < batch) && (i + j < num_items); j++) {
+            items[j] = alloc_item((i + j) * 2);
+        }
+
+        inserted = ttree_insert_batch(&tree, items, j);
+        UTEST_ASSERT(inserted == j);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+    }
+
+    /*
+     * Odd keys with each pair swapped and every tenth key
+     * duplicated by an already inserted even one.
+     */
+    for (i = 0; i < num_items; i++) {
+        j = ((i & 1) ? i - 1 : ((i + 1 < num_items) ? i + 1 : i));
+        items[i] = alloc_item((i % 10 == 9) ? j * 2 : j * 2 + 1);
+    }
+
+    inserted = ttree_insert_batch(&tree, items, num_items);
+    UTEST_ASSERT(tree_is_balanced(&tree));
+    for (i = 0; i < num_items; i++) {
+        if (ttree_lookup(&tree, &((struct item *)items[i])->key, NULL) !=
+            items[i]) {
+            inserted++;
+            free(items[i]);
+        }
+    }
+    if (inserted != num_items) {
+        UTEST_FAILED("%d items were either lost or duplicated!",
+                     (int)(inserted - num_items));
+    }
+
+    prev = -1;
+    i = 0;
+    for (tnode = ttree_node_leftmost(tree.root); tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, idx) {
+            item = ttree_key2item(&tree, tnode_key(tnode, idx));
+            UTEST_ASSERT(item->key > prev);
+            prev = item->key;
+            i++;
+        }
+    }
+    for (i = 0; i < num_items * 2; i++) {
+        item = ttree_delete(&tree, &i);
+        free(item);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    free(items);
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
+/*
+ * Checks order of items by successor links, returns number of them.
+ */
+static int count_ordered_items(Ttree *tree)
+{
+    TtreeNode *tnode;
+    struct item *item;
+    int idx, prev = -1, n = 0;
+
+    for (tnode = ttree_node_leftmost(tree->root); tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, idx) {
+            item = ttree_key2item(tree, tnode_key(tnode, idx));
+            if (item->key <= prev) {
+                return -1;
+            }
+
+            prev = item->key;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * ut_relaxed_balance fills a tree with TTREE_RELAXED_BALANCE in
+ * increasing (order 0) or pseudo-random (order 1) order and checks
+ * that its height stays within the limit of relaxed trees. Half of
+ * items are removed then and the tree is rebalanced by
+ * ttree_rebalance_all.
+ */
+UTEST_FUNCTION(ut_relaxed_balance, args)
+{
+    Ttree tree;
+    int num_keys, num_items, order, ret, i, key, limit;
+    size_t n;
+    struct item *item;
+    bool ok = true;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    order = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_RELAXED_BALANCE |
+                                 TTREE_CONCURRENT) < 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_RELAXED_BALANCE |
+                                 TTREE_ORDER_STATS) == 0);
+    for (i = 0; i < num_items; i++) {
+        key = order ? (int)(((long)i * 7919) % num_items) : i;
+        UTEST_ASSERT(ttree_insert(&tree, alloc_item(key)) == 0);
+        for (n = 1, limit = 1; n < tree.num_items; limit++) {
+            n += (n + 1) >> 1;
+        }
+        if (tnode_height(tree.root, &ok) > limit + 1) {
+            UTEST_FAILED("Tree of %d items is %d nodes high!", i + 1,
+                         tnode_height(tree.root, &ok));
+        }
+    }
+
+    UTEST_ASSERT(count_ordered_items(&tree) == num_items);
+    for (i = 0; i < num_items; i += 2) {
+        key = order ? (int)(((long)i * 7919) % num_items) : i;
+        item = ttree_delete(&tree, &key);
+        UTEST_ASSERT((item != NULL) && (item->key == key));
+        free(item);
+    }
+
+    UTEST_ASSERT(count_ordered_items(&tree) == num_items / 2);
+    for (i = 0; i < num_items / 2; i++) {
+        item = ttree_select(&tree, i, NULL);
+        UTEST_ASSERT((item != NULL) && (ttree_rank(&tree, &item->key) == i));
+    }
+
+    UTEST_ASSERT(ttree_rebalance_all(&tree) == 0);
+    UTEST_ASSERT(tree_is_balanced(&tree));
+    ok = true;
+    tnode_height(tree.root, &ok);
+    if (!ok) {
+        UTEST_FAILED("Balance factors don't match heights of subtrees!");
+    }
+
+    UTEST_ASSERT(count_ordered_items(&tree) == num_items / 2);
+    for (i = 0, n = 0; i < num_items; i++) {
+        item = ttree_delete(&tree, &i);
+        if (item) {
+            UTEST_ASSERT(item->key == i);
+            free(item);
+            n++;
+        }
+    }
+
+    UTEST_ASSERT(n == (size_t)(num_items / 2));
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_random_delete fills a tree in pseudo-random order and removes
+ * items in another pseudo-random order. Deletions make double
+ * rotations fill a single-item leaf that became the root of
+ * a subtree with items of its children, so after each deletion
+ * the order of items and balance of the tree are checked.
+ */
+UTEST_FUNCTION(ut_random_delete, args)
+{
+    Ttree tree;
+    int num_keys, num_items, ret, i, key;
+    struct item *item;
+    bool ok = true;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919) &&
+                 (num_items % 104729));
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items);
+        UTEST_ASSERT(ttree_insert(&tree, alloc_item(key)) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 104729) % num_items);
+        item = ttree_delete(&tree, &key);
+        if (!item || (item->key != key)) {
+            UTEST_FAILED("Failed to delete item %d of %d!", key, num_items);
+        }
+
+        free(item);
+        if (count_ordered_items(&tree) != num_items - i - 1) {
+            UTEST_FAILED("Order of items is broken after deletion of %d!",
+                         key);
+        }
+
+        UTEST_ASSERT(tree_is_balanced(&tree));
+        tnode_height(tree.root, &ok);
+        if (!ok) {
+            UTEST_FAILED("Balance factors don't match heights of subtrees!");
+        }
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
+/*
+ * Range scan callback summing keys of slices, which must be ordered
+ * and hold no copies of keys left by gaps.
+ */
+static int sum_slice(void **keys, int num, void *arg)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if ((i > 0) && (*(int *)keys[i - 1] >= *(int *)keys[i])) {
+            utest_warning("Slice has %d after %d", *(int *)keys[i],
+                          *(int *)keys[i - 1]);
+            return -1;
+        }
+
+        *(long *)arg += *(int *)keys[i];
+    }
+
+    return 0;
+}
+
+/*
+ * Check that a gapped tree holds items with present (even) keys only:
+ * cursors must visit each of them once in both directions, lookups
+ * must find them and range scans must hand out slices without gaps.
+ */
+static bool gapped_tree_matches(Ttree *tree, bool *present, int num_items)
+{
+    TtreeCursor cursor;
+    struct item *item;
+    long sum = 0, scan_sum = 0;
+    int i, n = 0, prev = -1;
+
+    for (i = 0; i < num_items; i++) {
+        n += present[i];
+        sum += present[i] ? i * 2 : 0;
+    }
+    if (tree->num_items != (size_t)n) {
+        utest_warning("Tree has %zd items instead of %d", tree->num_items, n);
+        return false;
+    }
+
+    ttree_cursor_open(&cursor, tree);
+    if (ttree_cursor_first(&cursor) == TCSR_OK) {
+        do {
+            item = ttree_item_from_cursor(&cursor);
+            if ((item->key <= prev) || (item->key >= num_items * 2) ||
+                !present[item->key / 2]) {
+                utest_warning("Cursor gave %d after %d", item->key, prev);
+                return false;
+            }
+
+            prev = item->key;
+            n--;
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+
+    ttree_cursor_open(&cursor, tree);
+    if (ttree_cursor_last(&cursor) == TCSR_OK) {
+        do {
+            item = ttree_item_from_cursor(&cursor);
+            if ((item->key > prev) || (item->key < 0) ||
+                !present[item->key / 2]) {
+                utest_warning("Cursor gave %d before %d", item->key, prev);
+                return false;
+            }
+
+            prev = item->key - 1;
+            n++;
+        } while (ttree_cursor_prev(&cursor) == TCSR_OK);
+    }
+    if (n != (int)tree->num_items) {
+        utest_warning("Cursors didn't visit all items of a tree");
+        return false;
+    }
+
+    for (i = -1; i <= num_items * 2; i++) {
+        item = ttree_lookup(tree, &i, NULL);
+        if ((item != NULL) != ((i >= 0) && !(i & 1) && (i < num_items * 2) &&
+                               present[i / 2]) || (item && (item->key != i))) {
+            utest_warning("Lookup of %d gave %p", i, item);
+            return false;
+        }
+    }
+
+    if ((ttree_range_scan(tree, NULL, NULL, sum_slice, &scan_sum) !=
+         (ssize_t)tree->num_items) || (scan_sum != sum)) {
+        utest_warning("Range scan summed %ld instead of %ld", scan_sum, sum);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * ut_gapped fills a tree with TTREE_GAPPED in pseudo-random order,
+ * removes and inserts items in another order, so that nodes get gaps,
+ * and checks the tree after each step with cursors, lookups and range
+ * scans. Replacements, ranged deletions, compaction and changing size
+ * of nodes must keep items too, while flags that gapped nodes can't be
+ * combined with and snapshots must be refused.
+ */
+UTEST_FUNCTION(ut_gapped, args)
+{
+    Ttree tree;
+    int num_keys, num_items, ret, i, key, lo, hi, fd;
+    struct item *items, *repl, *item;
+    bool *present;
+    ssize_t n;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919) &&
+                 (num_items % 104729));
+
+    items = malloc(num_items * sizeof(*items));
+    repl = malloc(num_items * sizeof(*repl));
+    present = calloc(num_items, sizeof(*present));
+    UTEST_ASSERT(items && repl && present);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = repl[i].key = i * 2;
+    }
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_GAPPED | TTREE_CONCURRENT) < 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_GAPPED | TTREE_ORDER_STATS) < 0);
+    UTEST_ASSERT(ttree_set_flags(&tree,
+                                 TTREE_GAPPED | TTREE_CACHE_ALIGNED) < 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_GAPPED) == 0);
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items);
+        UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+        present[key] = true;
+    }
+
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 104729) % num_items);
+        if (key % 3) {
+            continue;
+        }
+
+        key *= 2;
+        UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key / 2]);
+        present[key / 2] = false;
+        if (!(i % 64)) {
+            UTEST_ASSERT(tree_is_balanced(&tree));
+            UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+        }
+    }
+
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    for (i = 0; i < num_items; i += 6) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        present[i] = true;
+    }
+
+    UTEST_ASSERT(tree_is_balanced(&tree));
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    for (i = 0; i < num_items; i++) {
+        key = i * 2;
+        if (!present[i]) {
+            UTEST_ASSERT(ttree_replace(&tree, &key, &repl[i]) < 0);
+        } else if (i & 1) {
+            UTEST_ASSERT(ttree_replace(&tree, &key, &repl[i]) == 0);
+        } else {
+            UTEST_ASSERT(ttree_upsert(&tree, &repl[i], NULL, NULL) == 1);
+        }
+        if (present[i]) {
+            UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == &repl[i]);
+        }
+    }
+
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    UTEST_ASSERT(!ttree_snapshot(&tree) && (errno == EINVAL));
+    fd = open("/dev/null", O_WRONLY);
+    UTEST_ASSERT(fd >= 0);
+    UTEST_ASSERT((ttree_save(&tree, fd, sizeof(struct item), NULL,
+                             NULL) < 0) && (errno == EINVAL));
+    close(fd);
+
+    lo = num_items / 3 * 2;
+    hi = num_items / 3 * 4;
+    for (i = lo / 2, n = 0; i <= hi / 2; i++) {
+        n += present[i];
+        present[i] = false;
+    }
+
+    UTEST_ASSERT(ttree_delete_range(&tree, &lo, &hi, NULL, NULL) == n);
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    UTEST_ASSERT(ttree_compact(&tree, 0.7) >= 0);
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    for (i = 0; i < num_items; i += 4) {
+        if (!present[i]) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+            present[i] = true;
+        }
+    }
+
+    UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    if (!ttree_is_empty(&tree)) {
+        UTEST_ASSERT(ttree_set_keys_per_tnode(&tree, 2, 1.0) == 0);
+        UTEST_ASSERT(gapped_tree_matches(&tree, present, num_items));
+    }
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 104729) % num_items);
+        lo = key * 2;
+        item = ttree_delete(&tree, &lo);
+        UTEST_ASSERT(present[key] == (item != NULL));
+        present[key] = false;
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    free(present);
+    free(repl);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_gapped_duplicates puts the same item many times into a gapped
+ * non-unique tree and deletes keys around it, so that copies of the
+ * item stand next to gaps. Copies of the item must be neither taken
+ * for gaps nor lost by cursors and deletions.
+ */
+UTEST_FUNCTION(ut_gapped_duplicates, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct item *items, *item;
+    int num_keys, num_items, copies, i, key, mid, n, prev = -1;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    copies = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 3) && (copies >= 0));
+
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+    }
+
+    UTEST_ASSERT(ttree_init(&tree, num_keys, false, __cmpfunc,
+                            struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_GAPPED) == 0);
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    mid = num_items / 2;
+    for (i = 0; i < copies; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[mid]) == 0);
+    }
+    for (i = 1; i < num_items; i += 2) {
+        key = (i < mid) ? mid - i : mid + i;
+        if ((key > 0) && (key < num_items - 1)) {
+            UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+            items[key].key = -1;
+        }
+    }
+
+    n = 0;
+    ttree_cursor_open(&cursor, &tree);
+    if (ttree_cursor_first(&cursor) == TCSR_OK) {
+        do {
+            item = ttree_item_from_cursor(&cursor);
+            if ((item->key < prev) || (item->key < 0) ||
+                ((item->key == prev) && (item->key != mid))) {
+                UTEST_FAILED("Cursor gave %d after %d", item->key, prev);
+            }
+
+            prev = item->key;
+            n++;
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+    if (n != (int)tree.num_items) {
+        UTEST_FAILED("Cursor visited %d of %zd items", n, tree.num_items);
+    }
+    for (i = 0; i <= copies; i++) {
+        UTEST_ASSERT(ttree_delete(&tree, &mid) == &items[mid]);
+    }
+
+    UTEST_ASSERT(ttree_delete(&tree, &mid) == NULL);
+    for (i = 0; i < num_items; i++) {
+        if ((items[i].key >= 0) && (i != mid)) {
+            UTEST_ASSERT(ttree_delete(&tree, &i) == &items[i]);
+        }
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
 DEFINE_UTESTS_LIST(tests) = {
     {
         "UT_INSERT_INC",
@@ -286,7 +930,71 @@ DEFINE_UTESTS_LIST(tests) = {
             UTEST_ARGS_LIST_END,
         },
     },
+    {
+        "UT_BULK_LOAD",
+        "Build a tree from sorted array of items",
+        ut_bulk_load,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items to load" },
+            { "fill", UT_ARG_DOUBLE, "Part of node rooms to fill (0, 1]" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_INSERT_BATCH",
+        "Insert sorted and nearly sorted batches of items",
+        ut_insert_batch,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items to insert" },
+            { "batch", UT_ARG_INT, "Number of items per batch" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
 
+    {
+        "UT_RELAXED_BALANCE",
+        "Relaxed trees should stay within their height limit",
+        ut_relaxed_balance,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "order", UT_ARG_INT, "0 - increasing, 1 - pseudo-random" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_RANDOM_DELETE",
+        "Delete items of a tree in pseudo-random order",
+        ut_random_delete,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_GAPPED",
+        "Gapped nodes should keep order and contents of a tree",
+        ut_gapped,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_GAPPED_DUPLICATES",
+        "Copies of an item in a gapped tree should not be taken for gaps",
+        ut_gapped_duplicates,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "copies", UT_ARG_INT, "Number of extra copies of an item" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
     UTESTS_LIST_END,
 };
 
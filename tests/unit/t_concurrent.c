@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+struct reader_ctx {
+    Ttree *tree;
+    int num_items;
+    volatile int *stop;
+    const char *error;
+    long lookups;
+    int reader;
+    int prev;
+    int seen;
+};
+
+static int scan_cb(void **keys, int num, void *arg)
+{
+    struct reader_ctx *ctx = arg;
+    int i, key;
+
+    for (i = 0; i < num; i++) {
+        key = *(int *)keys[i];
+        if (key <= ctx->prev) {
+            ctx->error = "Range scan went out of order";
+            return 1;
+        }
+        if (!(key & 1)) {
+            ctx->seen++;
+        }
+
+        ctx->prev = key;
+    }
+
+    return 0;
+}
+
+/*
+ * Even keys are never removed, so a reader must always find them
+ * and must always see them in order while iterating over the tree.
+ */
+static int limbo_size(Ttree *tree)
+{
+    TtreeNode *tnode;
+    int i, num = 0;
+
+    for (i = 0; i < TTREE_EPOCHS; i++) {
+        for (tnode = tree->limbo[i]; tnode; tnode = tnode->successor) {
+            num++;
+        }
+    }
+
+    return num;
+}
+
+static void *reader(void *arg)
+{
+    struct reader_ctx *ctx = arg;
+    TtreeCursor cursor;
+    struct item *item;
+    int key, prev, seen;
+
+    while (!*ctx->stop && !ctx->error) {
+        ttree_read_enter(ctx->tree, ctx->reader);
+        for (key = 0; key < ctx->num_items * 2; key += 2) {
+            item = ttree_lookup(ctx->tree, &key, NULL);
+            if (!item || (item->key != key)) {
+                ctx->error = "Stable key wasn't found";
+                return NULL;
+            }
+
+            ctx->lookups++;
+        }
+
+        key = -1;
+        ttree_lookup(ctx->tree, &key, &cursor);
+        prev = -1;
+        seen = 0;
+        while (ttree_cursor_next(&cursor) == TCSR_OK) {
+            item = ttree_item_from_cursor(&cursor);
+            if (item->key <= prev) {
+                ctx->error = "Cursor went out of order";
+                return NULL;
+            }
+            if (!(item->key & 1)) {
+                seen++;
+            }
+
+            prev = item->key;
+        }
+        if (seen != ctx->num_items) {
+            ctx->error = "Cursor missed stable keys";
+            return NULL;
+        }
+
+        ctx->prev = -1;
+        ctx->seen = 0;
+        key = 0;
+        ttree_range_scan(ctx->tree, &key, NULL, scan_cb, ctx);
+        if (!ctx->error && (ctx->seen != ctx->num_items)) {
+            ctx->error = "Range scan missed stable keys";
+            return NULL;
+        }
+
+        ttree_read_exit(ctx->tree, ctx->reader);
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_concurrent runs readers that look up, iterate and scan over the
+ * tree while the main thread keeps removing and inserting odd keys.
+ */
+UTEST_FUNCTION(ut_concurrent, args)
+{
+    Ttree tree;
+    int num_keys, num_items, num_readers, rounds, i, r, key;
+    struct reader_ctx *ctxs;
+    struct item *items;
+    pthread_t *threads;
+    volatile int stop = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_readers = utest_get_arg(args, 2, INT);
+    rounds = utest_get_arg(args, 3, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_readers >= 1));
+
+    UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                            struct item, key) == 0);
+    UTEST_ASSERT((ttree_set_flags(&tree, TTREE_CONCURRENT) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT((ttree_reader_register(&tree) < 0) && (errno == EINVAL));
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CONCURRENT) == 0);
+    for (i = 0; i < TTREE_MAX_READERS; i++) {
+        UTEST_ASSERT(ttree_reader_register(&tree) == i);
+    }
+
+    UTEST_ASSERT((ttree_reader_register(&tree) < 0) && (errno == EAGAIN));
+    for (i = 0; i < TTREE_MAX_READERS; i++) {
+        ttree_reader_unregister(&tree, i);
+    }
+
+    /*
+     * Items are never freed while readers run: a reader may still
+     * hold a key of an item that was just removed.
+     */
+    items = malloc(sizeof(*items) * num_items * 2);
+    ctxs = calloc(num_readers, sizeof(*ctxs));
+    threads = malloc(sizeof(*threads) * num_readers);
+    UTEST_ASSERT(items && ctxs && threads);
+    for (i = 0; i < num_items * 2; i++) {
+        items[i].key = i;
+        if (!(i & 1)) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        }
+    }
+    for (r = 0; r < num_readers; r++) {
+        ctxs[r].tree = &tree;
+        ctxs[r].num_items = num_items;
+        ctxs[r].stop = &stop;
+        ctxs[r].reader = ttree_reader_register(&tree);
+        UTEST_ASSERT(ctxs[r].reader >= 0);
+        UTEST_ASSERT(pthread_create(&threads[r], NULL, reader,
+                                    &ctxs[r]) == 0);
+    }
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < num_items; i++) {
+            key = ((i * 7 + r) % num_items) * 2 + 1;
+            if (ttree_lookup(&tree, &key, NULL)) {
+                UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+            }
+            else {
+                UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+            }
+        }
+    }
+
+    stop = 1;
+    for (r = 0; r < num_readers; r++) {
+        pthread_join(threads[r], NULL);
+        if (ctxs[r].error) {
+            UTEST_FAILED("Reader %d: %s", r, ctxs[r].error);
+        }
+        if (!ctxs[r].lookups) {
+            utest_warning("Reader %d didn't make any lookup", r);
+        }
+
+        ttree_reader_unregister(&tree, ctxs[r].reader);
+    }
+
+    /* Without readers inside removed nodes are freed almost at once */
+    for (i = 0; i < num_items; i++) {
+        key = i * 2 + 1;
+        if (ttree_delete(&tree, &key)) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+        }
+        else {
+            UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+            UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+        }
+        if (limbo_size(&tree) > 2) {
+            UTEST_FAILED("%d removed nodes are still kept",
+                         limbo_size(&tree));
+        }
+    }
+
+    for (key = 1; key < num_items * 2; key += 2) {
+        ttree_delete(&tree, &key);
+    }
+    for (key = 0; key < num_items * 2; key += 2) {
+        UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    free(threads);
+    free(ctxs);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct writer_ctx {
+    Ttree *tree;
+    struct item *items;
+    int num_items;
+    int num_writers;
+    int writer;
+    const char *error;
+};
+
+/*
+ * Each writer owns keys equal to its number modulo number of writers.
+ * It inserts all of them, then removes every other one.
+ */
+static void *writer(void *arg)
+{
+    struct writer_ctx *ctx = arg;
+    int i, key;
+
+    for (i = 0; i < ctx->num_items; i++) {
+        key = ((i * 7919) % ctx->num_items) * ctx->num_writers + ctx->writer;
+        if (ttree_insert(ctx->tree, &ctx->items[key]) < 0) {
+            ctx->error = "Failed to insert an item";
+            return NULL;
+        }
+    }
+    for (i = 0; i < ctx->num_items; i += 2) {
+        key = i * ctx->num_writers + ctx->writer;
+        if (ttree_delete(ctx->tree, &key) != &ctx->items[key]) {
+            ctx->error = "Failed to delete an item";
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_multi_writer runs several writers inserting and deleting disjoint
+ * sets of keys at once, then checks the tree they have built.
+ */
+UTEST_FUNCTION(ut_multi_writer, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct balance_info binfo;
+    struct writer_ctx *ctxs;
+    struct item *items, *item;
+    pthread_t *threads;
+    int num_keys, num_items, num_writers, total, i, w, prev;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_writers = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_writers >= 1));
+
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT((ttree_set_flags(&tree, TTREE_MULTI_WRITER) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CONCURRENT |
+                                 TTREE_MULTI_WRITER) == 0);
+
+    total = num_items * num_writers;
+    items = malloc(sizeof(*items) * total);
+    ctxs = calloc(num_writers, sizeof(*ctxs));
+    threads = malloc(sizeof(*threads) * num_writers);
+    UTEST_ASSERT(items && ctxs && threads);
+    for (i = 0; i < total; i++) {
+        items[i].key = i;
+    }
+    for (w = 0; w < num_writers; w++) {
+        ctxs[w].tree = &tree;
+        ctxs[w].items = items;
+        ctxs[w].num_items = num_items;
+        ctxs[w].num_writers = num_writers;
+        ctxs[w].writer = w;
+        UTEST_ASSERT(pthread_create(&threads[w], NULL, writer,
+                                    &ctxs[w]) == 0);
+    }
+    for (w = 0; w < num_writers; w++) {
+        pthread_join(threads[w], NULL);
+        if (ctxs[w].error) {
+            UTEST_FAILED("Writer %d: %s", w, ctxs[w].error);
+        }
+    }
+
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is unbalanced on a node %p BFC = %d, %s\n",
+                     binfo.tnode, binfo.tnode->bfc,
+                     balance_name(binfo.balance));
+    }
+
+    /* Only keys with odd quotient are left */
+    UTEST_ASSERT(ttree_size(&tree) == (size_t)(num_items / 2) * num_writers);
+    ttree_cursor_open(&cursor, &tree);
+    prev = -1;
+    if (ttree_cursor_first(&cursor) == TCSR_OK) {
+        do {
+            item = ttree_item_from_cursor(&cursor);
+            UTEST_ASSERT(item->key > prev);
+            UTEST_ASSERT((item->key / num_writers) & 1);
+            prev = item->key;
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+    for (i = 0; i < total; i++) {
+        item = ttree_lookup(&tree, &i, NULL);
+        UTEST_ASSERT(((i / num_writers) & 1) ? (item == &items[i]) : !item);
+    }
+
+    ttree_destroy(&tree);
+    free(threads);
+    free(ctxs);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct counted {
+    int key;
+    int count;
+};
+
+struct upsert_ctx {
+    Ttree *tree;
+    struct counted *items; /* own copy of every key for each writer */
+    int num_items;
+    int writer;
+    const char *error;
+};
+
+/* Merges are serialized by the latch of the node, so no atomics needed */
+static void *count_merge(void *old_item, void *new_item, void *arg)
+{
+    ((struct counted *)old_item)->count++;
+    return old_item;
+}
+
+/*
+ * Each writer upserts its own items of all keys, so every key is
+ * inserted by one writer and merged by the rest of them. Every tenth
+ * key is taken by ttree_find_or_insert instead.
+ */
+static void *upserter(void *arg)
+{
+    struct upsert_ctx *ctx = arg;
+    struct counted *item, *found;
+    int i, key;
+
+    for (i = 0; i < ctx->num_items; i++) {
+        key = (int)(((long)i * 7919 + ctx->writer * 104729L) %
+                    ctx->num_items);
+        item = &ctx->items[key];
+        if (!(key % 10)) {
+            found = ttree_find_or_insert(ctx->tree, item);
+            if (found->key != key) {
+                ctx->error = "Found an item with another key";
+                return NULL;
+            }
+        }
+        else if (ttree_upsert(ctx->tree, item, count_merge, NULL) < 0) {
+            ctx->error = "Failed to upsert an item";
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_multi_upsert runs several writers upserting the same keys at once.
+ * Each key must be inserted only once and merged by all other writers.
+ */
+UTEST_FUNCTION(ut_multi_upsert, args)
+{
+    Ttree tree;
+    struct balance_info binfo;
+    struct upsert_ctx *ctxs;
+    struct counted *items, *item;
+    pthread_t *threads;
+    int num_keys, num_items, num_writers, i, w;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_writers = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_writers >= 1));
+
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct counted, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CONCURRENT |
+                                 TTREE_MULTI_WRITER) == 0);
+
+    items = malloc(sizeof(*items) * num_items * num_writers);
+    ctxs = calloc(num_writers, sizeof(*ctxs));
+    threads = malloc(sizeof(*threads) * num_writers);
+    UTEST_ASSERT(items && ctxs && threads);
+    for (i = 0; i < num_items * num_writers; i++) {
+        items[i].key = i % num_items;
+        items[i].count = 0;
+    }
+    for (w = 0; w < num_writers; w++) {
+        ctxs[w].tree = &tree;
+        ctxs[w].items = items + w * num_items;
+        ctxs[w].num_items = num_items;
+        ctxs[w].writer = w;
+        UTEST_ASSERT(pthread_create(&threads[w], NULL, upserter,
+                                    &ctxs[w]) == 0);
+    }
+    for (w = 0; w < num_writers; w++) {
+        pthread_join(threads[w], NULL);
+        if (ctxs[w].error) {
+            UTEST_FAILED("Writer %d: %s", w, ctxs[w].error);
+        }
+    }
+
+    check_tree_balance(&tree, &binfo);
+    UTEST_ASSERT(binfo.balance == TREE_BALANCED);
+    UTEST_ASSERT(ttree_size(&tree) == (size_t)num_items);
+    for (i = 0; i < num_items; i++) {
+        item = ttree_lookup(&tree, &i, NULL);
+        UTEST_ASSERT(item && (item->key == i));
+        if (item->count != ((i % 10) ? num_writers - 1 : 0)) {
+            UTEST_FAILED("Item %d was merged %d times", i, item->count);
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(threads);
+    free(ctxs);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_CONCURRENT",
+        "Lookups and iteration concurrent with insertions and deletions",
+        ut_concurrent,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of stable keys" },
+            { "readers", UT_ARG_INT, "Number of reader threads" },
+            { "rounds", UT_ARG_INT, "Number of passes the writer makes" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_MULTI_WRITER",
+        "Insertions and deletions made by several writers at once",
+        ut_multi_writer,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of keys each writer inserts" },
+            { "writers", UT_ARG_INT, "Number of writer threads" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_MULTI_UPSERT",
+        "Upserts of the same keys made by several writers at once",
+        ut_multi_upsert,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of keys" },
+            { "writers", UT_ARG_INT, "Number of writer threads" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
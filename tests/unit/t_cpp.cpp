@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iterator>
+#include <ranges>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+extern "C" {
+#include "utest.h"
+}
+#include "ttree.hpp"
+
+struct item {
+    long pad;
+    int key;
+};
+
+struct big_key {
+    char bytes[TTREE_INLINE_KEY_MAX + 1];
+
+    bool operator<(const big_key &other) const
+    {
+        return bytes[0] < other.bytes[0];
+    }
+};
+
+struct big_item {
+    big_key key;
+};
+
+typedef tt::tree<item, &item::key> itree;
+typedef tt::tree<item, &item::key, std::greater<int>> rtree;
+
+static_assert(std::bidirectional_iterator<itree::iterator>);
+static_assert(std::ranges::bidirectional_range<itree>);
+
+/*
+ * Lookup awaiting another one: awaiting runs the inner lookup
+ * to completion without suspending.
+ */
+static tt::lookup_task<item> await_lookup(itree &tree, int key)
+{
+    co_return co_await tree.lookup_async(key);
+}
+
+/*
+ * Check that @tree holds every copy of the items with present keys
+ * (odd keys are never inserted): in order by iterators in both
+ * directions, and by lookups, bounds and interleaved lookups.
+ */
+static bool tree_matches(itree &tree, std::vector<item> &items,
+                         std::vector<bool> &present, int copies)
+{
+    std::vector<int> keys, expect;
+    std::vector<item *> found;
+    int i, n = 0, num_found = 0;
+
+    for (i = 0; i < (int)present.size(); i++) {
+        n += present[i] ? copies : 0;
+    }
+    if ((tree.size() != (size_t)n) ||
+        (std::ranges::distance(tree) != n) ||
+        (std::distance(tree.rbegin(), tree.rend()) != n)) {
+        utest_warning("Tree has %zd items instead of %d", tree.size(), n);
+        return false;
+    }
+    for (i = 0; i < (int)present.size(); i++) {
+        for (int j = 0; present[i] && (j < copies); j++) {
+            expect.push_back(i * 2);
+        }
+    }
+    if (!std::ranges::equal(tree, expect, {}, &item::key) ||
+        !std::equal(tree.rbegin(), tree.rend(), expect.rbegin(),
+                    [](const item &it, int key) { return it.key == key; })) {
+        utest_warning("Items aren't in order of their keys");
+        return false;
+    }
+
+    for (i = -1; i <= (int)present.size() * 2; i++) {
+        auto lo = std::lower_bound(expect.begin(), expect.end(), i);
+        auto hi = std::upper_bound(expect.begin(), expect.end(), i);
+        auto range = tree.equal_range(i);
+        item *it = tree.lookup(i);
+        bool has = (lo != hi);
+
+        if ((std::distance(tree.begin(), range.first) !=
+             lo - expect.begin()) ||
+            (std::distance(range.first, range.second) != hi - lo)) {
+            utest_warning("Bounds of %d are wrong", i);
+            return false;
+        }
+        if ((has != (it != nullptr)) || (it && (it->key != i)) ||
+            (has != (tree.find(i) != tree.end())) ||
+            (has && (tree.find(i)->key != i))) {
+            utest_warning("Lookup of %d gave %p", i, it);
+            return false;
+        }
+
+        keys.push_back(i);
+    }
+
+    num_found = (int)tree.lookup_interleaved(keys.begin(), keys.end(),
+                                             std::back_inserter(found), 7);
+    if ((found.size() != keys.size()) ||
+        (num_found != (int)std::ranges::count_if(found, [](item *it) {
+            return it != nullptr;
+        }))) {
+        utest_warning("Interleaved lookups found %d items", num_found);
+        return false;
+    }
+    for (i = 0; i < (int)keys.size(); i++) {
+        if (found[i] != tree.lookup(keys[i])) {
+            utest_warning("Interleaved lookup of %d gave %p", keys[i],
+                          found[i]);
+            return false;
+        }
+    }
+
+    (void)items;
+    return true;
+}
+
+/*
+ * ut_cpp_tree fills a tree by the C++ wrapper in pseudo-random order,
+ * removes a part of items and checks the tree by iterators, bounds and
+ * interleaved lookups. Mode 0 is a plain tree, 1 stores keys inline,
+ * 2 holds two copies of each key and 3 is concurrent (with inline keys).
+ */
+UTEST_FUNCTION(ut_cpp_tree, args)
+{
+    std::vector<item> items;
+    std::vector<bool> present;
+    int num_keys, num_items, mode, copies, i;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919));
+
+    copies = (mode == 2) ? 2 : 1;
+    itree tree(num_keys, mode != 2, (mode == 1) || (mode == 3));
+    if (mode == 3) {
+        UTEST_ASSERT(!ttree_set_flags(tree.native_handle(),
+                                      TTREE_CONCURRENT));
+    }
+
+    items.resize(num_items * copies);
+    present.assign(num_items, true);
+    for (i = 0; i < num_items * copies; i++) {
+        items[i].key = (i % num_items) * 2;
+    }
+    for (i = 0; i < num_items * copies; i++) {
+        UTEST_ASSERT(tree.insert(items[((long)i * 7919) %
+                                       (num_items * copies)]));
+    }
+
+    UTEST_ASSERT((mode == 2) || !tree.insert(items[0]));
+    UTEST_ASSERT(tree_matches(tree, items, present, copies));
+
+    for (i = 0; i < num_items; i += 3) {
+        for (int j = 0; j < copies; j++) {
+            UTEST_ASSERT(tree.erase(i * 2) != nullptr);
+        }
+
+        UTEST_ASSERT(tree.erase(i * 2) == nullptr);
+        present[i] = false;
+    }
+
+    UTEST_ASSERT(tree_matches(tree, items, present, copies));
+    for (i = 0; i < num_items; i++) {
+        tt::lookup_task<item> task = await_lookup(tree, i * 2);
+
+        tt::run_interleaved(std::span(&task, 1));
+        UTEST_ASSERT(task.done() && (task.get() == tree.lookup(i * 2)));
+    }
+
+    UTEST_PASSED();
+}
+
+/*
+ * ut_cpp_interleave checks that lookups really suspend on the way down
+ * and that many of them resumed in turn find the same items as plain
+ * lookups do, with a comparison reversing the order of keys.
+ */
+UTEST_FUNCTION(ut_cpp_interleave, args)
+{
+    rtree tree(utest_get_arg(args, 0, INT));
+    std::vector<item> items;
+    std::vector<tt::lookup_task<item>> tasks;
+    int num_items, i, steps = 0;
+    bool active = true;
+
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+    items.resize(num_items);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        UTEST_ASSERT(tree.insert(items[i]));
+    }
+
+    UTEST_ASSERT(std::ranges::is_sorted(tree, std::greater<int>(),
+                                        &item::key));
+    for (i = -1; i <= num_items; i++) {
+        tasks.push_back(tree.lookup_async(i));
+        UTEST_ASSERT(!tasks.back().done());
+    }
+    while (active) {
+        active = false;
+        for (auto &task : tasks) {
+            if (!task.done()) {
+                task.resume();
+                active |= !task.done();
+            }
+        }
+
+        steps++;
+    }
+    for (i = -1; i <= num_items; i++) {
+        item *it = tasks[i + 1].get();
+
+        if (it != (((i < 0) || (i == num_items)) ? nullptr : &items[i])) {
+            UTEST_FAILED("Lookup of %d gave %p", i, it);
+        }
+    }
+
+    /* A descent of a tree of several nodes takes several steps */
+    UTEST_ASSERT((tree.native_handle()->root->left == nullptr) ||
+                 (steps > 2));
+
+    tasks.clear();
+    UTEST_PASSED();
+}
+
+/* ut_cpp_errors checks that failures of initialization throw. */
+UTEST_FUNCTION(ut_cpp_errors, args)
+{
+    bool thrown = false;
+
+    try {
+        itree tree(0);
+    } catch (const std::system_error &e) {
+        thrown = (e.code().value() == EINVAL);
+    }
+
+    UTEST_ASSERT(thrown);
+    thrown = false;
+    try {
+        tt::tree<big_item, &big_item::key> tree(8, true, true);
+    } catch (const std::invalid_argument &) {
+        thrown = true;
+    }
+
+    UTEST_ASSERT(thrown);
+    (void)args;
+    UTEST_PASSED();
+}
+
+static struct test_arg tree_args[] = {
+    { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+    { "total_items", UT_ARG_INT, "Number of items in a tree" },
+    {
+        "mode", UT_ARG_INT,
+        "0 - plain, 1 - inline keys, 2 - duplicates, 3 - concurrent",
+    },
+    UTEST_ARGS_LIST_END,
+};
+
+static struct test_arg interleave_args[] = {
+    { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+    { "total_items", UT_ARG_INT, "Number of items in a tree" },
+    UTEST_ARGS_LIST_END,
+};
+
+static struct test_arg no_args[] = {
+    UTEST_ARGS_LIST_END,
+};
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_CPP_TREE",
+        "C++ tree should work with standard algorithms",
+        ut_cpp_tree,
+        tree_args,
+    },
+    {
+        "UT_CPP_INTERLEAVE",
+        "Interleaved lookups should find the same items as plain ones",
+        ut_cpp_interleave,
+        interleave_args,
+    },
+    {
+        "UT_CPP_ERRORS",
+        "Failures to initialize a tree should throw",
+        ut_cpp_errors,
+        no_args,
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "utest.h"
 #include "test_utils.h"
 #include "ttree.h"
@@ -245,6 +246,141 @@ UTEST_FUNCTION(ut_cursor_move, args)
     UTEST_PASSED();
 }
 
+#define cursor_key(cursor)                                      \
+    (((struct item *)ttree_item_from_cursor(cursor))->key)
+
+/*
+ * Check that a cursor points to an item with key @expected being
+ * the first (if @first) or the last of its duplicates.
+ */
+static bool cursor_at(TtreeCursor *cursor, int expected, bool first)
+{
+    TtreeCursor tmp;
+    int ret;
+
+    if ((cursor->state != CURSOR_OPENED) || (cursor_key(cursor) != expected)) {
+        return false;
+    }
+
+    ttree_cursor_copy(&tmp, cursor);
+    ret = first ? ttree_cursor_prev(&tmp) : ttree_cursor_next(&tmp);
+    if (ret != TCSR_OK) {
+        return true;
+    }
+
+    return first ? (cursor_key(&tmp) < expected) :
+        (cursor_key(&tmp) > expected);
+}
+
+struct scan_state {
+    Ttree *tree;
+    int lo, hi, prev, stop_after;
+};
+
+static int scan_cb(void **keys, int num, void *arg)
+{
+    struct scan_state *st = arg;
+    struct item *item;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        item = ttree_key2item(st->tree, keys[i]);
+        if ((item->key < st->lo) || (item->key > st->hi) ||
+            (item->key < st->prev)) {
+            utest_error("Key %d is out of range [%d, %d] or unordered!",
+                        item->key, st->lo, st->hi);
+        }
+
+        st->prev = item->key;
+    }
+
+    return !--st->stop_after;
+}
+
+/*
+ * ut_cursor_seek fills a tree with even keys (each one repeated
+ * @dups times) and checks cursor bounds seeking and range scans
+ * for keys around each of them.
+ */
+UTEST_FUNCTION(ut_cursor_seek, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct scan_state st;
+    int num_keys, num_items, dups, ret, i, j, last, e;
+    ssize_t scanned, expected;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    dups = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (dups >= 1));
+
+    ret = ttree_init(&tree, num_keys, (dups == 1), __cmpfunc,
+                     struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    i = 0;
+    UTEST_ASSERT(ttree_cursor_seek_ge(&cursor, &tree, &i) == TCSR_END);
+    UTEST_ASSERT(ttree_cursor_seek_le(&cursor, &tree, &i) == TCSR_END);
+    for (j = 0; j < dups; j++) {
+        for (i = 0; i < num_items; i++) {
+            UTEST_ASSERT(ttree_insert(&tree, alloc_item(i * 2)) == 0);
+        }
+    }
+
+    last = (num_items - 1) * 2;
+    for (i = -1; i <= last + 2; i++) {
+        e = (i <= 0) ? 0 : ((i + 1) & ~1);
+        ret = ttree_cursor_seek_ge(&cursor, &tree, &i);
+        UTEST_ASSERT((e > last) ? (ret == TCSR_END) :
+                     ((ret == TCSR_OK) && cursor_at(&cursor, e, true)));
+
+        e = (i < 0) ? 0 : (i / 2 + 1) * 2;
+        ret = ttree_cursor_seek_gt(&cursor, &tree, &i);
+        UTEST_ASSERT((e > last) ? (ret == TCSR_END) :
+                     ((ret == TCSR_OK) && cursor_at(&cursor, e, true)));
+
+        e = (i & ~1) > last ? last : (i & ~1);
+        ret = ttree_cursor_seek_le(&cursor, &tree, &i);
+        UTEST_ASSERT((i < 0) ? (ret == TCSR_END) :
+                     ((ret == TCSR_OK) && cursor_at(&cursor, e, false)));
+
+        e = ((i - 1) & ~1) > last ? last : ((i - 1) & ~1);
+        ret = ttree_cursor_seek_lt(&cursor, &tree, &i);
+        UTEST_ASSERT((i <= 0) ? (ret == TCSR_END) :
+                     ((ret == TCSR_OK) && cursor_at(&cursor, e, false)));
+
+        /* Scan [i, i + 7] */
+        st.tree = &tree;
+        st.lo = i;
+        st.hi = i + 7;
+        st.prev = st.lo;
+        st.stop_after = -1;
+        scanned = ttree_range_scan(&tree, &st.lo, &st.hi, scan_cb, &st);
+        for (expected = 0, j = st.lo; j <= st.hi; j++) {
+            if ((j >= 0) && (j <= last) && !(j & 1)) {
+                expected += dups;
+            }
+        }
+        if (scanned != expected) {
+            UTEST_FAILED("Got %zd items in range [%d, %d], expected %zd",
+                         scanned, st.lo, st.hi, expected);
+        }
+    }
+
+    st.lo = 0;
+    st.hi = last;
+    st.prev = 0;
+    st.stop_after = -1;
+    scanned = ttree_range_scan(&tree, NULL, NULL, scan_cb, &st);
+    UTEST_ASSERT(scanned == (ssize_t)num_items * dups);
+    st.prev = 0;
+    st.stop_after = 1;
+    scanned = ttree_range_scan(&tree, NULL, NULL, scan_cb, &st);
+    UTEST_ASSERT((scanned > 0) && (scanned <= num_keys));
+
+    UTEST_PASSED();
+}
+
 DEFINE_UTESTS_LIST(tests) = {
     {
         "UTEST_CURSOR_MOVE",
@@ -272,6 +408,17 @@ DEFINE_UTESTS_LIST(tests) = {
         ut_cursor_move_pending,
         UTEST_ARGS_LIST { UTEST_ARGS_LIST_END, },
     },
+    {
+        "UTEST_CURSOR_SEEK",
+        "Seeking bounds of keys and scanning ranges",
+        ut_cursor_seek,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of distinct keys" },
+            { "dups", UT_ARG_INT, "Number of items per each key" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
 
     UTESTS_LIST_END,
 };
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int payload;
+    int key;
+    char *name;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+/* Pointers can't be saved, so records keep no name. */
+static void serialize_item(void *item, void *record, void *arg)
+{
+    struct item *rec = record;
+
+    memcpy(rec, item, sizeof(*rec));
+    rec->name = NULL;
+    (*(int *)arg)++;
+}
+
+static int make_image_file(void)
+{
+    char path[] = "/tmp/ttree_image.XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd >= 0) {
+        unlink(path);
+    }
+
+    return fd;
+}
+
+/*
+ * ut_image saves a tree to a file, loads it back by mapping the file
+ * and checks that the loaded tree has all items and can be modified.
+ * The image is also loaded while it's mapped, so the second tree must
+ * be relocated.
+ */
+UTEST_FUNCTION(ut_image, args)
+{
+    Ttree tree, other;
+    TtreeCursor cursor;
+    struct balance_info binfo;
+    struct item *items, *item;
+    int num_keys, num_items, mode, fd, i, key, serialized = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 0);
+
+    items = calloc(num_items + 1, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    if ((mode == 1) || (mode == 3)) {
+        UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                       struct item, key) == 0);
+    }
+    else {
+        UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                                struct item, key) == 0);
+    }
+    if (mode == 2) {
+        UTEST_ASSERT(ttree_set_flags(&tree, TTREE_ORDER_STATS) == 0);
+    }
+    else if (mode == 3) {
+        UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CACHE_ALIGNED) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (int)(((long)i * 7919) % num_items) * 2;
+        items[i].payload = -items[i].key;
+        items[i].name = "item";
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    fd = make_image_file();
+    UTEST_ASSERT(fd >= 0);
+    UTEST_ASSERT(ttree_save(&tree, fd, sizeof(struct item), serialize_item,
+                            &serialized) == 0);
+    UTEST_ASSERT(serialized == num_items);
+    ttree_destroy(&tree);
+    free(items);
+
+    UTEST_ASSERT(ttree_open_mmap(&tree, fd, __cmpfunc) == 0);
+    /* Nothing was mapped since saving, so the preferred range is free */
+    UTEST_ASSERT(!tree.slab.image_relocated);
+    UTEST_ASSERT(ttree_size(&tree) == (size_t)num_items);
+    UTEST_ASSERT(tree.keys_per_tnode == num_keys);
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Loaded tree is not balanced: %s",
+                     balance_name(binfo.balance));
+    }
+    for (key = 0; key < num_items * 2; key++) {
+        item = ttree_lookup(&tree, &key, NULL);
+        if (key & 1) {
+            UTEST_ASSERT(item == NULL);
+            continue;
+        }
+        if (!item || (item->key != key) || (item->payload != -key) ||
+            item->name) {
+            UTEST_FAILED("Key %d wasn't loaded properly", key);
+        }
+    }
+    if (mode == 2) {
+        for (i = 0; i < num_items; i++) {
+            item = ttree_select(&tree, i, NULL);
+            UTEST_ASSERT(item && (item->key == i * 2));
+        }
+    }
+
+    /* The range the image prefers is taken, so a second one is relocated */
+    UTEST_ASSERT(ttree_open_mmap(&other, fd, __cmpfunc) == 0);
+    UTEST_ASSERT(other.slab.image_relocated &&
+                 (ttree_size(&other) == (size_t)num_items));
+    check_tree_balance(&other, &binfo);
+    UTEST_ASSERT(binfo.balance == TREE_BALANCED);
+    for (key = 0; key < num_items * 2; key += 2) {
+        item = ttree_lookup(&other, &key, NULL);
+        UTEST_ASSERT(item && (item->key == key) &&
+                     (item != ttree_lookup(&tree, &key, NULL)));
+    }
+
+    ttree_destroy(&other);
+
+    /* Loaded nodes are freed and split as any other ones. */
+    items = calloc(num_items + 1, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i * 2 + 1;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (key = 0; key < num_items * 2; key += 4) {
+        item = ttree_delete(&tree, &key);
+        UTEST_ASSERT(item && (item->key == key));
+    }
+
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Modified tree is not balanced: %s",
+                     balance_name(binfo.balance));
+    }
+    if (num_items) {
+        ttree_cursor_open(&cursor, &tree);
+        UTEST_ASSERT(ttree_cursor_first(&cursor) == 0);
+        key = -1;
+        i = 0;
+        do {
+            item = ttree_item_from_cursor(&cursor);
+            UTEST_ASSERT((item->key > key) && (item->key % 4));
+            key = item->key;
+            i++;
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+        UTEST_ASSERT((size_t)i == ttree_size(&tree));
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+
+    /* A truncated image is rejected. */
+    UTEST_ASSERT(ftruncate(fd, sizeof(void *)) == 0);
+    UTEST_ASSERT((ttree_open_mmap(&tree, fd, __cmpfunc) < 0) &&
+                 (errno == EINVAL));
+    close(fd);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_IMAGE",
+        "Save T*-tree image and load it by mapping",
+        ut_image,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items" },
+            { "mode", UT_ARG_INT,
+              "0 - plain, 1 - inline keys, 2 - order statistics, "
+              "3 - cache aligned nodes" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
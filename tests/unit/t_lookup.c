@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
 #include "utest.h"
 #include "test_utils.h"
 #include "ttree.h"
+#include "ttree_simd.h"
 
 struct item {
     int key;
@@ -102,6 +106,657 @@ UTEST_FUNCTION(ut_lookup, args)
     UTEST_PASSED();
 }
 
+struct item64 {
+    uint64_t key;
+    char payload[16];
+};
+
+static int __cmpfunc64(void *key1, void *key2)
+{
+    uint64_t k1 = *(uint64_t *)key1, k2 = *(uint64_t *)key2;
+
+    return ((k1 > k2) - (k1 < k2));
+}
+
+/*
+ * Every inline key copy must be equal to the key of an item
+ * it corresponds to.
+ */
+static bool inline_keys_are_valid(Ttree *tree)
+{
+    TtreeNode *tnode;
+    int i;
+
+    tnode = ttree_node_leftmost(tree->root);
+    while (tnode) {
+        tnode_for_each_index(tnode, i) {
+            if (memcmp(tnode_inline_key(tree, tnode, i), tnode_key(tnode, i),
+                       tree->key_width)) {
+                utest_warning("Inline key copy of %" PRIu64 " differs from "
+                              "the key itself!", *(uint64_t *)tnode_key(tnode, i));
+                return false;
+            }
+        }
+
+        tnode = tnode->successor;
+    }
+
+    return true;
+}
+
+/*
+ * ut_lookup_inline inserts and removes items in a pseudo-random
+ * order into a tree storing 64-bit keys inline. After each pass
+ * it checks that every inline key copy is consistent and all
+ * items can be found.
+ */
+UTEST_FUNCTION(ut_lookup_inline, args)
+{
+    Ttree tree;
+    int num_keys, num_items, ret, i;
+    struct balance_info binfo;
+    struct item64 *items, *item;
+    uint64_t key;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init_inline(&tree, num_keys, true, __cmpfunc64,
+                            struct item64, key);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(tree.key_width == sizeof(uint64_t));
+    items = calloc(num_items, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        item = &items[((long)i * 7919) % num_items];
+        item->key = ((long)i * 7919) % num_items;
+        UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    }
+
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is unbalanced on a node %p BFC = %d, %s\n",
+                     binfo.tnode, binfo.tnode->bfc,
+                     balance_name(binfo.balance));
+    }
+
+    UTEST_ASSERT(inline_keys_are_valid(&tree));
+    for (key = 0; key < num_items; key++) {
+        item = ttree_lookup(&tree, &key, NULL);
+        UTEST_ASSERT((item != NULL) && (item->key == key));
+    }
+    for (key = 0; key < num_items; key += 2) {
+        UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+    }
+
+    UTEST_ASSERT(inline_keys_are_valid(&tree));
+    for (key = 0; key < num_items; key++) {
+        item = ttree_lookup(&tree, &key, NULL);
+        if (key % 2) {
+            UTEST_ASSERT((item != NULL) && (item->key == key));
+        }
+        else {
+            UTEST_ASSERT(item == NULL);
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct item32 {
+    uint32_t key;
+};
+
+struct item_i64 {
+    int64_t key;
+};
+
+static int __cmpfunc32(void *key1, void *key2)
+{
+    uint32_t k1 = *(uint32_t *)key1, k2 = *(uint32_t *)key2;
+
+    return ((k1 > k2) - (k1 < k2));
+}
+
+static int __cmpfunc_i64(void *key1, void *key2)
+{
+    int64_t k1 = *(int64_t *)key1, k2 = *(int64_t *)key2;
+
+    return ((k1 > k2) - (k1 < k2));
+}
+
+#define CURSORS_ARE_EQUAL(c1, c2)                                   \
+    (((c1)->tnode == (c2)->tnode) && ((c1)->idx == (c2)->idx) &&    \
+     ((c1)->side == (c2)->side) && ((c1)->state == (c2)->state))
+
+/*
+ * Fill a tree with keys <base + 3 * i> in a pseudo-random order, then
+ * make sure typed lookup of every key in the range (including keys
+ * that are absent) gives the same result and the same cursor as
+ * generic ttree_lookup does.
+ */
+#define CHECK_TYPED_LOOKUP(item_type, key_type, cmpf, lookup_fn, base)  \
+    do {                                                                \
+        item_type *__items;                                             \
+        key_type __k;                                                   \
+        TtreeCursor __c1, __c2;                                         \
+        void *__r1, *__r2;                                              \
+        long __i;                                                       \
+                                                                        \
+        ret = ttree_init_inline(&tree, num_keys, true, cmpf,            \
+                                item_type, key);                        \
+        UTEST_ASSERT(ret == 0);                                         \
+        __items = calloc(num_items, sizeof(*__items));                  \
+        UTEST_ASSERT(__items != NULL);                                  \
+        for (__i = 0; __i < num_items; __i++) {                         \
+            __items[__i].key = (base) + (key_type)(3 * ((__i * 7919) %  \
+                                                        num_items));    \
+            UTEST_ASSERT(ttree_insert(&tree, &__items[__i]) == 0);      \
+        }                                                               \
+        for (__i = -2; __i <= 3L * num_items; __i++) {                  \
+            __k = (base) + (key_type)__i;                               \
+            __r1 = ttree_lookup(&tree, &__k, &__c1);                    \
+            __r2 = lookup_fn(&tree, __k, &__c2);                        \
+            if ((__r1 != __r2) || !CURSORS_ARE_EQUAL(&__c1, &__c2)) {   \
+                UTEST_FAILED("%s returned %p (idx %d), while "          \
+                             "ttree_lookup returned %p (idx %d) for "   \
+                             "key #%ld", #lookup_fn, __r2, __c2.idx,    \
+                             __r1, __c1.idx, __i);                      \
+            }                                                           \
+            if (__r2 && (((item_type *)__r2)->key != __k)) {            \
+                UTEST_FAILED("%s found wrong item", #lookup_fn);        \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        ttree_destroy(&tree);                                           \
+        free(__items);                                                  \
+    } while (0)
+
+/*
+ * ut_lookup_typed validates typed lookups with given search kernel.
+ * Keys are chosen so that they cross the sign boundary of a type,
+ * to make sure unsigned keys are compared as unsigned ones.
+ */
+UTEST_FUNCTION(ut_lookup_typed, args)
+{
+    Ttree tree;
+    int num_keys, num_items, ret;
+    char *kernel;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    kernel = utest_get_arg(args, 2, STRING);
+    UTEST_ASSERT(num_items >= 1);
+    if (ttree_simd_select(kernel) < 0) {
+        utest_warning("Kernel %s is not supported. Skipping.", kernel);
+        UTEST_PASSED();
+    }
+
+    UTEST_ASSERT(!strcmp(ttree_simd_name(), kernel));
+    CHECK_TYPED_LOOKUP(struct item32, uint32_t, __cmpfunc32,
+                       ttree_lookup_u32, (uint32_t)INT32_MAX - num_items);
+    CHECK_TYPED_LOOKUP(struct item64, uint64_t, __cmpfunc64,
+                       ttree_lookup_u64, (uint64_t)INT64_MAX - num_items);
+    CHECK_TYPED_LOOKUP(struct item_i64, int64_t, __cmpfunc_i64,
+                       ttree_lookup_i64, -(int64_t)num_items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_lookup_batch looks up existing and missing keys by batches
+ * of different sizes and checks results against ttree_lookup.
+ * Both a tree with key pointers and a tree with inline keys are used.
+ */
+UTEST_FUNCTION(ut_lookup_batch, args)
+{
+    Ttree trees[2];
+    int num_keys, num_items, batch, ret, i, j, t, num, found;
+    int *keybuf;
+    void **keys, **items;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    batch = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (batch >= 1));
+
+    ret = ttree_init(&trees[0], num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    ret = ttree_init_inline(&trees[1], num_keys, true, __cmpfunc,
+                            struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    keybuf = malloc(sizeof(*keybuf) * batch);
+    keys = malloc(sizeof(*keys) * batch);
+    items = malloc(sizeof(*items) * batch);
+    UTEST_ASSERT(keybuf && keys && items);
+    for (t = 0; t < 2; t++) {
+        UTEST_ASSERT(ttree_lookup_batch(&trees[t], keys, 0, items) == 0);
+        for (i = 0; i < num_items; i++) {
+            UTEST_ASSERT(ttree_insert(&trees[t], alloc_item(i * 3)) == 0);
+        }
+    }
+
+    for (t = 0; t < 2; t++) {
+        for (i = -batch; i < num_items * 3 + batch; i += batch) {
+            /* Keys of a batch go in a pseudo-random order. */
+            for (j = 0, found = 0; j < batch; j++) {
+                keybuf[j] = i + (j * 7) % batch;
+                keys[j] = &keybuf[j];
+                if ((keybuf[j] >= 0) && (keybuf[j] < num_items * 3) &&
+                    !(keybuf[j] % 3)) {
+                    found++;
+                }
+            }
+
+            num = (int)ttree_lookup_batch(&trees[t], keys, batch, items);
+            if (num != found) {
+                UTEST_FAILED("Found %d items by batch starting at %d, "
+                             "but %d were expected", num, i, found);
+            }
+            for (j = 0; j < batch; j++) {
+                UTEST_ASSERT(items[j] ==
+                             ttree_lookup(&trees[t], keys[j], NULL));
+            }
+        }
+    }
+
+    free(keybuf);
+    free(keys);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_lookup_finger walks over keys of a tree by small steps in both
+ * directions mixed with long jumps and looks each key up from the
+ * cursor the previous lookup positioned. Both the item and the cursor
+ * position must be the same as ttree_lookup gives. Some missing keys
+ * are inserted at the cursor on the way.
+ */
+UTEST_FUNCTION(ut_lookup_finger, args)
+{
+    Ttree tree;
+    TtreeCursor cursor, exp;
+    struct balance_info binfo;
+    struct item *item, *exp_item;
+    int num_keys, num_items, step, ret, i, key, inserted = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    step = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (step >= 1));
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    key = 0;
+    ttree_lookup(&tree, &key, &cursor);
+    UTEST_ASSERT(ttree_lookup_from_cursor(&cursor, &key) == NULL);
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, alloc_item(i * 3)) == 0);
+    }
+
+    ttree_cursor_open(&cursor, &tree);
+    for (i = 0; i < num_items * 4; i++) {
+        if (!(i % 64)) {
+            key = (int)(((long)i * 7919) % (num_items * 3 + 2)) - 1;
+        }
+        else {
+            key += ((i * 31) % (step * 2 + 1)) - step;
+        }
+
+        item = ttree_lookup_from_cursor(&cursor, &key);
+        exp_item = ttree_lookup(&tree, &key, &exp);
+        if ((item != exp_item) || (cursor.tnode != exp.tnode) ||
+            (cursor.idx != exp.idx) || (cursor.side != exp.side) ||
+            (cursor.state != exp.state)) {
+            UTEST_FAILED("Lookup of %d from cursor differs from ttree_lookup",
+                         key);
+        }
+        if (item) {
+            CHECK_ITEM(item, key);
+        }
+        else if (!(i % 5)) {
+            ttree_insert_at_cursor(&cursor, alloc_item(key));
+            inserted++;
+        }
+    }
+
+    UTEST_ASSERT(tree.num_items == (size_t)(num_items + inserted));
+    check_tree_balance(&tree, &binfo);
+    UTEST_ASSERT(binfo.balance == TREE_BALANCED);
+    for (i = 0; i < num_items; i++) {
+        key = i * 3;
+        CHECK_ITEM((struct item *)ttree_lookup(&tree, &key, NULL), key);
+    }
+    ttree_cursor_first(&cursor);
+    key = INT_MIN;
+    do {
+        item = ttree_key2item(&tree,
+                              tnode_key(cursor.tnode, cursor.idx));
+        UTEST_ASSERT(item->key > key);
+        key = item->key;
+    } while (ttree_cursor_next(&cursor) == TCSR_OK);
+
+    UTEST_PASSED();
+}
+
+/*
+ * ut_lookup_finger_dup is ut_lookup_finger for a tree where keys have
+ * up to @dups copies. Among equal keys a lookup from the cursor must
+ * land on the same one ttree_lookup does.
+ */
+UTEST_FUNCTION(ut_lookup_finger_dup, args)
+{
+    Ttree tree;
+    TtreeCursor cursor, exp;
+    struct item *item, *exp_item;
+    int num_keys, num_items, dups, ret, i, j, key;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    dups = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (dups >= 1));
+
+    ret = ttree_init(&tree, num_keys, false, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items) * 3;
+        for (j = 0; j <= (key / 3) % dups; j++) {
+            UTEST_ASSERT(ttree_insert(&tree, alloc_item(key)) == 0);
+        }
+    }
+
+    ttree_cursor_open(&cursor, &tree);
+    key = 0;
+    for (i = 0; i < num_items * 4; i++) {
+        if (!(i % 64)) {
+            key = (int)(((long)i * 7919) % (num_items * 3 + 2)) - 1;
+        }
+        else {
+            key += ((i * 31) % 9) - 4;
+        }
+
+        item = ttree_lookup_from_cursor(&cursor, &key);
+        exp_item = ttree_lookup(&tree, &key, &exp);
+        if ((item != exp_item) || (cursor.tnode != exp.tnode) ||
+            (cursor.idx != exp.idx) || (cursor.side != exp.side) ||
+            (cursor.state != exp.state)) {
+            UTEST_FAILED("Lookup of %d from cursor differs from ttree_lookup",
+                         key);
+        }
+        if (item) {
+            CHECK_ITEM(item, key);
+        }
+    }
+
+    UTEST_PASSED();
+}
+
+struct item_str {
+    char *name;
+    char buf[48];
+};
+
+static void format_str_key(char *buf, size_t size, int val)
+{
+    /* Most keys share a prefix longer than their inline copies. */
+    if (val % 3) {
+        snprintf(buf, size, "http://example.com/%08d", val);
+    }
+    else {
+        snprintf(buf, size, "%d", val);
+    }
+}
+
+/*
+ * Inline copy of a string key must be its prefix padded with zeroes.
+ */
+static bool str_prefixes_are_valid(Ttree *tree)
+{
+    TtreeNode *tnode;
+    char prefix[TTREE_INLINE_KEY_MAX];
+    const char *str;
+    int i;
+
+    tnode = ttree_node_leftmost(tree->root);
+    while (tnode) {
+        tnode_for_each_index(tnode, i) {
+            str = (tree->str_keys == TTREE_STR_PTR) ?
+                *(char **)tnode_key(tnode, i) : (char *)tnode_key(tnode, i);
+            strncpy(prefix, str, tree->key_width);
+            if (memcmp(tnode_inline_key(tree, tnode, i), prefix,
+                       tree->key_width)) {
+                utest_warning("Inline prefix of \"%s\" is invalid!", str);
+                return false;
+            }
+        }
+
+        tnode = tnode->successor;
+    }
+
+    return true;
+}
+
+static struct item_str *lookup_str(Ttree *tree, int mode, char *str)
+{
+    return ttree_lookup(tree, mode ? (void *)str : (void *)&str, NULL);
+}
+
+/*
+ * ut_lookup_str fills a tree having string keys either behind
+ * pointers (mode 0) or in items (mode 1), removes a half of them
+ * and checks the order of keys, inline prefixes and lookups.
+ */
+UTEST_FUNCTION(ut_lookup_str, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    int num_keys, num_items, mode, ret, i, n;
+    struct balance_info binfo;
+    struct item_str *items, *item, *prev;
+    char buf[48];
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    if (mode) {
+        ret = ttree_init_strbuf(&tree, num_keys, true, 8,
+                                struct item_str, buf);
+    }
+    else {
+        ret = ttree_init_str(&tree, num_keys, true, 8,
+                             struct item_str, name);
+    }
+
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CACHE_ALIGNED) < 0);
+    items = calloc(num_items, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        item = &items[((long)i * 7919) % num_items];
+        format_str_key(item->buf, sizeof(item->buf), item - items);
+        item->name = item->buf;
+        UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    }
+
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is unbalanced on a node %p BFC = %d, %s\n",
+                     binfo.tnode, binfo.tnode->bfc,
+                     balance_name(binfo.balance));
+    }
+
+    UTEST_ASSERT(str_prefixes_are_valid(&tree));
+    for (i = 0; i < num_items; i += 2) {
+        format_str_key(buf, sizeof(buf), i);
+        UTEST_ASSERT(ttree_delete(&tree, mode ? (void *)buf :
+                                  (void *)&items[i].name) == &items[i]);
+    }
+
+    UTEST_ASSERT(str_prefixes_are_valid(&tree));
+    for (i = 0; i < num_items; i++) {
+        format_str_key(buf, sizeof(buf), i);
+        item = lookup_str(&tree, mode, buf);
+        UTEST_ASSERT(item == ((i % 2) ? &items[i] : NULL));
+    }
+
+    /* Lookups of absent strings sharing whole prefixes with keys. */
+    UTEST_ASSERT(lookup_str(&tree, mode, "http://e") == NULL);
+    UTEST_ASSERT(lookup_str(&tree, mode, "http://example.com/") == NULL);
+
+    n = 0;
+    prev = NULL;
+    UTEST_ASSERT(ttree_cursor_open(&cursor, &tree) == 0);
+    if (ttree_cursor_first(&cursor) == 0) {
+        do {
+            item = ttree_item_from_cursor(&cursor);
+            if (prev && (strcmp(prev->buf, item->buf) >= 0)) {
+                UTEST_FAILED("\"%s\" goes after \"%s\"", item->buf, prev->buf);
+            }
+
+            prev = item;
+            n++;
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+
+    UTEST_ASSERT(n == num_items / 2);
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct counted {
+    int key;
+    int count;
+};
+
+/* Items of the first generation count merges, others replace them. */
+static void *count_merge(void *old_item, void *new_item, void *arg)
+{
+    struct counted *old = old_item;
+
+    (*(int *)arg)++;
+    if (old->count < 100) {
+        old->count++;
+        return old_item;
+    }
+
+    return new_item;
+}
+
+/*
+ * ut_upsert mixes ttree_upsert, ttree_find_or_insert and ttree_replace
+ * on items of two generations with the same keys. Mode 0 is a plain
+ * tree, 1 has order statistics, 2 keeps keys inline and 3 allows
+ * duplicated keys.
+ */
+UTEST_FUNCTION(ut_upsert, args)
+{
+    Ttree tree;
+    TtreeNode *tnode;
+    struct counted *a, *b, *item, *exp;
+    int num_keys, num_items, mode, i, j, idx, ret, merges = 0, merged = 0;
+    int prev = -1, n = 0;
+    bool present;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919));
+
+    if (mode == 2) {
+        ret = ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                struct counted, key);
+    }
+    else {
+        ret = ttree_init(&tree, num_keys, mode != 3, __cmpfunc,
+                         struct counted, key);
+    }
+
+    UTEST_ASSERT(ret == 0);
+    if (mode == 1) {
+        UTEST_ASSERT(ttree_set_flags(&tree, TTREE_ORDER_STATS) == 0);
+    }
+
+    a = malloc(sizeof(*a) * num_items);
+    b = malloc(sizeof(*b) * num_items);
+    UTEST_ASSERT(a && b);
+    for (i = 0; i < num_items; i++) {
+        a[i].key = b[i].key = i;
+        a[i].count = 0;
+        b[i].count = 100;
+    }
+    for (j = 0; j < num_items; j++) {
+        i = (int)(((long)j * 7919) % num_items);
+        if (!(i % 2)) {
+            UTEST_ASSERT(ttree_upsert(&tree, &a[i], count_merge,
+                                      &merges) == 0);
+        }
+    }
+    for (i = 0; i < num_items; i += 3) {
+        item = ttree_find_or_insert(&tree, &b[i]);
+        UTEST_ASSERT(item == ((i % 2) ? &b[i] : &a[i]));
+    }
+    for (j = 0; j < num_items; j++) {
+        i = (int)(((long)j * 7919) % num_items);
+        present = !(i % 2) || !(i % 3);
+        ret = ttree_upsert(&tree, &b[i], count_merge, &merges);
+        if (ret != present) {
+            UTEST_FAILED("Upsert of %d returned %d", i, ret);
+        }
+
+        merged += present;
+    }
+    for (i = 0; i < num_items; i += 5) {
+        UTEST_ASSERT(ttree_upsert(&tree, &a[i], NULL, NULL) == 1);
+    }
+    for (i = 0; i < num_items; i += 7) {
+        exp = ((i % 2) && (i % 5)) ? &a[i] : &b[i];
+        UTEST_ASSERT(ttree_replace(&tree, &i, exp) == 0);
+    }
+
+    UTEST_ASSERT(merges == merged);
+    UTEST_ASSERT(tree.num_items == (size_t)num_items);
+    i = num_items;
+    UTEST_ASSERT(ttree_replace(&tree, &i, &a[0]) < 0);
+    for (tnode = ttree_node_leftmost(tree.root); tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, idx) {
+            item = ttree_key2item(&tree, tnode_key(tnode, idx));
+            UTEST_ASSERT(item->key > prev);
+            prev = item->key;
+            n++;
+        }
+    }
+
+    UTEST_ASSERT(n == num_items);
+    for (i = 0; i < num_items; i++) {
+        if (!(i % 7)) {
+            exp = ((i % 2) && (i % 5)) ? &a[i] : &b[i];
+        }
+        else {
+            exp = ((i % 2) && (i % 5)) ? &b[i] : &a[i];
+        }
+
+        item = ttree_lookup(&tree, &i, NULL);
+        if (item != exp) {
+            UTEST_FAILED("Key %d has item %p instead of %p", i, item, exp);
+        }
+        if (a[i].count != !(i % 2)) {
+            UTEST_FAILED("Item %d was merged %d times", i, a[i].count);
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(b);
+    free(a);
+    UTEST_PASSED();
+}
+
 DEFINE_UTESTS_LIST(tests) = {
     {
         "UT_LOOKUP",
@@ -113,6 +768,88 @@ DEFINE_UTESTS_LIST(tests) = {
             UTEST_ARGS_LIST_END,
         },
     },
+    {
+        "UT_LOOKUP_INLINE",
+        "Lookup test on a tree storing 64-bit keys inside its nodes",
+        ut_lookup_inline,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_LOOKUP_TYPED",
+        "Typed lookups of integer keys should agree with ttree_lookup",
+        ut_lookup_typed,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            {
+                "kernel", UT_ARG_STRING,
+                "Search kernel (scalar, sse4.2, avx2 or neon)",
+            },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_LOOKUP_BATCH",
+        "Batched lookups should agree with ttree_lookup",
+        ut_lookup_batch,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "batch", UT_ARG_INT, "Number of keys per batch" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_LOOKUP_FINGER",
+        "Lookups from a cursor should agree with ttree_lookup",
+        ut_lookup_finger,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "step", UT_ARG_INT, "Maximum distance between keys" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_LOOKUP_FINGER_DUP",
+        "Lookups from a cursor should pick the same duplicate as ttree_lookup",
+        ut_lookup_finger_dup,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of distinct keys" },
+            { "dups", UT_ARG_INT, "Maximum number of copies of a key" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_LOOKUP_STR",
+        "String keys with inline prefixes should be ordered by strcmp",
+        ut_lookup_str,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "mode", UT_ARG_INT, "0 - char pointers, 1 - char arrays" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_UPSERT",
+        "Insert items or merge them with items having the same keys",
+        ut_upsert,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            {
+                "mode", UT_ARG_INT,
+                "0 - plain, 1 - order stats, 2 - inline, 3 - not unique",
+            },
+            UTEST_ARGS_LIST_END,
+        },
+    },
     UTESTS_LIST_END,
 };
 
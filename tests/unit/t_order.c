@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static struct item *alloc_item(int val)
+{
+    struct item *item = malloc(sizeof(*item));
+
+    if (!item) {
+        utest_error("Failed to allocate %zd bytes!", sizeof(*item));
+    }
+
+    item->key = val;
+    return item;
+}
+
+/*
+ * Returns real number of items in a subtree, @ok is cleared if
+ * a counter of any node doesn't match it.
+ */
+static size_t check_counts(Ttree *tree, TtreeNode *tnode, bool *ok)
+{
+    size_t num;
+
+    if (!tnode) {
+        return 0;
+    }
+
+    num = tnode_num_keys(tnode) + check_counts(tree, tnode->left, ok) +
+        check_counts(tree, tnode->right, ok);
+    if (tnode_count(tree, tnode) != num) {
+        *ok = false;
+    }
+
+    return num;
+}
+
+#define CHECK_COUNTS(tree)                                              \
+    do {                                                                \
+        bool __ok = true;                                               \
+        size_t __num = check_counts(tree, (tree)->root, &__ok);         \
+                                                                        \
+        if (!__ok || (__num != ttree_size(tree))) {                     \
+            UTEST_FAILED("Subtree counters are broken: %zd items in a " \
+                         "tree, but size is %zd", __num,                \
+                         ttree_size(tree));                             \
+        }                                                               \
+    } while (0)
+
+/*
+ * Check rank, select and count_range for a tree holding
+ * keys k * 2 repeated @dups times, for k in [0, num).
+ */
+static bool check_order_stats(Ttree *tree, int num, int dups)
+{
+    TtreeCursor cursor;
+    struct item *item;
+    ssize_t rank;
+    int i, lo, hi;
+
+    for (i = -1; i <= num * 2; i++) {
+        rank = ttree_rank(tree, &i);
+        lo = (i <= 0) ? 0 : (i + 1) / 2;
+        if (lo > num) {
+            lo = num;
+        }
+        if (rank != (ssize_t)lo * dups) {
+            utest_warning("Rank of %d is %zd, expected %d", i, rank,
+                          lo * dups);
+            return false;
+        }
+    }
+    for (i = 0; i < num * dups; i++) {
+        item = ttree_select(tree, i, &cursor);
+        if (!item || (item->key != (i / dups) * 2) ||
+            (ttree_item_from_cursor(&cursor) != item)) {
+            utest_warning("Failed to select item %d", i);
+            return false;
+        }
+    }
+    if (ttree_select(tree, num * dups, NULL)) {
+        utest_warning("Selected an item out of range!");
+        return false;
+    }
+    for (lo = -3; lo < num * 2; lo += 5) {
+        hi = lo + 9;
+        rank = ttree_count_range(tree, &lo, &hi);
+        if (rank != ttree_rank(tree, &hi) - ttree_rank(tree, &lo)) {
+            utest_warning("Wrong number of items in [%d, %d)", lo, hi);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * ut_order_stats builds a tree with subtree counters in an order
+ * causing lots of rotations, verifies counters and order statistics,
+ * then does the same while the tree is drained.
+ */
+UTEST_FUNCTION(ut_order_stats, args)
+{
+    Ttree tree;
+    int num_keys, num_items, dups, ret, i, j, key;
+    struct item *item;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    dups = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (dups >= 1));
+
+    ret = ttree_init(&tree, num_keys, (dups == 1), __cmpfunc,
+                     struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    i = 0;
+    UTEST_ASSERT((ttree_rank(&tree, &i) < 0) && (errno == EINVAL));
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_ORDER_STATS) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, ~0U) < 0);
+    UTEST_ASSERT(ttree_rank(&tree, &i) == 0);
+    UTEST_ASSERT(ttree_select(&tree, 0, NULL) == NULL);
+    for (j = 0; j < dups; j++) {
+        for (i = 0; i < num_items; i++) {
+            /* Zig-zag order: 0, n - 1, 1, n - 2, ... */
+            key = (i & 1) ? num_items - 1 - i / 2 : i / 2;
+            UTEST_ASSERT(ttree_insert(&tree, alloc_item(key * 2)) == 0);
+            if (!(i % 97)) {
+                CHECK_COUNTS(&tree);
+            }
+        }
+    }
+
+    UTEST_ASSERT(ttree_set_flags(&tree, 0) < 0);
+    CHECK_COUNTS(&tree);
+    UTEST_ASSERT(check_order_stats(&tree, num_items, dups));
+
+    /* Remove keys from the middle of the tree. */
+    for (i = num_items / 2, j = 0; j < num_items * dups; j++) {
+        key = (i + (((j / dups) & 1) ? -(j / dups + 1) / 2 :
+                    (j / dups) / 2)) * 2;
+        item = ttree_delete(&tree, &key);
+        UTEST_ASSERT(item != NULL);
+        free(item);
+        if (!(j % 97)) {
+            CHECK_COUNTS(&tree);
+        }
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree) && !ttree_size(&tree));
+
+    /* Bulk loaded trees must have valid counters too */
+    {
+        void **items = malloc(sizeof(*items) * num_items * dups);
+
+        UTEST_ASSERT(items != NULL);
+        for (i = 0; i < num_items * dups; i++) {
+            items[i] = alloc_item((i / dups) * 2);
+        }
+
+        UTEST_ASSERT(ttree_bulk_load(&tree, items, num_items * dups,
+                                     0.8) == 0);
+        free(items);
+    }
+
+    CHECK_COUNTS(&tree);
+    UTEST_ASSERT(check_order_stats(&tree, num_items, dups));
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_ORDER_STATS",
+        "Rank, select and range counting on a tree with subtree counters",
+        ut_order_stats,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of distinct keys" },
+            { "dups", UT_ARG_INT, "Number of items per each key" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
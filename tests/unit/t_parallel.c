@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int key;
+    int seq;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static int tnode_height(TtreeNode *tnode, bool *ok)
+{
+    int l, r;
+
+    if (!tnode) {
+        return 0;
+    }
+
+    l = tnode_height(tnode->left, ok);
+    r = tnode_height(tnode->right, ok);
+    if ((tnode->bfc != r - l) || tnode_is_empty(tnode) ||
+        (tnode->left && (tnode->left->parent != tnode)) ||
+        (tnode->right && (tnode->right->parent != tnode))) {
+        *ok = false;
+    }
+
+    return ((r > l) ? r : l) + 1;
+}
+
+/*
+ * Check that @tree holds all @num_items items ordered by keys and by
+ * their sequence numbers if keys are equal, that all of them are found
+ * by lookups and that the tree is balanced.
+ */
+static bool tree_is_built(Ttree *tree, struct item *items, int num_items)
+{
+    struct balance_info binfo;
+    TtreeNode *tnode;
+    struct item *item, *prev = NULL;
+    int idx, i, n = 0;
+    bool ok = true;
+
+    for (tnode = tree->root ? ttree_node_leftmost(tree->root) : NULL; tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, idx) {
+            item = ttree_key2item(tree, tnode_key(tnode, idx));
+            if (prev && ((item->key < prev->key) ||
+                         ((item->key == prev->key) &&
+                          (item->seq <= prev->seq)))) {
+                utest_warning("Item %d:%d follows %d:%d", item->key,
+                              item->seq, prev->key, prev->seq);
+                return false;
+            }
+
+            prev = item;
+            n++;
+        }
+    }
+    if ((n != num_items) || (tree->num_items != (size_t)num_items)) {
+        utest_warning("Tree has %d of %d items", n, num_items);
+        return false;
+    }
+    for (i = 0; i < num_items; i++) {
+        item = ttree_lookup(tree, &items[i].key, NULL);
+        if (!item || (item->key != items[i].key)) {
+            utest_warning("Item %d isn't found", items[i].key);
+            return false;
+        }
+    }
+    if ((tree->flags & TTREE_ORDER_STATS) &&
+        ((ttree_select(tree, num_items - 1, NULL) != prev) ||
+         ttree_select(tree, num_items, NULL))) {
+        utest_warning("Counters of the tree are broken");
+        return false;
+    }
+
+    check_tree_balance(tree, &binfo);
+    tnode_height(tree->root, &ok);
+    if ((binfo.balance != TREE_BALANCED) || !ok) {
+        utest_warning("Tree of %d items isn't balanced", n);
+        return false;
+    }
+
+    return true;
+}
+
+/* A plain tree with a snapshot taken before it's loaded */
+#define TEST_TREE_SNAPSHOT (TEST_TREE_RELAXED + 1)
+
+/* Trees with order statistics aren't unique in these tests. */
+#define init_tree(tree, num_keys, mode)                                 \
+    init_test_tree(tree, num_keys,                                      \
+                   ((mode) == TEST_TREE_SNAPSHOT) ? TEST_TREE_PLAIN : (mode), \
+                   (mode) != TEST_TREE_ORDER_STATS, __cmpfunc,          \
+                   struct item, key)
+
+/*
+ * ut_bulk_load_parallel builds trees of items given in pseudo-random
+ * order by different numbers of threads and checks them. Mode 0 is
+ * a plain tree, 1 has order statistics and isn't unique, so every
+ * key is given three times, 2 has cache aligned nodes, nodes of mode 3
+ * are taken from a slab, 4 has relaxed balance and in mode 5 the tree
+ * has a snapshot.
+ */
+UTEST_FUNCTION(ut_bulk_load_parallel, args)
+{
+    Ttree tree, sorted;
+    TtreeSnapshot *snap = NULL;
+    struct item *items;
+    void **ptrs;
+    int num_keys, num_items, num_threads, mode, i, r;
+    double fill;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_threads = utest_get_arg(args, 2, INT);
+    mode = utest_get_arg(args, 3, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919));
+    UTEST_ASSERT(num_threads >= 1);
+
+    items = malloc(sizeof(*items) * num_items);
+    ptrs = malloc(sizeof(*ptrs) * num_items);
+    UTEST_ASSERT(items && ptrs);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (int)(((long)i * 7919) % num_items);
+        if (mode == TEST_TREE_ORDER_STATS) {
+            items[i].key /= 3;
+        }
+
+        items[i].seq = i;
+    }
+
+    for (r = 0; r < 4; r++) {
+        fill = (r % 2) ? 0.5 : 1.0;
+        init_tree(&tree, num_keys, mode);
+        if (mode == TEST_TREE_SNAPSHOT) {
+            snap = ttree_snapshot(&tree);
+            UTEST_ASSERT(snap != NULL);
+        }
+        for (i = 0; i < num_items; i++) {
+            ptrs[i] = &items[i];
+        }
+        if (r == 3) {
+            /* Items are sorted in place, so the tree gets sorted ones */
+            init_tree(&sorted, num_keys, mode);
+            UTEST_ASSERT(ttree_bulk_load_parallel(&sorted, ptrs, num_items,
+                                                  fill, 1) == 0);
+            ttree_destroy(&sorted);
+        }
+        if (ttree_bulk_load_parallel(&tree, ptrs, num_items, fill,
+                                     num_threads + r) < 0) {
+            UTEST_FAILED("Failed to build a tree by %d threads: %d",
+                         num_threads + r, errno);
+        }
+
+        UTEST_ASSERT(tree_is_built(&tree, items, num_items));
+        if (snap) {
+            UTEST_ASSERT(snap->num_items == 0);
+            ttree_snapshot_release(snap);
+        }
+
+        /* The tree must be empty */
+        UTEST_ASSERT((ttree_bulk_load_parallel(&tree, ptrs, num_items, fill,
+                                               num_threads) < 0) &&
+                     (errno == EBUSY));
+        ttree_destroy(&tree);
+    }
+
+    /* Duplicates in a tree with unique keys */
+    if (num_items > 1) {
+        init_tree(&tree, num_keys, 0);
+        items[num_items - 1].key = items[0].key;
+        for (i = 0; i < num_items; i++) {
+            ptrs[i] = &items[(i * 2) % num_items];
+        }
+
+        UTEST_ASSERT((ttree_bulk_load_parallel(&tree, ptrs, num_items, 1.0,
+                                               num_threads) < 0) &&
+                     (errno == EINVAL));
+        UTEST_ASSERT(ttree_is_empty(&tree));
+        ttree_destroy(&tree);
+    }
+
+    init_tree(&tree, num_keys, 0);
+    UTEST_ASSERT((ttree_bulk_load_parallel(&tree, ptrs, num_items, 1.0, 0) < 0)
+                 && (errno == EINVAL));
+    UTEST_ASSERT(ttree_bulk_load_parallel(&tree, ptrs, 0, 1.0, 4) == 0);
+    ttree_destroy(&tree);
+    free(ptrs);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct segment {
+    long num;
+    int first, last;
+    bool unordered;
+};
+
+struct walk_state {
+    Ttree *tree;
+    struct segment *segments;
+    int stop_after;
+};
+
+static int walk_cb(int segment, void **keys, int num, void *arg)
+{
+    struct walk_state *ws = arg;
+    struct segment *seg = &ws->segments[segment];
+    struct item *item;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        item = ttree_key2item(ws->tree, keys[i]);
+        if (seg->num && (item->key <= seg->last)) {
+            seg->unordered = true;
+        }
+        if (!seg->num) {
+            seg->first = item->key;
+        }
+
+        seg->last = item->key;
+        seg->num++;
+    }
+
+    return (ws->stop_after && (seg->num >= ws->stop_after));
+}
+
+/*
+ * ut_for_each_parallel walks a tree cut into segments by several
+ * threads. Each segment must be walked in order, segments must follow
+ * each other and cover the whole tree. Mode 0 is a plain tree, 1 has
+ * order statistics, so segments are cut by ranks of items.
+ */
+UTEST_FUNCTION(ut_for_each_parallel, args)
+{
+    Ttree tree;
+    struct item *items;
+    struct walk_state ws;
+    int num_keys, num_items, num_segments, num_threads, mode, i, prev;
+    long total;
+    ssize_t walked;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_segments = utest_get_arg(args, 2, INT);
+    num_threads = utest_get_arg(args, 3, INT);
+    mode = utest_get_arg(args, 4, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919));
+    UTEST_ASSERT(num_segments >= 1);
+
+    init_tree(&tree, num_keys, mode);
+    items = malloc(sizeof(*items) * num_items);
+    ws.segments = malloc(sizeof(*ws.segments) * num_segments);
+    UTEST_ASSERT(items && ws.segments);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        items[i].seq = 0;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree,
+                                  &items[((long)i * 7919) % num_items]) == 0);
+    }
+
+    ws.tree = &tree;
+    ws.stop_after = 0;
+    memset(ws.segments, 0, sizeof(*ws.segments) * num_segments);
+    walked = ttree_for_each_parallel(&tree, num_segments, num_threads,
+                                     walk_cb, &ws);
+    UTEST_ASSERT(walked == num_items);
+    for (i = 0, total = 0, prev = -1; i < num_segments; i++) {
+        struct segment *seg = &ws.segments[i];
+
+        if (!seg->num) {
+            continue;
+        }
+        if (seg->unordered || (seg->first != prev + 1) ||
+            (seg->last - seg->first + 1 != seg->num)) {
+            UTEST_FAILED("Segment %d has %ld items [%d, %d] after %d", i,
+                         seg->num, seg->first, seg->last, prev);
+        }
+        if ((mode == TEST_TREE_ORDER_STATS) &&
+            (seg->num > num_items / num_segments + 2 * num_keys)) {
+            UTEST_FAILED("Segment %d of %d has %ld of %d items", i,
+                         num_segments, seg->num, num_items);
+        }
+
+        prev = seg->last;
+        total += seg->num;
+    }
+
+    UTEST_ASSERT((total == num_items) && (prev == num_items - 1));
+
+    /* Walks of segments stop on their own */
+    ws.stop_after = 1;
+    memset(ws.segments, 0, sizeof(*ws.segments) * num_segments);
+    walked = ttree_for_each_parallel(&tree, num_segments, num_threads,
+                                     walk_cb, &ws);
+    for (i = 0, total = 0; i < num_segments; i++) {
+        UTEST_ASSERT(ws.segments[i].num <= num_keys);
+        total += ws.segments[i].num;
+    }
+
+    UTEST_ASSERT((walked == total) && (walked <= num_items));
+    UTEST_ASSERT((ttree_for_each_parallel(&tree, 0, num_threads, walk_cb,
+                                          &ws) < 0) && (errno == EINVAL));
+    ttree_destroy(&tree);
+
+    /* Concurrent trees can't be walked */
+    UTEST_ASSERT(ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                                   struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_CONCURRENT) == 0);
+    UTEST_ASSERT((ttree_for_each_parallel(&tree, num_segments, num_threads,
+                                          walk_cb, &ws) < 0) &&
+                 (errno == EINVAL));
+    ttree_destroy(&tree);
+    free(ws.segments);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_BULK_LOAD_PARALLEL",
+        "Build a tree from unsorted items by several threads",
+        ut_bulk_load_parallel,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "threads", UT_ARG_INT, "Number of threads" },
+            {
+                "mode", UT_ARG_INT,
+                "0 - plain, 1 - order stats, 2 - aligned, 3 - slab, "
+                "4 - relaxed, 5 - snapshot",
+            },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_FOR_EACH_PARALLEL",
+        "Walk segments of a tree by several threads",
+        ut_for_each_parallel,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "segments", UT_ARG_INT, "Number of segments" },
+            { "threads", UT_ARG_INT, "Number of threads" },
+            { "mode", UT_ARG_INT, "0 - plain, 1 - order stats" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
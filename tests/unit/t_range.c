@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static int tnode_height(TtreeNode *tnode, bool *ok)
+{
+    int l, r;
+
+    if (!tnode) {
+        return 0;
+    }
+
+    l = tnode_height(tnode->left, ok);
+    r = tnode_height(tnode->right, ok);
+    if ((tnode->bfc != r - l) || tnode_is_empty(tnode)) {
+        *ok = false;
+    }
+
+    return ((r > l) ? r : l) + 1;
+}
+
+/*
+ * Check that @tree holds exactly the items of @items marked in
+ * @present, in order of their keys and reachable by lookups,
+ * and that the tree is balanced. Items are sorted by their keys.
+ */
+static bool tree_matches(Ttree *tree, struct item *items, bool *present,
+                         int num_items)
+{
+    struct balance_info binfo;
+    TtreeNode *tnode;
+    struct item *item;
+    int idx, i, n = 0, prev = -1, below = 0;
+    bool ok = true;
+
+    for (tnode = tree->root ? ttree_node_leftmost(tree->root) : NULL; tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, idx) {
+            item = ttree_key2item(tree, tnode_key(tnode, idx));
+            if ((item->key <= prev) || !present[item - items]) {
+                utest_warning("Unexpected item %d after %d", item->key, prev);
+                return false;
+            }
+
+            prev = item->key;
+            n++;
+        }
+    }
+    for (i = 0; i < num_items; i++) {
+        item = ttree_lookup(tree, &items[i].key, NULL);
+        if (item != (present[i] ? &items[i] : NULL)) {
+            utest_warning("Lookup of %d gave %p", items[i].key, item);
+            return false;
+        }
+        if (present[i] && (tree->flags & TTREE_ORDER_STATS) &&
+            (ttree_rank(tree, &items[i].key) != below)) {
+            utest_warning("Rank of %d isn't %d", items[i].key, below);
+            return false;
+        }
+
+        below += present[i];
+    }
+    if (n != (int)tree->num_items) {
+        utest_warning("%d items are in order, but tree has %zd", n,
+                      tree->num_items);
+        return false;
+    }
+
+    check_tree_balance(tree, &binfo);
+    tnode_height(tree->root, &ok);
+    if ((binfo.balance != TREE_BALANCED) || !ok) {
+        utest_warning("Tree of %d items isn't balanced", n);
+        return false;
+    }
+
+    return true;
+}
+
+struct free_state {
+    struct item *items;
+    bool *present;
+    int lo, hi, freed;
+    bool ok;
+};
+
+static void free_cb(void *item, void *arg)
+{
+    struct free_state *fs = arg;
+    struct item *it = item;
+
+    if ((it->key < fs->lo) || (it->key > fs->hi) ||
+        !fs->present[it - fs->items]) {
+        fs->ok = false;
+    }
+
+    fs->present[it - fs->items] = false;
+    fs->freed++;
+}
+
+#define init_tree(tree, num_keys, mode)                                 \
+    init_test_tree_inline(tree, num_keys, mode, true, __cmpfunc,        \
+                          struct item, key)
+
+/*
+ * ut_delete_range fills a tree with even keys in pseudo-random order
+ * and removes ranges of growing width from it, from ranges inside
+ * a single node up to ones covering many nodes. Bounds of ranges are
+ * both present and missing keys.
+ * Mode 0 is a plain tree, 1 has order statistics and 2 has cache
+ * aligned nodes.
+ */
+UTEST_FUNCTION(ut_delete_range, args)
+{
+    Ttree tree;
+    struct item *items;
+    struct free_state fs;
+    bool *present;
+    int num_keys, num_items, mode, i, width, left;
+    ssize_t ret;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919));
+
+    init_tree(&tree, num_keys, mode);
+    items = malloc(num_items * sizeof(*items));
+    present = malloc(num_items * sizeof(*present));
+    UTEST_ASSERT(items && present);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i * 2;
+        present[i] = true;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree,
+                                  &items[((long)i * 7919) % num_items]) == 0);
+    }
+
+    fs.items = items;
+    fs.present = present;
+    left = num_items;
+    for (i = 0, width = 0; width < num_items; i++, width += 1 + width / 2) {
+        fs.lo = (int)(((long)i * 104729) % (num_items * 2)) - 1;
+        fs.hi = fs.lo + width;
+        fs.freed = 0;
+        fs.ok = true;
+        ret = ttree_delete_range(&tree, &fs.lo, &fs.hi, free_cb, &fs);
+        if (!fs.ok || (ret != fs.freed)) {
+            UTEST_FAILED("Range [%d, %d]: %zd items removed, %d freed",
+                         fs.lo, fs.hi, ret, fs.freed);
+        }
+
+        left -= fs.freed;
+        UTEST_ASSERT(tree.num_items == (size_t)left);
+        UTEST_ASSERT(tree_matches(&tree, items, present, num_items));
+    }
+
+    /* Ranges open on either side */
+    fs.lo = num_items;
+    fs.hi = num_items * 2;
+    fs.freed = 0;
+    ret = ttree_delete_range(&tree, &fs.lo, NULL, free_cb, &fs);
+    UTEST_ASSERT(ret == fs.freed);
+    UTEST_ASSERT(tree_matches(&tree, items, present, num_items));
+    fs.lo = -1;
+    fs.hi = num_items / 2;
+    fs.freed = 0;
+    ret = ttree_delete_range(&tree, NULL, &fs.hi, free_cb, &fs);
+    UTEST_ASSERT(ret == fs.freed);
+    UTEST_ASSERT(tree_matches(&tree, items, present, num_items));
+    left = tree.num_items;
+    UTEST_ASSERT(ttree_delete_range(&tree, NULL, NULL, NULL, NULL) == left);
+    UTEST_ASSERT(ttree_is_empty(&tree) && !tree.num_items);
+    UTEST_ASSERT(ttree_delete_range(&tree, NULL, NULL, NULL, NULL) == 0);
+
+    ttree_destroy(&tree);
+    free(present);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_split_join splits a tree at several keys, checks both parts and
+ * joins them back. Mode 0 is a plain tree, 1 has order statistics
+ * and 2 has cache aligned nodes. In mode 3 the right tree uses
+ * the slab allocator, so nodes are copied between trees.
+ */
+UTEST_FUNCTION(ut_split_join, args)
+{
+    Ttree tree, right, other;
+    struct item *items;
+    bool *present;
+    int num_keys, num_items, mode, i, j, key;
+    ssize_t moved;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    init_tree(&tree, num_keys,
+              (mode == TEST_TREE_SLAB) ? TEST_TREE_PLAIN : mode);
+    init_tree(&right, num_keys, mode);
+
+    items = malloc(num_items * sizeof(*items));
+    present = malloc(num_items * sizeof(*present));
+    UTEST_ASSERT(items && present);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    for (j = -1; j <= 5; j++) {
+        key = (j < 0) ? -1 : (int)(((long)num_items * j) / 4);
+        moved = ttree_split_at(&tree, &key, &right);
+        if (moved != num_items - ((key < 0) ? 0 :
+                                  ((key > num_items) ? num_items : key))) {
+            UTEST_FAILED("Split at %d moved %zd items", key, moved);
+        }
+        for (i = 0; i < num_items; i++) {
+            present[i] = (i < key);
+        }
+
+        UTEST_ASSERT(tree_matches(&tree, items, present, num_items));
+        for (i = 0; i < num_items; i++) {
+            present[i] = !present[i];
+        }
+
+        UTEST_ASSERT(tree_matches(&right, items, present, num_items));
+
+        /* Right tree must be empty, keys of trees mustn't overlap. */
+        if (moved && (key > 0)) {
+            UTEST_ASSERT((ttree_split_at(&tree, &key, &right) < 0) &&
+                         (errno == EBUSY));
+            UTEST_ASSERT((ttree_join(&right, &tree) < 0) &&
+                         (errno == EINVAL));
+        }
+
+        UTEST_ASSERT(ttree_join(&tree, &right) == 0);
+        UTEST_ASSERT(ttree_is_empty(&right) && !right.num_items);
+        for (i = 0; i < num_items; i++) {
+            present[i] = true;
+        }
+
+        UTEST_ASSERT(tree_matches(&tree, items, present, num_items));
+    }
+
+    /* Trees with different nodes can't exchange them. */
+    init_tree(&other, num_keys + 1, mode);
+    key = num_items / 2;
+    UTEST_ASSERT((ttree_split_at(&tree, &key, &other) < 0) &&
+                 (errno == EINVAL));
+    UTEST_ASSERT((ttree_join(&tree, &tree) < 0) && (errno == EINVAL));
+
+    /* Join to an empty tree */
+    UTEST_ASSERT(ttree_join(&right, &tree) == 0);
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    UTEST_ASSERT(tree_matches(&right, items, present, num_items));
+
+    ttree_destroy(&other);
+    ttree_destroy(&right);
+    ttree_destroy(&tree);
+    free(present);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_DELETE_RANGE",
+        "Remove ranges of items from a tree",
+        ut_delete_range,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "mode", UT_ARG_INT, "0 - plain, 1 - order stats, 2 - aligned" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SPLIT_JOIN",
+        "Split a tree by a key and join parts back",
+        ut_split_join,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            {
+                "mode", UT_ARG_INT,
+                "0 - plain, 1 - order stats, 2 - aligned, 3 - other allocator",
+            },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
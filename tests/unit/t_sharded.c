@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree_sharded.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+struct scan_ctx {
+    long count;
+    long sum;
+    int stop_after;
+};
+
+/* Slices come from several threads at once, so counters are atomic. */
+static int scan_cb(void **keys, int num, void *arg)
+{
+    struct scan_ctx *ctx = arg;
+    long sum = 0;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        sum += *(int *)keys[i];
+    }
+
+    __atomic_fetch_add(&ctx->sum, sum, __ATOMIC_RELAXED);
+    return (__atomic_add_fetch(&ctx->count, num, __ATOMIC_RELAXED) >=
+            ctx->stop_after);
+}
+
+static const char *check_shards(TtreeSharded *st, size_t total)
+{
+    struct balance_info binfo;
+    TtreeCursor cursor;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < st->num_shards; i++) {
+        Ttree *tree = st->shards[i].tree;
+
+        check_tree_balance(tree, &binfo);
+        if (binfo.balance != TREE_BALANCED) {
+            return "Shard is not balanced";
+        }
+        size += ttree_size(tree);
+        if (ttree_is_empty(tree)) {
+            continue;
+        }
+
+        ttree_cursor_open(&cursor, tree);
+        do {
+            struct item *item = ttree_item_from_cursor(&cursor);
+
+            if (ttree_sharded_route(st, &item->key) != i) {
+                return "Item is placed into a wrong shard";
+            }
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+    if ((size != total) || (ttree_sharded_size(st) != total)) {
+        return "Wrong number of items in shards";
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_sharded fills a sharded tree, repartitions it, scans ranges and
+ * deletes items, then rebuilds the tree by bulk load.
+ */
+UTEST_FUNCTION(ut_sharded, args)
+{
+    TtreeSharded st;
+    struct scan_ctx ctx;
+    struct item *items, *item;
+    void **sorted, *splitters[2];
+    const char *msg;
+    int num_shards, num_threads, num_items, i, key, lo, hi;
+    long sum;
+
+    num_shards = utest_get_arg(args, 0, INT);
+    num_threads = utest_get_arg(args, 1, INT);
+    num_items = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_shards >= 1) && (num_items >= 1));
+
+    items = malloc(num_items * sizeof(*items));
+    sorted = malloc(num_items * sizeof(*sorted));
+    UTEST_ASSERT((items != NULL) && (sorted != NULL));
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        sorted[i] = &items[i];
+    }
+
+    UTEST_ASSERT(ttree_sharded_init(&st, num_shards, num_threads, 8, true,
+                                    __cmpfunc, struct item, key) == 0);
+    if (num_shards == 3) {
+        lo = 10;
+        hi = 5;
+        splitters[0] = &lo;
+        splitters[1] = &hi;
+        UTEST_ASSERT((ttree_sharded_set_splitters(&st, splitters) < 0) &&
+                     (errno == EINVAL));
+    }
+
+    for (i = 0; i < num_items; i++) {
+        key = (int)(((long)i * 7919) % num_items);
+        UTEST_ASSERT(ttree_sharded_insert(&st, &items[key]) == 0);
+    }
+
+    key = 0;
+    UTEST_ASSERT(ttree_sharded_insert(&st, &items[key]) < 0);
+    UTEST_ASSERT((ttree_sharded_use_pages(&st, 0, NULL) < 0) &&
+                 (errno == EBUSY));
+    UTEST_ASSERT(ttree_size(st.shards[0].tree) == (size_t)num_items);
+    UTEST_ASSERT(ttree_sharded_repartition(&st, 1.5) ==
+                 ((num_shards > 1) && (num_items > 1)));
+    msg = check_shards(&st, num_items);
+    if (msg) {
+        UTEST_FAILED("%s", msg);
+    }
+    for (i = 0; i < num_shards; i++) {
+        long size = (long)ttree_size(st.shards[i].tree);
+
+        if (((size + 1) * num_shards < num_items) ||
+            ((size - 1) * num_shards > num_items)) {
+            UTEST_FAILED("Shard %d has %ld items of %d", i, size, num_items);
+        }
+    }
+
+    UTEST_ASSERT(ttree_sharded_repartition(&st, 1.5) == 0);
+    for (key = 0; key < num_items; key++) {
+        item = ttree_sharded_lookup(&st, &key);
+        UTEST_ASSERT((item != NULL) && (item->key == key));
+    }
+
+    key = num_items;
+    UTEST_ASSERT(ttree_sharded_lookup(&st, &key) == NULL);
+
+    lo = num_items / 5;
+    hi = num_items - 1 - num_items / 3;
+    ctx.count = ctx.sum = 0;
+    ctx.stop_after = num_items + 1;
+    UTEST_ASSERT(ttree_sharded_range_scan(&st, &lo, &hi, scan_cb, &ctx) ==
+                 hi - lo + 1);
+    sum = ((long)lo + hi) * (hi - lo + 1) / 2;
+    if ((ctx.count != hi - lo + 1) || (ctx.sum != sum)) {
+        UTEST_FAILED("Range scan got %ld keys with sum %ld instead of "
+                     "%d keys with sum %ld", ctx.count, ctx.sum,
+                     hi - lo + 1, sum);
+    }
+
+    ctx.count = ctx.sum = 0;
+    ctx.stop_after = 1;
+    UTEST_ASSERT(ttree_sharded_range_scan(&st, NULL, NULL, scan_cb, &ctx) ==
+                 ctx.count);
+    UTEST_ASSERT(ctx.count >= 1);
+
+    for (key = 0; key < num_items; key += 2) {
+        UTEST_ASSERT(ttree_sharded_delete(&st, &key) == &items[key]);
+    }
+    for (key = 0; key < num_items; key++) {
+        item = ttree_sharded_lookup(&st, &key);
+        UTEST_ASSERT((key & 1) ? (item == &items[key]) : (item == NULL));
+    }
+
+    msg = check_shards(&st, num_items / 2);
+    if (msg) {
+        UTEST_FAILED("%s", msg);
+    }
+
+    if (num_items > 1) {
+        UTEST_ASSERT((ttree_sharded_bulk_load(&st, sorted, num_items, 1.0) < 0)
+                     && (errno == EBUSY));
+    }
+    ttree_sharded_destroy(&st);
+
+    UTEST_ASSERT(ttree_sharded_init(&st, num_shards, num_threads, 8, true,
+                                    __cmpfunc, struct item, key) == 0);
+    if (num_items > 1) {
+        item = sorted[0];
+        sorted[0] = sorted[num_items - 1];
+        sorted[num_items - 1] = item;
+        UTEST_ASSERT((ttree_sharded_bulk_load(&st, sorted, num_items, 1.0) < 0)
+                     && (errno == EINVAL));
+        UTEST_ASSERT(ttree_sharded_size(&st) == 0);
+        sorted[num_items - 1] = sorted[0];
+        sorted[0] = item;
+    }
+
+    /* Trees made for shards by the bulk load are placed the same way */
+    UTEST_ASSERT(ttree_sharded_use_pages(&st, 0, NULL) == 0);
+    UTEST_ASSERT(ttree_sharded_bulk_load(&st, sorted, num_items, 0.5) == 0);
+    msg = check_shards(&st, num_items);
+    if (msg) {
+        UTEST_FAILED("%s", msg);
+    }
+    for (i = 0; i < num_shards; i++) {
+        UTEST_ASSERT(st.shards[i].tree->slab.page_size != 0);
+    }
+    for (key = 0; key < num_items; key++) {
+        UTEST_ASSERT(ttree_sharded_lookup(&st, &key) == &items[key]);
+    }
+
+    ttree_sharded_destroy(&st);
+    free(sorted);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct writer_ctx {
+    TtreeSharded *st;
+    struct item *items;
+    int num_items;
+    int num_writers;
+    int writer;
+    const char *error;
+};
+
+static void *writer(void *arg)
+{
+    struct writer_ctx *ctx = arg;
+    int i, key;
+
+    for (i = 0; i < ctx->num_items; i++) {
+        key = i * ctx->num_writers + ctx->writer;
+        if (ttree_sharded_insert(ctx->st, &ctx->items[key]) < 0) {
+            ctx->error = "Failed to insert an item";
+            return NULL;
+        }
+        if (ttree_sharded_lookup(ctx->st, &key) != &ctx->items[key]) {
+            ctx->error = "Inserted item wasn't found";
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ut_sharded_writers runs several writers filling a sharded tree
+ * while the tree is repartitioned again and again.
+ */
+UTEST_FUNCTION(ut_sharded_writers, args)
+{
+    TtreeSharded st;
+    struct writer_ctx *ctxs;
+    struct item *items;
+    pthread_t *threads;
+    const char *msg;
+    int num_shards, num_items, num_writers, total, i, key;
+
+    num_shards = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_writers = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_writers >= 1));
+
+    total = num_items * num_writers;
+    items = malloc(total * sizeof(*items));
+    ctxs = calloc(num_writers, sizeof(*ctxs));
+    threads = malloc(num_writers * sizeof(*threads));
+    UTEST_ASSERT(items && ctxs && threads);
+    for (i = 0; i < total; i++) {
+        items[i].key = i;
+    }
+
+    UTEST_ASSERT(ttree_sharded_init(&st, num_shards, 2, 8, true,
+                                    __cmpfunc, struct item, key) == 0);
+    for (i = 0; i < num_writers; i++) {
+        ctxs[i].st = &st;
+        ctxs[i].items = items;
+        ctxs[i].num_items = num_items;
+        ctxs[i].num_writers = num_writers;
+        ctxs[i].writer = i;
+        UTEST_ASSERT(pthread_create(&threads[i], NULL, writer,
+                                    &ctxs[i]) == 0);
+    }
+    while (ttree_sharded_size(&st) < (size_t)total) {
+        UTEST_ASSERT(ttree_sharded_repartition(&st, 1.2) >= 0);
+    }
+    for (i = 0; i < num_writers; i++) {
+        pthread_join(threads[i], NULL);
+        if (ctxs[i].error) {
+            UTEST_FAILED("Writer %d: %s", i, ctxs[i].error);
+        }
+    }
+
+    msg = check_shards(&st, total);
+    if (msg) {
+        UTEST_FAILED("%s", msg);
+    }
+    for (key = 0; key < total; key++) {
+        UTEST_ASSERT(ttree_sharded_lookup(&st, &key) == &items[key]);
+    }
+
+    ttree_sharded_destroy(&st);
+    free(threads);
+    free(ctxs);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_SHARDED",
+        "Routing, repartitioning, parallel range scans and bulk load "
+        "of a sharded T*-tree",
+        ut_sharded,
+        UTEST_ARGS_LIST {
+            { "shards", UT_ARG_INT, "Number of shards" },
+            { "threads", UT_ARG_INT, "Number of pool threads" },
+            { "items", UT_ARG_INT, "Number of items" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SHARDED_WRITERS",
+        "Insertions made by several writers while a sharded T*-tree "
+        "is repartitioned",
+        ut_sharded_writers,
+        UTEST_ARGS_LIST {
+            { "shards", UT_ARG_INT, "Number of shards" },
+            { "items", UT_ARG_INT, "Number of keys each writer inserts" },
+            { "writers", UT_ARG_INT, "Number of writer threads" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+#define NUM_SNAPSHOTS 4
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+/*
+ * Check that @snap holds exactly the items marked in @present: a scan
+ * from the first item, a scan from the middle and lookups of all keys
+ * must agree with them.
+ */
+static bool snapshot_matches(TtreeSnapshot *snap, struct item *items,
+                             bool *present, int num_items)
+{
+    TtreeSnapshotCursor cursor;
+    struct item *item;
+    int i, n = 0, mid = num_items / 2;
+
+    i = 0;
+    if (!ttree_snapshot_cursor_open(&cursor, snap, NULL)) {
+        do {
+            item = ttree_snapshot_cursor_item(&cursor);
+            for (; (i < num_items) && !present[i]; i++);
+            if ((i == num_items) || (item != &items[i])) {
+                utest_warning("Scan gave %d instead of %d", item->key, i);
+                return false;
+            }
+
+            i++;
+            n++;
+        } while (ttree_snapshot_cursor_next(&cursor) == TCSR_OK);
+    }
+    for (; (i < num_items) && !present[i]; i++);
+    if ((i != num_items) || (n != (int)snap->num_items)) {
+        utest_warning("Scan stopped before %d after %d items", i, n);
+        return false;
+    }
+
+    for (i = mid; (i < num_items) && !present[i]; i++);
+    if (ttree_snapshot_cursor_open(&cursor, snap, &mid) ?
+        (i != num_items) :
+        (ttree_snapshot_cursor_item(&cursor) != &items[i])) {
+        utest_warning("Scan from %d doesn't start at %d", mid, i);
+        return false;
+    }
+    for (i = 0; i < num_items; i++) {
+        item = ttree_snapshot_lookup(snap, &items[i].key);
+        if (item != (present[i] ? &items[i] : NULL)) {
+            utest_warning("Lookup of %d gave %p", i, item);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Trees with order statistics aren't unique in these tests. */
+#define init_tree(tree, num_keys, mode)                                 \
+    init_test_tree(tree, num_keys, mode, (mode) != TEST_TREE_ORDER_STATS, \
+                   __cmpfunc, struct item, key)
+
+/* Insert a missing item or remove a present one. */
+static void toggle_item(Ttree *tree, struct item *items, bool *present,
+                        int i)
+{
+    if (present[i]) {
+        ttree_delete(tree, &items[i].key);
+    }
+    else {
+        ttree_insert(tree, &items[i]);
+    }
+
+    present[i] = !present[i];
+}
+
+/*
+ * ut_snapshot takes several snapshots of a tree changing between them
+ * by insertions, deletions and operations relinking the whole tree,
+ * and checks that every snapshot keeps seeing the items the tree had
+ * when the snapshot was taken. Snapshots are released in the middle,
+ * at the oldest and at the newest end, the last one is left to
+ * ttree_destroy. Mode 0 is a plain tree, 1 has order statistics and
+ * isn't unique, 2 has cache aligned nodes, nodes of mode 3 are
+ * allocated from a slab and 4 is relaxed.
+ */
+UTEST_FUNCTION(ut_snapshot, args)
+{
+    Ttree tree, other;
+    TtreeSnapshot *snaps[NUM_SNAPSHOTS];
+    struct item *items;
+    bool *present, *seen[NUM_SNAPSHOTS];
+    int num_keys, num_items, mode, i, j, r, lo, hi, total;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    mode = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= 2) && (num_items % 7919));
+
+    total = num_items * 2;
+    items = malloc(sizeof(*items) * total);
+    present = calloc(total, sizeof(*present));
+    UTEST_ASSERT(items && present);
+    init_tree(&tree, num_keys, mode);
+    for (i = 0; i < total; i++) {
+        items[i].key = i;
+    }
+    for (i = 0; i < num_items; i++) {
+        toggle_item(&tree, items, present, (int)(((long)i * 7919) %
+                                                 num_items) * 2);
+    }
+
+    for (r = 0; r < NUM_SNAPSHOTS; r++) {
+        snaps[r] = ttree_snapshot(&tree);
+        seen[r] = malloc(sizeof(*present) * total);
+        UTEST_ASSERT(snaps[r] && seen[r]);
+        memcpy(seen[r], present, sizeof(*present) * total);
+        for (j = 0; j < num_items / 2; j++) {
+            toggle_item(&tree, items, present,
+                         (int)(((long)j * 7919 + (long)r * 104729) % total));
+        }
+
+        switch (r) {
+            case 0:
+                UTEST_ASSERT(ttree_rebalance_all(&tree) == 0);
+                break;
+            case 1:
+                UTEST_ASSERT(ttree_compact(&tree, 0.9) >= 0);
+                break;
+            case 2:
+                lo = total / 3;
+                hi = lo + total / 4;
+                UTEST_ASSERT(ttree_delete_range(&tree, &lo, &hi,
+                                                NULL, NULL) >= 0);
+                for (i = lo; i <= hi; i++) {
+                    present[i] = false;
+                }
+                break;
+            default:
+                /* Nodes are copied if allocators of trees differ */
+                init_tree(&other, num_keys, mode ? mode : TEST_TREE_SLAB);
+                lo = total / 2;
+                UTEST_ASSERT(ttree_split_at(&tree, &lo, &other) >= 0);
+                UTEST_ASSERT(ttree_join(&tree, &other) == 0);
+                ttree_destroy(&other);
+                break;
+        }
+        for (i = 0; i <= r; i++) {
+            if (snaps[i]) {
+                UTEST_ASSERT(snapshot_matches(snaps[i], items, seen[i],
+                                              total));
+            }
+        }
+        if (r == 2) {
+            ttree_snapshot_release(snaps[1]);
+            snaps[1] = NULL;
+        }
+    }
+
+    UTEST_ASSERT((ttree_set_flags(&tree, 0) < 0) && (errno == EBUSY));
+    for (r = 0; r < NUM_SNAPSHOTS - 1; r++) {
+        i = (r % 2) ? (NUM_SNAPSHOTS - 1) : 0;
+        if (snaps[i]) {
+            ttree_snapshot_release(snaps[i]);
+            snaps[i] = NULL;
+        }
+        for (j = 0; j < NUM_SNAPSHOTS; j++) {
+            if (snaps[j]) {
+                UTEST_ASSERT(snapshot_matches(snaps[j], items, seen[j],
+                                              total));
+            }
+        }
+    }
+
+    ttree_destroy(&tree);
+    for (r = 0; r < NUM_SNAPSHOTS; r++) {
+        free(seen[r]);
+    }
+
+    free(present);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_snapshot_scan scans a snapshot while the tree keeps changing
+ * between steps of the scan, so nodes the cursor has on its path
+ * are copied under it. The scan must see the tree as it was.
+ */
+UTEST_FUNCTION(ut_snapshot_scan, args)
+{
+    Ttree tree;
+    TtreeSnapshot *snap;
+    TtreeSnapshotCursor cursor;
+    struct item *items, *item;
+    bool *present;
+    int num_keys, num_items, i, j = 0, prev = -1, n = 0, ret;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    items = malloc(sizeof(*items) * num_items);
+    present = calloc(num_items, sizeof(*present));
+    UTEST_ASSERT(items && present);
+    init_tree(&tree, num_keys, TEST_TREE_PLAIN);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        if (i % 3) {
+            toggle_item(&tree, items, present, i);
+        }
+    }
+
+    snap = ttree_snapshot(&tree);
+    UTEST_ASSERT(snap != NULL);
+    ret = ttree_snapshot_cursor_open(&cursor, snap, NULL);
+    while (!ret) {
+        item = ttree_snapshot_cursor_item(&cursor);
+        if ((item->key <= prev) || !(item->key % 3)) {
+            UTEST_FAILED("Scan gave %d after %d", item->key, prev);
+        }
+
+        prev = item->key;
+        n++;
+        for (i = 0; i < 3; i++, j++) {
+            toggle_item(&tree, items, present,
+                        (int)(((long)j * 7919) % num_items));
+        }
+
+        ret = ttree_snapshot_cursor_next(&cursor);
+    }
+
+    UTEST_ASSERT(n == num_items - (num_items + 2) / 3);
+    ttree_snapshot_release(snap);
+    snap = ttree_snapshot(&tree);
+    UTEST_ASSERT(snap && snapshot_matches(snap, items, present, num_items));
+    ttree_snapshot_release(snap);
+    ttree_destroy(&tree);
+
+    /* Concurrent trees can't be snapshotted */
+    ret = ttree_init_inline(&tree, num_keys, true, __cmpfunc,
+                            struct item, key);
+    UTEST_ASSERT(!ret && !ttree_set_flags(&tree, TTREE_CONCURRENT));
+    UTEST_ASSERT(!ttree_snapshot(&tree) && (errno == EINVAL));
+    ttree_destroy(&tree);
+    free(present);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_SNAPSHOT",
+        "Snapshots should see a tree as it was when they were taken",
+        ut_snapshot,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            {
+                "mode", UT_ARG_INT,
+                "0 - plain, 1 - order stats, 2 - aligned, 3 - slab, "
+                "4 - relaxed",
+            },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SNAPSHOT_SCAN",
+        "Scan a snapshot while the tree changes",
+        ut_snapshot_scan,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+/*
+ * Counter values which depend only on the shape of the tree.
+ */
+static bool counters_are_valid(struct ttree_stats *stats, int num_lookups)
+{
+    const struct ttree_counters *c = &stats->counters;
+    struct ttree_counters zero;
+
+    if (!stats->counters_enabled) {
+        memset(&zero, 0, sizeof(zero));
+        return !memcmp(c, &zero, sizeof(zero));
+    }
+
+    /* Only the very first insertion looks into an empty tree. */
+    if ((c->lookups < (uint64_t)num_lookups) ||
+        (c->lookup_cmps + 1 < c->lookups) ||
+        (c->lookup_depth + 1 < c->lookups)) {
+        utest_warning("Lookup counters are inconsistent!");
+        return false;
+    }
+    if ((c->tnode_allocs - c->tnode_frees != stats->num_tnodes) ||
+        (c->tnode_allocs != c->splits + 1)) {
+        utest_warning("%" PRIu64 " nodes allocated, %" PRIu64 " freed, "
+                      "%" PRIu64 " split, but %zu are in the tree!",
+                      c->tnode_allocs, c->tnode_frees, c->splits,
+                      stats->num_tnodes);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * ut_stats fills and partially drains a tree, and checks that
+ * statistics and the dump of the tree describe its actual shape.
+ */
+UTEST_FUNCTION(ut_stats, args)
+{
+    Ttree tree;
+    struct ttree_stats stats;
+    struct item *items;
+    TtreeNode *tnode;
+    FILE *f;
+    char line[512], *p;
+    size_t num_tnodes = 0, sum, keys_sum = 0, num_lines = 0;
+    int num_keys, num_items, i, key, roots = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                            struct item, key) == 0);
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (int)(((long)i * 7919) % num_items);
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (key = 0; key < num_items; key++) {
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) != NULL);
+    }
+    for (key = 0; key < num_items; key += 3) {
+        UTEST_ASSERT(ttree_delete(&tree, &key) != NULL);
+    }
+
+    ttree_stats(&tree, &stats);
+    for (tnode = ttree_node_leftmost(tree.root); tnode;
+         tnode = tnode->successor) {
+        num_tnodes++;
+    }
+
+    UTEST_ASSERT(stats.num_items == tree.num_items);
+    UTEST_ASSERT(stats.num_tnodes == num_tnodes);
+    UTEST_ASSERT(stats.depth == ttree_get_depth(&tree));
+    UTEST_ASSERT(stats.keys_per_tnode == num_keys);
+    for (i = 0, sum = 0; i < TTREE_FILL_BUCKETS; i++) {
+        sum += stats.fill_histogram[i];
+    }
+
+    UTEST_ASSERT(sum == num_tnodes);
+    UTEST_ASSERT(counters_are_valid(&stats, num_items * 2));
+
+    f = tmpfile();
+    UTEST_ASSERT(f != NULL);
+    UTEST_ASSERT(ttree_dump(&tree, f) == 0);
+    rewind(f);
+    UTEST_ASSERT(fgets(line, sizeof(line), f) != NULL);
+    UTEST_ASSERT(strtoul(line + strlen("{\"items\":"), NULL, 10) ==
+                 tree.num_items);
+    while (fgets(line, sizeof(line), f)) {
+        UTEST_ASSERT(strtoul(line + strlen("{\"node\":"), NULL, 10) ==
+                     num_lines);
+        if (strstr(line, "\"parent\":-1,\"side\":\"root\"")) {
+            roots++;
+        }
+
+        p = strstr(line, "\"keys\":");
+        UTEST_ASSERT(p != NULL);
+        keys_sum += strtoul(p + strlen("\"keys\":"), NULL, 10);
+        num_lines++;
+    }
+
+    fclose(f);
+    UTEST_ASSERT((num_lines == num_tnodes) && (roots == (num_tnodes > 0)));
+    UTEST_ASSERT(keys_sum == tree.num_items);
+
+    ttree_stats_reset(&tree);
+    ttree_stats(&tree, &stats);
+    UTEST_ASSERT(stats.counters.lookups == 0);
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+static int count_scan(void **keys, int num, void *arg)
+{
+    *(long *)arg += num;
+    return 0;
+}
+
+/*
+ * ut_autotune runs a read-only workload of lookups and scans, which
+ * should make nodes grow, then a workload of writes into a tree with
+ * huge nodes, which should make them shrink. Without counters
+ * capacity must never change.
+ */
+UTEST_FUNCTION(ut_autotune, args)
+{
+    Ttree tree;
+    struct ttree_stats stats;
+    struct item *items;
+    int num_keys, num_items, i, r, key, lo, hi, tuned;
+    long scanned = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT((num_keys < 256) && (num_items >= 2));
+
+    UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                            struct item, key) == 0);
+    UTEST_ASSERT(ttree_autotune(&tree) == num_keys);
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[(i * 7919L) % num_items])
+                     == 0);
+    }
+
+    ttree_stats_reset(&tree);
+    for (r = 0; r < 4; r++) {
+        for (i = 0; i < num_items; i++) {
+            key = (int)((i * 104729L) % num_items);
+            UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == &items[key]);
+        }
+
+        lo = r * (num_items / 4);
+        hi = lo + num_items / 4;
+        UTEST_ASSERT(ttree_range_scan(&tree, &lo, &hi, count_scan,
+                                      &scanned) >= 0);
+    }
+
+    ttree_stats(&tree, &stats);
+    tuned = ttree_autotune(&tree);
+    if (!stats.counters_enabled) {
+        UTEST_ASSERT((tuned == num_keys) && (tree.keys_per_tnode == num_keys));
+        ttree_destroy(&tree);
+        free(items);
+        UTEST_PASSED();
+    }
+    if ((stats.counters.scans != 4) ||
+        (stats.counters.scan_keys != (uint64_t)scanned) ||
+        (stats.counters.moved_keys != 0)) {
+        UTEST_FAILED("%" PRIu64 " scans of %" PRIu64 " keys, %" PRIu64
+                     " keys moved", stats.counters.scans,
+                     stats.counters.scan_keys, stats.counters.moved_keys);
+    }
+    if ((tuned <= num_keys) || (tree.keys_per_tnode != tuned)) {
+        UTEST_FAILED("Lookups made nodes of %d keys have %d keys",
+                     num_keys, tuned);
+    }
+
+    /* Counters are reset, so the verdict is kept without a new workload */
+    ttree_stats(&tree, &stats);
+    UTEST_ASSERT(stats.counters.lookups == 0);
+    UTEST_ASSERT(ttree_autotune(&tree) == tuned);
+
+    UTEST_ASSERT(ttree_set_keys_per_tnode(&tree, 512, 0.75) == 0);
+    for (r = 0; r < 4; r++) {
+        for (i = 0; i < num_items; i += 2) {
+            key = (int)((i * 104729L) % num_items);
+            UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+        }
+        for (i = 0; i < num_items; i += 2) {
+            key = (int)((i * 104729L) % num_items);
+            UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+        }
+    }
+
+    tuned = ttree_autotune(&tree);
+    if ((tuned >= 512) || (tree.keys_per_tnode != tuned)) {
+        UTEST_FAILED("Writes made nodes of 512 keys have %d keys", tuned);
+    }
+    for (key = 0; key < num_items; key++) {
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == &items[key]);
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * ut_moved_keys fills a tree in ascending, descending and pseudo-random
+ * order of keys and drains it, checking the number of keys shifted
+ * inside nodes. Sequential insertions must not move whole windows
+ * each time, so they shift O(log M) keys on average for nodes of M
+ * keys. Random deletions must move keys of the shorter side only,
+ * which is at most a quarter of a node on average. Random insertions
+ * mostly go to full nodes, where the only free room is the one left
+ * by the key pushed out to the successor, so they may move half.
+ */
+UTEST_FUNCTION(ut_moved_keys, args)
+{
+    Ttree tree;
+    struct ttree_stats stats;
+    struct item *items;
+    int num_keys, num_items, order, i, key;
+    uint64_t limit;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+    }
+    for (order = 0; order < 3; order++) {
+        UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                                struct item, key) == 0);
+        for (i = 0; i < num_items; i++) {
+            key = (order == 0) ? i : ((order == 1) ? num_items - 1 - i :
+                                      (int)((i * 7919L) % num_items));
+            UTEST_ASSERT(ttree_insert(&tree, &items[key]) == 0);
+        }
+
+        ttree_stats(&tree, &stats);
+        if (!stats.counters_enabled) {
+            ttree_destroy(&tree);
+            break;
+        }
+
+        /* Each move of a window to the middle halves free rooms */
+        for (i = 1, limit = 2; i < num_keys; i <<= 1, limit++);
+        limit = (uint64_t)num_items * ((order < 2) ? limit :
+                                       (uint64_t)(num_keys / 2 + 2));
+        if (stats.counters.moved_keys > limit) {
+            UTEST_FAILED("Insertions in order %d moved %" PRIu64
+                         " keys, at most %" PRIu64 " expected", order,
+                         stats.counters.moved_keys, limit);
+        }
+
+        ttree_stats_reset(&tree);
+        for (i = 0; i < num_items; i++) {
+            key = (int)((i * 104729L) % num_items);
+            UTEST_ASSERT(ttree_delete(&tree, &key) == &items[key]);
+        }
+
+        ttree_stats(&tree, &stats);
+        limit = (uint64_t)num_items * (num_keys / 4 + 2);
+        if (stats.counters.moved_keys > limit) {
+            UTEST_FAILED("Deletions moved %" PRIu64 " keys, at most %"
+                         PRIu64 " expected", stats.counters.moved_keys,
+                         limit);
+        }
+
+        ttree_destroy(&tree);
+    }
+
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * Fill a tree in pseudo-random order and run a churn of random
+ * deletions and insertions on it, returns the number of keys moved
+ * by the churn.
+ */
+static uint64_t churn_moved_keys(Ttree *tree, struct item *items,
+                                 int num_items)
+{
+    struct ttree_stats stats;
+    int i, key;
+
+    for (i = 0; i < num_items; i++) {
+        key = (int)((i * 7919L) % num_items);
+        UTEST_ASSERT(ttree_insert(tree, &items[key]) == 0);
+    }
+
+    ttree_stats_reset(tree);
+    for (i = 0; i < num_items; i++) {
+        key = (int)((i * 104729L) % num_items);
+        UTEST_ASSERT(ttree_delete(tree, &key) == &items[key]);
+        if (i & 1) {
+            key = (int)(((i - 1) * 104729L) % num_items);
+            UTEST_ASSERT(ttree_insert(tree, &items[key]) == 0);
+        }
+    }
+
+    ttree_stats(tree, &stats);
+    return stats.counters.moved_keys;
+}
+
+/*
+ * ut_gapped_moves runs a churn of random deletions and insertions on
+ * a tree with contiguous windows and on a TTREE_GAPPED one. Deletions
+ * leave gaps which insertions fill, so the gapped tree must move at
+ * least twice fewer keys once nodes are large enough for shifts to cost
+ * more than keeping gaps.
+ */
+UTEST_FUNCTION(ut_gapped_moves, args)
+{
+    Ttree tree;
+    struct ttree_stats stats;
+    struct item *items;
+    int num_keys, num_items, i;
+    uint64_t plain, gapped;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT((num_items >= 1) && (num_items % 7919) &&
+                 (num_items % 104729));
+
+    items = malloc(num_items * sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+    }
+
+    UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                            struct item, key) == 0);
+    ttree_stats(&tree, &stats);
+    plain = churn_moved_keys(&tree, items, num_items);
+    ttree_destroy(&tree);
+
+    UTEST_ASSERT(ttree_init(&tree, num_keys, true, __cmpfunc,
+                            struct item, key) == 0);
+    UTEST_ASSERT(ttree_set_flags(&tree, TTREE_GAPPED) == 0);
+    gapped = churn_moved_keys(&tree, items, num_items);
+    ttree_destroy(&tree);
+    if (stats.counters_enabled && (num_keys >= 16) &&
+        (num_items >= num_keys * 8) && (gapped * 2 >= plain)) {
+        UTEST_FAILED("Gapped tree moved %" PRIu64 " keys, a plain one %"
+                     PRIu64, gapped, plain);
+    }
+
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_STATS",
+        "Statistics and dump should describe the shape of a tree",
+        ut_stats,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_AUTOTUNE",
+        "Capacity of nodes should follow the workload of a tree",
+        ut_autotune,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Initial number of keys per node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_MOVED_KEYS",
+        "Writes should shift only a few keys inside nodes",
+        ut_moved_keys,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_GAPPED_MOVES",
+        "Gapped nodes should move fewer keys on random writes",
+        ut_gapped_moves,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree_typed.h"
+
+struct item {
+    int key;
+};
+
+TTREE_DEFINE(itree, struct item, key, TTREE_NUM_CMP, 8)
+TTREE_DEFINE_INLINE(iitree, struct item, key, TTREE_NUM_CMP, 16)
+
+static struct item *alloc_item(int val)
+{
+    struct item *item = malloc(sizeof(*item));
+
+    if (!item) {
+        utest_error("Failed to allocate %zd bytes!", sizeof(*item));
+    }
+
+    item->key = val;
+    return item;
+}
+
+/*
+ * Typed lookup must position the cursor exactly like the generic one
+ * does, otherwise insertions at cursor would break the tree.
+ */
+#define CHECK_SAME_CURSOR(tree, prefix, k)                              \
+    do {                                                                \
+        TtreeCursor __c1, __c2;                                         \
+        void *__i1, *__i2;                                              \
+        int __k = (k);                                                  \
+                                                                        \
+        __i1 = prefix##_lookup(tree, __k, &__c1);                       \
+        __i2 = ttree_lookup(tree, &__k, &__c2);                         \
+        if ((__i1 != __i2) || (__c1.tnode != __c2.tnode) ||             \
+            (__c1.idx != __c2.idx) || (__c1.side != __c2.side) ||       \
+            (__c1.state != __c2.state)) {                               \
+            UTEST_FAILED("Typed and generic lookups of %d differ: "     \
+                         "(%p, %d, %d, %d) vs (%p, %d, %d, %d)", __k,   \
+                         __c1.tnode, __c1.idx, __c1.side, __c1.state,   \
+                         __c2.tnode, __c2.idx, __c2.side, __c2.state);  \
+        }                                                               \
+    } while (0)
+
+#define TYPED_TEST_BODY(prefix, num_items)                              \
+    do {                                                                \
+        Ttree tree;                                                     \
+        TtreeCursor cursor;                                             \
+        struct balance_info binfo;                                      \
+        struct item *item;                                              \
+        int i, key, prev;                                               \
+                                                                        \
+        UTEST_ASSERT(prefix##_init(&tree, true) == 0);                  \
+        UTEST_ASSERT(prefix##_lookup(&tree, 0, &cursor) == NULL);       \
+        UTEST_ASSERT(prefix##_first(&tree, &cursor) == NULL);           \
+        for (i = 0; i < (num_items); i++) {                             \
+            key = ((i * 7919) % (num_items)) * 2;                       \
+            UTEST_ASSERT(prefix##_insert(&tree, alloc_item(key)) == 0); \
+        }                                                               \
+                                                                        \
+        check_tree_balance(&tree, &binfo);                              \
+        if (binfo.balance != TREE_BALANCED) {                           \
+            UTEST_FAILED("Tree is unbalanced on a node %p BFC = %d, %s\n", \
+                         binfo.tnode, binfo.tnode->bfc,                 \
+                         balance_name(binfo.balance));                  \
+        }                                                               \
+                                                                        \
+        item = alloc_item(0);                                           \
+        UTEST_ASSERT(prefix##_insert(&tree, item) < 0);                 \
+        free(item);                                                     \
+        for (i = -1; i <= (num_items) * 2; i++) {                       \
+            item = prefix##_lookup(&tree, i, NULL);                     \
+            if (i & 1 || i < 0 || i >= (num_items) * 2) {               \
+                UTEST_ASSERT(item == NULL);                             \
+            }                                                           \
+            else {                                                      \
+                UTEST_ASSERT((item != NULL) && (item->key == i));       \
+            }                                                           \
+                                                                        \
+            CHECK_SAME_CURSOR(&tree, prefix, i);                        \
+        }                                                               \
+                                                                        \
+        i = 0;                                                          \
+        prev = -1;                                                      \
+        for (item = prefix##_first(&tree, &cursor); item;               \
+             item = prefix##_next(&cursor)) {                           \
+            UTEST_ASSERT(item->key > prev);                             \
+            prev = item->key;                                           \
+            i++;                                                        \
+        }                                                               \
+                                                                        \
+        UTEST_ASSERT(i == (num_items));                                 \
+        item = prefix##_last(&tree, &cursor);                           \
+        UTEST_ASSERT((item != NULL) && (item->key == prev));            \
+        for (i = 0; i < (num_items); i++) {                             \
+            item = prefix##_delete(&tree, i * 2);                       \
+            UTEST_ASSERT((item != NULL) && (item->key == i * 2));       \
+            free(item);                                                 \
+        }                                                               \
+                                                                        \
+        UTEST_ASSERT(ttree_is_empty(&tree));                            \
+        ttree_destroy(&tree);                                           \
+    } while (0)
+
+/*
+ * ut_typed fills trees made by TTREE_DEFINE and TTREE_DEFINE_INLINE,
+ * looks up existing and missing keys, iterates and drains them.
+ */
+UTEST_FUNCTION(ut_typed, args)
+{
+    int num_items;
+
+    num_items = utest_get_arg(args, 0, INT);
+    UTEST_ASSERT(num_items >= 1);
+    TYPED_TEST_BODY(itree, num_items);
+    TYPED_TEST_BODY(iitree, num_items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_TYPED",
+        "Test T*-tree functions generated by TTREE_DEFINE",
+        ut_typed,
+        UTEST_ARGS_LIST {
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
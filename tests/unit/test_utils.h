@@ -14,7 +14,35 @@ struct balance_info {
     TtreeNode *tnode;
 };
 
+/*
+ * Kinds of trees tests taking a mode argument are run on.
+ * Trees of TEST_TREE_SLAB take nodes from a slab of small chunks.
+ */
+enum test_tree_mode {
+    TEST_TREE_PLAIN,
+    TEST_TREE_ORDER_STATS,
+    TEST_TREE_CACHE_ALIGNED,
+    TEST_TREE_SLAB,
+    TEST_TREE_RELAXED,
+};
+
 void check_tree_balance(Ttree *ttree, struct balance_info *binfo);
 char *balance_name(enum balance_type type);
+void __init_test_tree(Ttree *ttree, int num_keys, int mode, bool is_unique,
+                      ttree_cmp_func_fn cmpf, size_t key_offs,
+                      size_t key_width);
+
+/* Initialize a tree of @mode, failing the test if it can't be done. */
+#define init_test_tree(ttree, num_keys, mode, is_unique, cmpf,          \
+                       data_struct, key_field)                          \
+    __init_test_tree(ttree, num_keys, mode, is_unique, cmpf,            \
+                     offsetof(data_struct, key_field), 0)
+
+/* The same as init_test_tree, but keys are stored inside nodes. */
+#define init_test_tree_inline(ttree, num_keys, mode, is_unique, cmpf,   \
+                              data_struct, key_field)                   \
+    __init_test_tree(ttree, num_keys, mode, is_unique, cmpf,            \
+                     offsetof(data_struct, key_field),                  \
+                     sizeof(((data_struct *)0)->key_field))
 
 #endif /* !_TEST_UTILS_H_ */
@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "ttree.h"
+#include "utest.h"
 #include "test_utils.h"
 
 static int __check_tree_balance(TtreeNode *tnode, struct balance_info *binfo)
@@ -53,3 +54,29 @@ char *balance_name(enum balance_type type)
 
     return "Balanced";
 }
+
+void __init_test_tree(Ttree *ttree, int num_keys, int mode, bool is_unique,
+                      ttree_cmp_func_fn cmpf, size_t key_offs,
+                      size_t key_width)
+{
+    static const unsigned int mode_flags[] = {
+        [TEST_TREE_ORDER_STATS] = TTREE_ORDER_STATS,
+        [TEST_TREE_CACHE_ALIGNED] = TTREE_CACHE_ALIGNED,
+        [TEST_TREE_RELAXED] = TTREE_RELAXED_BALANCE,
+    };
+    int ret = -1;
+
+    if ((mode >= 0) && (mode <= TEST_TREE_RELAXED)) {
+        ret = __ttree_init_inline(ttree, num_keys, is_unique, cmpf,
+                                  key_offs, key_width);
+    }
+    if (!ret) {
+        ret = ttree_set_flags(ttree, mode_flags[mode]);
+    }
+    if (!ret && (mode == TEST_TREE_SLAB)) {
+        ret = ttree_use_slab(ttree, 5);
+    }
+    if (ret) {
+        utest_error("Failed to initialize a tree in mode %d", mode);
+    }
+}
@@ -36,10 +36,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /* __linux__ */
 
 #include "ttree.h"
+#include "ttree_simd.h"
+#include "ttree_pool.h"
 
 #ifndef DEBUG_TTREE
 #define SET_ERRNO(err) errno = (err)
@@ -55,6 +65,19 @@
     } while (0)
 #endif /* DEBUG_TTREE */
 
+/*
+ * Counters are updated atomically, since lookups run concurrently
+ * with each other and with writers in some modes.
+ */
+#ifdef TTREE_STATS
+#define TTREE_STAT_ADD(ttree, counter, n)                       \
+    ((void)TTREE_FETCH_ADD(&(ttree)->counters.counter, (n)))
+#define TTREE_STAT_INC(var) ((var)++)
+#else /* TTREE_STATS */
+#define TTREE_STAT_ADD(ttree, counter, n) ((void)0)
+#define TTREE_STAT_INC(var) ((void)(var))
+#endif /* !TTREE_STATS */
+
 /* Index number of first key in a T*-tree node when a node has only one key. */
 #define first_tnode_idx(ttree)                  \
     (((ttree)->keys_per_tnode >> 1) - 1)
@@ -66,22 +89,87 @@
 #define min_tnode_entries(ttree)                                \
     ((ttree)->keys_per_tnode - ((ttree)->keys_per_tnode >> 2))
 
+/*
+ * Leafs aren't refilled from other nodes, so a leaf holding less
+ * than a half of rooms gets merged into its predecessor or successor
+ * if either of them has enough free rooms.
+ */
+#define leaf_underflows(ttree, tnode)                           \
+    (tnode_num_keys(tnode) < ((ttree)->keys_per_tnode >> 1))
+
+/*
+ * Nodes of TTREE_INDEX_LINKS trees are cut off before their sides[],
+ * which hold 32-bit links instead of pointers. A link is the distance
+ * of a node from the index base of the slab in 8-byte units, 0 is NULL.
+ */
+struct tnode_index_links {
+    uint32_t parent;
+    uint32_t successor;
+    union {
+        uint32_t sides[2];
+        struct {
+            uint32_t left;
+            uint32_t right;
+        };
+    };
+};
+
+#define is_indexed(ttree)                       \
+    ((ttree)->flags & TTREE_INDEX_LINKS)
+
+#define TNODE_CUT_BYTES offsetof(TtreeNode, sides)
+#define tnode_cut(ttree) (is_indexed(ttree) ? TNODE_CUT_BYTES : 0)
+#define tnode_index_links(tnode)                                        \
+    ((struct tnode_index_links *)(void *)((char *)(tnode) + TNODE_CUT_BYTES))
+
+static __inline TtreeNode *index2tnode(Ttree *ttree, uint32_t link)
+{
+    return link ?
+        (TtreeNode *)(ttree->slab.index_base + ((size_t)link << 3)) : NULL;
+}
+
+static __inline uint32_t tnode2index(Ttree *ttree, TtreeNode *tnode)
+{
+    return tnode ?
+        (uint32_t)(((char *)tnode - ttree->slab.index_base) >> 3) : 0;
+}
+
+/*
+ * Get or set the @link of a node: parent, successor, left, right
+ * or sides[side].
+ */
+#define tnode_link(ttree, tnode, link)                                  \
+    (UNLIKELY(is_indexed(ttree)) ?                                      \
+     index2tnode(ttree, tnode_index_links(tnode)->link) : (tnode)->link)
+
+#define tnode_set_link(ttree, tnode, link, val)                         \
+    do {                                                                \
+        TtreeNode *__tn = (tnode), *__val = (val);                      \
+                                                                        \
+        if (UNLIKELY(is_indexed(ttree))) {                              \
+            tnode_index_links(__tn)->link = tnode2index(ttree, __val);  \
+        }                                                               \
+        else {                                                          \
+            __tn->link = __val;                                         \
+        }                                                               \
+    } while (0)
+
 /*
  * T*-tree has three types of node:
  * 1. Node that hasn't left and right child is called "leaf node".
  * 2. Node that has only one child is called "half-leaf node"
  * 3. Finally, node that has both left and right childs is called "internal node"
  */
-#define is_leaf_node(node)                      \
-    (!(node)->left && !(node)->right)
-#define is_internal_node(node)                  \
-    ((node)->left && (node)->right)
-#define is_half_leaf(tnode)                                             \
-    ((!(tnode)->left || !(tnode)->right) && !((tnode)->left && (tnode)->right))
+#define is_leaf_node(ttree, node)                                       \
+    (!tnode_link(ttree, node, left) && !tnode_link(ttree, node, right))
+#define is_internal_node(ttree, node)                                   \
+    (tnode_link(ttree, node, left) && tnode_link(ttree, node, right))
+#define is_half_leaf(ttree, tnode)              \
+    (!is_internal_node(ttree, tnode))
 
 /* Translate node side to balance factor */
 #define side2bfc(side)                          \
-    __balance_factors[side]
+    __balance_factors[(side) + 1]
 #define get_bfc_delta(node)                     \
     (side2bfc(tnode_get_side(node)))
 #define subtree_is_unbalanced(node)             \
@@ -93,1076 +181,6393 @@
 #define right_heavy(node)                       \
     ((node)->bfc > 0)
 
+/*
+ * A key T*-tree compares with: an inline copy if keys are
+ * stored inside nodes or a pointer to item's key otherwise.
+ */
+#define tnode_cmp_key(ttree, tnode, idx)                        \
+    ((ttree)->key_width ? tnode_inline_key(ttree, tnode, idx) : \
+     (tnode)->keys[(idx)])
+
+/* String a key of a tree with string keys refers to. */
+#define str_of_key(ttree, key)                                  \
+    (((ttree)->str_keys == TTREE_STR_PTR) ?                     \
+     *(const unsigned char **)(key) : (const unsigned char *)(key))
+
+/*
+ * Inline copy of a string key is its prefix padded with zeroes.
+ * The strings differ within the prefix in most cases, and if not,
+ * the prefix is skipped by final comparison of the rest of them.
+ */
+static int str_cmp_prefix(Ttree *ttree, void *key, TtreeNode *tnode, int idx)
+{
+    const unsigned char *str = str_of_key(ttree, key);
+    const unsigned char *prefix = tnode_inline_key(ttree, tnode, idx);
+    size_t i;
+
+    for (i = 0; i < ttree->key_width; i++) {
+        if (str[i] != prefix[i]) {
+            return (str[i] < prefix[i]) ? -1 : 1;
+        }
+        if (!str[i]) {
+            return 0;
+        }
+    }
+
+    return strcmp((const char *)str + i,
+                  (const char *)str_of_key(ttree, tnode->keys[idx]) + i);
+}
+
+/* Compare a key with the key at @idx of a node. */
+static TTREE_ALWAYS_INLINE int tnode_cmp(Ttree *ttree, void *key,
+                                         TtreeNode *tnode, int idx)
+{
+    if (UNLIKELY(ttree->str_keys)) {
+        return str_cmp_prefix(ttree, key, tnode, idx);
+    }
+
+    return ttree->cmp_func(key, tnode_cmp_key(ttree, tnode, idx));
+}
+
 struct tnode_lookup {
     void *key;
     int low_bound;
     int high_bound;
+    int cmps; /* comparisons made, counted only with TTREE_STATS */
+};
+
+/*
+ * Kinds of keys T*-tree lookup may be specialized for.
+ * All kinds except LOOKUP_GENERIC require keys to be stored inline
+ * and compare them directly, without calling user-defined function.
+ */
+enum lookup_kind {
+    LOOKUP_GENERIC,
+    LOOKUP_U32,
+    LOOKUP_U64,
+    LOOKUP_I64,
 };
 
-static int __balance_factors[] = { -1, 1 };
+#define cmp_numbers(a, b)                       \
+    (((a) > (b)) - ((a) < (b)))
 
-static TtreeNode *allocate_ttree_node(Ttree *ttree)
+/* The root node doesn't affect balance of any node. */
+static int __balance_factors[] = { 0, -1, 1 };
+
+/* Alignment of T*-tree nodes and slab chunks. */
+#define TNODE_ALIGN sizeof(void *)
+
+#define TTREE_CACHELINE 64
+
+/*
+ * With TTREE_CACHE_ALIGNED flag each node block starts with a copy
+ * of the node's minimum key (or a pointer to it), followed by the node
+ * itself, so the copy shares the first cache line with the links.
+ */
+#define TTREE_HOT_BYTES TTREE_HOT_KEY_MAX
+#define has_hot_keys(ttree) ((ttree)->tnode_hot != 0)
+#define tnode_hot_key(tnode)                            \
+    ((void *)((char *)(tnode) - TTREE_HOT_BYTES))
+
+/* Size of a block holding a node including its alignment. */
+#define tnode_block_size(ttree)                                         \
+    align_up((ttree)->tnode_hot + tnode_size(ttree),                    \
+             has_hot_keys(ttree) ? TTREE_CACHELINE : TNODE_ALIGN)
+
+#define align_up(val, align)                            \
+    (((val) + ((align) - 1)) & ~((size_t)(align) - 1))
+
+static void *malloc_alloc(void *ctx, size_t size, size_t align)
 {
-    TtreeNode *tnode = malloc(tnode_size(ttree));
+    void *ptr;
 
-    if (tnode) {
-        memset(tnode, 0, sizeof(*tnode) - TNODE_ITEMS_MIN * sizeof(uintptr_t));
+    (void)ctx;
+    if (align <= TNODE_ALIGN) {
+        return malloc(size);
+    }
+    if (posix_memalign(&ptr, align, size)) {
+        return NULL;
     }
 
-    return tnode;
+    return ptr;
+}
+
+static void malloc_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+    free(ptr);
 }
 
+const TtreeNodeAllocator ttree_malloc_allocator = {
+    .alloc = malloc_alloc,
+    .free = malloc_free,
+    .release = NULL,
+};
+
 /*
- * T*-tree node contains keys in a sorted order. Thus binary search
- * is used for internal lookup.
+ * Slab chunk header. Chunk blocks start right after the header
+ * (rounded up to blocks alignment).
  */
-static void *lookup_inside_tnode(Ttree *ttree, TtreeNode *tnode,
-                                 struct tnode_lookup *tnl, int *out_idx)
+struct slab_chunk {
+    struct slab_chunk *next;
+    size_t size;
+};
+
+/*
+ * Chunks of a slab carving nodes from pages are mapped directly.
+ * Chunk of normal pages is just a unit of NUMA placement, so it is
+ * as big as a chunk of 2M pages is.
+ */
+#define page_chunk_size(slab)                                   \
+    (((slab)->page_size == TTREE_PAGE_NORMAL) ?                 \
+     TTREE_PAGE_2M : (slab)->page_size)
+
+/* Page size of slabs mapping normal pages, 0 is left for malloc. */
+#define TTREE_PAGE_NORMAL ((size_t)1)
+
+#define TTREE_MPOL_PREFERRED 1
+
+/* NUMA node of the calling thread or -1 if it's unknown. */
+static int current_numa_node(void)
 {
-    int floor, ceil, mid, cmp_res;
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu, node;
 
-    floor = tnl->low_bound;
-    ceil = tnl->high_bound;
-    TTREE_ASSERT((floor >= 0) && (ceil < ttree->keys_per_tnode));
-    while (floor <= ceil) {
-        mid = (floor + ceil) >> 1;
-        if ((cmp_res = ttree->cmp_func(tnl->key, tnode->keys[mid])) < 0)
-            ceil = mid - 1;
-        else if (cmp_res > 0)
-            floor = mid + 1;
-        else {
-            *out_idx = mid;
-            return ttree_key2item(ttree, tnode->keys[mid]);
-        }
+    if (!syscall(SYS_getcpu, &cpu, &node, NULL)) {
+        return (int)node;
     }
+#endif /* __linux__ && SYS_getcpu */
 
-    /*
-     * If a key position is not found, save an index of the position
-     * where key may be placed to.
-     */
-    *out_idx = floor;
-    return NULL;
+    return -1;
 }
 
-static __inline void increase_tnode_window(Ttree *ttree,
-                                           TtreeNode *tnode, int *idx)
+/* Prefer @node for pages of [@ptr, @ptr + @size) not touched yet. */
+static int bind_numa_node(void *ptr, size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[TTREE_NUMA_NODES_MAX / (8 * sizeof(unsigned long))];
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(*mask))] |= 1UL << (node % (8 * sizeof(*mask)));
+    return (int)syscall(SYS_mbind, ptr, size, TTREE_MPOL_PREFERRED, mask,
+                        TTREE_NUMA_NODES_MAX, 0);
+#else /* __linux__ && SYS_mbind */
+    return -1;
+#endif /* !__linux__ || !SYS_mbind */
+}
+
+/* Map @size bytes aligned to @align, which is a multiple of page size. */
+static void *map_aligned(size_t size, size_t align)
 {
-    register int i;
+    char *ptr, *start;
 
-    /*
-     * If the right side of an array has more free rooms than the left one,
-     * the window will grow to the right. Otherwise it'll grow to the left.
-     */
-    if ((ttree->keys_per_tnode - 1 - tnode->max_idx) > tnode->min_idx) {
-        for (i = ++tnode->max_idx; i > *idx - 1; i--)
-            tnode->keys[i] = tnode->keys[i - 1];
+    ptr = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
     }
-    else {
-        *idx -= 1;
-        for (i = --tnode->min_idx; i < *idx; i++) {
-            tnode->keys[i] = tnode->keys[i + 1];
-        }
+
+    start = (char *)align_up((uintptr_t)ptr, align);
+    if (start > ptr) {
+        munmap(ptr, start - ptr);
     }
+
+    munmap(start + size, (ptr + align) - start);
+    return start;
 }
 
-static __inline void decrease_tnode_window(Ttree *ttree,
-                                         TtreeNode *tnode, int *idx)
+static void *map_page_chunk(struct ttree_slab *slab)
 {
-    register int i;
-
-    /* Shrink the window to the longer side by given index. */
-    if ((ttree->keys_per_tnode - 1 - tnode->max_idx) <= tnode->min_idx) {
-        tnode->max_idx--;
-        for (i = *idx; i <= tnode->max_idx; i++)
-            tnode->keys[i] = tnode->keys[i + 1];
+    size_t size = page_chunk_size(slab);
+    void *ptr = NULL;
+    int node;
+
+    if (slab->page_size != TTREE_PAGE_NORMAL) {
+#ifdef MAP_HUGETLB
+        int huge_flags = MAP_HUGETLB;
+
+#ifdef MAP_HUGE_SHIFT
+        huge_flags |= ((slab->page_size == TTREE_PAGE_1G) ? 30 : 21) <<
+            MAP_HUGE_SHIFT;
+#endif /* MAP_HUGE_SHIFT */
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | huge_flags, -1, 0);
+        if (ptr != MAP_FAILED) {
+            slab->hugetlb_bytes += size;
+        }
+        else {
+            ptr = NULL;
+        }
+#endif /* MAP_HUGETLB */
+    }
+    if (!ptr) {
+        /* Reserved huge pages are over, ask for transparent ones. */
+        ptr = map_aligned(size, TTREE_PAGE_2M);
+        if (!ptr) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if ((slab->page_size != TTREE_PAGE_NORMAL) &&
+            !madvise(ptr, size, MADV_HUGEPAGE)) {
+            slab->thp_bytes += size;
+        }
+#endif /* MADV_HUGEPAGE */
     }
-    else {
-        tnode->min_idx++;
-        for (i = *idx; i >= tnode->min_idx; i--)
-            tnode->keys[i] = tnode->keys[i - 1];
 
-        *idx = *idx + 1;
+    node = (slab->numa_node == TTREE_NUMA_LOCAL) ?
+        current_numa_node() : slab->numa_node;
+    if ((node >= 0) && !bind_numa_node(ptr, size, node)) {
+        slab->numa_bytes += size;
     }
+
+    slab->mapped_bytes += size;
+    return ptr;
 }
 
 /*
- * generic single rotation procedrue.
- * side = TNODE_LEFT  - Right rotation
- * side = TNODE_RIGHT - Left rotation.
- * "target" will be set to the new root of rotated subtree.
+ * Nodes of TTREE_INDEX_LINKS trees are carved from a single range
+ * of address space, so that 32-bit links reach any of them. The range
+ * is only reserved at first, and its pages are committed by chunks.
  */
-static void __rotate_single(TtreeNode **target, int side)
+#define TTREE_ARENA_SIZE                                        \
+    ((sizeof(size_t) > 4) ? ((size_t)1 << 35) - TTREE_PAGE_2M : \
+     ((size_t)1 << 30))
+
+static int arena_reserve(struct ttree_slab *slab)
 {
-    TtreeNode *p, *s;
-    int opside = opposite_side(side);
+    void *ptr;
 
-    p = *target;
-    TTREE_ASSERT(p != NULL);
-    s = p->sides[side];
-    TTREE_ASSERT(s != NULL);
-    tnode_set_side(s, tnode_get_side(p));
-    p->sides[side] = s->sides[opside];
-    s->sides[opside] = p;
-    tnode_set_side(p, opside);
-    s->parent = p->parent;
-    p->parent = s;
-    if (p->sides[side]) {
-        p->sides[side]->parent = p;
-        tnode_set_side(p->sides[side], side);
-    }
-    if (s->parent) {
-        if (s->parent->sides[side] == p)
-            s->parent->sides[side] = s;
-        else
-            s->parent->sides[opside] = s;
+    ptr = mmap(NULL, TTREE_ARENA_SIZE, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return -1;
     }
 
-    *target = s;
+    slab->arena = ptr;
+    slab->arena_size = TTREE_ARENA_SIZE;
+    slab->bump = slab->bump_end = ptr;
+
+    /* The first node gets link 1, so no node gets the NULL one. */
+    slab->index_base = slab->arena - TNODE_CUT_BYTES - 8;
+    return 0;
 }
 
-/*
- * There are two cases of single rotation possible:
- * 1) Right rotation (side = TNODE_LEFT)
- *         [P]             [L]
- *        /  \            /  \
- *      [L]  x1    =>   x2   [P]
- *     /  \                 /  \
- *    x2  x3               x3  x1
- *
- * 2) Left rotation (side = TNODE_RIHGT)
- *      [P]                [R]
- *     /  \               /  \
- *    x1  [R]      =>   [P]   x2
- *       /  \          /  \
- *     x3   x2        x1  x3
- */
-static void rotate_single(TtreeNode **target, int side)
+static int arena_commit(struct ttree_slab *slab)
 {
-    TtreeNode *n;
+    size_t size;
 
-    __rotate_single(target, side);
-    n = (*target)->sides[opposite_side(side)];
-
-    /*
-     * Recalculate balance factors of nodes after rotation.
-     * Let X was a root node of rotated subtree and Y was its
-     * child. After single rotation Y is new root of subtree and X is its child.
-     * Y node may become either balanced or overweighted to the
-     * same side it was but 1 level less.
-     * X node scales at 1 level down and possibly it has new child, so
-     * its balance should be recalculated too. If it still internal node and
-     * its new parent was not overwaighted to the opposite to X side,
-     * X is overweighted to the opposite to its new parent side, otherwise it's balanced.
-     * If X is either half-leaf or leaf, balance racalculation is obvious.
-     */
-    if (is_internal_node(n)) {
-        n->bfc = (n->parent->bfc != side2bfc(side)) ? side2bfc(side) : 0;
+    size = align_up(slab->block_size * slab->tnodes_per_chunk,
+                    sysconf(_SC_PAGESIZE));
+    if ((size_t)(slab->arena + slab->arena_size - slab->bump_end) < size) {
+        return -1;
     }
-    else {
-        n->bfc = !!(n->right) - !!(n->left);
+    if (mprotect(slab->bump_end, size, PROT_READ | PROT_WRITE)) {
+        return -1;
     }
 
-    (*target)->bfc += side2bfc(opposite_side(side));
-    TTREE_ASSERT((abs(n->bfc < 2) && (abs((*target)->bfc) < 2)));
+    slab->bump_end += size;
+    slab->mapped_bytes += size;
+    return 0;
 }
 
-/*
- * There are two possible cases of double rotation:
- * 1) Left-right rotation: (side == TNODE_LEFT)
- *      [P]                     [r]
- *     /  \                    /  \
- *   [L]  x1                [L]   [P]
- *  /  \          =>       / \    / \
- * x2  [r]                x2 x4  x3 x1
- *    /  \
- *  x4   x3
- *
- * 2) Right-left rotation: (side == TNODE_RIGHT)
- *      [P]                     [l]
- *     /  \                    /  \
- *    x1  [R]               [P]   [R]
- *       /  \     =>        / \   / \
- *      [l] x2             x1 x3 x4 x2
- *     /  \
- *    x3  x4
- */
-static void rotate_double(TtreeNode **target, int side)
+static void *slab_alloc(void *ctx, size_t size, size_t align)
 {
-    int opside = opposite_side(side);
-    TtreeNode *n = (*target)->sides[side];
+    struct ttree_slab *slab = ctx;
+    struct slab_chunk *chunk;
+    size_t hdr_size;
+    void *block;
 
-    __rotate_single(&n, opside);
+    if (UNLIKELY(!slab->block_size)) {
+        slab->block_size = align_up(size, align);
+    }
 
-    /*
-     * Balance recalculation is very similar to recalculation after
-     * simple single rotation.
-     */
-    if (is_internal_node(n->sides[side])) {
-        n->sides[side]->bfc = (n->bfc == side2bfc(opside)) ? side2bfc(side) : 0;
+    TTREE_ASSERT(align_up(size, align) <= slab->block_size);
+    if (slab->free_list) {
+        block = slab->free_list;
+        slab->free_list = *(void **)block;
+        return block;
     }
-    else {
-        n->sides[side]->bfc =
-            !!(n->sides[side]->right) - !!(n->sides[side]->left);
+    if (slab->arena) {
+        /* Tails of committed chunks are used by blocks of the next ones. */
+        if (UNLIKELY((size_t)(slab->bump_end - slab->bump) <
+                     slab->block_size) && (arena_commit(slab) < 0)) {
+            return NULL;
+        }
     }
+    else if (UNLIKELY(slab->bump == slab->bump_end)) {
+        /*
+         * There are no free blocks left in the last chunk,
+         * so new chunk has to be allocated.
+         */
+        hdr_size = align_up(sizeof(*chunk), align);
+        if (slab->page_size) {
+            if (hdr_size + slab->block_size > page_chunk_size(slab)) {
+                return NULL;
+            }
 
-    TTREE_ASSERT(abs(n->sides[side]->bfc) < 2);
-    n = n->parent;
-    __rotate_single(target, side);
-    if (is_internal_node(n)) {
-        n->bfc = ((*target)->bfc == side2bfc(side)) ? side2bfc(opside) : 0;
-    }
-    else {
-        n->bfc = !!(n->right) - !!(n->left);
+            chunk = map_page_chunk(slab);
+        }
+        else {
+            chunk = malloc_alloc(NULL, hdr_size + slab->block_size *
+                                 slab->tnodes_per_chunk, align);
+        }
+        if (!chunk) {
+            return NULL;
+        }
+
+        if (slab->page_size) {
+            chunk->size = page_chunk_size(slab);
+            slab->tnodes_per_chunk =
+                (int)((chunk->size - hdr_size) / slab->block_size);
+        }
+        else {
+            chunk->size = hdr_size +
+                slab->block_size * slab->tnodes_per_chunk;
+        }
+
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        slab->bump = (char *)chunk + hdr_size;
+        slab->bump_end = slab->bump +
+            slab->block_size * slab->tnodes_per_chunk;
     }
 
-    /*
-     * new root node of subtree is always ideally balanced
-     * after double rotation.
-     */
-    TTREE_ASSERT(abs(n->bfc) < 2);
-    (*target)->bfc = 0;
+    block = slab->bump;
+    slab->bump += slab->block_size;
+    return block;
 }
 
-static void rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
+static void slab_free(void *ctx, void *ptr)
 {
-    int lh = left_heavy(*node);
-    int sum = abs((*node)->bfc + (*node)->sides[opposite_side(lh)]->bfc);
+    struct ttree_slab *slab = ctx;
 
-    if (sum >= 2) {
-        rotate_single(node, opposite_side(lh));
-        goto out;
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+}
+
+static void slab_release(void *ctx)
+{
+    struct ttree_slab *slab = ctx;
+    struct slab_chunk *chunk, *next;
+
+    for (chunk = slab->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        if (slab->page_size) {
+            munmap(chunk, chunk->size);
+        }
+        else {
+            free(chunk);
+        }
     }
 
-    rotate_double(node, opposite_side(lh));
+    if (slab->image) {
+        munmap(slab->image, slab->image_size);
+    }
+    if (slab->arena) {
+        munmap(slab->arena, slab->arena_size);
+    }
 
-    /*
-     * T-tree rotation rules difference from AVL rules in only one aspect.
-     * After double rotation is done and a leaf became a new root node of
-     * subtree and both its left and right childs are half-leafs.
-     * If the new root node contains only one item, N - 1 items should
-     * be moved into it from one of its childs.
-     * (N is a number of items in selected child node).
-     */
-    if ((tnode_num_keys(*node) == 1) &&
-        is_half_leaf((*node)->left) && is_half_leaf((*node)->right)) {
-        TtreeNode *n;
-        int offs, nkeys;
+    slab->chunks = slab->free_list = NULL;
+    slab->bump = slab->bump_end = NULL;
+    slab->block_size = 0;
+    slab->image = NULL;
+    slab->image_size = 0;
+    slab->image_relocated = false;
+    slab->mapped_bytes = slab->hugetlb_bytes = 0;
+    slab->thp_bytes = slab->numa_bytes = 0;
+    slab->arena = slab->index_base = NULL;
+    slab->arena_size = 0;
+}
 
-        /*
-         * If right child contains more items than left, they will be moved
-         * from the right child. Otherwise from the left one.
-         */
-        if (tnode_num_keys((*node)->right) >= tnode_num_keys((*node)->left)) {
-            /*
-             * Right child was selected. So first N - 1 items will be copied
-             * and inserted after parent's first item.
+static const TtreeNodeAllocator slab_allocator = {
+    .alloc = slab_alloc,
+    .free = slab_free,
+    .release = slab_release,
+};
+
+/* Initial number of entries in a snapshot table of node copies. */
+#define TTREE_SNAPSHOT_ENTRIES 64
+
+static __inline size_t snapshot_slot(TtreeSnapshot *snap, TtreeNode *tnode)
+{
+    uint64_t h = (uint64_t)(uintptr_t)tnode * 0x9e3779b97f4a7c15ULL;
+
+    return (size_t)(h ^ (h >> 32)) & snap->mask;
+}
+
+static struct ttree_snapshot_entry *snapshot_find(TtreeSnapshot *snap,
+                                                  TtreeNode *tnode)
+{
+    struct ttree_snapshot_entry *e;
+    size_t i;
+
+    for (i = snapshot_slot(snap, tnode); ; i = (i + 1) & snap->mask) {
+        e = &snap->entries[i];
+        if (e->tnode == tnode) {
+            return e;
+        }
+        if (!e->tnode) {
+            return NULL;
+        }
+    }
+}
+
+static void snapshot_put(TtreeSnapshot *snap, TtreeNode *tnode,
+                         TtreeNode *copy)
+{
+    size_t i;
+
+    for (i = snapshot_slot(snap, tnode); snap->entries[i].tnode;
+         i = (i + 1) & snap->mask);
+
+    snap->entries[i].tnode = tnode;
+    snap->entries[i].copy = copy;
+    snap->num_entries++;
+}
+
+/*
+ * Add a node which isn't in the table yet. The table is kept at most
+ * half full, but if it can't grow, it's filled up to the last free entry.
+ */
+static int snapshot_insert(TtreeSnapshot *snap, TtreeNode *tnode,
+                           TtreeNode *copy)
+{
+    struct ttree_snapshot_entry *entries = snap->entries;
+    size_t size = snap->mask + 1, i;
+
+    if (2 * (snap->num_entries + 1) > size) {
+        snap->entries = calloc(size * 2, sizeof(*entries));
+        if (!snap->entries) {
+            snap->entries = entries;
+            if (snap->num_entries + 1 >= size) {
+                SET_ERRNO(ENOMEM);
+                return -1;
+            }
+        }
+        else {
+            snap->mask = size * 2 - 1;
+            snap->num_entries = 0;
+            for (i = 0; i < size; i++) {
+                if (entries[i].tnode) {
+                    snapshot_put(snap, entries[i].tnode, entries[i].copy);
+                }
+            }
+
+            free(entries);
+        }
+    }
+
+    snapshot_put(snap, tnode, copy);
+    return 0;
+}
+
+static __inline void free_tnode_copy(Ttree *ttree, TtreeNode *copy)
+{
+    if (copy) {
+        free((char *)copy - ttree->tnode_hot);
+    }
+}
+
+/* A snapshot is lost together with all older ones reading its copies. */
+static void snapshot_lose(TtreeSnapshot *snap)
+{
+    for (; snap; snap = snap->older) {
+        snap->lost = true;
+    }
+}
+
+/*
+ * Copy a node the tree is going to change, unless the newest snapshot
+ * has already got its copy or the node is newer than the snapshot.
+ * Older snapshots see the same state of the node unless they have
+ * copies of their own.
+ */
+static void __snapshot_preserve(Ttree *ttree, TtreeNode *tnode)
+{
+    TtreeSnapshot *snap = ttree->snapshot;
+    size_t size = ttree->tnode_hot + tnode_size(ttree);
+    char *block;
+
+    if (snap->lost || snapshot_find(snap, tnode)) {
+        return;
+    }
+
+    block = malloc(size);
+    if (block) {
+        memcpy(block, (char *)tnode - ttree->tnode_hot, size);
+        if (!snapshot_insert(snap, tnode,
+                             (TtreeNode *)(block + ttree->tnode_hot))) {
+            return;
+        }
+
+        free(block);
+    }
+
+    snapshot_lose(snap);
+}
+
+#define snapshot_preserve(ttree, tnode)                         \
+    do {                                                        \
+        if (UNLIKELY((ttree)->snapshot != NULL)) {              \
+            __snapshot_preserve(ttree, tnode);                  \
+        }                                                       \
+    } while (0)
+
+/*
+ * Nodes allocated after the newest snapshot was taken aren't seen
+ * by snapshots, so they are never copied. If a node can't be marked
+ * as such, it's merely copied when it's changed.
+ */
+static void snapshot_mark_new(Ttree *ttree, TtreeNode *tnode)
+{
+    TtreeSnapshot *snap = ttree->snapshot;
+
+    if (!snap->lost && !snapshot_find(snap, tnode)) {
+        snapshot_insert(snap, tnode, NULL);
+    }
+}
+
+static TtreeNode *allocate_ttree_node(Ttree *ttree)
+{
+    TtreeNode *tnode;
+    char *block;
+
+    block = ttree->allocator->alloc(ttree->alloc_ctx,
+                                    ttree->tnode_hot + tnode_size(ttree) -
+                                    tnode_cut(ttree),
+                                    has_hot_keys(ttree) ?
+                                    TTREE_CACHELINE : TNODE_ALIGN);
+    if (!block) {
+        return NULL;
+    }
+
+    TTREE_STAT_ADD(ttree, tnode_allocs, 1);
+    tnode = (TtreeNode *)(block + ttree->tnode_hot - tnode_cut(ttree));
+    memset(block + ttree->tnode_hot, 0, sizeof(*tnode) - tnode_cut(ttree) -
+           TNODE_ITEMS_MIN * sizeof(uintptr_t));
+    if (UNLIKELY(ttree->snapshot != NULL)) {
+        snapshot_mark_new(ttree, tnode);
+    }
+
+    return tnode;
+}
+
+static __inline void free_ttree_node(Ttree *ttree, TtreeNode *tnode)
+{
+    snapshot_preserve(ttree, tnode);
+    TTREE_STAT_ADD(ttree, tnode_frees, 1);
+    ttree->allocator->free(ttree->alloc_ctx, (char *)tnode -
+                           ttree->tnode_hot + tnode_cut(ttree));
+}
+
+#define is_concurrent(ttree)                    \
+    ((ttree)->flags & TTREE_CONCURRENT)
+#define is_relaxed(ttree)                       \
+    ((ttree)->flags & TTREE_RELAXED_BALANCE)
+#define is_gapped(ttree)                        \
+    ((ttree)->flags & TTREE_GAPPED)
+
+/* ttree_node_leftmost and ttree_node_rightmost following index links. */
+static __inline TtreeNode *tnode_sidemost(Ttree *ttree, TtreeNode *tnode,
+                                          int side)
+{
+    TtreeNode *n;
+
+    if (!tnode) {
+        return NULL;
+    }
+
+    while ((n = tnode_link(ttree, tnode, sides[side]))) {
+        tnode = n;
+    }
+
+    return tnode;
+}
+
+#define tnode_leftmost(ttree, tnode)            \
+    tnode_sidemost(ttree, tnode, TNODE_LEFT)
+#define tnode_rightmost(ttree, tnode)           \
+    tnode_sidemost(ttree, tnode, TNODE_RIGHT)
+#define tnode_glb(ttree, tnode)                                 \
+    tnode_rightmost(ttree, tnode_link(ttree, tnode, left))
+
+/*
+ * Nodes modified by a write are collected either to be published
+ * to readers or to refresh copies of their minimum keys.
+ */
+#define tracks_writes(ttree)                                    \
+    ((ttree)->flags & (TTREE_CONCURRENT | TTREE_CACHE_ALIGNED))
+
+static __inline void tnode_refresh_hot(Ttree *ttree, TtreeNode *tnode)
+{
+    if (tnode->min_idx > tnode->max_idx) {
+        return;
+    }
+    if (ttree->key_width) {
+        memcpy(tnode_hot_key(tnode),
+               tnode_inline_key(ttree, tnode, tnode->min_idx),
+               ttree->key_width);
+    }
+    else {
+        *(void **)tnode_hot_key(tnode) = tnode_key_min(tnode);
+    }
+}
+
+/*
+ * Maximum number of nodes a single write may modify. Each rotation
+ * touches four nodes and there are at most 1.44 * log2(N) nodes on a
+ * path in AVL tree, so it's enough for any tree fitting in memory.
+ */
+#define TTREE_MAX_DIRTY 1024
+
+/*
+ * Maximum depth of a path reader may go through. If reader
+ * gets deeper, it has seen inconsistent state and has to retry.
+ */
+#define TTREE_MAX_PATH 128
+
+/*
+ * Nodes visited by a reader together with their versions.
+ */
+struct tnode_path {
+    int depth;
+    TtreeNode *tnodes[TTREE_MAX_PATH];
+    uint32_t versions[TTREE_MAX_PATH];
+};
+
+/*
+ * Writer side of per-node seqlock. Before a node is modified
+ * its version becomes odd and it stays odd until the whole write is
+ * completed (see write_end), so readers never see half of a write.
+ */
+static __inline void tnode_write_begin(Ttree *ttree, TtreeNode *tnode)
+{
+    snapshot_preserve(ttree, tnode);
+    if (tracks_writes(ttree) && !(tnode->version & 1)) {
+        TTREE_ASSERT(ttree->num_dirty < TTREE_MAX_DIRTY);
+        TTREE_STORE_RELAXED(&tnode->version, tnode->version + 1);
+        TTREE_FENCE_RELEASE();
+        ttree->dirty[ttree->num_dirty++] = tnode;
+    }
+}
+
+/*
+ * Each reader writes only to its own slot, and slots don't share
+ * cache lines, so readers never bounce lines between each other.
+ */
+struct ttree_reader_slot {
+    unsigned long epoch; /* epoch reader is in, 0 if it's outside */
+    int in_use;
+    char pad[TTREE_CACHELINE - sizeof(unsigned long) - sizeof(int)];
+};
+
+static void free_limbo(Ttree *ttree, int i)
+{
+    TtreeNode *tnode, *next;
+
+    for (tnode = ttree->limbo[i]; tnode; tnode = next) {
+        next = tnode->successor;
+        free_ttree_node(ttree, tnode);
+    }
+
+    ttree->limbo[i] = NULL;
+}
+
+/*
+ * Epoch may be advanced only when every reader inside the tree has
+ * entered in the current epoch. Such readers entered after all nodes
+ * removed in the previous epoch had been unlinked, so nobody can
+ * reach those nodes anymore.
+ */
+static void try_advance_epoch(Ttree *ttree)
+{
+    unsigned long epoch = ttree->epoch, e;
+    int i;
+
+    /* Unlinking must be visible before readers' epochs are checked */
+    TTREE_FENCE_FULL();
+    for (i = 0; i < TTREE_MAX_READERS; i++) {
+        e = TTREE_LOAD_ACQUIRE(&ttree->readers[i].epoch);
+        if (e && (e != epoch)) {
+            return;
+        }
+    }
+
+    /* Nodes removed in the previous epoch are freed */
+    TTREE_STORE_RELEASE(&ttree->epoch, epoch + 1);
+    free_limbo(ttree, (epoch + TTREE_EPOCHS - 1) % TTREE_EPOCHS);
+}
+
+static __inline void write_end(Ttree *ttree)
+{
+    int i;
+
+    for (i = 0; i < ttree->num_dirty; i++) {
+        TtreeNode *tnode = ttree->dirty[i];
+
+        if (has_hot_keys(ttree)) {
+            tnode_refresh_hot(ttree, tnode);
+        }
+
+        TTREE_STORE_RELEASE(&tnode->version, tnode->version + 1);
+    }
+
+    ttree->num_dirty = 0;
+    if (ttree->limbo[0] || ttree->limbo[1] || ttree->limbo[2]) {
+        try_advance_epoch(ttree);
+    }
+}
+
+/*
+ * Reader side: wait until the node isn't modified and
+ * remember the version it has.
+ *
+ * Keys are read by plain loads and copies and may race with a writer
+ * moving them, which is deliberate: whatever a reader has read from a
+ * node is thrown away unless the node version is still the same.
+ */
+static __inline uint32_t tnode_read_begin(TtreeNode *tnode)
+{
+    uint32_t version;
+
+    while ((version = TTREE_LOAD_ACQUIRE(&tnode->version)) & 1) {
+        TTREE_CPU_RELAX();
+    }
+
+    return version;
+}
+
+/*
+ * Indices and links readers go through are loaded at once, so a reader
+ * racing with a writer sees either old or new value of each of them.
+ * Indices share a word with the balance factor and the side of node.
+ */
+union tnode_word {
+    uint32_t word;
+    struct {
+        signed min_idx     :12;
+        signed max_idx     :12;
+        signed bfc         :4;
+        unsigned node_side :4;
+    };
+};
+
+static __inline union tnode_word tnode_load_word(TtreeNode *tnode)
+{
+    union tnode_word w;
+
+    w.word = TTREE_LOAD_RELAXED(&tnode->pad);
+    return w;
+}
+
+#define tnode_min_idx(tnode) (tnode_load_word(tnode).min_idx)
+#define tnode_max_idx(tnode) (tnode_load_word(tnode).max_idx)
+
+/* Trees with index links are never concurrent, so links are read plainly. */
+#define tnode_load_link(ttree, tnode, link)                             \
+    (UNLIKELY(is_indexed(ttree)) ?                                      \
+     index2tnode(ttree, tnode_index_links(tnode)->link) :              \
+     TTREE_LOAD_RELAXED(&(tnode)->link))
+
+/*
+ * Add a node to the reader's path. Does nothing for
+ * non-concurrent readers that go without a path.
+ */
+static __inline bool path_add(struct tnode_path *path, TtreeNode *tnode)
+{
+    if (!path) {
+        return true;
+    }
+    if (UNLIKELY(path->depth >= TTREE_MAX_PATH)) {
+        path->depth = TTREE_MAX_PATH + 1;
+        return false;
+    }
+
+    path->tnodes[path->depth] = tnode;
+    path->versions[path->depth++] = tnode_read_begin(tnode);
+    return true;
+}
+
+static __inline uint32_t path_version(struct tnode_path *path,
+                                      TtreeNode *tnode)
+{
+    int i;
+
+    for (i = path->depth - 1; i >= 0; i--) {
+        if (path->tnodes[i] == tnode) {
+            return path->versions[i];
+        }
+    }
+
+    TTREE_ASSERT(0);
+    return 0;
+}
+
+/*
+ * Everything a reader has seen is consistent if none of the
+ * nodes on its path was changed since reader visited it.
+ */
+static __inline bool path_is_valid(struct tnode_path *path)
+{
+    int i;
+
+    if (path->depth > TTREE_MAX_PATH) {
+        return false;
+    }
+
+    TTREE_FENCE_ACQUIRE();
+    for (i = 0; i < path->depth; i++) {
+        if (TTREE_LOAD_RELAXED(&path->tnodes[i]->version) !=
+            path->versions[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The root pointer isn't covered by versions, but a node may stop
+ * being the root only when its parent is changed. So a path which
+ * started at the root is valid if its first node is still parentless.
+ */
+static __inline bool path_from_root_is_valid(struct tnode_path *path)
+{
+    if ((path->depth > 0) && (path->depth <= TTREE_MAX_PATH) &&
+        TTREE_LOAD_RELAXED(&path->tnodes[0]->parent)) {
+        return false;
+    }
+
+    return path_is_valid(path);
+}
+
+/* Node modified by current write is freed before the write is over. */
+static void forget_dirty_tnode(Ttree *ttree, TtreeNode *tnode)
+{
+    int i;
+
+    for (i = 0; i < ttree->num_dirty; i++) {
+        if (ttree->dirty[i] == tnode) {
+            ttree->dirty[i] = ttree->dirty[--ttree->num_dirty];
+            return;
+        }
+    }
+}
+
+/*
+ * In concurrent mode readers may still go through a node removed
+ * from the tree, so it's kept until all of them leave current epoch.
+ */
+static __inline void retire_ttree_node(Ttree *ttree, TtreeNode *tnode)
+{
+    int i = ttree->epoch % TTREE_EPOCHS;
+
+    if (!is_concurrent(ttree)) {
+        if (tnode->version & 1) {
+            forget_dirty_tnode(ttree, tnode);
+        }
+
+        free_ttree_node(ttree, tnode);
+        return;
+    }
+
+    tnode_write_begin(ttree, tnode);
+    tnode->successor = ttree->limbo[i];
+    ttree->limbo[i] = tnode;
+}
+
+/*
+ * Gaps of TTREE_GAPPED nodes are marked in a bitmap at the end of
+ * the node, a bit per room. Bits are valid inside the window only:
+ * each write of a room sets or clears its bit.
+ */
+#define tnode_gap_words(num_keys) (((num_keys) + 63) >> 6)
+#define tnode_gap_map(ttree, tnode)                                     \
+    ((uint64_t *)(void *)((char *)(tnode) + (ttree)->tnode_bytes -      \
+                          tnode_gap_words((ttree)->keys_per_tnode) *    \
+                          sizeof(uint64_t)))
+
+static __inline bool tnode_gap_bit(Ttree *ttree, TtreeNode *tnode, int idx)
+{
+    return (tnode_gap_map(ttree, tnode)[idx >> 6] >> (idx & 63)) & 1;
+}
+
+static __inline void tnode_mark_gap(Ttree *ttree, TtreeNode *tnode,
+                                    int idx, bool is_gap)
+{
+    uint64_t *word = &tnode_gap_map(ttree, tnode)[idx >> 6];
+
+    if (is_gap) {
+        *word |= (uint64_t)1 << (idx & 63);
+    }
+    else {
+        *word &= ~((uint64_t)1 << (idx & 63));
+    }
+}
+
+/*
+ * Set a key of a node readers can't see, so that the write isn't
+ * tracked. Node builders refresh hot keys of their nodes themselves.
+ */
+static __inline void tnode_fill_key(Ttree *ttree, TtreeNode *tnode,
+                                    int idx, void *key)
+{
+    if (UNLIKELY(is_gapped(ttree))) {
+        tnode_mark_gap(ttree, tnode, idx, false);
+    }
+
+    tnode->keys[idx] = key;
+    if (UNLIKELY(ttree->str_keys)) {
+        strncpy((char *)tnode_inline_key(ttree, tnode, idx),
+                (const char *)str_of_key(ttree, key), ttree->key_width);
+    }
+    else if (ttree->key_width) {
+        memcpy(tnode_inline_key(ttree, tnode, idx), key, ttree->key_width);
+    }
+}
+
+static __inline void tnode_set_key(Ttree *ttree, TtreeNode *tnode,
+                                   int idx, void *key)
+{
+    tnode_write_begin(ttree, tnode);
+    tnode_fill_key(ttree, tnode, idx, key);
+}
+
+/*
+ * Move @num keys (together with their inline copies) from
+ * @src node starting at @sidx to @dst node starting at @didx.
+ * Source and destination ranges may overlap.
+ */
+static __inline void tnode_move_keys(Ttree *ttree, TtreeNode *dst, int didx,
+                                     TtreeNode *src, int sidx, int num)
+{
+    int i;
+
+    if (num <= 0) {
+        return;
+    }
+
+    tnode_write_begin(ttree, dst);
+    memmove(dst->keys + didx, src->keys + sidx, sizeof(void *) * num);
+    if (ttree->key_width) {
+        memmove(tnode_inline_key(ttree, dst, didx),
+                tnode_inline_key(ttree, src, sidx), ttree->key_width * num);
+    }
+    if (UNLIKELY(is_gapped(ttree))) {
+        /* Gap bits go along, in the order memmove would copy them. */
+        if ((dst != src) || (didx < sidx)) {
+            for (i = 0; i < num; i++) {
+                tnode_mark_gap(ttree, dst, didx + i,
+                               tnode_gap_bit(ttree, src, sidx + i));
+            }
+        }
+        else {
+            for (i = num - 1; i >= 0; i--) {
+                tnode_mark_gap(ttree, dst, didx + i,
+                               tnode_gap_bit(ttree, src, sidx + i));
+            }
+        }
+    }
+}
+
+/*
+ * A gap of a TTREE_GAPPED node holds a copy of the key before it, so the
+ * window stays sorted. It's told from a duplicate of that key by its bit
+ * in the gap bitmap. Edges of the window are never gaps.
+ */
+#define tnode_is_gap(ttree, tnode, idx)                                 \
+    (is_gapped(ttree) && ((idx) > (tnode)->min_idx) &&                  \
+     tnode_gap_bit(ttree, tnode, idx))
+
+/* Turn the room at @idx into a gap after the key before it. */
+static __inline void tnode_fill_gap(Ttree *ttree, TtreeNode *tnode, int idx)
+{
+    tnode_fill_key(ttree, tnode, idx, tnode->keys[idx - 1]);
+    tnode_mark_gap(ttree, tnode, idx, true);
+}
+
+#define tnode_num_items(ttree, tnode)                                   \
+    (tnode_num_keys(tnode) - (is_gapped(ttree) ? (int)(tnode)->num_gaps : 0))
+
+/* A gapped node with the whole array taken still has room in its gaps */
+#define tnode_has_room(ttree, tnode)                                    \
+    (!tnode_is_full(ttree, tnode) || (is_gapped(ttree) && (tnode)->num_gaps))
+
+#define tnode_for_each_key(ttree, tnode, iter)                          \
+    tnode_for_each_index(tnode, iter)                                   \
+        if (tnode_is_gap(ttree, tnode, iter)) {} else
+
+/*
+ * The minimum or the maximum key was just taken out of a gapped node.
+ * Gaps holding its copies go away together with it.
+ */
+static __inline void tnode_trim_min(Ttree *ttree, TtreeNode *tnode)
+{
+    while (is_gapped(ttree) && (tnode->min_idx <= tnode->max_idx) &&
+           tnode_gap_bit(ttree, tnode, tnode->min_idx)) {
+        tnode->min_idx++;
+        tnode->num_gaps--;
+    }
+}
+
+static __inline void tnode_trim_max(Ttree *ttree, TtreeNode *tnode)
+{
+    while (tnode_is_gap(ttree, tnode, tnode->max_idx)) {
+        tnode->max_idx--;
+        tnode->num_gaps--;
+    }
+}
+
+/*
+ * Length of the slice of keys without gaps which starts at @idx and
+ * ends before @end. Gaps at @idx are skipped first.
+ */
+static __inline int tnode_key_run(Ttree *ttree, TtreeNode *tnode,
+                                  int *idx, int end)
+{
+    int i;
+
+    if (LIKELY(!is_gapped(ttree))) {
+        return end - *idx;
+    }
+    for (; (*idx < end) && tnode_is_gap(ttree, tnode, *idx); (*idx)++);
+    for (i = *idx; (i < end) && ((i == *idx) ||
+                                 !tnode_is_gap(ttree, tnode, i)); i++);
+    return i - *idx;
+}
+
+/* Replace the key at @idx together with its copies in the gaps after it */
+static void tnode_replace_key(Ttree *ttree, TtreeNode *tnode, int idx,
+                              void *key)
+{
+    int i;
+
+    tnode_set_key(ttree, tnode, idx, key);
+    for (i = idx + 1; (i <= tnode->max_idx) &&
+             tnode_is_gap(ttree, tnode, i); i++) {
+        tnode_fill_gap(ttree, tnode, i);
+    }
+}
+
+/* Number of gaps before the @j'th of @num keys spread by tnode_spread */
+#define spread_gaps_before(j, num, gaps)                \
+    (((num) > 1) ? ((j) * (gaps)) / ((num) - 1) : 0)
+
+/*
+ * Lay keys of a gapped node out anew with @gaps gaps spread evenly
+ * among them (none squeezes the node), the window being in the middle
+ * of the array. The keys are squeezed to the end of the array first,
+ * so the following spreading moves each of them only towards the start.
+ * @idx is a position in the node, it follows the key it points to.
+ */
+static void tnode_spread(Ttree *ttree, TtreeNode *tnode, int gaps, int *idx)
+{
+    int num = 0, before = 0, dst = ttree->keys_per_tnode;
+    int start, end, min_idx, i, j, k, g;
+
+    TTREE_ASSERT(!tnode_is_empty(tnode));
+    tnode_write_begin(ttree, tnode);
+    for (end = tnode->max_idx; end >= tnode->min_idx; end = start - 1) {
+        for (; tnode_is_gap(ttree, tnode, end); end--);
+        for (start = end; (start > tnode->min_idx) &&
+                 !tnode_is_gap(ttree, tnode, start); start--);
+        start += tnode_is_gap(ttree, tnode, start);
+        num += end - start + 1;
+        dst -= end - start + 1;
+        if (idx && (*idx > start)) {
+            before += ((*idx > end) ? end + 1 : *idx) - start;
+        }
+        if (dst != start) {
+            TTREE_STAT_ADD(ttree, moved_keys, end - start + 1);
+            tnode_move_keys(ttree, tnode, dst, tnode, start, end - start + 1);
+        }
+    }
+
+    TTREE_ASSERT(gaps < num);
+    min_idx = (ttree->keys_per_tnode - num - gaps) >> 1;
+    for (j = 0; j < num; j = k) {
+        g = spread_gaps_before(j, num, gaps);
+        for (k = j + 1; (k < num) && (spread_gaps_before(k, num, gaps) == g);
+             k++);
+        TTREE_STAT_ADD(ttree, moved_keys, k - j);
+        tnode_move_keys(ttree, tnode, min_idx + j + g, tnode, dst + j, k - j);
+        if (k < num) {
+            for (i = min_idx + k + g;
+                 i < min_idx + k + spread_gaps_before(k, num, gaps); i++) {
+                tnode_fill_gap(ttree, tnode, i);
+            }
+        }
+    }
+    if (idx) {
+        *idx = (before < num) ?
+            min_idx + before + spread_gaps_before(before, num, gaps) :
+            min_idx + num + gaps;
+    }
+
+    tnode->min_idx = min_idx;
+    tnode->max_idx = min_idx + num + gaps - 1;
+    tnode->num_gaps = gaps;
+}
+
+#define has_order_stats(ttree)                  \
+    ((ttree)->flags & TTREE_ORDER_STATS)
+
+#define subtree_count(ttree, tnode)                     \
+    ((tnode) ? tnode_count(ttree, tnode) : 0)
+
+/*
+ * Recalculate subtree items counter of a node from
+ * counters of its children.
+ */
+static __inline void tnode_update_count(Ttree *ttree, TtreeNode *tnode)
+{
+    if (has_order_stats(ttree)) {
+        tnode_count(ttree, tnode) = tnode_num_keys(tnode) +
+            subtree_count(ttree, tnode_link(ttree, tnode, left)) +
+            subtree_count(ttree, tnode_link(ttree, tnode, right));
+    }
+}
+
+/*
+ * Number of keys in @tnode was changed by @delta.
+ * Fix counters of the node and all its ancestors.
+ */
+static __inline void tnode_count_add(Ttree *ttree, TtreeNode *tnode,
+                                     long delta)
+{
+    if (has_order_stats(ttree)) {
+        for (; tnode; tnode = tnode_link(ttree, tnode, parent)) {
+            tnode_count(ttree, tnode) += delta;
+        }
+    }
+}
+
+/*
+ * T*-tree node contains keys in a sorted order. Thus binary search
+ * is used for internal lookup.
+ */
+static void *lookup_inside_tnode(Ttree *ttree, TtreeNode *tnode,
+                                 struct tnode_lookup *tnl, int *out_idx)
+{
+    int floor, ceil, mid, cmp_res;
+
+    floor = tnl->low_bound;
+    ceil = tnl->high_bound;
+    TTREE_ASSERT((floor >= 0) && (ceil < ttree->keys_per_tnode));
+    while (floor <= ceil) {
+        mid = (floor + ceil) >> 1;
+        cmp_res = tnode_cmp(ttree, tnl->key, tnode, mid);
+        TTREE_STAT_INC(tnl->cmps);
+        if (cmp_res < 0)
+            ceil = mid - 1;
+        else if (cmp_res > 0)
+            floor = mid + 1;
+        else {
+            /* A gap is found as its key, which is before it. */
+            while (UNLIKELY(tnode_is_gap(ttree, tnode, mid))) {
+                mid--;
+            }
+
+            *out_idx = mid;
+            return ttree_key2item(ttree, tnode->keys[mid]);
+        }
+    }
+
+    /*
+     * If a key position is not found, save an index of the position
+     * where key may be placed to.
+     */
+    *out_idx = floor;
+    return NULL;
+}
+
+/*
+ * Typed search inside a node. Vectorized kernel counts keys
+ * less than the search one, so the result is the position
+ * of the first key that is greater or equal to the search key.
+ */
+static TTREE_ALWAYS_INLINE void *
+lookup_inside_tnode_kind(Ttree *ttree, TtreeNode *tnode,
+                         struct tnode_lookup *tnl, int *out_idx,
+                         enum lookup_kind kind)
+{
+    int num = tnl->high_bound - tnl->low_bound + 1, idx = 0;
+    void *keys = tnode_inline_key(ttree, tnode, tnl->low_bound);
+
+    if (kind == LOOKUP_GENERIC) {
+        return lookup_inside_tnode(ttree, tnode, tnl, out_idx);
+    }
+    if (num > 0) {
+        /* SIMD kernels compare the key with every key in range. */
+#ifdef TTREE_STATS
+        tnl->cmps += num;
+#endif /* TTREE_STATS */
+        switch (kind) {
+            case LOOKUP_U32:
+                idx = ttree_rank_u32(keys, num, *(uint32_t *)tnl->key);
+                break;
+            case LOOKUP_U64:
+                idx = ttree_rank_u64(keys, num, *(uint64_t *)tnl->key);
+                break;
+            case LOOKUP_I64:
+                idx = ttree_rank_i64(keys, num, *(int64_t *)tnl->key);
+                break;
+            default:
+                TTREE_ASSERT(0);
+        }
+    }
+
+    *out_idx = idx += tnl->low_bound;
+    if ((idx <= tnl->high_bound) &&
+        !memcmp(tnode_inline_key(ttree, tnode, idx),
+                tnl->key, ttree->key_width)) {
+        return ttree_key2item(ttree, tnode->keys[idx]);
+    }
+
+    return NULL;
+}
+
+/* Key of the minimum item a node is compared with by a descent. */
+static TTREE_ALWAYS_INLINE void *tnode_cmp_min(Ttree *ttree, TtreeNode *tnode)
+{
+    if (has_hot_keys(ttree)) {
+        return ttree->key_width ?
+            tnode_hot_key(tnode) : *(void **)tnode_hot_key(tnode);
+    }
+
+    return tnode_cmp_key(ttree, tnode, tnode_min_idx(tnode));
+}
+
+static TTREE_ALWAYS_INLINE int tnode_cmp_with_min(Ttree *ttree, void *key,
+                                                  TtreeNode *tnode)
+{
+    if (has_hot_keys(ttree)) {
+        return ttree->cmp_func(key, tnode_cmp_min(ttree, tnode));
+    }
+
+    return tnode_cmp(ttree, key, tnode, tnode_min_idx(tnode));
+}
+
+static TTREE_ALWAYS_INLINE int lookup_cmp(Ttree *ttree, enum lookup_kind kind,
+                                          void *key, TtreeNode *tnode, int idx)
+{
+    void *tkey;
+
+    if (kind == LOOKUP_GENERIC) {
+        return (idx == tnode_min_idx(tnode)) ?
+            tnode_cmp_with_min(ttree, key, tnode) :
+            tnode_cmp(ttree, key, tnode, idx);
+    }
+
+    tkey = (has_hot_keys(ttree) && (idx == tnode_min_idx(tnode))) ?
+        tnode_hot_key(tnode) : tnode_inline_key(ttree, tnode, idx);
+    switch (kind) {
+        case LOOKUP_U32:
+            return cmp_numbers(*(uint32_t *)key, *(uint32_t *)tkey);
+        case LOOKUP_U64:
+            return cmp_numbers(*(uint64_t *)key, *(uint64_t *)tkey);
+        default:
+            return cmp_numbers(*(int64_t *)key, *(int64_t *)tkey);
+    }
+}
+
+/*
+ * Keys of a node fill a window of its array, free rooms are on both
+ * sides of it. A gap for a new key is opened by moving the keys on
+ * the side which has fewer of them, provided that side has a free room.
+ * If only the side holding the most of the window has rooms, the whole
+ * window is moved to the middle of them first: it costs about the same
+ * as moving that side once, but insertions near the edge of the window
+ * become cheap again. Sequential insertions don't pay for moving
+ * the whole window each time this way.
+ */
+static __inline void move_tnode_window(Ttree *ttree, TtreeNode *tnode,
+                                       int shift, int *idx)
+{
+    TTREE_STAT_ADD(ttree, moved_keys, tnode_num_keys(tnode));
+    tnode_move_keys(ttree, tnode, tnode->min_idx + shift, tnode,
+                    tnode->min_idx, tnode_num_keys(tnode));
+    tnode->min_idx += shift;
+    tnode->max_idx += shift;
+    *idx += shift;
+}
+
+static __inline void increase_tnode_window(Ttree *ttree,
+                                           TtreeNode *tnode, int *idx)
+{
+    int room_left = tnode->min_idx;
+    int room_right = ttree->keys_per_tnode - 1 - tnode->max_idx;
+    int num_left = *idx - tnode->min_idx;
+    int num_right = tnode->max_idx - *idx + 1;
+
+    tnode_write_begin(ttree, tnode);
+    if (!room_right && (num_right < num_left) && (room_left > 1)) {
+        move_tnode_window(ttree, tnode, -((room_left + 1) >> 1), idx);
+        room_right = (room_left + 1) >> 1;
+    }
+    else if (!room_left && (num_left < num_right) && (room_right > 1)) {
+        move_tnode_window(ttree, tnode, (room_right + 1) >> 1, idx);
+        room_left = (room_right + 1) >> 1;
+    }
+    if (room_right && (!room_left || (num_right <= num_left))) {
+        TTREE_STAT_ADD(ttree, moved_keys, tnode->max_idx - *idx + 1);
+        tnode_move_keys(ttree, tnode, *idx + 1, tnode, *idx,
+                        tnode->max_idx - *idx + 1);
+        tnode->max_idx++;
+    }
+    else {
+        *idx -= 1;
+        tnode->min_idx--;
+        TTREE_STAT_ADD(ttree, moved_keys, *idx - tnode->min_idx);
+        tnode_move_keys(ttree, tnode, tnode->min_idx, tnode,
+                        tnode->min_idx + 1, *idx - tnode->min_idx);
+    }
+}
+
+/* The gap of a removed key is closed by moving the shorter side. */
+static __inline void decrease_tnode_window(Ttree *ttree,
+                                         TtreeNode *tnode, int *idx)
+{
+    tnode_write_begin(ttree, tnode);
+    if (tnode->max_idx - *idx <= *idx - tnode->min_idx) {
+        tnode->max_idx--;
+        TTREE_STAT_ADD(ttree, moved_keys, tnode->max_idx - *idx + 1);
+        tnode_move_keys(ttree, tnode, *idx, tnode, *idx + 1,
+                        tnode->max_idx - *idx + 1);
+    }
+    else {
+        TTREE_STAT_ADD(ttree, moved_keys, *idx - tnode->min_idx);
+        tnode_move_keys(ttree, tnode, tnode->min_idx + 1, tnode,
+                        tnode->min_idx, *idx - tnode->min_idx);
+        tnode->min_idx++;
+        *idx = *idx + 1;
+    }
+}
+
+/*
+ * Gapped nodes spread their keys leaving a gap after every
+ * TNODE_GAP_STRIDE keys once an insertion would move more than
+ * TNODE_SPREAD_MOVES keys. Spreading moves about twice the keys of
+ * a node, it pays off over the insertions filling the gaps cheaply.
+ */
+#define TNODE_GAP_STRIDE   4
+#define TNODE_SPREAD_MOVES 16
+
+/* Number of keys increase_tnode_window moves to open a room at @idx */
+static int window_moves(Ttree *ttree, TtreeNode *tnode, int idx)
+{
+    int room_left = tnode->min_idx;
+    int room_right = ttree->keys_per_tnode - 1 - tnode->max_idx;
+    int num_left = idx - tnode->min_idx;
+    int num_right = tnode->max_idx - idx + 1;
+
+    if (!room_left && !room_right) {
+        return INT_MAX;
+    }
+    if ((!room_right && (num_right < num_left) && (room_left > 1)) ||
+        (!room_left && (num_left < num_right) && (room_right > 1))) {
+        return tnode_num_keys(tnode) +
+            ((num_left < num_right) ? num_left : num_right);
+    }
+
+    return (room_right && (!room_left || (num_right <= num_left))) ?
+        num_right : num_left;
+}
+
+/* The nearest gap to @idx closer than @limit keys to move, -1 if none */
+static int find_gap(Ttree *ttree, TtreeNode *tnode, int idx, int limit)
+{
+    int d;
+
+    for (d = 0; (d < limit) && ((idx - 1 - d > tnode->min_idx) ||
+                                (idx + d <= tnode->max_idx)); d++) {
+        if (tnode_is_gap(ttree, tnode, idx - 1 - d)) {
+            return idx - 1 - d;
+        }
+        if ((idx + d <= tnode->max_idx) &&
+            tnode_is_gap(ttree, tnode, idx + d)) {
+            return idx + d;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Put @key before the key at @idx of a gapped node. Keys between @idx
+ * and the nearest gap are moved into it, unless opening a room at
+ * the edge of the window is cheaper. If both of them move too many
+ * keys, the node is spread first.
+ */
+static void insert_gapped(Ttree *ttree, TtreeNode *tnode, int *idx,
+                          void *key, bool may_spread)
+{
+    int moves = window_moves(ttree, tnode, *idx), gap, gaps, num;
+
+    TTREE_ASSERT(tnode_has_room(ttree, tnode));
+    gap = find_gap(ttree, tnode, *idx, moves);
+    if (gap >= 0) {
+        moves = (gap < *idx) ? (*idx - 1 - gap) : (gap - *idx);
+    }
+
+    num = tnode_num_items(ttree, tnode);
+    gaps = (num - 1) / TNODE_GAP_STRIDE;
+    if (gaps > ttree->keys_per_tnode - num) {
+        gaps = ttree->keys_per_tnode - num;
+    }
+    if (may_spread && (moves > TNODE_SPREAD_MOVES) && (gaps > 0)) {
+        tnode_spread(ttree, tnode, gaps, idx);
+        insert_gapped(ttree, tnode, idx, key, false);
+        return;
+    }
+    if (gap < 0) {
+        increase_tnode_window(ttree, tnode, idx);
+    }
+    else {
+        TTREE_STAT_ADD(ttree, moved_keys, moves);
+        if (gap < *idx) {
+            *idx -= 1;
+            tnode_move_keys(ttree, tnode, gap, tnode, gap + 1, moves);
+        }
+        else {
+            tnode_move_keys(ttree, tnode, *idx + 1, tnode, *idx, moves);
+        }
+
+        tnode->num_gaps--;
+    }
+
+    tnode_set_key(ttree, tnode, *idx, key);
+}
+
+static __inline void tnode_insert_key(Ttree *ttree, TtreeNode *tnode,
+                                      int *idx, void *key)
+{
+    if (UNLIKELY(is_gapped(ttree))) {
+        insert_gapped(ttree, tnode, idx, key, true);
+        return;
+    }
+
+    increase_tnode_window(ttree, tnode, idx);
+    tnode_set_key(ttree, tnode, *idx, key);
+}
+
+/*
+ * Remove the key at @idx of a gapped node. A key inside the window
+ * becomes a gap, while a key at an edge shrinks the window together
+ * with the gaps next to it. A node which is more than half gaps is
+ * squeezed. @idx is left at the key which followed the removed one.
+ */
+static void remove_gapped(Ttree *ttree, TtreeNode *tnode, int *idx)
+{
+    int end, i;
+
+    tnode_write_begin(ttree, tnode);
+    for (end = *idx + 1; (end <= tnode->max_idx) &&
+             tnode_is_gap(ttree, tnode, end); end++);
+    if (*idx == tnode->min_idx) {
+        tnode->num_gaps -= end - *idx - 1;
+        tnode->min_idx = end;
+    }
+    else if (end > tnode->max_idx) {
+        tnode->num_gaps -= end - *idx - 1;
+        tnode->max_idx = *idx - 1;
+        tnode_trim_max(ttree, tnode);
+    }
+    else {
+        TTREE_STAT_ADD(ttree, moved_keys, end - *idx);
+        for (i = *idx; i < end; i++) {
+            tnode_fill_gap(ttree, tnode, i);
+        }
+
+        tnode->num_gaps++;
+    }
+
+    *idx = end;
+    if (tnode->num_gaps * 2 > (unsigned int)tnode_num_keys(tnode)) {
+        tnode_spread(ttree, tnode, 0, idx);
+    }
+}
+
+static __inline void tnode_remove_key(Ttree *ttree, TtreeNode *tnode,
+                                      int *idx)
+{
+    if (UNLIKELY(is_gapped(ttree))) {
+        remove_gapped(ttree, tnode, idx);
+        return;
+    }
+
+    decrease_tnode_window(ttree, tnode, idx);
+}
+
+/*
+ * generic single rotation procedrue.
+ * side = TNODE_LEFT  - Right rotation
+ * side = TNODE_RIGHT - Left rotation.
+ * "target" will be set to the new root of rotated subtree.
+ */
+static void __rotate_single(Ttree *ttree, TtreeNode **target, int side)
+{
+    TtreeNode *p, *s, *inner, *parent;
+    int opside = opposite_side(side);
+
+    p = *target;
+    TTREE_ASSERT(p != NULL);
+    s = tnode_link(ttree, p, sides[side]);
+    TTREE_ASSERT(s != NULL);
+    inner = tnode_link(ttree, s, sides[opside]);
+    parent = tnode_link(ttree, p, parent);
+
+    /* Each node which links are changed by the rotation is modified. */
+    tnode_write_begin(ttree, p);
+    tnode_write_begin(ttree, s);
+    if (inner) {
+        tnode_write_begin(ttree, inner);
+    }
+    if (parent) {
+        tnode_write_begin(ttree, parent);
+    }
+
+    tnode_set_side(s, tnode_get_side(p));
+    tnode_set_link(ttree, p, sides[side], inner);
+    tnode_set_link(ttree, s, sides[opside], p);
+    tnode_set_side(p, opside);
+    tnode_set_link(ttree, s, parent, parent);
+    tnode_set_link(ttree, p, parent, s);
+    if (inner) {
+        tnode_set_link(ttree, inner, parent, p);
+        tnode_set_side(inner, side);
+    }
+    if (parent) {
+        if (tnode_link(ttree, parent, sides[side]) == p)
+            tnode_set_link(ttree, parent, sides[side], s);
+        else
+            tnode_set_link(ttree, parent, sides[opside], s);
+    }
+
+    /* P is a child of S now, so its counter goes first. */
+    tnode_update_count(ttree, p);
+    tnode_update_count(ttree, s);
+    *target = s;
+}
+
+/*
+ * There are two cases of single rotation possible:
+ * 1) Right rotation (side = TNODE_LEFT)
+ *         [P]             [L]
+ *        /  \            /  \
+ *      [L]  x1    =>   x2   [P]
+ *     /  \                 /  \
+ *    x2  x3               x3  x1
+ *
+ * 2) Left rotation (side = TNODE_RIHGT)
+ *      [P]                [R]
+ *     /  \               /  \
+ *    x1  [R]      =>   [P]   x2
+ *       /  \          /  \
+ *     x3   x2        x1  x3
+ */
+static void rotate_single(Ttree *ttree, TtreeNode **target, int side)
+{
+    TtreeNode *n;
+
+    TTREE_STAT_ADD(ttree, single_rotations, 1);
+    __rotate_single(ttree, target, side);
+    n = tnode_link(ttree, *target, sides[opposite_side(side)]);
+
+    /*
+     * Recalculate balance factors of nodes after rotation.
+     * Let X was a root node of rotated subtree and Y was its
+     * child. After single rotation Y is new root of subtree and X is its child.
+     * Y node may become either balanced or overweighted to the
+     * same side it was but 1 level less.
+     * X node scales at 1 level down and possibly it has new child, so
+     * its balance should be recalculated too. If it still internal node and
+     * its new parent was not overwaighted to the opposite to X side,
+     * X is overweighted to the opposite to its new parent side, otherwise it's balanced.
+     * If X is either half-leaf or leaf, balance racalculation is obvious.
+     */
+    if (is_internal_node(ttree, n)) {
+        n->bfc = ((*target)->bfc != side2bfc(side)) ? side2bfc(side) : 0;
+    }
+    else {
+        n->bfc = !!tnode_link(ttree, n, right) - !!tnode_link(ttree, n, left);
+    }
+
+    (*target)->bfc += side2bfc(opposite_side(side));
+    TTREE_ASSERT((abs(n->bfc < 2) && (abs((*target)->bfc) < 2)));
+}
+
+/*
+ * There are two possible cases of double rotation:
+ * 1) Left-right rotation: (side == TNODE_LEFT)
+ *      [P]                     [r]
+ *     /  \                    /  \
+ *   [L]  x1                [L]   [P]
+ *  /  \          =>       / \    / \
+ * x2  [r]                x2 x4  x3 x1
+ *    /  \
+ *  x4   x3
+ *
+ * 2) Right-left rotation: (side == TNODE_RIGHT)
+ *      [P]                     [l]
+ *     /  \                    /  \
+ *    x1  [R]               [P]   [R]
+ *       /  \     =>        / \   / \
+ *      [l] x2             x1 x3 x4 x2
+ *     /  \
+ *    x3  x4
+ */
+static void rotate_double(Ttree *ttree, TtreeNode **target, int side)
+{
+    int opside = opposite_side(side);
+    TtreeNode *n = tnode_link(ttree, *target, sides[side]), *c;
+
+    TTREE_STAT_ADD(ttree, double_rotations, 1);
+    __rotate_single(ttree, &n, opside);
+
+    /*
+     * Balance recalculation is very similar to recalculation after
+     * simple single rotation.
+     */
+    c = tnode_link(ttree, n, sides[side]);
+    if (is_internal_node(ttree, c)) {
+        c->bfc = (n->bfc == side2bfc(opside)) ? side2bfc(side) : 0;
+    }
+    else {
+        c->bfc = !!tnode_link(ttree, c, right) - !!tnode_link(ttree, c, left);
+    }
+
+    TTREE_ASSERT(abs(c->bfc) < 2);
+    n = tnode_link(ttree, n, parent);
+    __rotate_single(ttree, target, side);
+    if (is_internal_node(ttree, n)) {
+        n->bfc = ((*target)->bfc == side2bfc(side)) ? side2bfc(opside) : 0;
+    }
+    else {
+        n->bfc = !!tnode_link(ttree, n, right) - !!tnode_link(ttree, n, left);
+    }
+
+    /*
+     * new root node of subtree is always ideally balanced
+     * after double rotation.
+     */
+    TTREE_ASSERT(abs(n->bfc) < 2);
+    (*target)->bfc = 0;
+}
+
+static void rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
+{
+    int lh = left_heavy(*node);
+    int sum = abs((*node)->bfc +
+                  tnode_link(ttree, *node, sides[opposite_side(lh)])->bfc);
+    TtreeNode *l, *r;
+
+    if (sum >= 2) {
+        rotate_single(ttree, node, opposite_side(lh));
+        goto out;
+    }
+
+    rotate_double(ttree, node, opposite_side(lh));
+
+    /*
+     * T-tree rotation rules difference from AVL rules in only one aspect.
+     * After double rotation is done and a leaf became a new root node of
+     * subtree and both its left and right childs are half-leafs.
+     * If the new root node contains only one item, N - 1 items should
+     * be moved into it from one of its childs.
+     * (N is a number of items in selected child node).
+     */
+    l = tnode_link(ttree, *node, left);
+    r = tnode_link(ttree, *node, right);
+    if ((tnode_num_keys(*node) == 1) &&
+        is_half_leaf(ttree, l) && is_half_leaf(ttree, r)) {
+        TtreeNode *n;
+        int offs, nkeys;
+
+        tnode_write_begin(ttree, l);
+        tnode_write_begin(ttree, r);
+        if (is_gapped(ttree)) {
+            /* Keys are moved out of a child in blocks, gaps can't be */
+            tnode_spread(ttree, l, 0, (cursor && (cursor->tnode == l)) ?
+                         &cursor->idx : NULL);
+            tnode_spread(ttree, r, 0, (cursor && (cursor->tnode == r)) ?
+                         &cursor->idx : NULL);
+        }
+
+        /*
+         * If right child contains more items than left, they will be moved
+         * from the right child. Otherwise from the left one.
+         */
+        if (tnode_num_keys(r) >= tnode_num_keys(l)) {
+            /*
+             * Right child was selected. So first N - 1 items will be copied
+             * and inserted after parent's first item.
+             */
+            n = r;
+            nkeys = tnode_num_keys(n);
+            tnode_move_keys(ttree, *node, 0, *node, (*node)->min_idx, 1);
+            offs = 1;
+            (*node)->min_idx = 0;
+            (*node)->max_idx = nkeys - 1;
+            if (!cursor) {
+                goto no_cursor;
+            }
+            else if (cursor->tnode == n) {
+                if (cursor->idx < n->max_idx) {
+                    cursor->tnode = *node;
+                    cursor->idx = (*node)->min_idx +
+                        (cursor->idx - n->min_idx + 1);
+                }
+                else {
+                    cursor->idx = first_tnode_idx(ttree);
+                }
+            }
+        }
+        else {
+            /*
+             * Left child was selected. So its N - 1 items
+             * (starting after the min one)
+             * will be copied and inserted before parent's single item.
+             */
+            n = l;
+            nkeys = tnode_num_keys(n);
+            tnode_move_keys(ttree, *node, ttree->keys_per_tnode - 1,
+                            *node, (*node)->min_idx, 1);
+            (*node)->min_idx = offs = ttree->keys_per_tnode - nkeys;
+            (*node)->max_idx = ttree->keys_per_tnode - 1;
+
+            /* The minimum item stays in the child, the rest are moved. */
+            n->max_idx = n->min_idx++;
+            if (!cursor) {
+                goto no_cursor;
+            }
+            else if (cursor->tnode == n) {
+                if (cursor->idx >= n->min_idx) {
+                    cursor->tnode = *node;
+                    cursor->idx = (*node)->min_idx + (cursor->idx - n->min_idx);
+                }
+                else {
+                    cursor->idx = first_tnode_idx(ttree);
+                }
+            }
+        }
+
+no_cursor:
+        tnode_move_keys(ttree, *node, offs, n, n->min_idx, nkeys - 1);
+        tnode_move_keys(ttree, n, first_tnode_idx(ttree), n, n->max_idx, 1);
+        n->min_idx = n->max_idx = first_tnode_idx(ttree);
+        tnode_update_count(ttree, n);
+        tnode_update_count(ttree, *node);
+    }
+
+out:
+    if (tnode_link(ttree, ttree->root, parent)) {
+        ttree->root = *node;
+    }
+}
+
+/*
+ * Link nodes @nodes[lo..hi) into a perfectly balanced subtree.
+ * Nodes are expected to be in key order, the middle one becomes the
+ * root of the subtree. Since sizes of left and right halves differ
+ * by at most one node, their heights differ by at most one as well,
+ * so balance factors are set without any rotations.
+ * Returns the root of the subtree and its height in @height.
+ */
+static TtreeNode *link_balanced(Ttree *ttree, TtreeNode **nodes,
+                                size_t lo, size_t hi, TtreeNode *parent,
+                                int side, int *height)
+{
+    TtreeNode *tnode;
+    size_t mid;
+    int lh, rh;
+
+    if (lo >= hi) {
+        *height = 0;
+        return NULL;
+    }
+
+    mid = lo + ((hi - lo) >> 1);
+    tnode = nodes[mid];
+    snapshot_preserve(ttree, tnode);
+    tnode_set_link(ttree, tnode, parent, parent);
+    tnode_set_side(tnode, side);
+    tnode_set_link(ttree, tnode, left,
+                   link_balanced(ttree, nodes, lo, mid, tnode,
+                                 TNODE_LEFT, &lh));
+    tnode_set_link(ttree, tnode, right,
+                   link_balanced(ttree, nodes, mid + 1, hi, tnode,
+                                 TNODE_RIGHT, &rh));
+    tnode->bfc = rh - lh;
+    tnode_update_count(ttree, tnode);
+    *height = ((lh > rh) ? lh : rh) + 1;
+    return tnode;
+}
+
+/*
+ * Make a balanced tree from @num nodes ordered by key.
+ * In-order successor of each node is simply the next node in the array.
+ */
+static void relink_tree(Ttree *ttree, TtreeNode **nodes, size_t num)
+{
+    TtreeNode *root;
+    size_t i;
+    int height;
+
+    root = link_balanced(ttree, nodes, 0, num, NULL, TNODE_ROOT, &height);
+    for (i = 0; i < num; i++) {
+        tnode_set_link(ttree, nodes[i], successor,
+                       (i + 1 < num) ? nodes[i + 1] : NULL);
+    }
+
+    TTREE_FENCE_RELEASE(); /* publish initialized nodes to readers */
+    ttree->root = root;
+}
+
+/*
+ * Relaxed trees are balanced the way scapegoat trees are. A node
+ * of a tree with N nodes whose depth exceeds log(N) base 3/2 must
+ * have an ancestor X one of whose subtrees holds more than 2/3 of
+ * the nodes of X. Such an ancestor is looked for only when a new
+ * node goes that deep, and its subtree is relinked into a perfectly
+ * balanced one. Since a node holds at least one item, the number of
+ * items limits the number of nodes, and the depth limit is derived
+ * from it.
+ */
+static int relaxed_depth_limit(Ttree *ttree)
+{
+    size_t n = 1;
+    int depth = 0;
+
+    while (n < ttree->num_items) {
+        n += (n + 1) >> 1;
+        depth++;
+    }
+
+    return depth;
+}
+
+static size_t subtree_num_tnodes(Ttree *ttree, TtreeNode *tnode)
+{
+    if (!tnode) {
+        return 0;
+    }
+
+    return subtree_num_tnodes(ttree, tnode_link(ttree, tnode, left)) + 1 +
+        subtree_num_tnodes(ttree, tnode_link(ttree, tnode, right));
+}
+
+/*
+ * Relink the subtree of @top having @num nodes into a balanced one.
+ * The order of the nodes is kept, so successors need no fixing.
+ */
+static int rebuild_subtree(Ttree *ttree, TtreeNode *top, size_t num)
+{
+    TtreeNode **nodes, *parent = tnode_link(ttree, top, parent), *tnode;
+    int side = tnode_get_side(top), height;
+    size_t i;
+
+    nodes = malloc(sizeof(*nodes) * num);
+    if (!nodes) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    tnode = tnode_leftmost(ttree, top);
+    for (i = 0; i < num; i++) {
+        nodes[i] = tnode;
+        tnode = tnode_link(ttree, tnode, successor);
+    }
+
+    TTREE_STAT_ADD(ttree, rebuilds, 1);
+    tnode = link_balanced(ttree, nodes, 0, num, parent, side, &height);
+    if (parent) {
+        snapshot_preserve(ttree, parent);
+        tnode_set_link(ttree, parent, sides[side], tnode);
+    }
+    else {
+        ttree->root = tnode;
+    }
+
+    free(nodes);
+    return 0;
+}
+
+static void relaxed_fixup(Ttree *ttree, TtreeNode *n)
+{
+    TtreeNode *node, *parent;
+    size_t size, total;
+    int depth = 0;
+
+    for (node = n; (node = tnode_link(ttree, node, parent)); ) {
+        depth++;
+    }
+    if (depth <= relaxed_depth_limit(ttree)) {
+        return;
+    }
+
+    /*
+     * If the subtree can't be rebuilt now, it's tried again
+     * by the next insertion going too deep.
+     */
+    for (size = 1, node = n; (parent = tnode_link(ttree, node, parent));
+         node = parent) {
+        int side = opposite_side(tnode_get_side(node));
+        TtreeNode *sibling = tnode_link(ttree, parent, sides[side]);
+
+        total = size + 1 + subtree_num_tnodes(ttree, sibling);
+        if (3 * size > 2 * total) {
+            rebuild_subtree(ttree, parent, total);
+            return;
+        }
+
+        size = total;
+    }
+}
+
+static __inline void __add_successor(Ttree *ttree, TtreeNode *n)
+{
+    TtreeNode *parent = tnode_link(ttree, n, parent);
+
+    /*
+     * After new leaf node was added, its successor should be
+     * fixed. Also it(successor) could became a successor of the node
+     * higher than the given one.
+     * There are several possible cases of such situation:
+     * 1) If new node is added as a right child, it inherites
+     *    successor of its parent. And it itself becomes a successor
+     *    of its parent.
+     * 2) If it is a left child, its parent will be the successor.
+     * 2.1) If parent itself is a right child, then newly added node becomes
+     *      the successor of parent's parent.
+     * 2.2) Otherwise it becomes a successor of one of nodes located higher.
+     *      In this case, we should browse up the tree starting from
+     *      parent's parent. One of the nodes on the path *may* have a successor
+     *      equals to parent of a newly added node. If such node will be found,
+     *      its successor should be changed to a newly added node.
+     */
+    tnode_write_begin(ttree, n); /* it's already visible to readers */
+    if (tnode_get_side(n) == TNODE_RIGHT) {
+        tnode_set_link(ttree, n, successor,
+                       tnode_link(ttree, parent, successor));
+        tnode_write_begin(ttree, parent);
+        tnode_set_link(ttree, parent, successor, n);
+    }
+    else {
+        tnode_set_link(ttree, n, successor, parent);
+        if (tnode_get_side(parent) == TNODE_RIGHT) {
+            tnode_write_begin(ttree, tnode_link(ttree, parent, parent));
+            tnode_set_link(ttree, tnode_link(ttree, parent, parent),
+                           successor, n);
+        }
+        else if (tnode_get_side(parent) == TNODE_LEFT) {
+            register TtreeNode *node;
+
+            for (node = tnode_link(ttree, parent, parent); node;
+                 node = tnode_link(ttree, node, parent)) {
+                if (tnode_link(ttree, node, successor) == parent) {
+                    tnode_write_begin(ttree, node);
+                    tnode_set_link(ttree, node, successor, n);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static __inline void __remove_successor(Ttree *ttree, TtreeNode *n)
+{
+    TtreeNode *parent = tnode_link(ttree, n, parent);
+
+    /*
+     * Node removing could affect the successor of one of nodes
+     * with higher level, so it should be fixed.
+     * Since T*-tree node deletion algorithm
+     * assumes that ony leafs are removed, successor fixing
+     * is opposite to successor adding algorithm.
+     */
+    if (tnode_get_side(n) == TNODE_RIGHT) {
+        tnode_write_begin(ttree, parent);
+        tnode_set_link(ttree, parent, successor,
+                       tnode_link(ttree, n, successor));
+    }
+    else if (tnode_get_side(parent) == TNODE_RIGHT) {
+        tnode_write_begin(ttree, tnode_link(ttree, parent, parent));
+        tnode_set_link(ttree, tnode_link(ttree, parent, parent),
+                       successor, parent);
+    }
+    else {
+        register TtreeNode *node = n;
+
+        while ((node = tnode_link(ttree, node, parent))) {
+            if (tnode_link(ttree, node, successor) == n) {
+                tnode_write_begin(ttree, node);
+                tnode_set_link(ttree, node, successor, parent);
+                break;
+            }
+        }
+    }
+}
+
+static void fixup_after_insertion(Ttree *ttree, TtreeNode *n,
+                                  TtreeCursor *cursor)
+{
+    int bfc_delta = get_bfc_delta(n);
+    TtreeNode *node = n;
+
+    __add_successor(ttree, n);
+    if (UNLIKELY(is_relaxed(ttree))) {
+        relaxed_fixup(ttree, n);
+        return;
+    }
+
+    /* check tree for balance after new node was added. */
+    while ((node = tnode_link(ttree, node, parent))) {
+        node->bfc += bfc_delta;
+        /*
+         * if node becomes balanced, tree balance is ok,
+         * so process may be stopped here
+         */
+        if (!node->bfc) {
+            return;
+        }
+        if (subtree_is_unbalanced(node)) {
+            /*
+             * Because of nature of T-tree rebalancing, just inserted item
+             * may change its position in its node and even the node itself.
+             * Thus if T-tree cursor was specified we have to take care of it.
+             */
+            rebalance(ttree, &node, cursor);
+
+            /*
+             * single or double rotation tree becomes balanced
+             * and we can stop here.
+             */
+            return;
+        }
+
+        bfc_delta = get_bfc_delta(node);
+    }
+}
+
+static void fixup_after_deletion(Ttree *ttree, TtreeNode *n,
+                                 TtreeCursor *cursor)
+{
+    TtreeNode *node = tnode_link(ttree, n, parent);
+    int bfc_delta = get_bfc_delta(n);
+
+    __remove_successor(ttree, n);
+    if (UNLIKELY(is_relaxed(ttree))) {
+        return; /* removing a leaf makes no path longer */
+    }
+
+    /*
+     * Unlike balance fixing after insertion,
+     * deletion may require several rotations.
+     */
+    while (node) {
+        node->bfc -= bfc_delta;
+        /*
+         * If node's balance factor was 0 and becomes 1 or -1, we can stop.
+         */
+        if (!(node->bfc + bfc_delta))
+            break;
+
+        bfc_delta = get_bfc_delta(node);
+        if (subtree_is_unbalanced(node)) {
+            TtreeNode *tmp = node;
+
+            rebalance(ttree, &tmp, cursor);
+            /*
+             * If after rotation subtree height is not changed,
+             * proccess should be continued.
+             */
+            if (tmp->bfc)
+                break;
+
+            node = tmp;
+        }
+
+        node = tnode_link(ttree, node, parent);
+    }
+}
+
+/*
+ * Calculate size of nodes and offsets of optional per-node
+ * data placed after keys (and their inline copies).
+ */
+static size_t tnode_layout(int num_keys, size_t key_width,
+                           unsigned int flags, size_t *count_offs)
+{
+    size_t size = sizeof(TtreeNode) +
+        (num_keys - TNODE_ITEMS_MIN) * sizeof(uintptr_t) +
+        num_keys * key_width;
+
+    *count_offs = 0;
+    if (flags & TTREE_ORDER_STATS) {
+        *count_offs = size = align_up(size, sizeof(size_t));
+        size += sizeof(size_t);
+    }
+    if (flags & TTREE_GAPPED) {
+        size = align_up(size, sizeof(uint64_t)) +
+            tnode_gap_words(num_keys) * sizeof(uint64_t);
+    }
+    if (flags & TTREE_CACHE_ALIGNED) {
+        size = align_up(TTREE_HOT_BYTES + size, TTREE_CACHELINE) -
+            TTREE_HOT_BYTES;
+    }
+
+    return size;
+}
+
+static void set_tnode_layout(Ttree *ttree)
+{
+    ttree->tnode_bytes = tnode_layout(ttree->keys_per_tnode, ttree->key_width,
+                                      ttree->flags, &ttree->count_offs);
+    ttree->tnode_hot = (ttree->flags & TTREE_CACHE_ALIGNED) ?
+        TTREE_HOT_BYTES : 0;
+}
+
+int ttree_fit_keys(size_t key_width, unsigned int flags, int num_lines)
+{
+    size_t count_offs, hot, limit;
+    int num_keys = TNODE_ITEMS_MIN;
+
+    hot = (flags & TTREE_CACHE_ALIGNED) ? TTREE_HOT_BYTES : 0;
+    limit = (size_t)num_lines * TTREE_CACHELINE;
+    if ((num_lines < 1) ||
+        (hot + tnode_layout(num_keys, key_width, flags & ~TTREE_CACHE_ALIGNED,
+                            &count_offs) > limit)) {
+        return -1;
+    }
+    while ((num_keys < TNODE_ITEMS_MAX) &&
+           (hot + tnode_layout(num_keys + 1, key_width,
+                               flags & ~TTREE_CACHE_ALIGNED,
+                               &count_offs) <= limit)) {
+        num_keys++;
+    }
+
+    return num_keys;
+}
+
+int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
+                 ttree_cmp_func_fn cmpf, size_t key_offs)
+{
+    return __ttree_init_inline(ttree, num_keys, is_unique,
+                               cmpf, key_offs, 0);
+}
+
+int __ttree_init_inline(Ttree *ttree, int num_keys, bool is_unique,
+                        ttree_cmp_func_fn cmpf, size_t key_offs,
+                        size_t key_width)
+{
+    TTREE_CT_ASSERT((TTREE_DEFAULT_NUMKEYS >= TNODE_ITEMS_MIN) &&
+                    (TTREE_DEFAULT_NUMKEYS <= TNODE_ITEMS_MAX));
+
+    if ((num_keys < TNODE_ITEMS_MIN) ||
+        (num_keys > TNODE_ITEMS_MAX) || !ttree || !cmpf ||
+        (key_width > TTREE_INLINE_KEY_MAX)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree->root = NULL;
+    ttree->keys_per_tnode = num_keys;
+    ttree->cmp_func = cmpf;
+    ttree->key_offs = key_offs;
+    ttree->keys_are_unique = is_unique;
+    ttree->key_width = key_width;
+    ttree->str_keys = 0;
+    memset(&ttree->counters, 0, sizeof(ttree->counters));
+    ttree->allocator = &ttree_malloc_allocator;
+    ttree->alloc_ctx = NULL;
+    memset(&ttree->slab, 0, sizeof(ttree->slab));
+    ttree->flags = 0;
+    ttree->num_items = 0;
+    ttree->dirty = NULL;
+    ttree->num_dirty = 0;
+    ttree->epoch = 1;
+    memset(ttree->limbo, 0, sizeof(ttree->limbo));
+    ttree->readers = NULL;
+    ttree->latch = 0;
+    ttree->snapshot = NULL;
+    set_tnode_layout(ttree);
+
+    return 0;
+}
+
+static int cmp_str_ptrs(void *key1, void *key2)
+{
+    return strcmp(*(const char **)key1, *(const char **)key2);
+}
+
+static int cmp_str_arrays(void *key1, void *key2)
+{
+    return strcmp((const char *)key1, (const char *)key2);
+}
+
+int __ttree_init_str(Ttree *ttree, int num_keys, bool is_unique,
+                     size_t key_offs, size_t prefix_width, int kind)
+{
+    ttree_cmp_func_fn cmpf;
+
+    if ((prefix_width < 1) || (prefix_width > TTREE_INLINE_KEY_MAX) ||
+        ((kind != TTREE_STR_PTR) && (kind != TTREE_STR_ARRAY))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    cmpf = (kind == TTREE_STR_PTR) ? cmp_str_ptrs : cmp_str_arrays;
+    if (__ttree_init_inline(ttree, num_keys, is_unique, cmpf,
+                            key_offs, prefix_width) < 0) {
+        return -1;
+    }
+
+    ttree->str_keys = kind;
+    return 0;
+}
+
+int ttree_set_allocator(Ttree *ttree, const TtreeNodeAllocator *allocator,
+                        void *ctx)
+{
+    if (!ttree || !allocator || !allocator->alloc || !allocator->free ||
+        is_indexed(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    ttree_reclaim(ttree);
+    if (ttree->allocator->release) {
+        ttree->allocator->release(ttree->alloc_ctx);
+    }
+
+    ttree->allocator = allocator;
+    ttree->alloc_ctx = ctx;
+    return 0;
+}
+
+static int alloc_concurrent_state(Ttree *ttree, unsigned int flags)
+{
+    void *readers;
+
+    if (!ttree->dirty) {
+        ttree->dirty = malloc(TTREE_MAX_DIRTY * sizeof(*ttree->dirty));
+        if (!ttree->dirty) {
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+    }
+    if ((flags & TTREE_CONCURRENT) && !ttree->readers) {
+        if (posix_memalign(&readers, TTREE_CACHELINE,
+                           TTREE_MAX_READERS * sizeof(*ttree->readers))) {
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+
+        ttree->readers = readers;
+        memset(ttree->readers, 0,
+               TTREE_MAX_READERS * sizeof(*ttree->readers));
+    }
+
+    return 0;
+}
+
+static void free_concurrent_state(Ttree *ttree)
+{
+    free(ttree->dirty);
+    ttree->dirty = NULL;
+    free(ttree->readers);
+    ttree->readers = NULL;
+}
+
+int ttree_set_flags(Ttree *ttree, unsigned int flags)
+{
+    if (!ttree || (flags & ~TTREE_FLAGS_ALL) ||
+        ((flags & TTREE_CONCURRENT) && !ttree->key_width) ||
+        ((flags & TTREE_MULTI_WRITER) && !(flags & TTREE_CONCURRENT)) ||
+        ((flags & TTREE_RELAXED_BALANCE) && (flags & TTREE_CONCURRENT)) ||
+        ((flags & TTREE_CACHE_ALIGNED) &&
+         (ttree->key_width > TTREE_HOT_KEY_MAX)) ||
+        ((flags & TTREE_GAPPED) &&
+         (flags & (TTREE_CONCURRENT | TTREE_ORDER_STATS |
+                   TTREE_CACHE_ALIGNED))) ||
+        ((flags & TTREE_INDEX_LINKS) &&
+         ((flags & (TTREE_CONCURRENT | TTREE_CACHE_ALIGNED)) ||
+          (ttree->allocator != &slab_allocator) || ttree->slab.page_size ||
+          (sizeof(struct tnode_index_links) > sizeof(ttree->root->sides)))) ||
+        (ttree->str_keys &&
+         (flags & (TTREE_CONCURRENT | TTREE_CACHE_ALIGNED)))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree) || ttree->snapshot) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if ((flags & (TTREE_CONCURRENT | TTREE_CACHE_ALIGNED)) &&
+        (alloc_concurrent_state(ttree, flags) < 0)) {
+        return -1;
+    }
+    if (!(flags & TTREE_CONCURRENT)) {
+        free(ttree->readers);
+        ttree->readers = NULL;
+    }
+    if (!(flags & (TTREE_CONCURRENT | TTREE_CACHE_ALIGNED))) {
+        free_concurrent_state(ttree);
+    }
+
+    /*
+     * Node size may change, so blocks cached by the allocator
+     * can't be reused anymore.
+     */
+    ttree_reclaim(ttree);
+    if (ttree->allocator->release) {
+        ttree->allocator->release(ttree->alloc_ctx);
+    }
+    if ((flags & TTREE_INDEX_LINKS) && (arena_reserve(&ttree->slab) < 0)) {
+        ttree->flags &= ~TTREE_INDEX_LINKS;
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    ttree->flags = flags;
+    set_tnode_layout(ttree);
+    return 0;
+}
+
+int ttree_use_slab(Ttree *ttree, int tnodes_per_chunk)
+{
+    if (!ttree || (tnodes_per_chunk < 0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (ttree_set_allocator(ttree, &slab_allocator, &ttree->slab) < 0) {
+        return -1;
+    }
+
+    memset(&ttree->slab, 0, sizeof(ttree->slab));
+    ttree->slab.tnodes_per_chunk =
+        tnodes_per_chunk ? tnodes_per_chunk : TTREE_SLAB_DEFAULT_TNODES;
+    return 0;
+}
+
+int ttree_use_pages(Ttree *ttree, size_t page_size, int numa_node)
+{
+    if (!ttree || (page_size && (page_size != TTREE_PAGE_2M) &&
+                   (page_size != TTREE_PAGE_1G)) ||
+        (numa_node < TTREE_NUMA_LOCAL) ||
+        (numa_node >= TTREE_NUMA_NODES_MAX)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (ttree_use_slab(ttree, 0) < 0) {
+        return -1;
+    }
+
+    ttree->slab.page_size = page_size ? page_size : TTREE_PAGE_NORMAL;
+    ttree->slab.numa_node = numa_node;
+    return 0;
+}
+
+static void free_snapshot(TtreeSnapshot *snap)
+{
+    size_t i;
+
+    for (i = 0; i <= snap->mask; i++) {
+        free_tnode_copy(snap->ttree, snap->entries[i].copy);
+    }
+
+    free(snap->entries);
+    free(snap);
+}
+
+void ttree_destroy(Ttree *ttree)
+{
+    TtreeNode *tnode, *next;
+    TtreeSnapshot *snap;
+
+    while ((snap = ttree->snapshot)) {
+        ttree->snapshot = snap->older;
+        free_snapshot(snap);
+    }
+
+    /*
+     * If the allocator is able to free all its blocks at once,
+     * there is no need to walk through the tree nodes.
+     */
+    ttree->num_items = 0;
+    if (ttree->allocator->release) {
+        ttree->allocator->release(ttree->alloc_ctx);
+        ttree->root = NULL;
+        memset(ttree->limbo, 0, sizeof(ttree->limbo));
+    }
+    else {
+        ttree_reclaim(ttree);
+        if (ttree->root) {
+            for (tnode = next = tnode_leftmost(ttree, ttree->root); tnode;
+                 tnode = next) {
+                next = tnode_link(ttree, tnode, successor);
+                free_ttree_node(ttree, tnode);
+            }
+        }
+
+        ttree->root = NULL;
+    }
+
+    /* Flags requiring additional state are dropped together with it. */
+    free_concurrent_state(ttree);
+    ttree->flags &= ~(TTREE_CONCURRENT | TTREE_MULTI_WRITER |
+                      TTREE_CACHE_ALIGNED | TTREE_INDEX_LINKS);
+    set_tnode_layout(ttree);
+}
+
+void ttree_reclaim(Ttree *ttree)
+{
+    int i;
+
+    for (i = 0; i < TTREE_EPOCHS; i++) {
+        free_limbo(ttree, i);
+    }
+}
+
+int ttree_reader_register(Ttree *ttree)
+{
+    int i, free_slot;
+
+    if (!ttree || !is_concurrent(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    for (i = 0; i < TTREE_MAX_READERS; i++) {
+        free_slot = 0;
+        if (TTREE_CAS(&ttree->readers[i].in_use, free_slot, 1)) {
+            return i;
+        }
+    }
+
+    SET_ERRNO(EAGAIN);
+    return -1;
+}
+
+void ttree_reader_unregister(Ttree *ttree, int reader)
+{
+    TTREE_ASSERT((reader >= 0) && (reader < TTREE_MAX_READERS));
+    TTREE_STORE_RELEASE(&ttree->readers[reader].epoch, 0);
+    TTREE_STORE_RELEASE(&ttree->readers[reader].in_use, 0);
+}
+
+void ttree_read_enter(Ttree *ttree, int reader)
+{
+    TTREE_ASSERT((reader >= 0) && (reader < TTREE_MAX_READERS));
+
+    /*
+     * Writer has to see the reader inside before the reader
+     * gets any node, hence the full fence.
+     */
+    TTREE_STORE_RELAXED(&ttree->readers[reader].epoch,
+                        TTREE_LOAD_RELAXED(&ttree->epoch));
+    TTREE_FENCE_FULL();
+}
+
+void ttree_read_exit(Ttree *ttree, int reader)
+{
+    TTREE_ASSERT((reader >= 0) && (reader < TTREE_MAX_READERS));
+    TTREE_STORE_RELEASE(&ttree->readers[reader].epoch, 0);
+}
+
+/*
+ * Remember a key the cursor position may be recovered by, if its node
+ * is changed by a writer. Pending cursor keeps the key of the nearest
+ * existing item and the side of the position relative to it.
+ */
+static void cursor_save_position(TtreeCursor *cursor, struct tnode_path *path)
+{
+    TtreeNode *tnode = cursor->tnode;
+    union tnode_word w = tnode_load_word(tnode);
+
+    cursor->version = path_version(path, tnode);
+    cursor->after_key = false;
+    if (cursor->state == CURSOR_OPENED) {
+        cursor->key = tnode_key(tnode, cursor->idx);
+    }
+    else if ((cursor->side == TNODE_LEFT) || (cursor->idx < w.min_idx)) {
+        cursor->key = tnode_key(tnode, w.min_idx);
+    }
+    else if ((cursor->side == TNODE_RIGHT) || (cursor->idx > w.max_idx)) {
+        cursor->key = tnode_key(tnode, w.max_idx);
+        cursor->after_key = true;
+    }
+    else {
+        cursor->key = tnode_key(tnode, cursor->idx);
+    }
+}
+
+static TTREE_ALWAYS_INLINE void *__ttree_lookup(Ttree *ttree, void *key,
+                                                TtreeCursor *cursor,
+                                                enum lookup_kind kind,
+                                                struct tnode_path *path,
+                                                TtreeNode *start)
+{
+    TtreeNode *n, *marked_tn, *target;
+    int side = TNODE_BOUND, cmp_res, idx, depth = 0, cmps = 0;
+    void *item = NULL;
+    enum ttree_cursor_state st = CURSOR_PENDING;
+    union tnode_word w;
+
+    /*
+     * Classical T-tree search algorithm is O(log(2N/M) + log(M - 2))
+     * Where N is total number of items in the tree and M is a number of
+     * items per node. In worst case each node on the path requires 2
+     * comparison(with its min and max items) plus binary search in the last
+     * node(bound node) excluding its first and last items.
+     *
+     * Here is used another approach that was suggested in
+     * "Tobin J. Lehman , Michael J. Carey, A Study of Index Structures for
+     * Main Memory Database Management Systems".
+     * It reduces O(log(2N/M) + log(M - 2)) to true O(log(N)).
+     * This algorithm compares the search
+     * key only with minimum item in each node. If search key is greater,
+     * current node is marked for future consideration.
+     */
+    if (start) {
+        target = n = start;
+    }
+    else {
+        target = n = path ? TTREE_LOAD_ACQUIRE(&ttree->root) : ttree->root;
+    }
+
+    marked_tn = NULL;
+    idx = first_tnode_idx(ttree);
+    if (!n) {
+        goto out;
+    }
+    while (n) {
+        if (UNLIKELY(!path_add(path, n))) {
+            return NULL;
+        }
+
+        /*
+         * Both children are requested before the comparison so that
+         * fetching the next node overlaps with fetching the key.
+         */
+        TTREE_PREFETCH(tnode_load_link(ttree, n, left));
+        TTREE_PREFETCH(tnode_load_link(ttree, n, right));
+        target = n;
+        idx = tnode_min_idx(n);
+        cmp_res = lookup_cmp(ttree, kind, key, n, idx);
+        TTREE_STAT_INC(depth);
+        TTREE_STAT_INC(cmps);
+        if (cmp_res < 0)
+            side = TNODE_LEFT;
+        else if (cmp_res > 0) {
+            marked_tn = n; /* mark current node for future consideration. */
+            side = TNODE_RIGHT;
+        }
+        else { /* ok, key is found, search is completed. */
+            side = TNODE_BOUND;
+            item = ttree_key2item(ttree, tnode_key(n, idx));
+            st = CURSOR_OPENED;
+            goto out;
+        }
+
+        n = tnode_load_link(ttree, n, sides[side]);
+    }
+    idx = first_tnode_idx(ttree);
+    if (marked_tn) {
+        int c;
+
+        w = tnode_load_word(marked_tn);
+        c = lookup_cmp(ttree, kind, key, marked_tn, w.max_idx);
+
+        TTREE_STAT_INC(cmps);
+        if (c <= 0) {
+            side = TNODE_BOUND;
+            target = marked_tn;
+            if (!c) {
+                item = ttree_key2item(ttree, tnode_key(target, w.max_idx));
+                idx = w.max_idx;
+                st = CURSOR_OPENED;
+            }
+            else { /* make internal binary search */
+                struct tnode_lookup tnl;
+
+                tnl.key = key;
+                tnl.low_bound = w.min_idx + 1;
+                tnl.high_bound = w.max_idx - 1;
+                tnl.cmps = 0;
+                item = lookup_inside_tnode_kind(ttree, target, &tnl,
+                                                &idx, kind);
+                cmps += tnl.cmps;
+                st = (item != NULL) ? CURSOR_OPENED : CURSOR_PENDING;
+            }
+
+            goto out;
+        }
+    }
+
+    /*
+     * If we're here, item wasn't found. So the only thing
+     * needs to be done is to determine the position where search key
+     * may be placed to. If target node is not empty, key may be placed
+     * to its min or max positions.
+     */
+    w = tnode_load_word(target);
+    if (((w.max_idx - w.min_idx + 1) != ttree->keys_per_tnode) ||
+        (is_gapped(ttree) && target->num_gaps)) {
+        side = TNODE_BOUND;
+        idx = ((marked_tn != target) || (cmp_res < 0)) ?
+            w.min_idx : (w.max_idx + 1);
+        st = CURSOR_PENDING;
+    }
+
+out:
+    TTREE_STAT_ADD(ttree, lookups, 1);
+    TTREE_STAT_ADD(ttree, lookup_depth, depth);
+    TTREE_STAT_ADD(ttree, lookup_cmps, cmps);
+    if (cursor) {
+        cursor->ttree = ttree;
+        cursor->tnode = target;
+        cursor->side = side;
+        cursor->idx = idx;
+        cursor->state = st;
+        if (path && target) {
+            cursor_save_position(cursor, path);
+        }
+    }
+
+    return item;
+}
+
+static TTREE_ALWAYS_INLINE void *lookup_kind(Ttree *ttree, void *key,
+                                             TtreeCursor *cursor,
+                                             enum lookup_kind kind)
+{
+    struct tnode_path path;
+    void *item;
+
+    if (LIKELY(!is_concurrent(ttree))) {
+        return __ttree_lookup(ttree, key, cursor, kind, NULL, NULL);
+    }
+
+    do {
+        path.depth = 0;
+        item = __ttree_lookup(ttree, key, cursor, kind, &path, NULL);
+    } while (!path_from_root_is_valid(&path));
+
+    return item;
+}
+
+void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
+{
+    return lookup_kind(ttree, key, cursor, LOOKUP_GENERIC);
+}
+
+/*
+ * Key comparisons of the finger search. For a search going to @side
+ * from a node, the "near" key of another node is the one facing the
+ * keys already passed by, the "far" key is the opposite one.
+ */
+#define finger_cmp_near(ttree, key, tnode, side)                        \
+    (((side) == TNODE_LEFT) ?                                           \
+     tnode_cmp(ttree, key, tnode, (tnode)->max_idx) :                   \
+     -tnode_cmp(ttree, key, tnode, (tnode)->min_idx))
+
+#define finger_cmp_far(ttree, key, tnode, side)                         \
+    (((side) == TNODE_LEFT) ?                                           \
+     tnode_cmp(ttree, key, tnode, (tnode)->min_idx) :                   \
+     -tnode_cmp(ttree, key, tnode, (tnode)->max_idx))
+
+/*
+ * Find a node the search of @key may start from instead of the root,
+ * so that it ends exactly where a search from the root does.
+ * It's either a node bounding the key or the lowest node among
+ * @tnode, its neighbour and their ancestors whose subtree covers
+ * the position of the key. Each node bounds its left subtree from
+ * above and its right subtree from below, so climbing stops at
+ * the first ancestor the path comes to from the side facing the key.
+ */
+static TtreeNode *finger_start(Ttree *ttree, TtreeNode *tnode, void *key)
+{
+    TtreeNode *next, *p;
+    int side;
+
+    if (tnode_cmp(ttree, key, tnode, tnode->min_idx) < 0) {
+        side = TNODE_LEFT;
+        next = tnode_glb(ttree, tnode);
+    }
+    else if (tnode_cmp(ttree, key, tnode, tnode->max_idx) > 0) {
+        side = TNODE_RIGHT;
+        next = tnode_link(ttree, tnode, successor);
+    }
+    else {
+        return tnode;
+    }
+
+    /*
+     * The neighbour bounds the key, or the key falls in between and
+     * the node of two having no child towards the other one is the
+     * place of the key.
+     */
+    if (next) {
+        if (finger_cmp_near(ttree, key, next, side) > 0) {
+            return tnode_link(ttree, tnode, sides[side]) ? next : tnode;
+        }
+        if (finger_cmp_far(ttree, key, next, side) >= 0) {
+            return next;
+        }
+
+        tnode = next;
+    }
+    for (; (p = tnode_link(ttree, tnode, parent)); tnode = p) {
+        if (tnode_get_side(tnode) == side) {
+            continue;
+        }
+        if (finger_cmp_near(ttree, key, p, side) > 0) {
+            break;
+        }
+        if (finger_cmp_far(ttree, key, p, side) >= 0) {
+            return p;
+        }
+    }
+
+    return tnode;
+}
+
+/* Check whether an item next to the one under cursor has a key equal to @key */
+static bool cursor_has_equal_neighbour(TtreeCursor *cursor, void *key)
+{
+    TtreeCursor tmp;
+
+    ttree_cursor_copy(&tmp, cursor);
+    if ((ttree_cursor_prev(&tmp) == TCSR_OK) &&
+        !tnode_cmp(cursor->ttree, key, tmp.tnode, tmp.idx)) {
+        return true;
+    }
+
+    ttree_cursor_copy(&tmp, cursor);
+    return (ttree_cursor_next(&tmp) == TCSR_OK) &&
+        !tnode_cmp(cursor->ttree, key, tmp.tnode, tmp.idx);
+}
+
+void *ttree_lookup_from_cursor(TtreeCursor *cursor, void *key)
+{
+    Ttree *ttree = cursor->ttree;
+    void *item;
+
+    TTREE_ASSERT(ttree != NULL);
+    if (UNLIKELY(is_concurrent(ttree)) || !cursor->tnode ||
+        (cursor->state == CURSOR_CLOSED) || !ttree->root) {
+        return ttree_lookup(ttree, key, cursor);
+    }
+
+    item = __ttree_lookup(ttree, key, cursor, LOOKUP_GENERIC, NULL,
+                          finger_start(ttree, cursor->tnode, key));
+
+    /*
+     * Which of equal keys a lookup lands on depends on the path it
+     * comes by, so the search is redone from the root if the key
+     * found has copies next to it.
+     */
+    if (item && !ttree->keys_are_unique &&
+        cursor_has_equal_neighbour(cursor, key)) {
+        return ttree_lookup(ttree, key, cursor);
+    }
+
+    return item;
+}
+
+void *ttree_lookup_u32(Ttree *ttree, uint32_t key, TtreeCursor *cursor)
+{
+    TTREE_ASSERT(ttree->key_width == sizeof(key));
+    return lookup_kind(ttree, &key, cursor, LOOKUP_U32);
+}
+
+void *ttree_lookup_u64(Ttree *ttree, uint64_t key, TtreeCursor *cursor)
+{
+    TTREE_ASSERT(ttree->key_width == sizeof(key));
+    return lookup_kind(ttree, &key, cursor, LOOKUP_U64);
+}
+
+void *ttree_lookup_i64(Ttree *ttree, int64_t key, TtreeCursor *cursor)
+{
+    TTREE_ASSERT(ttree->key_width == sizeof(key));
+    return lookup_kind(ttree, &key, cursor, LOOKUP_I64);
+}
+
+/*
+ * Number of lookups interleaved by ttree_lookup_batch. It should be
+ * large enough to cover memory latency with comparisons of other
+ * lookups, but each lookup state has to stay in registers or L1.
+ */
+#define LOOKUP_BATCH_GROUP 16
+
+static __inline void lookup_step_init(Ttree *ttree, TtreeLookupStep *ls,
+                                      void *key)
+{
+    ls->key = key;
+    ls->tnode = ttree->root;
+    ls->marked_tn = NULL;
+    ls->item = NULL;
+    ls->key_fetched = false;
+}
+
+/*
+ * Make one step of a descent. The node the lookup compares with on
+ * its next step is prefetched. If keys aren't inlined, comparison
+ * requires one more memory access, so it's prefetched on a separate
+ * step. Returns false when the descent is over.
+ */
+static TTREE_ALWAYS_INLINE bool lookup_step(Ttree *ttree, TtreeLookupStep *ls)
+{
+    TtreeNode *tn = ls->tnode;
+    int cmp_res;
+
+    if (!tn) {
+        return false;
+    }
+    if (!ttree->key_width && !ls->key_fetched) {
+        TTREE_PREFETCH(tnode_cmp_min(ttree, tn));
+        ls->key_fetched = true;
+        return true;
+    }
+
+    ls->key_fetched = false;
+    cmp_res = tnode_cmp_with_min(ttree, ls->key, tn);
+    if (cmp_res < 0) {
+        tn = tnode_link(ttree, tn, left);
+    }
+    else if (cmp_res > 0) {
+        ls->marked_tn = tn;
+        tn = tnode_link(ttree, tn, right);
+    }
+    else {
+        ls->item = ttree_key2item(ttree, tnode_key_min(tn));
+        tn = NULL;
+    }
+    if (tn) {
+        TTREE_PREFETCH(tn);
+    }
+
+    ls->tnode = tn;
+    return (tn != NULL);
+}
+
+/*
+ * Finish the lookup after the descent is over:
+ * the same as the tail of __ttree_lookup, but without cursor.
+ */
+static __inline void *lookup_step_finish(Ttree *ttree, TtreeLookupStep *ls)
+{
+    struct tnode_lookup tnl;
+    TtreeNode *tn = ls->marked_tn;
+    int c, idx;
+
+    if (ls->item || !tn) {
+        return ls->item;
+    }
+
+    c = tnode_cmp(ttree, ls->key, tn, tn->max_idx);
+    if (!c) {
+        return ttree_key2item(ttree, tnode_key_max(tn));
+    }
+    else if (c > 0) {
+        return NULL;
+    }
+
+    tnl.key = ls->key;
+    tnl.low_bound = tn->min_idx + 1;
+    tnl.high_bound = tn->max_idx - 1;
+    tnl.cmps = 0;
+    return lookup_inside_tnode(ttree, tn, &tnl, &idx);
+}
+
+/*
+ * Interleaved descents don't validate the nodes they go through,
+ * so lookups in concurrent trees are done at once by ttree_lookup.
+ */
+void ttree_lookup_start(Ttree *ttree, TtreeLookupStep *ls, void *key)
+{
+    TTREE_ASSERT(ttree != NULL);
+    lookup_step_init(ttree, ls, key);
+    if (UNLIKELY(is_concurrent(ttree))) {
+        ls->item = ttree_lookup(ttree, key, NULL);
+        ls->tnode = NULL;
+        ls->marked_tn = NULL;
+    }
+}
+
+bool ttree_lookup_step(Ttree *ttree, TtreeLookupStep *ls)
+{
+    return lookup_step(ttree, ls);
+}
+
+void *ttree_lookup_finish(Ttree *ttree, TtreeLookupStep *ls)
+{
+    TTREE_ASSERT(ls->tnode == NULL);
+    return lookup_step_finish(ttree, ls);
+}
+
+size_t ttree_lookup_batch(Ttree *ttree, void **keys, size_t n,
+                          void **out_items)
+{
+    TtreeLookupStep group[LOOKUP_BATCH_GROUP];
+    size_t i, found = 0;
+    int num, active, j;
+
+    /*
+     * Interleaved descents don't validate the nodes they go through,
+     * so concurrent readers look the keys up one by one.
+     */
+    if (UNLIKELY(is_concurrent(ttree))) {
+        for (i = 0; i < n; i++) {
+            out_items[i] = ttree_lookup(ttree, keys[i], NULL);
+            found += (out_items[i] != NULL);
+        }
+
+        return found;
+    }
+    for (i = 0; i < n; i += num) {
+        num = ((n - i) < LOOKUP_BATCH_GROUP) ? (int)(n - i) :
+            LOOKUP_BATCH_GROUP;
+        for (j = 0; j < num; j++) {
+            lookup_step_init(ttree, &group[j], keys[i + j]);
+        }
+
+        /*
+         * Descents of all lookups in a group make one step each in turn.
+         * The node every lookup goes to is prefetched, so by the time the
+         * lookup makes its next step the node is (hopefully) in cache.
+         */
+        active = ttree->root ? num : 0;
+        while (active) {
+            active = 0;
+            for (j = 0; j < num; j++) {
+                active += lookup_step(ttree, &group[j]);
+            }
+        }
+        for (j = 0; j < num; j++) {
+            out_items[i + j] = lookup_step_finish(ttree, &group[j]);
+            if (out_items[i + j]) {
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+#define is_multi_writer(ttree)                  \
+    ((ttree)->flags & TTREE_MULTI_WRITER)
+
+/*
+ * Tree latch is held shared by writers changing a single node and
+ * exclusively by writers changing the tree structure. Once exclusive
+ * writer is waiting, no more shared holders are let in.
+ */
+#define TTREE_LATCH_EXCL (1 << 30)
+
+static void latch_shared(Ttree *ttree)
+{
+    int latch;
+
+    for (;;) {
+        latch = TTREE_LOAD_RELAXED(&ttree->latch);
+        if (!(latch & TTREE_LATCH_EXCL) &&
+            TTREE_CAS(&ttree->latch, latch, latch + 1)) {
+            return;
+        }
+
+        TTREE_CPU_RELAX();
+    }
+}
+
+static __inline void unlatch_shared(Ttree *ttree)
+{
+    TTREE_FETCH_SUB(&ttree->latch, 1);
+}
+
+static void latch_exclusive(Ttree *ttree)
+{
+    int latch;
+
+    for (;;) {
+        latch = TTREE_LOAD_RELAXED(&ttree->latch);
+        if (!(latch & TTREE_LATCH_EXCL) &&
+            TTREE_CAS(&ttree->latch, latch, latch | TTREE_LATCH_EXCL)) {
+            break;
+        }
+
+        TTREE_CPU_RELAX();
+    }
+    while (TTREE_LOAD_ACQUIRE(&ttree->latch) != TTREE_LATCH_EXCL) {
+        TTREE_CPU_RELAX();
+    }
+}
+
+static __inline void unlatch_exclusive(Ttree *ttree)
+{
+    TTREE_STORE_RELEASE(&ttree->latch, 0);
+}
+
+/*
+ * A node is latched by making its version odd, exactly like a write
+ * marks it for readers. It succeeds only if the node wasn't changed
+ * since the writer has seen it at @version.
+ */
+static __inline bool tnode_latch(TtreeNode *tnode, uint32_t version)
+{
+    return TTREE_CAS(&tnode->version, version, version + 1);
+}
+
+static __inline void tnode_unlatch(Ttree *ttree, TtreeNode *tnode)
+{
+    if (has_hot_keys(ttree)) {
+        tnode_refresh_hot(ttree, tnode);
+    }
+
+    TTREE_STORE_RELEASE(&tnode->version, tnode->version + 1);
+}
+
+static int __ttree_insert(Ttree *ttree, void *item)
+{
+    TtreeCursor cursor;
+
+    /*
+     * If the tree already contains the same key item has and
+     * tree's wasn't allowed to hold duplicate keys, signal an error.
+     */
+    if (ttree_lookup(ttree, ttree_item2key(ttree, item), &cursor)) {
+        if (ttree->keys_are_unique) {
+            return -1;
+        }
+
+        /* Duplicate is placed before the item with the same key. */
+        cursor.state = CURSOR_PENDING;
+    }
+
+    ttree_insert_at_cursor(&cursor, item);
+    return 0;
+}
+
+/*
+ * Put @key at the position @cursor was left at by a lookup done with
+ * the tree latched shared. It's done only if the key fits into the bound
+ * node, so that nothing but this node is changed. Returns 1 if the key
+ * was inserted, 0 if the node was changed since the lookup and -1 if
+ * the insertion has to be done by an exclusive writer.
+ */
+static int insert_into_latched(Ttree *ttree, TtreeCursor *cursor, void *key)
+{
+    TtreeNode *tnode = cursor->tnode;
+
+    if (!tnode || (cursor->side != TNODE_BOUND) ||
+        tnode_is_full(ttree, tnode) || has_order_stats(ttree)) {
+        return -1;
+    }
+    if (!tnode_latch(tnode, cursor->version)) {
+        return 0;
+    }
+
+    increase_tnode_window(ttree, tnode, &cursor->idx);
+    tnode_set_key(ttree, tnode, cursor->idx, key);
+    TTREE_FETCH_ADD(&ttree->num_items, 1);
+    tnode_unlatch(ttree, tnode);
+    return 1;
+}
+
+/*
+ * Most insertions put a key into a bound node having a free room, so
+ * nothing but this node is changed. Such insertion latches only the node
+ * and runs in parallel with other ones. Insertions which add a node
+ * have to wait until they are alone in the tree.
+ */
+static int insert_latched(Ttree *ttree, void *item)
+{
+    void *key = ttree_item2key(ttree, item);
+    TtreeCursor cursor;
+    int ret;
+
+    for (;;) {
+        latch_shared(ttree);
+        if (ttree_lookup(ttree, key, &cursor)) {
+            if (ttree->keys_are_unique) {
+                unlatch_shared(ttree);
+                return -1;
+            }
+
+            cursor.state = CURSOR_PENDING;
+        }
+
+        ret = insert_into_latched(ttree, &cursor, key);
+        unlatch_shared(ttree);
+        if (ret > 0) {
+            return 0;
+        }
+        else if (ret < 0) {
+            break;
+        }
+
+        /* Somebody has changed the node meanwhile, try again. */
+    }
+
+    latch_exclusive(ttree);
+    ret = __ttree_insert(ttree, item);
+    unlatch_exclusive(ttree);
+    return ret;
+}
+
+int ttree_insert(Ttree *ttree, void *item)
+{
+    if (UNLIKELY(is_multi_writer(ttree))) {
+        return insert_latched(ttree, item);
+    }
+
+    return __ttree_insert(ttree, item);
+}
+
+/*
+ * Either insert @item or merge it with the item having the same key,
+ * which is returned in @old. A single lookup finds both the item and
+ * the place for insertion.
+ */
+static int __ttree_upsert(Ttree *ttree, void *item, ttree_merge_fn merge_cb,
+                          void *arg, void **old)
+{
+    TtreeCursor cursor;
+    void *new_item;
+
+    *old = ttree_lookup(ttree, ttree_item2key(ttree, item), &cursor);
+    if (!*old) {
+        ttree_insert_at_cursor(&cursor, item);
+        return 0;
+    }
+
+    new_item = merge_cb ? merge_cb(*old, item, arg) : item;
+    if (new_item != *old) {
+        TTREE_ASSERT(!ttree->cmp_func(ttree_item2key(ttree, new_item),
+                                      ttree_item2key(ttree, *old)));
+        tnode_replace_key(ttree, cursor.tnode, cursor.idx,
+                          ttree_item2key(ttree, new_item));
+        write_end(ttree);
+    }
+
+    return 1;
+}
+
+/*
+ * Replacing a key changes only the node holding it, so merges are
+ * done with the tree latched shared, as well as insertions into
+ * bound nodes. @see insert_latched
+ */
+static int upsert_latched(Ttree *ttree, void *item, ttree_merge_fn merge_cb,
+                          void *arg, void **old)
+{
+    void *key = ttree_item2key(ttree, item), *new_item;
+    TtreeCursor cursor;
+    int ret;
+
+    for (;;) {
+        latch_shared(ttree);
+        *old = ttree_lookup(ttree, key, &cursor);
+        if (!*old) {
+            ret = insert_into_latched(ttree, &cursor, key);
+            unlatch_shared(ttree);
+            if (ret > 0) {
+                return 0;
+            }
+            else if (ret < 0) {
+                break;
+            }
+
+            continue;
+        }
+        if (tnode_latch(cursor.tnode, cursor.version)) {
+            new_item = merge_cb ? merge_cb(*old, item, arg) : item;
+            if (new_item != *old) {
+                tnode_set_key(ttree, cursor.tnode, cursor.idx,
+                              ttree_item2key(ttree, new_item));
+            }
+
+            tnode_unlatch(ttree, cursor.tnode);
+            unlatch_shared(ttree);
+            return 1;
+        }
+
+        unlatch_shared(ttree);
+    }
+
+    latch_exclusive(ttree);
+    ret = __ttree_upsert(ttree, item, merge_cb, arg, old);
+    unlatch_exclusive(ttree);
+    return ret;
+}
+
+int ttree_upsert(Ttree *ttree, void *item, ttree_merge_fn merge_cb, void *arg)
+{
+    void *old;
+
+    if (UNLIKELY(is_multi_writer(ttree))) {
+        return upsert_latched(ttree, item, merge_cb, arg, &old);
+    }
+
+    return __ttree_upsert(ttree, item, merge_cb, arg, &old);
+}
+
+static void *keep_old_item(void *old_item, void *new_item, void *arg)
+{
+    (void)new_item;
+    (void)arg;
+    return old_item;
+}
+
+void *ttree_find_or_insert(Ttree *ttree, void *item)
+{
+    void *old;
+
+    if (UNLIKELY(is_multi_writer(ttree))) {
+        upsert_latched(ttree, item, keep_old_item, NULL, &old);
+    }
+    else {
+        __ttree_upsert(ttree, item, keep_old_item, NULL, &old);
+    }
+
+    return old ? old : item;
+}
+
+static int __cursor_open_on_node(TtreeCursor *cursor, Ttree *tree,
+                                 TtreeNode *tnode, enum tnode_seek seek)
+{
+    TTREE_ASSERT(cursor != NULL);
+    TTREE_ASSERT(tree != NULL);
+
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->ttree = tree;
+    cursor->tnode = tnode;
+
+    /*
+     * If T*-tree node was specified, the cursor becomes
+     * ready for iteration. Otherwise we suppose that T*-tree
+     * is completely empty, so it becomes ready for insertion.
+     * In second case seek argument is ignored.
+     */
+    if (tnode) {
+        switch (seek) {
+            case TNODE_SEEK_START:
+                cursor->idx = tnode->min_idx;
+                break;
+            case TNODE_SEEK_END:
+                cursor->idx = tnode->max_idx;
+                break;
+            default:
+                SET_ERRNO(EINVAL);
+                return -1;
+        }
+
+        cursor->state = CURSOR_OPENED;
+    }
+    else {
+        TTREE_ASSERT(cursor->ttree->root == NULL);
+        cursor->idx = first_tnode_idx(cursor->ttree);
+        cursor->state = CURSOR_PENDING;
+    }
+
+    cursor->side = TNODE_BOUND;
+    return 0;
+}
+
+/*
+ * Find a position for @key around @hint node without descending
+ * from the root. Since the only thing matters for T*-tree search is
+ * the order of keys, new key may be put to any node bounding it:
+ * the hint itself, its successor or a new child of one of them.
+ * Returns false if the key doesn't fall inside [min(hint), min(successor)).
+ */
+static bool lookup_near_hint(Ttree *ttree, TtreeNode *hint, void *key,
+                             TtreeCursor *cursor)
+{
+    TtreeNode *succ = tnode_link(ttree, hint, successor);
+    struct tnode_lookup tnl;
+    int cmp_res;
+
+    cmp_res = tnode_cmp(ttree, key, hint, hint->min_idx);
+    if (cmp_res < 0) {
+        return false;
+    }
+    if (succ && (tnode_cmp(ttree, key, succ, succ->min_idx) >= 0)) {
+        return false;
+    }
+
+    __cursor_open_on_node(cursor, ttree, hint, TNODE_SEEK_START);
+    cursor->side = TNODE_BOUND;
+    cursor->state = CURSOR_PENDING;
+    if (!cmp_res) {
+        cursor->idx = hint->min_idx;
+        cursor->state = CURSOR_OPENED;
+        return true;
+    }
+
+    cmp_res = tnode_cmp(ttree, key, hint, hint->max_idx);
+    if (cmp_res <= 0) {
+        if (!cmp_res) {
+            cursor->idx = hint->max_idx;
+            cursor->state = CURSOR_OPENED;
+            return true;
+        }
+
+        tnl.key = key;
+        tnl.low_bound = hint->min_idx + 1;
+        tnl.high_bound = hint->max_idx - 1;
+        tnl.cmps = 0;
+        if (lookup_inside_tnode(ttree, hint, &tnl, &cursor->idx)) {
+            cursor->state = CURSOR_OPENED;
+        }
+
+        return true;
+    }
+
+    /*
+     * The key lies between the hint and its successor. Free rooms
+     * of existing nodes are preferred to creation of new ones.
+     */
+    if (tnode_has_room(ttree, hint)) {
+        cursor->idx = hint->max_idx + 1;
+    }
+    else if (succ && tnode_has_room(ttree, succ)) {
+        cursor->tnode = succ;
+        cursor->idx = succ->min_idx;
+    }
+    else if (!tnode_link(ttree, hint, right)) {
+        cursor->side = TNODE_RIGHT;
+        cursor->idx = first_tnode_idx(ttree);
+    }
+    else {
+        /*
+         * If the hint has right child, its successor is the leftmost
+         * node of the right subtree, so it hasn't left child.
+         */
+        TTREE_ASSERT(succ && !tnode_link(ttree, succ, left));
+        cursor->tnode = succ;
+        cursor->side = TNODE_LEFT;
+        cursor->idx = first_tnode_idx(ttree);
+    }
+
+    return true;
+}
+
+ssize_t ttree_insert_batch(Ttree *ttree, void **items, size_t n)
+{
+    TtreeCursor cursor;
+    TtreeNode *hint = NULL;
+    ssize_t inserted = 0;
+    size_t i;
+    void *key;
+
+    if (!ttree || (!items && n)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        key = ttree_item2key(ttree, items[i]);
+
+        /*
+         * Each insertion starts from the node the previous item was put
+         * to. Only if the key is out of its bounds, the whole
+         * lookup from the root is done.
+         */
+        if (!hint || !lookup_near_hint(ttree, hint, key, &cursor)) {
+            ttree_lookup(ttree, key, &cursor);
+        }
+        if (cursor.state == CURSOR_OPENED) {
+            if (ttree->keys_are_unique) {
+                continue;
+            }
+
+            cursor.state = CURSOR_PENDING;
+        }
+
+        ttree_insert_at_cursor(&cursor, items[i]);
+        hint = cursor.tnode;
+        inserted++;
+    }
+
+    return inserted;
+}
+
+static void __insert_at_cursor(TtreeCursor *cursor, void *item)
+{
+    Ttree *ttree = cursor->ttree;
+    TtreeNode *at_node, *n;
+    TtreeCursor tmp_cursor;
+    void *key;
+
+    TTREE_ASSERT(cursor->ttree != NULL);
+    TTREE_ASSERT(cursor->state == CURSOR_PENDING);
+    key = ttree_item2key(ttree, item);
+    n = at_node = cursor->tnode;
+    ttree->num_items++;
+    if (!ttree->root) { /* The root node has to be created. */
+        at_node = allocate_ttree_node(ttree);
+        tnode_set_key(ttree, at_node, first_tnode_idx(ttree), key);
+        at_node->min_idx = at_node->max_idx = first_tnode_idx(ttree);
+        tnode_update_count(ttree, at_node);
+        tnode_set_side(at_node, TNODE_ROOT);
+        TTREE_FENCE_RELEASE(); /* publish initialized node to readers */
+        ttree->root = at_node;
+        __cursor_open_on_node(cursor, ttree, at_node, TNODE_SEEK_START);
+        return;
+    }
+    if (cursor->side == TNODE_BOUND) {
+        if (!tnode_has_room(ttree, n)) {
+            /*
+             * If node is full its max item should be removed and
+             * new key should be inserted into it. Removed key becomes
+             * new insert value that should be put in successor node.
+             */
+            void *tmp;
+
+            tnode_write_begin(ttree, n);
+            tmp = n->keys[n->max_idx--];
+            increase_tnode_window(ttree, n, &cursor->idx);
+            tnode_set_key(ttree, n, cursor->idx, key);
+            key = tmp;
+
+            ttree_cursor_copy(&tmp_cursor, cursor);
+            cursor = &tmp_cursor;
+
+            /*
+             * If current node hasn't successor and right child
+             * New node have to be created. It'll become the right child
+             * of the current node.
+             */
+            TTREE_STAT_ADD(ttree, overflows, 1);
+            if (!tnode_link(ttree, n, successor) ||
+                !tnode_link(ttree, n, right)) {
+                cursor->side = TNODE_RIGHT;
+                cursor->idx = first_tnode_idx(ttree);
+                goto create_new_node;
+            }
+
+            at_node = tnode_link(ttree, n, successor);
+            /*
+             * If successor hasn't any free rooms, new value is inserted
+             * into newly created node that becomes left child of the current
+             * node's successor.
              */
-            n = (*node)->right;
-            nkeys = tnode_num_keys(n);
-            (*node)->keys[0] = (*node)->keys[(*node)->min_idx];
-            offs = 1;
-            (*node)->min_idx = 0;
-            (*node)->max_idx = nkeys - 1;
-            if (!cursor) {
-                goto no_cursor;
+            if (!tnode_has_room(ttree, at_node)) {
+                cursor->side = TNODE_LEFT;
+                cursor->idx = first_tnode_idx(ttree);
+                goto create_new_node;
+            }
+
+            /*
+             * If we're here, then successor has free rooms and key
+             * will be inserted to one of them.
+             */
+            cursor->idx = at_node->min_idx;
+            cursor->tnode = at_node;
+        }
+
+        /*
+         * Even if the key was pushed out of a full node, the number of keys
+         * in it isn't changed. Only the node that gets the key grows.
+         */
+        tnode_insert_key(ttree, at_node, &cursor->idx, key);
+        tnode_count_add(ttree, at_node, 1);
+        cursor->state = CURSOR_OPENED;
+        return;
+    }
+
+create_new_node:
+    TTREE_STAT_ADD(ttree, splits, 1);
+    n = allocate_ttree_node(ttree);
+    tnode_set_key(ttree, n, cursor->idx, key);
+    n->min_idx = n->max_idx = cursor->idx;
+    tnode_set_link(ttree, n, parent, at_node);
+    tnode_set_side(n, cursor->side);
+    tnode_update_count(ttree, n);
+    tnode_write_begin(ttree, at_node);
+    TTREE_FENCE_RELEASE(); /* publish initialized node to readers */
+    tnode_set_link(ttree, at_node, sides[cursor->side], n);
+    tnode_count_add(ttree, at_node, 1);
+    cursor->tnode = n;
+    cursor->state = CURSOR_OPENED;
+    fixup_after_insertion(ttree, n, cursor);
+}
+
+void ttree_insert_at_cursor(TtreeCursor *cursor, void *item)
+{
+    __insert_at_cursor(cursor, item);
+    write_end(cursor->ttree);
+    if (is_concurrent(cursor->ttree)) {
+        cursor->version = cursor->tnode->version;
+        cursor->key = tnode_key(cursor->tnode, cursor->idx);
+    }
+}
+
+static void *__ttree_delete(Ttree *ttree, void *key)
+{
+    TtreeCursor cursor;
+    void *ret;
+
+    ret = ttree_lookup(ttree, key, &cursor);
+    if (!ret) {
+        return ret;
+    }
+
+    ttree_delete_at_cursor(&cursor);
+    return ret;
+}
+
+/*
+ * Deletion changes only the node an item is removed from, unless
+ * the node underflows. So the same approach as for insertions is used.
+ * @see insert_latched
+ */
+static void *delete_latched(Ttree *ttree, void *key)
+{
+    TtreeCursor cursor;
+    TtreeNode *tnode;
+    void *ret;
+    int nkeys;
+
+    for (;;) {
+        latch_shared(ttree);
+        ret = ttree_lookup(ttree, key, &cursor);
+        if (!ret) {
+            unlatch_shared(ttree);
+            return NULL;
+        }
+
+        tnode = cursor.tnode;
+        nkeys = tnode_num_keys(tnode);
+        if (has_order_stats(ttree) ||
+            !((nkeys - 1 > min_tnode_entries(ttree)) ||
+              (is_leaf_node(ttree, tnode) && (nkeys > 1) &&
+               (nkeys - 1 >= (ttree->keys_per_tnode >> 1))))) {
+            unlatch_shared(ttree);
+            break;
+        }
+        if (tnode_latch(tnode, cursor.version)) {
+            decrease_tnode_window(ttree, tnode, &cursor.idx);
+            TTREE_FETCH_SUB(&ttree->num_items, 1);
+            tnode_unlatch(ttree, tnode);
+            unlatch_shared(ttree);
+            return ret;
+        }
+
+        unlatch_shared(ttree);
+    }
+
+    latch_exclusive(ttree);
+    ret = __ttree_delete(ttree, key);
+    unlatch_exclusive(ttree);
+    return ret;
+}
+
+void *ttree_delete(Ttree *ttree, void *key)
+{
+    if (UNLIKELY(is_multi_writer(ttree))) {
+        return delete_latched(ttree, key);
+    }
+
+    return __ttree_delete(ttree, key);
+}
+
+/*
+ * Move all keys of @src next to keys of @dst: after them if @side is
+ * TNODE_RIGHT, before them otherwise. @dst must have enough free rooms,
+ * its keys are shifted if there isn't enough of them on that side.
+ * @src becomes empty.
+ */
+static void tnode_merge_keys(Ttree *ttree, TtreeNode *dst, TtreeNode *src,
+                             int side, TtreeCursor *cursor)
+{
+    int items = tnode_num_keys(src), diff, idx;
+
+    tnode_write_begin(ttree, dst);
+    if (side == TNODE_RIGHT) {
+        diff = (ttree->keys_per_tnode - dst->max_idx - items) - 1;
+        if (diff < 0) {
+            tnode_move_keys(ttree, dst, dst->min_idx + diff, dst,
+                            dst->min_idx, tnode_num_keys(dst));
+            dst->min_idx += diff;
+            dst->max_idx += diff;
+            if (cursor->tnode == dst) {
+                cursor->idx += diff;
+            }
+        }
+
+        idx = dst->max_idx + 1;
+        dst->max_idx += items;
+    }
+    else {
+        diff = dst->min_idx - items;
+        if (diff < 0) {
+            tnode_move_keys(ttree, dst, dst->min_idx - diff, dst,
+                            dst->min_idx, tnode_num_keys(dst));
+            dst->min_idx -= diff;
+            dst->max_idx -= diff;
+            if (cursor->tnode == dst) {
+                cursor->idx -= diff;
+            }
+        }
+
+        dst->min_idx -= items;
+        idx = dst->min_idx;
+    }
+
+    TTREE_STAT_ADD(ttree, merges, 1);
+    tnode_move_keys(ttree, dst, idx, src, src->min_idx, items);
+    if (cursor->tnode == src) {
+        cursor->tnode = dst;
+        cursor->idx = idx + (cursor->idx - src->min_idx);
+    }
+
+    tnode_write_begin(ttree, src);
+    src->min_idx = 1;
+    src->max_idx = 0;
+    if (is_gapped(ttree)) {
+        dst->num_gaps += src->num_gaps;
+        src->num_gaps = 0;
+    }
+}
+
+/*
+ * Merge an underflown leaf into its predecessor or successor,
+ * whichever has more free rooms. Both of them are ancestors of the
+ * leaf, so only counters of nodes between them and the leaf change.
+ * Returns false if neither of them can take keys of the leaf.
+ */
+static bool merge_leaf(Ttree *ttree, TtreeNode *leaf, TtreeCursor *cursor)
+{
+    TtreeNode *pred, *succ = tnode_link(ttree, leaf, successor), *dst;
+    int items = tnode_num_keys(leaf), pred_rooms = 0, succ_rooms = 0;
+
+    for (pred = leaf; tnode_link(ttree, pred, parent) &&
+             (tnode_get_side(pred) == TNODE_LEFT);
+         pred = tnode_link(ttree, pred, parent));
+    pred = tnode_link(ttree, pred, parent);
+    if (pred) {
+        pred_rooms = ttree->keys_per_tnode - tnode_num_keys(pred);
+    }
+    if (succ) {
+        succ_rooms = ttree->keys_per_tnode - tnode_num_keys(succ);
+    }
+    if ((items > pred_rooms) && (items > succ_rooms)) {
+        return false;
+    }
+
+    dst = (pred_rooms >= succ_rooms) ? pred : succ;
+    tnode_merge_keys(ttree, dst, leaf,
+                     (dst == pred) ? TNODE_RIGHT : TNODE_LEFT, cursor);
+    tnode_count_add(ttree, leaf, -items);
+    tnode_count_add(ttree, dst, items);
+    return true;
+}
+
+/*
+ * Replace an empty half-leaf with its only child. The node preceding
+ * the half-leaf gets its successor.
+ */
+static void splice_half_leaf(Ttree *ttree, TtreeNode *tnode)
+{
+    TtreeNode *left = tnode_link(ttree, tnode, left);
+    TtreeNode *child = left ? left : tnode_link(ttree, tnode, right);
+    TtreeNode *parent = tnode_link(ttree, tnode, parent), *pred;
+    int side = tnode_get_side(tnode);
+
+    if (left) {
+        pred = tnode_rightmost(ttree, left);
+    }
+    else {
+        for (pred = tnode; tnode_link(ttree, pred, parent) &&
+                 (tnode_get_side(pred) == TNODE_LEFT);
+             pred = tnode_link(ttree, pred, parent));
+        pred = tnode_link(ttree, pred, parent);
+    }
+    if (pred) {
+        tnode_write_begin(ttree, pred);
+        tnode_set_link(ttree, pred, successor,
+                       tnode_link(ttree, tnode, successor));
+    }
+
+    tnode_write_begin(ttree, child);
+    tnode_set_link(ttree, child, parent, parent);
+    tnode_set_side(child, side);
+    if (parent) {
+        tnode_write_begin(ttree, parent);
+        tnode_set_link(ttree, parent, sides[side], child);
+    }
+    else {
+        ttree->root = child;
+    }
+
+    retire_ttree_node(ttree, tnode);
+}
+
+static void *__delete_at_cursor(TtreeCursor *cursor)
+{
+    Ttree *ttree = cursor->ttree;
+    TtreeNode *tnode, *n;
+    void *ret;
+
+    TTREE_ASSERT(cursor->ttree != NULL);
+    TTREE_ASSERT(cursor->state == CURSOR_OPENED);
+    tnode = cursor->tnode;
+    ret = ttree_key2item(ttree, tnode->keys[cursor->idx]);
+    tnode_remove_key(ttree, tnode, &cursor->idx);
+    tnode_count_add(ttree, tnode, -1);
+    ttree->num_items--;
+    cursor->state = CURSOR_CLOSED;
+    if (UNLIKELY(cursor->idx > tnode->max_idx)) {
+        cursor->idx = tnode->max_idx;
+    }
+
+    /*
+     * If after a key was removed, T*-tree node contains more than
+     * minimum allowed number of items, the proccess is completed.
+     */
+    if (tnode_num_keys(tnode) > min_tnode_entries(ttree)) {
+        return ret;
+    }
+    if (is_internal_node(ttree, tnode)) {
+        int idx, min_idx = tnode->min_idx;
+
+        /*
+         * If it is an internal node, we have to recover number
+         * of items from it by moving one item from its successor.
+         * The window may move to make a room, and the cursor
+         * follows its key.
+         */
+        n = tnode_link(ttree, tnode, successor);
+        if (UNLIKELY(tnode_is_full(ttree, tnode))) {
+            /* Tiny gapped nodes underflow with a gap left in a full window */
+            tnode_spread(ttree, tnode, 0, &cursor->idx);
+            min_idx = tnode->min_idx;
+        }
+
+        idx = tnode->max_idx + 1;
+        tnode_write_begin(ttree, n);
+        increase_tnode_window(ttree, tnode, &idx);
+        tnode_move_keys(ttree, tnode, idx, n, n->min_idx++, 1);
+        tnode_trim_min(ttree, n);
+        tnode_count_add(ttree, n, -1);
+        tnode_count_add(ttree, tnode, 1);
+        if (cursor->tnode == tnode) {
+            cursor->idx += tnode->min_idx - min_idx;
+        }
+        if (UNLIKELY(cursor->idx > tnode->max_idx)) {
+            cursor->idx = tnode->max_idx;
+        }
+        if (!tnode_is_empty(n) && is_leaf_node(ttree, n) &&
+            !leaf_underflows(ttree, n)) {
+            return ret;
+        }
+
+        /*
+         * If we're here, then successor is either a half-leaf
+         * or an empty or underflown leaf.
+         */
+        tnode = n;
+    }
+    if (!is_leaf_node(ttree, tnode)) {
+        int items;
+
+        n = tnode_link(ttree, tnode, left);
+        if (!n) {
+            n = tnode_link(ttree, tnode, right);
+        }
+        if (UNLIKELY(!is_leaf_node(ttree, n))) {
+            /* Only relaxed trees have half-leafs with deeper subtrees. */
+            if (tnode_is_empty(tnode)) {
+                splice_half_leaf(ttree, tnode);
+            }
+
+            return ret;
+        }
+
+        items = tnode_num_keys(n);
+
+        /*
+         * If half-leaf can not be merged with a leaf,
+         * the proccess is completed.
+         */
+        if (items > (ttree->keys_per_tnode - tnode_num_keys(tnode))) {
+            return ret;
+        }
+
+        /*
+         * Merge current node with its leaf. Items of a right leaf are
+         * placed after the maximum item in a node, items of a left one
+         * are placed before the minimum item.
+         */
+        tnode_merge_keys(ttree, tnode, n, tnode_get_side(n), cursor);
+
+        /* Items stay in the same subtree, only the leaf loses them. */
+        tnode_update_count(ttree, n);
+        tnode = n;
+    }
+    if (!tnode_is_empty(tnode) &&
+        !(leaf_underflows(ttree, tnode) && merge_leaf(ttree, tnode, cursor))) {
+        return ret;
+    }
+
+    /* if we're here, then current node will be removed from the tree. */
+    n = tnode_link(ttree, tnode, parent);
+    if (!n) {
+        ttree->root = NULL;
+        retire_ttree_node(ttree, tnode);
+        return ret;
+    }
+
+    tnode_write_begin(ttree, n);
+    tnode_set_link(ttree, n, sides[tnode_get_side(tnode)], NULL);
+    fixup_after_deletion(ttree, tnode, NULL);
+    retire_ttree_node(ttree, tnode);
+    return ret;
+}
+
+void *ttree_delete_at_cursor(TtreeCursor *cursor)
+{
+    void *ret = __delete_at_cursor(cursor);
+
+    write_end(cursor->ttree);
+    return ret;
+}
+
+int ttree_replace(Ttree *ttree, void *key, void *new_item)
+{
+    TtreeCursor cursor;
+
+    if (!ttree_lookup(ttree, key, &cursor)) {
+        return -1;
+    }
+
+    tnode_replace_key(ttree, cursor.tnode, cursor.idx,
+                      ttree_item2key(ttree, new_item));
+    write_end(ttree);
+    return 0;
+}
+
+static size_t num_packed_tnodes(Ttree *ttree, size_t n, double fill)
+{
+    int per_tnode = (int)(fill * ttree->keys_per_tnode + 0.5);
+
+    if (per_tnode < 1) {
+        per_tnode = 1;
+    }
+
+    return (n + per_tnode - 1) / per_tnode;
+}
+
+/*
+ * Pack nodes @nodes[from..to) of @num_tnodes nodes the way pack_tnodes
+ * does. Ranges of nodes don't share any keys, so they can be packed
+ * independently of each other.
+ */
+static void pack_tnode_range(Ttree *ttree, TtreeNode **nodes,
+                             size_t num_tnodes, void **keys, size_t n,
+                             bool are_items, size_t from, size_t to)
+{
+    size_t i, k = (n * from) / num_tnodes;
+    int j, nkeys;
+
+    for (i = from; i < to; i++) {
+        TtreeNode *tnode = nodes[i];
+
+        snapshot_preserve(ttree, tnode);
+        nkeys = (int)((n * (i + 1)) / num_tnodes - (n * i) / num_tnodes);
+        tnode->min_idx = (ttree->keys_per_tnode - nkeys) >> 1;
+        tnode->max_idx = tnode->min_idx + nkeys - 1;
+        if (is_gapped(ttree)) {
+            tnode->num_gaps = 0;
+        }
+        for (j = tnode->min_idx; j <= tnode->max_idx; j++, k++) {
+            tnode_fill_key(ttree, tnode, j, are_items ?
+                           ttree_item2key(ttree, keys[k]) : keys[k]);
+        }
+        if (has_hot_keys(ttree)) {
+            tnode_refresh_hot(ttree, tnode);
+        }
+    }
+
+    TTREE_ASSERT(k == (n * to) / num_tnodes);
+}
+
+/*
+ * Put @n keys (or keys of items if @are_items is set) ordered by
+ * their value into @nodes. Keys are spread over the nodes evenly,
+ * so that the number of keys in any two nodes differs at most by one.
+ * Each node keeps its keys in the middle of its array leaving free
+ * rooms on both sides.
+ */
+static void pack_tnodes(Ttree *ttree, TtreeNode **nodes, size_t num_tnodes,
+                        void **keys, size_t n, bool are_items)
+{
+    pack_tnode_range(ttree, nodes, num_tnodes, keys, n, are_items,
+                     0, num_tnodes);
+}
+
+/* Allocate an array of @num new nodes, either all of them or none. */
+static TtreeNode **allocate_tnodes(Ttree *ttree, size_t num)
+{
+    TtreeNode **nodes;
+    size_t i;
+
+    nodes = malloc(sizeof(*nodes) * num);
+    if (!nodes) {
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+    for (i = 0; i < num; i++) {
+        nodes[i] = allocate_ttree_node(ttree);
+        if (!nodes[i]) {
+            while (i--) {
+                free_ttree_node(ttree, nodes[i]);
+            }
+
+            free(nodes);
+            SET_ERRNO(ENOMEM);
+            return NULL;
+        }
+    }
+
+    return nodes;
+}
+
+int ttree_bulk_load(Ttree *ttree, void **sorted_items, size_t n, double fill)
+{
+    TtreeNode **nodes;
+    size_t num_tnodes, i;
+
+    if (!ttree || (!sorted_items && n) || !(fill > 0.0) || (fill > 1.0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (!n) {
+        return 0;
+    }
+
+    /*
+     * Items must be ordered by their keys. Since it costs only
+     * N comparisons, the order is verified instead of being trusted.
+     */
+    for (i = 1; i < n; i++) {
+        int cmp_res = ttree->cmp_func(ttree_item2key(ttree, sorted_items[i - 1]),
+                                      ttree_item2key(ttree, sorted_items[i]));
+
+        if ((cmp_res > 0) || (!cmp_res && ttree->keys_are_unique)) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+    }
+
+    num_tnodes = num_packed_tnodes(ttree, n, fill);
+    nodes = allocate_tnodes(ttree, num_tnodes);
+    if (!nodes) {
+        return -1;
+    }
+
+    pack_tnodes(ttree, nodes, num_tnodes, sorted_items, n, true);
+    relink_tree(ttree, nodes, num_tnodes);
+    ttree->num_items = n;
+    free(nodes);
+    return 0;
+}
+
+/*
+ * Parallel bulk load. Items are sorted by a merge sort: each task sorts
+ * its own chunk of items, then sorted runs of chunks are merged pairwise
+ * until a single run is left. A merge of two runs is split among tasks
+ * of their chunks by positions in the output, so all tasks are busy up
+ * to the last pass. Nodes are allocated by the calling thread since
+ * allocators aren't thread safe, but packed and linked by the tasks.
+ */
+#define SORT_RUN_MIN 16
+
+#define chunk_start(n, num_chunks, chunk)       \
+    (((n) * (size_t)(chunk)) / (size_t)(num_chunks))
+
+struct subtree {
+    size_t lo, hi;
+    TtreeNode *parent;
+    TtreeNode *root;
+    int side;
+    int height;
+};
+
+struct parallel_load {
+    Ttree *ttree;
+    void **items;
+    void **src, **dst; /* runs being merged and their destination */
+    size_t n;
+    int num_tasks;
+    int run_chunks;    /* number of chunks in each sorted run */
+    bool *duplicate;
+    TtreeNode **nodes;
+    size_t num_tnodes;
+    struct subtree *subtrees;
+};
+
+#define item_cmp(ttree, item1, item2)                   \
+    ((ttree)->cmp_func(ttree_item2key(ttree, item1),    \
+                       ttree_item2key(ttree, item2)))
+
+/* Put first @num items of the stable merge of @a and @b into @dst. */
+static void merge_items(Ttree *ttree, void **a, size_t na, void **b,
+                        size_t nb, void **dst, size_t num)
+{
+    while (num--) {
+        if (!nb || (na && (item_cmp(ttree, *a, *b) <= 0))) {
+            *dst++ = *a++;
+            na--;
+        }
+        else {
+            *dst++ = *b++;
+            nb--;
+        }
+    }
+}
+
+/* Stable merge sort of @n items using @tmp of @n / 2 items. */
+static void sort_items(Ttree *ttree, void **items, void **tmp, size_t n)
+{
+    size_t half = n >> 1, i, j;
+    void *item;
+
+    if (n <= SORT_RUN_MIN) {
+        for (i = 1; i < n; i++) {
+            item = items[i];
+            for (j = i; j && (item_cmp(ttree, items[j - 1], item) > 0); j--) {
+                items[j] = items[j - 1];
+            }
+
+            items[j] = item;
+        }
+
+        return;
+    }
+
+    sort_items(ttree, items, tmp, half);
+    sort_items(ttree, items + half, tmp, n - half);
+    if (item_cmp(ttree, items[half - 1], items[half]) > 0) {
+        memcpy(tmp, items, half * sizeof(*items));
+        merge_items(ttree, tmp, half, items + half, n - half, items, n);
+    }
+}
+
+/*
+ * Number of items of @a among the first @k items of the stable merge
+ * of @a and @b.
+ */
+static size_t merge_split(Ttree *ttree, void **a, size_t na, void **b,
+                          size_t nb, size_t k)
+{
+    size_t lo = (k > nb) ? k - nb : 0, hi = (k < na) ? k : na, i;
+
+    while (lo < hi) {
+        i = lo + ((hi - lo) >> 1);
+        if (item_cmp(ttree, a[i], b[k - i - 1]) <= 0) {
+            lo = i + 1;
+        }
+        else {
+            hi = i;
+        }
+    }
+
+    return lo;
+}
+
+static void sort_chunk(void *arg, int task)
+{
+    struct parallel_load *pl = arg;
+    size_t lo = chunk_start(pl->n, pl->num_tasks, task);
+    size_t hi = chunk_start(pl->n, pl->num_tasks, task + 1);
+
+    sort_items(pl->ttree, pl->items + lo, pl->dst + lo, hi - lo);
+}
+
+/* Fill the chunk of the task in the destination of a merge pass. */
+static void merge_chunk(void *arg, int task)
+{
+    struct parallel_load *pl = arg;
+    int first = task - task % (pl->run_chunks * 2), mid, last;
+    size_t start, lo, hi, na, nb, i;
+    void **a, **b;
+
+    mid = first + pl->run_chunks;
+    last = mid + pl->run_chunks;
+    mid = (mid < pl->num_tasks) ? mid : pl->num_tasks;
+    last = (last < pl->num_tasks) ? last : pl->num_tasks;
+    start = chunk_start(pl->n, pl->num_tasks, first);
+    lo = chunk_start(pl->n, pl->num_tasks, task) - start;
+    hi = chunk_start(pl->n, pl->num_tasks, task + 1) - start;
+    a = pl->src + start;
+    na = chunk_start(pl->n, pl->num_tasks, mid) - start;
+    b = a + na;
+    nb = chunk_start(pl->n, pl->num_tasks, last) - start - na;
+    i = merge_split(pl->ttree, a, na, b, nb, lo);
+    merge_items(pl->ttree, a + i, na - i, b + (lo - i), nb - (lo - i),
+                pl->dst + start + lo, hi - lo);
+}
+
+static void copy_chunk(void *arg, int task)
+{
+    struct parallel_load *pl = arg;
+    size_t lo = chunk_start(pl->n, pl->num_tasks, task);
+    size_t hi = chunk_start(pl->n, pl->num_tasks, task + 1);
+
+    memcpy(pl->dst + lo, pl->src + lo, (hi - lo) * sizeof(*pl->src));
+}
+
+/* Look for equal neighbours ending in the chunk of the task. */
+static void check_chunk(void *arg, int task)
+{
+    struct parallel_load *pl = arg;
+    size_t i = chunk_start(pl->n, pl->num_tasks, task);
+    size_t hi = chunk_start(pl->n, pl->num_tasks, task + 1);
+
+    for (i = i ? i : 1; i < hi; i++) {
+        if (!item_cmp(pl->ttree, pl->items[i - 1], pl->items[i])) {
+            pl->duplicate[task] = true;
+            break;
+        }
+    }
+}
+
+static void pack_chunk(void *arg, int task)
+{
+    struct parallel_load *pl = arg;
+    size_t lo = chunk_start(pl->num_tnodes, pl->num_tasks, task);
+    size_t hi = chunk_start(pl->num_tnodes, pl->num_tasks, task + 1);
+    size_t i;
+
+    pack_tnode_range(pl->ttree, pl->nodes, pl->num_tnodes, pl->items,
+                     pl->n, true, lo, hi);
+    for (i = lo; i < hi; i++) {
+        tnode_set_link(pl->ttree, pl->nodes[i], successor,
+                       (i + 1 < pl->num_tnodes) ? pl->nodes[i + 1] : NULL);
+    }
+}
+
+static void link_subtree(void *arg, int task)
+{
+    struct parallel_load *pl = arg;
+    struct subtree *st = &pl->subtrees[task];
+
+    st->root = link_balanced(pl->ttree, pl->nodes, st->lo, st->hi,
+                             st->parent, st->side, &st->height);
+}
+
+/*
+ * List non-empty ranges of nodes which link_balanced would make
+ * subtrees @depth levels below the subtree of @nodes[lo..hi).
+ * Returns a pointer past the last range listed.
+ */
+static struct subtree *list_subtrees(TtreeNode **nodes, size_t lo,
+                                     size_t hi, TtreeNode *parent, int side,
+                                     int depth, struct subtree *st)
+{
+    size_t mid = lo + ((hi - lo) >> 1);
+
+    if (lo >= hi) {
+        return st;
+    }
+    if (!depth) {
+        st->lo = lo;
+        st->hi = hi;
+        st->parent = parent;
+        st->side = side;
+        return st + 1;
+    }
+
+    st = list_subtrees(nodes, lo, mid, nodes[mid], TNODE_LEFT, depth - 1, st);
+    return list_subtrees(nodes, mid + 1, hi, nodes[mid], TNODE_RIGHT,
+                         depth - 1, st);
+}
+
+/*
+ * Link top @depth levels of the balanced tree of @nodes[lo..hi) the way
+ * link_balanced does, taking subtrees listed by list_subtrees and linked
+ * already from @next.
+ */
+static TtreeNode *link_top(Ttree *ttree, TtreeNode **nodes, size_t lo,
+                           size_t hi, TtreeNode *parent, int side,
+                           int depth, struct subtree **next, int *height)
+{
+    TtreeNode *tnode;
+    size_t mid;
+    int lh, rh;
+
+    if (lo >= hi) {
+        *height = 0;
+        return NULL;
+    }
+    if (!depth) {
+        *height = (*next)->height;
+        return (*next)++->root;
+    }
+
+    mid = lo + ((hi - lo) >> 1);
+    tnode = nodes[mid];
+    snapshot_preserve(ttree, tnode);
+    tnode_set_link(ttree, tnode, parent, parent);
+    tnode_set_side(tnode, side);
+    tnode_set_link(ttree, tnode, left,
+                   link_top(ttree, nodes, lo, mid, tnode, TNODE_LEFT,
+                            depth - 1, next, &lh));
+    tnode_set_link(ttree, tnode, right,
+                   link_top(ttree, nodes, mid + 1, hi, tnode, TNODE_RIGHT,
+                            depth - 1, next, &rh));
+    tnode->bfc = rh - lh;
+    tnode_update_count(ttree, tnode);
+    *height = ((lh > rh) ? lh : rh) + 1;
+    return tnode;
+}
+
+int ttree_bulk_load_parallel(Ttree *ttree, void **items, size_t n,
+                             double fill, int num_threads)
+{
+    struct parallel_load pl;
+    struct ttree_pool *pool = NULL;
+    struct subtree *next;
+    void **buf;
+    TtreeNode *root;
+    int depth, height, i, ret = -1;
+
+    if (!ttree || (!items && n) || !(fill > 0.0) || (fill > 1.0) ||
+        (num_threads < 1)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (!n) {
+        return 0;
+    }
+
+    memset(&pl, 0, sizeof(pl));
+    pl.ttree = ttree;
+    pl.items = items;
+    pl.n = n;
+    pl.num_tasks = ((size_t)num_threads < n) ? num_threads : (int)n;
+    for (depth = 0; (1 << depth) < pl.num_tasks; depth++);
+
+    buf = malloc(n * sizeof(*buf));
+    pl.duplicate = calloc(pl.num_tasks, sizeof(*pl.duplicate));
+    pl.subtrees = malloc(sizeof(*pl.subtrees) << depth);
+    if (!buf || !pl.duplicate || !pl.subtrees) {
+        SET_ERRNO(ENOMEM);
+        goto out;
+    }
+
+    /*
+     * Nodes of a tree having snapshots are preserved in tables shared
+     * by all nodes, so such trees are built by the calling thread.
+     * The same is done if threads can't be started.
+     */
+    if ((pl.num_tasks > 1) && (ttree->snapshot == NULL)) {
+        pool = ttree_pool_create(pl.num_tasks - 1);
+    }
+
+    pl.dst = buf;
+    ttree_pool_run(pool, sort_chunk, &pl, pl.num_tasks);
+    pl.src = items;
+    for (pl.run_chunks = 1; pl.run_chunks < pl.num_tasks;
+         pl.run_chunks <<= 1) {
+        ttree_pool_run(pool, merge_chunk, &pl, pl.num_tasks);
+        pl.src = pl.dst;
+        pl.dst = (pl.dst == buf) ? items : buf;
+    }
+    if (pl.src != items) {
+        ttree_pool_run(pool, copy_chunk, &pl, pl.num_tasks);
+    }
+    if (ttree->keys_are_unique) {
+        ttree_pool_run(pool, check_chunk, &pl, pl.num_tasks);
+        for (i = 0; i < pl.num_tasks; i++) {
+            if (pl.duplicate[i]) {
+                SET_ERRNO(EINVAL);
+                goto out;
+            }
+        }
+    }
+
+    pl.num_tnodes = num_packed_tnodes(ttree, n, fill);
+    pl.nodes = allocate_tnodes(ttree, pl.num_tnodes);
+    if (!pl.nodes) {
+        goto out;
+    }
+
+    ttree_pool_run(pool, pack_chunk, &pl, pl.num_tasks);
+    next = list_subtrees(pl.nodes, 0, pl.num_tnodes, NULL, TNODE_ROOT,
+                         depth, pl.subtrees);
+    ttree_pool_run(pool, link_subtree, &pl, (int)(next - pl.subtrees));
+    next = pl.subtrees;
+    root = link_top(ttree, pl.nodes, 0, pl.num_tnodes, NULL, TNODE_ROOT,
+                    depth, &next, &height);
+
+    TTREE_FENCE_RELEASE(); /* publish initialized nodes to readers */
+    ttree->root = root;
+    ttree->num_items = n;
+    ret = 0;
+
+out:
+    if (pool) {
+        ttree_pool_destroy(pool);
+    }
+
+    free(pl.nodes);
+    free(pl.subtrees);
+    free(pl.duplicate);
+    free(buf);
+    return ret;
+}
+
+static size_t count_tnodes(Ttree *ttree)
+{
+    TtreeNode *tnode;
+    size_t num = 0;
+
+    if (ttree->root) {
+        for (tnode = tnode_leftmost(ttree, ttree->root); tnode;
+             tnode = tnode_link(ttree, tnode, successor)) {
+            num++;
+        }
+    }
+
+    return num;
+}
+
+/* Put nodes of the tree to @nodes in key order. */
+static void list_tnodes(Ttree *ttree, TtreeNode **nodes)
+{
+    TtreeNode *tnode;
+
+    if (ttree->root) {
+        for (tnode = tnode_leftmost(ttree, ttree->root); tnode;
+             tnode = tnode_link(ttree, tnode, successor)) {
+            *nodes++ = tnode;
+        }
+    }
+}
+
+int ttree_rebalance_all(Ttree *ttree)
+{
+    TtreeNode **nodes;
+    size_t num;
+
+    if (!ttree || is_concurrent(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree->root) {
+        return 0;
+    }
+
+    num = count_tnodes(ttree);
+    nodes = malloc(sizeof(*nodes) * num);
+    if (!nodes) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    list_tnodes(ttree, nodes);
+    relink_tree(ttree, nodes, num);
+    free(nodes);
+    return 0;
+}
+
+ssize_t ttree_compact(Ttree *ttree, double fill)
+{
+    TtreeNode **nodes, *tnode;
+    void **keys;
+    size_t num, num_packed, i, k = 0;
+    int idx;
+
+    if (!ttree || is_concurrent(ttree) || !(fill > 0.0) || (fill > 1.0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree->root) {
+        return 0;
+    }
+
+    num = count_tnodes(ttree);
+    num_packed = num_packed_tnodes(ttree, ttree->num_items, fill);
+    if (num_packed >= num) {
+        return 0;
+    }
+
+    nodes = malloc(sizeof(*nodes) * num);
+    keys = malloc(sizeof(*keys) * ttree->num_items);
+    if (!nodes || !keys) {
+        free(nodes);
+        free(keys);
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    tnode = tnode_leftmost(ttree, ttree->root);
+    for (i = 0; i < num;
+         i++, tnode = tnode_link(ttree, tnode, successor)) {
+        nodes[i] = tnode;
+        tnode_for_each_key(ttree, tnode, idx) {
+            keys[k++] = tnode->keys[idx];
+        }
+    }
+
+    /* The first nodes in key order are reused, the rest are freed. */
+    TTREE_ASSERT(k == ttree->num_items);
+    pack_tnodes(ttree, nodes, num_packed, keys, k, false);
+    for (i = num_packed; i < num; i++) {
+        retire_ttree_node(ttree, nodes[i]);
+    }
+
+    relink_tree(ttree, nodes, num_packed);
+    free(keys);
+    free(nodes);
+    return num - num_packed;
+}
+
+/*
+ * Nodes of the old and the new size can't share a slab, since a slab
+ * has blocks of a single size. The new nodes get a fresh slab with
+ * the same settings and the old one is released at once when they are
+ * built. A mapped image holds items, so it stays with the tree.
+ */
+static void slab_start_over(struct ttree_slab *slab, struct ttree_slab *old)
+{
+    *old = *slab;
+    memset(slab, 0, sizeof(*slab));
+    slab->tnodes_per_chunk = old->tnodes_per_chunk;
+    slab->page_size = old->page_size;
+    slab->numa_node = old->numa_node;
+    slab->image = old->image;
+    slab->image_size = old->image_size;
+    slab->image_relocated = old->image_relocated;
+    old->image = NULL;
+    old->image_size = 0;
+}
+
+/* Undo slab_start_over freeing everything taken from the fresh slab. */
+static void slab_restore(struct ttree_slab *slab, struct ttree_slab *old)
+{
+    old->image = slab->image;
+    old->image_size = slab->image_size;
+    slab->image = NULL;
+    slab_release(slab);
+    *slab = *old;
+}
+
+int ttree_set_keys_per_tnode(Ttree *ttree, int num_keys, double fill)
+{
+    struct ttree_slab old_slab;
+    TtreeNode **nodes, **old_nodes, *tnode;
+    void **keys;
+    size_t num, num_tnodes, i, k = 0;
+    int old_keys, idx;
+    bool own_slab;
+
+    if (!ttree || is_concurrent(ttree) || is_indexed(ttree) ||
+        (num_keys < TNODE_ITEMS_MIN) || (num_keys > TNODE_ITEMS_MAX) ||
+        !(fill > 0.0) || (fill > 1.0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (ttree->snapshot) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (num_keys == ttree->keys_per_tnode) {
+        return 0;
+    }
+    if (!ttree->root) {
+        /* Blocks cached by the allocator have the old size. */
+        if (ttree->allocator->release) {
+            ttree->allocator->release(ttree->alloc_ctx);
+        }
+
+        ttree->keys_per_tnode = num_keys;
+        set_tnode_layout(ttree);
+        return 0;
+    }
+
+    num = count_tnodes(ttree);
+    old_nodes = malloc(sizeof(*old_nodes) * num);
+    keys = malloc(sizeof(*keys) * ttree->num_items);
+    if (!old_nodes || !keys) {
+        free(old_nodes);
+        free(keys);
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    tnode = tnode_leftmost(ttree, ttree->root);
+    for (i = 0; i < num;
+         i++, tnode = tnode_link(ttree, tnode, successor)) {
+        old_nodes[i] = tnode;
+        tnode_for_each_key(ttree, tnode, idx) {
+            keys[k++] = tnode->keys[idx];
+        }
+    }
+
+    TTREE_ASSERT(k == ttree->num_items);
+    old_keys = ttree->keys_per_tnode;
+    own_slab = (ttree->allocator == &slab_allocator);
+    if (own_slab) {
+        slab_start_over(&ttree->slab, &old_slab);
+    }
+
+    ttree->keys_per_tnode = num_keys;
+    set_tnode_layout(ttree);
+    num_tnodes = num_packed_tnodes(ttree, k, fill);
+    nodes = allocate_tnodes(ttree, num_tnodes);
+    if (!nodes) {
+        if (own_slab) {
+            slab_restore(&ttree->slab, &old_slab);
+        }
+
+        ttree->keys_per_tnode = old_keys;
+        set_tnode_layout(ttree);
+        free(keys);
+        free(old_nodes);
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    /* Old nodes hold the keys until the new ones are packed. */
+    pack_tnodes(ttree, nodes, num_tnodes, keys, k, false);
+    relink_tree(ttree, nodes, num_tnodes);
+    if (own_slab) {
+        TTREE_STAT_ADD(ttree, tnode_frees, num);
+        slab_release(&old_slab);
+    }
+    else {
+        for (i = 0; i < num; i++) {
+            free_ttree_node(ttree, old_nodes[i]);
+        }
+    }
+
+    free(nodes);
+    free(keys);
+    free(old_nodes);
+    return 0;
+}
+
+/*
+ * Costs of the autotuning model in units of one key shifted inside
+ * a node. Visiting a node is about a cache miss, while shifting keys
+ * is a streaming copy. A comparison is added to lookups by each
+ * doubling of nodes. Capacities above TTREE_TUNE_KEYS_MAX only add
+ * comparisons of keys on further cache lines, so they aren't picked.
+ */
+#define TTREE_TUNE_TNODE_COST 32
+#define TTREE_TUNE_CMP_COST   8
+#define TTREE_TUNE_MIN_OPS    1024
+#define TTREE_TUNE_KEYS_MAX   512
+
+int ttree_autotune(Ttree *ttree)
+{
+    struct ttree_counters *c;
+    double lookups, moves, per_tnode, fill;
+    size_t num_tnodes;
+    int num_keys;
+
+    if (!ttree || is_concurrent(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    c = &ttree->counters;
+    if (!ttree->root || (c->lookups + c->scans < TTREE_TUNE_MIN_OPS)) {
+        return ttree->keys_per_tnode;
+    }
+
+    num_tnodes = count_tnodes(ttree);
+    num_keys = ttree->keys_per_tnode;
+    per_tnode = (double)ttree->num_items / num_tnodes;
+    fill = per_tnode / num_keys;
+    lookups = (double)c->lookups;
+    moves = (double)c->moved_keys;
+
+    /*
+     * Doubling nodes takes one level off every descent, halves the
+     * number of nodes a scan hops through and doubles shifts made
+     * by writes. Halving does the opposite. The two conditions
+     * exclude each other, so capacity can't swing back and forth.
+     */
+    for (;;) {
+        double saved, spent;
+
+        saved = TTREE_TUNE_TNODE_COST * (lookups + c->scan_keys /
+                                         (2 * per_tnode));
+        spent = TTREE_TUNE_CMP_COST * lookups + moves;
+        if ((num_keys * 2 <= TTREE_TUNE_KEYS_MAX) && (saved > spent)) {
+            num_keys *= 2;
+            per_tnode *= 2;
+            moves *= 2;
+            continue;
+        }
+
+        saved = moves / 2 + TTREE_TUNE_CMP_COST * lookups;
+        spent = TTREE_TUNE_TNODE_COST * (lookups + c->scan_keys / per_tnode);
+        if ((num_keys / 2 >= TNODE_ITEMS_MIN) && (saved > spent)) {
+            num_keys /= 2;
+            per_tnode /= 2;
+            moves /= 2;
+            continue;
+        }
+
+        break;
+    }
+
+    /* Sparse nodes aren't worth keeping sparse in the rebuilt tree. */
+    if (fill < 0.5) {
+        fill = 0.5;
+    }
+    if ((num_keys != ttree->keys_per_tnode) &&
+        (ttree_set_keys_per_tnode(ttree, num_keys, fill) < 0)) {
+        return -1;
+    }
+
+    ttree_stats_reset(ttree);
+    return ttree->keys_per_tnode;
+}
+
+/*
+ * T*-tree image consists of a header, nodes in successor order and
+ * records of items in order of their keys. Every link of a node is
+ * stored as an address the link would have if the image were mapped
+ * at the preferred base (NULL is 0). The base is an address range free
+ * when the image is saved, and randomized layouts of other processes
+ * rarely take it, so the image mapped there is used as it is. Mapped
+ * elsewhere, it gets valid pointers by adding the difference of bases
+ * to all links. Images of version 2 have no preferred base, so their
+ * links are just offsets from the image start.
+ */
+#define TTREE_IMAGE_MAGIC      "TTREEIMG"
+#define TTREE_IMAGE_VERSION    3
+#define TTREE_IMAGE_VERSION_V2 2
+#define TTREE_IMAGE_BYTE_ORDER 0x01020304
+#define TTREE_IMAGE_ALIGN      64
+
+struct ttree_image {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t ptr_size;
+    uint32_t keys_per_tnode;
+    uint32_t flags;
+    uint32_t keys_are_unique;
+    uint32_t str_keys;
+    uint32_t reserved;
+    uint64_t key_offs;
+    uint64_t key_width;
+    uint64_t tnode_bytes;
+    uint64_t tnode_hot;
+    uint64_t tnode_stride;
+    uint64_t item_size;
+    uint64_t num_tnodes;
+    uint64_t num_items;
+    uint64_t root;
+    uint64_t tnodes_offs;
+    uint64_t items_offs;
+    uint64_t image_size;
+    uint64_t base;
+};
+
+struct image_tnode {
+    TtreeNode *tnode;
+    size_t idx;
+};
+
+static int cmp_image_tnodes(const void *a, const void *b)
+{
+    uintptr_t pa = (uintptr_t)((const struct image_tnode *)a)->tnode;
+    uintptr_t pb = (uintptr_t)((const struct image_tnode *)b)->tnode;
+
+    return cmp_numbers(pa, pb);
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t ret;
+
+    while (size) {
+        ret = write(fd, p, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            else if (cursor->tnode == n) {
-                if (cursor->idx < n->max_idx) {
-                    cursor->tnode = *node;
-                    cursor->idx = (*node)->min_idx +
-                        (cursor->idx - n->min_idx + 1);
+
+            return -1;
+        }
+
+        p += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/* Address of a node in the image, tnodes are sorted by their addresses. */
+static uint64_t image_tnode_addr(struct ttree_image *img,
+                                 struct image_tnode *tnodes, TtreeNode *tnode)
+{
+    struct image_tnode key, *found;
+
+    if (!tnode) {
+        return 0;
+    }
+
+    key.tnode = tnode;
+    found = bsearch(&key, tnodes, img->num_tnodes, sizeof(*tnodes),
+                    cmp_image_tnodes);
+    TTREE_ASSERT(found != NULL);
+    return img->base + img->tnodes_offs + found->idx * img->tnode_stride +
+        img->tnode_hot;
+}
+
+/*
+ * Take the range a mapping of @size bytes would get now. It's released
+ * at once, ttree_open_mmap just asks for it the next time.
+ */
+static uint64_t pick_image_base(size_t size)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return 0;
+    }
+
+    munmap(ptr, size);
+    return (uintptr_t)ptr;
+}
+
+int ttree_save(Ttree *ttree, int fd, size_t item_size,
+               ttree_serialize_fn serialize, void *arg)
+{
+    struct ttree_image img;
+    struct image_tnode *tnodes = NULL;
+    TtreeNode *tnode, *copy;
+    char *buf = NULL;
+    uint64_t *first_item = NULL;
+    size_t i, rec, bufsize;
+    int j, ret = -1;
+
+    /* Strings behind pointers don't belong to items, so can't be saved. */
+    if (!ttree || (fd < 0) || (item_size < ttree->key_offs) ||
+        (ttree->str_keys == TTREE_STR_PTR) || is_gapped(ttree) ||
+        is_indexed(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    memset(&img, 0, sizeof(img));
+    memcpy(img.magic, TTREE_IMAGE_MAGIC, sizeof(img.magic));
+    img.version = TTREE_IMAGE_VERSION;
+    img.byte_order = TTREE_IMAGE_BYTE_ORDER;
+    img.ptr_size = sizeof(void *);
+    img.keys_per_tnode = ttree->keys_per_tnode;
+    img.flags = ttree->flags;
+    img.str_keys = ttree->str_keys;
+    img.keys_are_unique = ttree->keys_are_unique;
+    img.key_offs = ttree->key_offs;
+    img.key_width = ttree->key_width;
+    img.tnode_bytes = tnode_size(ttree);
+    img.tnode_hot = ttree->tnode_hot;
+    img.tnode_stride = tnode_block_size(ttree);
+    img.item_size = item_size;
+    img.num_items = ttree->num_items;
+    for (tnode = ttree->root ? tnode_leftmost(ttree, ttree->root) : NULL;
+         tnode; tnode = tnode->successor) {
+        img.num_tnodes++;
+    }
+
+    img.tnodes_offs = align_up(sizeof(img), TTREE_IMAGE_ALIGN);
+    img.items_offs = align_up(img.tnodes_offs +
+                              img.num_tnodes * img.tnode_stride,
+                              TTREE_IMAGE_ALIGN);
+    img.image_size = img.items_offs + img.num_items * item_size;
+    img.base = pick_image_base(img.image_size);
+
+    /*
+     * Each node gets an index in successor order, and a node is found
+     * by its address in the array sorted by addresses of nodes.
+     */
+    bufsize = img.tnodes_offs;
+    if (bufsize < img.tnode_stride) {
+        bufsize = img.tnode_stride;
+    }
+    if (bufsize < item_size) {
+        bufsize = item_size;
+    }
+
+    tnodes = malloc((img.num_tnodes + 1) * sizeof(*tnodes));
+    first_item = malloc((img.num_tnodes + 1) * sizeof(*first_item));
+    buf = calloc(1, bufsize);
+    if (!tnodes || !first_item || !buf) {
+        SET_ERRNO(ENOMEM);
+        goto out;
+    }
+
+    rec = 0;
+    for (i = 0, tnode = ttree->root ? tnode_leftmost(ttree, ttree->root) : NULL;
+         tnode; tnode = tnode->successor, i++) {
+        tnodes[i].tnode = tnode;
+        tnodes[i].idx = i;
+        first_item[i] = rec;
+        rec += tnode_num_keys(tnode);
+    }
+
+    qsort(tnodes, img.num_tnodes, sizeof(*tnodes), cmp_image_tnodes);
+    img.root = image_tnode_addr(&img, tnodes, ttree->root);
+    memcpy(buf, &img, sizeof(img));
+    if (write_all(fd, buf, img.tnodes_offs) < 0) {
+        goto out;
+    }
+
+    copy = (TtreeNode *)(buf + img.tnode_hot);
+    for (i = 0, tnode = ttree->root ? tnode_leftmost(ttree, ttree->root) : NULL;
+         tnode; tnode = tnode->successor, i++) {
+        memset(buf, 0, img.tnode_stride);
+        memcpy(buf, (char *)tnode - img.tnode_hot,
+               img.tnode_hot + tnode_size(ttree));
+        copy->version = 0;
+        copy->parent = (TtreeNode *)(uintptr_t)
+            image_tnode_addr(&img, tnodes, tnode->parent);
+        copy->successor = (TtreeNode *)(uintptr_t)
+            image_tnode_addr(&img, tnodes, tnode->successor);
+        copy->left = (TtreeNode *)(uintptr_t)
+            image_tnode_addr(&img, tnodes, tnode->left);
+        copy->right = (TtreeNode *)(uintptr_t)
+            image_tnode_addr(&img, tnodes, tnode->right);
+        tnode_for_each_index(tnode, j) {
+            rec = first_item[i] + (j - tnode->min_idx);
+            copy->keys[j] = (void *)(uintptr_t)
+                (img.base + img.items_offs + rec * item_size +
+                 ttree->key_offs);
+        }
+        if (has_hot_keys(ttree) && !ttree->key_width) {
+            tnode_refresh_hot(ttree, copy);
+        }
+        if (write_all(fd, buf, img.tnode_stride) < 0) {
+            goto out;
+        }
+    }
+
+    memset(buf, 0, bufsize);
+    if (write_all(fd, buf, img.items_offs - img.tnodes_offs -
+                  img.num_tnodes * img.tnode_stride) < 0) {
+        goto out;
+    }
+    for (tnode = ttree->root ? tnode_leftmost(ttree, ttree->root) : NULL;
+         tnode; tnode = tnode->successor) {
+        tnode_for_each_index(tnode, j) {
+            void *item = ttree_key2item(ttree, tnode_key(tnode, j));
+
+            if (serialize) {
+                serialize(item, buf, arg);
+            }
+            else {
+                memcpy(buf, item, item_size);
+            }
+            if (write_all(fd, buf, item_size) < 0) {
+                goto out;
+            }
+        }
+    }
+
+    ret = 0;
+
+out:
+    free(buf);
+    free(first_item);
+    free(tnodes);
+    return ret;
+}
+
+static __inline void *image_reloc(void *ptr, uintptr_t delta)
+{
+    return ptr ? (void *)((uintptr_t)ptr + delta) : NULL;
+}
+
+int ttree_open_mmap(Ttree *ttree, int fd, ttree_cmp_func_fn cmpf)
+{
+    struct ttree_image img;
+    struct stat st;
+    TtreeNode *tnode;
+    char *base;
+    uintptr_t delta;
+    size_t i;
+    int j;
+
+    if (!ttree || (fd < 0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (((size_t)st.st_size < sizeof(img)) ||
+        (pread(fd, &img, sizeof(img), 0) != sizeof(img))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (memcmp(img.magic, TTREE_IMAGE_MAGIC, sizeof(img.magic)) ||
+        ((img.version != TTREE_IMAGE_VERSION) &&
+         (img.version != TTREE_IMAGE_VERSION_V2)) ||
+        (img.byte_order != TTREE_IMAGE_BYTE_ORDER) ||
+        (img.ptr_size != sizeof(void *)) ||
+        (img.image_size != (uint64_t)st.st_size) ||
+        (img.items_offs + img.num_items * img.item_size != img.image_size) ||
+        (img.tnodes_offs + img.num_tnodes * img.tnode_stride >
+         img.items_offs) || (!img.str_keys && !cmpf)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (img.version == TTREE_IMAGE_VERSION_V2) {
+        img.base = 0;
+    }
+
+    /*
+     * Private mapping lets loaded nodes be modified and reused by
+     * the tree as any other nodes without touching the file. The
+     * preferred base is only a hint, the kernel maps the image
+     * elsewhere if the range is taken.
+     */
+    base = mmap((void *)(uintptr_t)img.base, st.st_size,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    if (((img.str_keys ?
+         __ttree_init_str(ttree, img.keys_per_tnode, img.keys_are_unique,
+                          img.key_offs, img.key_width, img.str_keys) :
+         __ttree_init_inline(ttree, img.keys_per_tnode, img.keys_are_unique,
+                             cmpf, img.key_offs, img.key_width)) < 0) ||
+        (ttree_set_flags(ttree, img.flags) < 0) ||
+        (ttree_use_slab(ttree, 0) < 0)) {
+        goto fail;
+    }
+    if ((tnode_size(ttree) != img.tnode_bytes) ||
+        (ttree->tnode_hot != img.tnode_hot) ||
+        (tnode_block_size(ttree) != img.tnode_stride)) {
+        ttree_destroy(ttree);
+        goto invalid;
+    }
+
+    delta = (uintptr_t)base - (uintptr_t)img.base;
+    for (i = 0; delta && (i < img.num_tnodes); i++) {
+        tnode = (TtreeNode *)(base + img.tnodes_offs +
+                              i * img.tnode_stride + img.tnode_hot);
+        tnode->parent = image_reloc(tnode->parent, delta);
+        tnode->successor = image_reloc(tnode->successor, delta);
+        tnode->left = image_reloc(tnode->left, delta);
+        tnode->right = image_reloc(tnode->right, delta);
+        tnode_for_each_index(tnode, j) {
+            tnode->keys[j] = image_reloc(tnode->keys[j], delta);
+        }
+        if (has_hot_keys(ttree)) {
+            tnode_refresh_hot(ttree, tnode);
+        }
+    }
+
+    /*
+     * The mapping is owned by the slab from now on: nodes freed by
+     * the tree go to its free list, and the whole image is unmapped
+     * when the slab is released.
+     */
+    ttree->slab.block_size = img.tnode_stride;
+    ttree->slab.image = base;
+    ttree->slab.image_size = img.image_size;
+    ttree->slab.image_relocated = (delta != 0);
+    ttree->root = image_reloc((void *)(uintptr_t)img.root, delta);
+    ttree->num_items = img.num_items;
+    return 0;
+
+invalid:
+    SET_ERRNO(EINVAL);
+fail:
+    munmap(base, st.st_size);
+    return -1;
+}
+
+int ttree_cursor_open_on_node(TtreeCursor *cursor, Ttree *tree,
+                              TtreeNode *tnode, enum tnode_seek seek)
+{
+    struct tnode_path path;
+
+    if (__cursor_open_on_node(cursor, tree, tnode, seek) < 0) {
+        return -1;
+    }
+    if (tnode && is_concurrent(tree)) {
+        do {
+            path.depth = 0;
+            path_add(&path, tnode);
+            cursor->idx = (seek == TNODE_SEEK_START) ?
+                tnode_min_idx(tnode) : tnode_max_idx(tnode);
+            cursor_save_position(cursor, &path);
+        } while (!path_is_valid(&path));
+    }
+
+    return 0;
+}
+
+int ttree_cursor_open(TtreeCursor *cursor, Ttree *ttree)
+{
+    return ttree_cursor_open_on_node(cursor, ttree, ttree->root,
+                                     TNODE_SEEK_START);
+}
+
+/*
+ * Move the cursor to the leftmost or the rightmost item of the tree.
+ * Returns false if reader went too deep and has to retry.
+ */
+static bool __cursor_sidemost(TtreeCursor *cursor, int side,
+                              struct tnode_path *path)
+{
+    Ttree *ttree = cursor->ttree;
+    TtreeNode *n;
+
+    n = path ? TTREE_LOAD_ACQUIRE(&ttree->root) : ttree->root;
+    cursor->side = TNODE_BOUND;
+    cursor->state = CURSOR_OPENED;
+    cursor->tnode = n;
+    if (UNLIKELY(n == NULL)) {
+        cursor->idx = first_tnode_idx(cursor->ttree);
+        cursor->state = CURSOR_PENDING;
+        return true;
+    }
+    for (;;) {
+        if (UNLIKELY(!path_add(path, n))) {
+            return false;
+        }
+        if (!tnode_load_link(ttree, n, sides[side])) {
+            break;
+        }
+
+        n = tnode_load_link(ttree, n, sides[side]);
+    }
+
+    cursor->tnode = n;
+    cursor->idx = (side == TNODE_LEFT) ? tnode_min_idx(n) : tnode_max_idx(n);
+    if (path) {
+        cursor_save_position(cursor, path);
+    }
+
+    return true;
+}
+
+static int cursor_sidemost(TtreeCursor *cursor, int side)
+{
+    struct tnode_path path;
+
+    TTREE_ASSERT(cursor != NULL);
+    TTREE_ASSERT(cursor->ttree != NULL);
+
+    if (LIKELY(!is_concurrent(cursor->ttree))) {
+        __cursor_sidemost(cursor, side, NULL);
+    }
+    else {
+        do {
+            path.depth = 0;
+        } while (!__cursor_sidemost(cursor, side, &path) ||
+                 !path_from_root_is_valid(&path));
+    }
+
+    return (cursor->tnode != NULL) ? 0 : -1;
+}
+
+int ttree_cursor_first(TtreeCursor *cursor)
+{
+    return cursor_sidemost(cursor, TNODE_LEFT);
+}
+
+int ttree_cursor_last(TtreeCursor *cursor)
+{
+    return cursor_sidemost(cursor, TNODE_RIGHT);
+}
+
+static int __cursor_next(TtreeCursor *cursor, struct tnode_path *path)
+{
+    Ttree *ttree = cursor->ttree;
+
+    if (UNLIKELY(cursor->state == CURSOR_PENDING)) {
+        cursor->state = CURSOR_OPENED;
+        if ((cursor->side == TNODE_LEFT) ||
+            (cursor->idx < tnode_min_idx(cursor->tnode))) {
+            cursor->side = TNODE_BOUND;
+            cursor->idx = tnode_min_idx(cursor->tnode);
+            return TCSR_OK;
+        }
+        else if ((cursor->side == TNODE_RIGHT) ||
+                 (cursor->idx > tnode_max_idx(cursor->tnode))) {
+            /* Pending position is after the maximum key of the node. */
+            cursor->idx = tnode_max_idx(cursor->tnode);
+        }
+        else {
+            return TCSR_OK;
+        }
+    }
+
+    /*
+     * In case when maximum key of the T*-tree node is reached,
+     * the next item will be the very first(minumum) kery of
+     * its successor node. Because of nature of T*-tree we always
+     * has direct access to successor of each tree node.
+     */
+    cursor->side = TNODE_BOUND;
+    if (cursor->idx == tnode_max_idx(cursor->tnode)) {
+        TtreeNode *succ = tnode_load_link(ttree, cursor->tnode, successor);
+
+        if (succ) {
+            path_add(path, succ);
+            cursor->tnode = succ;
+            cursor->idx = tnode_min_idx(cursor->tnode);
+            return TCSR_OK;
+        }
+
+        return TCSR_END;
+    }
+
+    cursor->idx++;
+    while (UNLIKELY(tnode_is_gap(cursor->ttree, cursor->tnode, cursor->idx))) {
+        cursor->idx++;
+    }
+
+    return TCSR_OK;
+}
+
+static int __cursor_prev(TtreeCursor *cursor, struct tnode_path *path)
+{
+    Ttree *ttree = cursor->ttree;
+
+    if (UNLIKELY(cursor->state == CURSOR_PENDING)) {
+        cursor->state = CURSOR_OPENED;
+        if ((cursor->side == TNODE_RIGHT) ||
+            (cursor->idx > tnode_max_idx(cursor->tnode))) {
+            cursor->side = TNODE_BOUND;
+            cursor->idx = tnode_max_idx(cursor->tnode);
+            return TCSR_OK;
+        }
+        else if ((cursor->side == TNODE_LEFT) ||
+                 (cursor->idx < tnode_min_idx(cursor->tnode))) {
+            cursor->side = TNODE_BOUND;
+            cursor->idx = tnode_min_idx(cursor->tnode);
+        }
+    }
+
+    cursor->side = TNODE_BOUND;
+    if (cursor->idx == tnode_min_idx(cursor->tnode)) {
+        /*
+         * When cursor reaches the minimum index in a T*-tree
+         * node, a previous item would be the very last(maximum)
+         * key in the greatest lower bound of given node.
+         */
+        TtreeNode *n = tnode_load_link(ttree, cursor->tnode, left);
+
+        if (n) {
+            for (;;) {
+                if (UNLIKELY(!path_add(path, n))) {
+                    return TCSR_END;
                 }
-                else {
-                    cursor->idx = first_tnode_idx(ttree);
+                if (!tnode_load_link(ttree, n, right)) {
+                    break;
                 }
+
+                n = tnode_load_link(ttree, n, right);
             }
         }
         else {
             /*
-             * Left child was selected. So its N - 1 items
-             * (starting after the min one)
-             * will be copied and inserted before parent's single item.
-             */
-            n = (*node)->left;
-            nkeys = tnode_num_keys(n);
-            (*node)->keys[ttree->keys_per_tnode - 1] =
-                (*node)->keys[(*node)->min_idx];
-            (*node)->min_idx = offs = ttree->keys_per_tnode - nkeys;
-            (*node)->max_idx = ttree->keys_per_tnode - 1;
-            if (!cursor) {
-                goto no_cursor;
-            }
-            else if (cursor->tnode == n) {
-                if (cursor->idx > n->min_idx) {
-                    cursor->tnode = *node;
-                    cursor->idx = (*node)->min_idx + (cursor->idx - n->min_idx);
-                }
-                else {
-                    cursor->idx = first_tnode_idx(ttree);
+             * If given node has not greatest lower bound(I.e. it hasn't
+             * even its left child), we have to determine an accestor
+             * of given node such that it's a right child of its parent.
+             * The parent of accestor we found will be the previous node
+             * of given one.
+             */
+            TtreeNode *p;
+
+            for (n = cursor->tnode; (p = tnode_load_link(ttree, n, parent)) &&
+                     (tnode_load_link(ttree, p, left) == n); n = p) {
+                if (UNLIKELY(!path_add(path, p))) {
+                    return TCSR_END;
                 }
             }
+            if (!p) {
+                return TCSR_END;
+            }
 
-            n->max_idx = n->min_idx++;
+            n = p;
+            path_add(path, n);
         }
 
-no_cursor:
-        memcpy((*node)->keys + offs,
-               n->keys + n->min_idx, sizeof(void *) * (nkeys - 1));
-        n->keys[first_tnode_idx(ttree)] = n->keys[n->max_idx];
-        n->min_idx = n->max_idx = first_tnode_idx(ttree);
+        cursor->tnode = n;
+        cursor->idx = tnode_max_idx(cursor->tnode);
+        return TCSR_OK;
     }
 
-out:
-    if (ttree->root->parent) {
-        ttree->root = *node;
+    cursor->state = CURSOR_OPENED;
+    cursor->idx--;
+    while (UNLIKELY(tnode_is_gap(cursor->ttree, cursor->tnode, cursor->idx))) {
+        cursor->idx--;
     }
+
+    return TCSR_OK;
 }
 
-static __inline void __add_successor(TtreeNode *n)
+/*
+ * Step of a cursor in concurrent mode. If the node cursor points to
+ * was changed since cursor had been positioned, the position is
+ * found again by the key cursor remembered. Otherwise the step is made
+ * on a copy of the cursor which replaces the cursor only if none of
+ * nodes the step went through was changed meanwhile.
+ */
+static int cursor_step_concurrent(TtreeCursor *cursor,
+                                  int (*step)(TtreeCursor *,
+                                              struct tnode_path *))
 {
-    /*
-     * After new leaf node was added, its successor should be
-     * fixed. Also it(successor) could became a successor of the node
-     * higher than the given one.
-     * There are several possible cases of such situation:
-     * 1) If new node is added as a right child, it inherites
-     *    successor of its parent. And it itself becomes a successor
-     *    of its parent.
-     * 2) If it is a left child, its parent will be the successor.
-     * 2.1) If parent itself is a right child, then newly added node becomes
-     *      the successor of parent's parent.
-     * 2.2) Otherwise it becomes a successor of one of nodes located higher.
-     *      In this case, we should browse up the tree starting from
-     *      parent's parent. One of the nodes on the path *may* have a successor
-     *      equals to parent of a newly added node. If such node will be found,
-     *      its successor should be changed to a newly added node.
-     */
-    if (tnode_get_side(n) == TNODE_RIGHT) {
-        n->successor = n->parent->successor;
-        n->parent->successor = n;
-    }
-    else {
-        n->successor = n->parent;
-        if (tnode_get_side(n->parent) == TNODE_RIGHT) {
-            n->parent->parent->successor = n;
+    struct tnode_path path;
+    TtreeCursor tmp;
+    int ret;
+
+    for (;;) {
+        if (tnode_read_begin(cursor->tnode) != cursor->version) {
+            bool was_opened = (cursor->state == CURSOR_OPENED);
+            bool after_key = cursor->after_key;
+
+            ttree_lookup(cursor->ttree, cursor->key, cursor);
+            if (!cursor->tnode) {
+                cursor->state = CURSOR_CLOSED;
+                return TCSR_END;
+            }
+            if (!was_opened && (cursor->state == CURSOR_OPENED)) {
+                cursor->state = CURSOR_PENDING;
+                cursor->side = TNODE_BOUND;
+                cursor->idx += after_key;
+                cursor->after_key = after_key;
+            }
+
+            continue;
         }
-        else if (tnode_get_side(n->parent) == TNODE_LEFT) {
-            register TtreeNode *node;
 
-            for (node = n->parent->parent; node; node = node->parent) {
-                if (node->successor == n->parent) {
-                    node->successor = n;
-                    break;
-                }
-            }
+        /* The step is valid only if the node is still as cursor saw it */
+        ttree_cursor_copy(&tmp, cursor);
+        path.tnodes[0] = tmp.tnode;
+        path.versions[0] = tmp.version;
+        path.depth = 1;
+        ret = step(&tmp, &path);
+        if ((ret == TCSR_OK) && (path.depth <= TTREE_MAX_PATH)) {
+            tmp.version = path_version(&path, tmp.tnode);
+            tmp.key = tnode_key(tmp.tnode, tmp.idx);
+            tmp.after_key = false;
         }
+        if (path_is_valid(&path)) {
+            break;
+        }
+    }
+
+    if (ret == TCSR_OK) {
+        ttree_cursor_copy(cursor, &tmp);
     }
+
+    return ret;
 }
 
-static __inline void __remove_successor(TtreeNode *n)
+int ttree_cursor_next(TtreeCursor *cursor)
 {
-    /*
-     * Node removing could affect the successor of one of nodes
-     * with higher level, so it should be fixed.
-     * Since T*-tree node deletion algorithm
-     * assumes that ony leafs are removed, successor fixing
-     * is opposite to successor adding algorithm.
-     */
-    if (tnode_get_side(n) == TNODE_RIGHT) {
-        n->parent->successor = n->successor;
-    }
-    else if (tnode_get_side(n->parent) == TNODE_RIGHT) {
-        n->parent->parent->successor = n->parent;
+    TTREE_ASSERT(cursor != NULL);
+    TTREE_ASSERT(cursor->ttree != NULL);
+
+    if (UNLIKELY(cursor->state == CURSOR_CLOSED)) {
+        return TCSR_END;
     }
-    else {
-        register TtreeNode *node = n;
 
-        while ((node = node->parent)) {
-            if (node->successor == n) {
-                node->successor = n->parent;
-                break;
-            }
-        }
+    TTREE_ASSERT(cursor->tnode != NULL);
+    if (UNLIKELY(is_concurrent(cursor->ttree))) {
+        return cursor_step_concurrent(cursor, __cursor_next);
     }
+
+    return __cursor_next(cursor, NULL);
 }
 
-static void fixup_after_insertion(Ttree *ttree, TtreeNode *n,
-                                  TtreeCursor *cursor)
+int ttree_cursor_prev(TtreeCursor *cursor)
 {
-    int bfc_delta = get_bfc_delta(n);
-    TtreeNode *node = n;
+    TTREE_ASSERT(cursor != NULL);
+    TTREE_ASSERT(cursor->ttree != NULL);
 
-    __add_successor(n);
-    /* check tree for balance after new node was added. */
-    while ((node = node->parent)) {
-        node->bfc += bfc_delta;
-        /*
-         * if node becomes balanced, tree balance is ok,
-         * so process may be stopped here
-         */
-        if (!node->bfc) {
-            return;
-        }
-        if (subtree_is_unbalanced(node)) {
-            /*
-             * Because of nature of T-tree rebalancing, just inserted item
-             * may change its position in its node and even the node itself.
-             * Thus if T-tree cursor was specified we have to take care of it.
-             */
-            rebalance(ttree, &node, cursor);
+    if (UNLIKELY(cursor->state == CURSOR_CLOSED)) {
+        return TCSR_END;
+    }
 
-            /*
-             * single or double rotation tree becomes balanced
-             * and we can stop here.
-             */
-            return;
+    TTREE_ASSERT(cursor->tnode != NULL);
+    if (UNLIKELY(is_concurrent(cursor->ttree))) {
+        return cursor_step_concurrent(cursor, __cursor_prev);
+    }
+
+    return __cursor_prev(cursor, NULL);
+}
+
+enum cursor_seek {
+    SEEK_GE,
+    SEEK_GT,
+    SEEK_LE,
+    SEEK_LT,
+};
+
+/*
+ * Move the cursor over all items having the same key it points to.
+ * Makes sense only for trees with duplicated keys.
+ */
+static void cursor_skip_equal(TtreeCursor *cursor, void *key,
+                              int (*step)(TtreeCursor *))
+{
+    Ttree *ttree = cursor->ttree;
+    TtreeCursor tmp;
+
+    for (;;) {
+        ttree_cursor_copy(&tmp, cursor);
+        if ((step(&tmp) != TCSR_OK) ||
+            (is_concurrent(ttree) ? ttree->cmp_func(key, tmp.key) :
+             tnode_cmp(ttree, key, tmp.tnode, tmp.idx))) {
+            break;
         }
 
-        bfc_delta = get_bfc_delta(node);
+        ttree_cursor_copy(cursor, &tmp);
     }
 }
 
-static void fixup_after_deletion(Ttree *ttree, TtreeNode *n,
-                                 TtreeCursor *cursor)
+static int cursor_seek(TtreeCursor *cursor, Ttree *ttree, void *key,
+                       enum cursor_seek seek)
 {
-    TtreeNode *node = n->parent;
-    int bfc_delta = get_bfc_delta(n);
+    int ret;
 
-    __remove_successor(n);
-
-    /*
-     * Unlike balance fixing after insertion,
-     * deletion may require several rotations.
-     */
-    while (node) {
-        node->bfc -= bfc_delta;
+    if (!ttree_lookup(ttree, key, cursor)) {
         /*
-         * If node's balance factor was 0 and becomes 1 or -1, we can stop.
+         * Pending cursor points between two items around the key,
+         * so a single step in any direction gives the bound.
          */
-        if (!(node->bfc + bfc_delta))
-            break;
-
-        bfc_delta = get_bfc_delta(node);
-        if (subtree_is_unbalanced(node)) {
-            TtreeNode *tmp = node;
+        if (!cursor->tnode) {
+            ret = TCSR_END;
+        }
+        else if ((seek == SEEK_GE) || (seek == SEEK_GT)) {
+            ret = ttree_cursor_next(cursor);
+        }
+        else {
+            ret = ttree_cursor_prev(cursor);
+        }
 
-            rebalance(ttree, &tmp, cursor);
-            /*
-             * If after rotation subtree height is not changed,
-             * proccess should be continued.
-             */
-            if (tmp->bfc)
-                break;
+        goto out;
+    }
 
-            node = tmp;
+    ret = TCSR_OK;
+    if ((seek == SEEK_GE) || (seek == SEEK_LT)) {
+        if (!ttree->keys_are_unique) {
+            cursor_skip_equal(cursor, key, ttree_cursor_prev);
         }
+        if (seek == SEEK_LT) {
+            ret = ttree_cursor_prev(cursor);
+        }
+    }
+    else {
+        if (!ttree->keys_are_unique) {
+            cursor_skip_equal(cursor, key, ttree_cursor_next);
+        }
+        if (seek == SEEK_GT) {
+            ret = ttree_cursor_next(cursor);
+        }
+    }
 
-        node = node->parent;
+out:
+    if (ret != TCSR_OK) {
+        cursor->state = CURSOR_CLOSED;
     }
+
+    return ret;
 }
 
-int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
-                 ttree_cmp_func_fn cmpf, size_t key_offs)
+int ttree_cursor_seek_ge(TtreeCursor *cursor, Ttree *ttree, void *key)
 {
-    TTREE_CT_ASSERT((TTREE_DEFAULT_NUMKEYS >= TNODE_ITEMS_MIN) &&
-                    (TTREE_DEFAULT_NUMKEYS <= TNODE_ITEMS_MAX));
+    return cursor_seek(cursor, ttree, key, SEEK_GE);
+}
 
-    if ((num_keys < TNODE_ITEMS_MIN) ||
-        (num_keys > TNODE_ITEMS_MAX) || !ttree || !cmpf) {
-        SET_ERRNO(EINVAL);
-        return -1;
-    }
+int ttree_cursor_seek_gt(TtreeCursor *cursor, Ttree *ttree, void *key)
+{
+    return cursor_seek(cursor, ttree, key, SEEK_GT);
+}
 
-    ttree->root = NULL;
-    ttree->keys_per_tnode = num_keys;
-    ttree->cmp_func = cmpf;
-    ttree->key_offs = key_offs;
-    ttree->keys_are_unique = is_unique;
+int ttree_cursor_seek_le(TtreeCursor *cursor, Ttree *ttree, void *key)
+{
+    return cursor_seek(cursor, ttree, key, SEEK_LE);
+}
 
-    return 0;
+int ttree_cursor_seek_lt(TtreeCursor *cursor, Ttree *ttree, void *key)
+{
+    return cursor_seek(cursor, ttree, key, SEEK_LT);
 }
 
-void ttree_destroy(Ttree *ttree)
+/*
+ * Index of the first key greater than @key among
+ * @tnode keys starting from @idx.
+ */
+static int tnode_upper_bound(Ttree *ttree, TtreeNode *tnode,
+                             int idx, void *key)
 {
-    TtreeNode *tnode, *next;
+    int floor = idx, ceil = tnode_max_idx(tnode), mid;
 
-    if (!ttree->root)
-        return;
-    for (tnode = next = ttree_node_leftmost(ttree->root); tnode; tnode = next) {
-        next = tnode->successor;
-        free(tnode);
+    while (floor <= ceil) {
+        mid = (floor + ceil) >> 1;
+        if (tnode_cmp(ttree, key, tnode, mid) < 0)
+            ceil = mid - 1;
+        else
+            floor = mid + 1;
     }
 
-    ttree->root = NULL;
+    return floor;
 }
 
-void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
+/*
+ * Index following the last key of @tnode not greater than @hi
+ * (NULL for no bound). Only the maximum key is compared if the
+ * whole node is in range.
+ */
+static int tnode_range_end(Ttree *ttree, TtreeNode *tnode, int idx, void *hi)
 {
-    TtreeNode *n, *marked_tn, *target;
-    int side = TNODE_BOUND, cmp_res, idx;
-    void *item = NULL;
-    enum ttree_cursor_state st = CURSOR_PENDING;
+    if (hi && (ttree->cmp_func(hi, tnode_key_max(tnode)) < 0)) {
+        return tnode_upper_bound(ttree, tnode, idx, hi);
+    }
 
-    /*
-     * Classical T-tree search algorithm is O(log(2N/M) + log(M - 2))
-     * Where N is total number of items in the tree and M is a number of
-     * items per node. In worst case each node on the path requires 2
-     * comparison(with its min and max items) plus binary search in the last
-     * node(bound node) excluding its first and last items.
-     *
-     * Here is used another approach that was suggested in
-     * "Tobin J. Lehman , Michael J. Carey, A Study of Index Structures for
-     * Main Memory Database Management Systems".
-     * It reduces O(log(2N/M) + log(M - 2)) to true O(log(N)).
-     * This algorithm compares the search
-     * key only with minimum item in each node. If search key is greater,
-     * current node is marked for future consideration.
-     */
-    target = n = ttree->root;
-    marked_tn = NULL;
-    idx = first_tnode_idx(ttree);
-    if (!n) {
+    return tnode->max_idx + 1;
+}
+
+/*
+ * In concurrent mode a slice is copied out of a node and handed to
+ * the callback only if the node wasn't changed while it was copied.
+ * Otherwise the scan starts over after the last key handed so far.
+ */
+static ssize_t range_scan_concurrent(Ttree *ttree, void *lo, void *hi,
+                                     ttree_range_fn callback, void *arg)
+{
+    TtreeCursor cursor;
+    TtreeNode *tnode, *succ;
+    void **slice, *last = NULL;
+    ssize_t scanned = 0;
+    uint32_t version, succ_version;
+    int idx, end, max_idx, ret;
+    bool stop;
+
+    slice = malloc(ttree->keys_per_tnode * sizeof(*slice));
+    if (!slice) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+restart:
+    if (last) {
+        ret = ttree_cursor_seek_gt(&cursor, ttree, last);
+    }
+    else if (lo) {
+        ret = ttree_cursor_seek_ge(&cursor, ttree, lo);
+    }
+    else {
+        ttree_cursor_open(&cursor, ttree);
+        ret = ttree_cursor_first(&cursor);
+    }
+    if (ret != TCSR_OK) {
         goto out;
     }
-    while (n) {
-        target = n;
-        cmp_res = ttree->cmp_func(key, tnode_key_min(n));
-        if (cmp_res < 0)
-            side = TNODE_LEFT;
-        else if (cmp_res > 0) {
-            marked_tn = n; /* mark current node for future consideration. */
-            side = TNODE_RIGHT;
+
+    tnode = cursor.tnode;
+    idx = cursor.idx;
+    version = cursor.version;
+    for (;;) {
+        max_idx = tnode_max_idx(tnode);
+        end = max_idx + 1;
+        if (hi && (tnode_cmp(ttree, hi, tnode, max_idx) < 0)) {
+            end = tnode_upper_bound(ttree, tnode, idx, hi);
         }
-        else { /* ok, key is found, search is completed. */
-            side = TNODE_BOUND;
-            idx = n->min_idx;
-            item = ttree_key2item(ttree, tnode_key_min(n));
-            st = CURSOR_OPENED;
-            goto out;
+        if (end > idx) {
+            /* The copy may race with a writer, it's checked below */
+            memcpy(slice, &tnode->keys[idx], (end - idx) * sizeof(*slice));
+        }
+
+        stop = (end <= max_idx);
+        succ = tnode_load_link(ttree, tnode, successor);
+        TTREE_FENCE_ACQUIRE();
+        if (TTREE_LOAD_RELAXED(&tnode->version) != version) {
+            goto restart;
+        }
+        if (end > idx) {
+            scanned += end - idx;
+            last = slice[end - idx - 1];
+            if (callback(slice, end - idx, arg)) {
+                break;
+            }
+        }
+        if (stop || !succ) {
+            break;
+        }
+
+        /*
+         * Successor is still linked to the node if the node
+         * wasn't changed after the successor version was read.
+         */
+        succ_version = tnode_read_begin(succ);
+        TTREE_FENCE_ACQUIRE();
+        if (TTREE_LOAD_RELAXED(&tnode->version) != version) {
+            goto restart;
         }
 
-        n = n->sides[side];
+        tnode = succ;
+        version = succ_version;
+        idx = tnode_min_idx(tnode);
     }
-    if (marked_tn) {
-        int c = ttree->cmp_func(key, tnode_key_max(marked_tn));
 
-        if (c <= 0) {
-            side = TNODE_BOUND;
-            target = marked_tn;
-            if (!c) {
-                item = ttree_key2item(ttree, tnode_key_max(target));
-                idx = target->max_idx;
-                st = CURSOR_OPENED;
-            }
-            else { /* make internal binary search */
-                struct tnode_lookup tnl;
+out:
+    free(slice);
+    return scanned;
+}
+
+ssize_t ttree_range_scan(Ttree *ttree, void *lo, void *hi,
+                         ttree_range_fn callback, void *arg)
+{
+    TtreeCursor cursor;
+    TtreeNode *tnode;
+    ssize_t scanned = 0;
+    int idx, end, num;
 
-                tnl.key = key;
-                tnl.low_bound = target->min_idx + 1;
-                tnl.high_bound = target->max_idx - 1;
-                item = lookup_inside_tnode(ttree, target, &tnl, &idx);
-                st = (item != NULL) ? CURSOR_OPENED : CURSOR_PENDING;
-            }
+    if (!ttree || !callback) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
 
-            goto out;
+    TTREE_STAT_ADD(ttree, scans, 1);
+    if (UNLIKELY(is_concurrent(ttree))) {
+        scanned = range_scan_concurrent(ttree, lo, hi, callback, arg);
+        TTREE_STAT_ADD(ttree, scan_keys, (scanned > 0) ? scanned : 0);
+        return scanned;
+    }
+    if (lo) {
+        if (ttree_cursor_seek_ge(&cursor, ttree, lo) != TCSR_OK) {
+            return 0;
+        }
+    }
+    else {
+        ttree_cursor_open(&cursor, ttree);
+        if (ttree_cursor_first(&cursor) != TCSR_OK) {
+            return 0;
         }
     }
 
     /*
-     * If we're here, item wasn't found. So the only thing
-     * needs to be done is to determine the position where search key
-     * may be placed to. If target node is not empty, key may be placed
-     * to its min or max positions.
+     * Only the maximum key of each node is compared with the upper
+     * bound, the whole rest of the node is handed to the callback as is
+     * (in slices between gaps if the tree is gapped).
      */
-    if (!tnode_is_full(ttree, target)) {
-        side = TNODE_BOUND;
-        idx = ((marked_tn != target) || (cmp_res < 0)) ?
-            target->min_idx : (target->max_idx + 1);
-        st = CURSOR_PENDING;
+    for (tnode = cursor.tnode, idx = cursor.idx; tnode;
+         tnode = tnode_link(ttree, tnode, successor),
+             idx = tnode ? tnode->min_idx : 0) {
+        end = tnode_range_end(ttree, tnode, idx, hi);
+        for (; (num = tnode_key_run(ttree, tnode, &idx, end)) > 0;
+             idx += num) {
+            scanned += num;
+            if (callback(&tnode->keys[idx], num, arg)) {
+                goto out;
+            }
+        }
+        if (end <= tnode->max_idx) {
+            break;
+        }
     }
 
 out:
-    if (cursor) {
-        ttree_cursor_open_on_node(cursor, ttree, target, TNODE_SEEK_START);
-        cursor->side = side;
-        cursor->idx = idx;
-        cursor->state = st;
+    TTREE_STAT_ADD(ttree, scan_keys, scanned);
+    return scanned;
+}
+
+/*
+ * Parallel walk. The successor chain is cut into segments at nodes
+ * holding items of evenly spaced ranks if the tree has order statistics.
+ * Otherwise it's cut at nodes of top levels of the tree: each of them
+ * separates subtrees of about the same size since the tree is balanced.
+ */
+struct parallel_walk {
+    Ttree *ttree;
+    TtreeNode **bounds; /* the first node of each segment */
+    ssize_t *walked;
+    ttree_segment_fn callback;
+    void *arg;
+};
+
+static void walk_segment(void *arg, int segment)
+{
+    struct parallel_walk *pw = arg;
+    TtreeNode *tnode, *end = pw->bounds[segment + 1];
+    int idx, num;
+
+    for (tnode = pw->bounds[segment]; tnode != end;
+         tnode = tnode_link(pw->ttree, tnode, successor)) {
+        for (idx = tnode->min_idx;
+             (num = tnode_key_run(pw->ttree, tnode, &idx,
+                                  tnode->max_idx + 1)) > 0; idx += num) {
+            pw->walked[segment] += num;
+            if (pw->callback(segment, &tnode->keys[idx], num, pw->arg)) {
+                return;
+            }
+        }
     }
+}
 
-    return item;
+/* Put nodes of the top @depth levels of the subtree to @nodes in order. */
+static TtreeNode **list_top_tnodes(Ttree *ttree, TtreeNode *tnode, int depth,
+                                   TtreeNode **nodes)
+{
+    if (!tnode || !depth) {
+        return nodes;
+    }
+
+    nodes = list_top_tnodes(ttree, tnode_link(ttree, tnode, left), depth - 1,
+                            nodes);
+    *nodes++ = tnode;
+    return list_top_tnodes(ttree, tnode_link(ttree, tnode, right), depth - 1,
+                           nodes);
 }
 
-int ttree_insert(Ttree *ttree, void *item)
+static int cut_segments(Ttree *ttree, TtreeNode **bounds, int num_segments)
 {
     TtreeCursor cursor;
+    TtreeNode **top;
+    size_t num_top, part;
+    int depth, i;
+
+    bounds[0] = tnode_leftmost(ttree, ttree->root);
+    bounds[num_segments] = NULL;
+    if (has_order_stats(ttree)) {
+        for (i = 1; i < num_segments; i++) {
+            ttree_select(ttree, (ttree->num_items * i) / num_segments,
+                         &cursor);
+            bounds[i] = cursor.tnode;
+        }
 
-    /*
-     * If the tree already contains the same key item has and
-     * tree's wasn't allowed to hold duplicate keys, signal an error.
-     */
-    if (ttree_lookup(ttree, ttree_item2key(ttree, item), &cursor)
-        && !ttree->keys_are_unique) {
+        return 0;
+    }
+
+    for (depth = 0; ((size_t)1 << depth) < (size_t)num_segments; depth++);
+    top = malloc(sizeof(*top) * (((size_t)1 << depth) - 1));
+    if (!top && depth) {
+        SET_ERRNO(ENOMEM);
         return -1;
     }
 
-    ttree_insert_at_cursor(&cursor, item);
+    /* Top nodes split the chain into num_top + 1 parts. */
+    num_top = list_top_tnodes(ttree, ttree->root, depth, top) - top;
+    for (i = 1; i < num_segments; i++) {
+        part = ((num_top + 1) * i) / num_segments;
+        bounds[i] = part ? top[part - 1] : bounds[0];
+    }
+
+    free(top);
     return 0;
 }
 
-void ttree_insert_at_cursor(TtreeCursor *cursor, void *item)
+ssize_t ttree_for_each_parallel(Ttree *ttree, int num_segments,
+                                int num_threads, ttree_segment_fn callback,
+                                void *arg)
 {
-    Ttree *ttree = cursor->ttree;
-    TtreeNode *at_node, *n;
-    TtreeCursor tmp_cursor;
-    void *key;
+    struct parallel_walk pw;
+    struct ttree_pool *pool = NULL;
+    ssize_t walked = -1;
+    int i;
 
-    TTREE_ASSERT(cursor->ttree != NULL);
-    TTREE_ASSERT(cursor->state == CURSOR_PENDING);
-    key = ttree_item2key(ttree, item);
-    n = at_node = cursor->tnode;
-    if (!ttree->root) { /* The root node has to be created. */
-        at_node = allocate_ttree_node(ttree);
-        at_node->keys[first_tnode_idx(ttree)] = key;
-        at_node->min_idx = at_node->max_idx = first_tnode_idx(ttree);
-        ttree->root = at_node;
-        tnode_set_side(at_node, TNODE_ROOT);
-        ttree_cursor_open_on_node(cursor, ttree, at_node, TNODE_SEEK_START);
-        return;
+    if (!ttree || !callback || (num_segments < 1) || (num_threads < 1) ||
+        is_concurrent(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree->root) {
+        return 0;
     }
-    if (cursor->side == TNODE_BOUND) {
-        if (tnode_is_full(ttree, n)) {
-            /*
-             * If node is full its max item should be removed and
-             * new key should be inserted into it. Removed key becomes
-             * new insert value that should be put in successor node.
-             */
-            void *tmp = n->keys[n->max_idx--];
 
-            increase_tnode_window(ttree, n, &cursor->idx);
-            n->keys[cursor->idx] = key;
-            key = tmp;
+    pw.ttree = ttree;
+    pw.callback = callback;
+    pw.arg = arg;
+    pw.bounds = malloc(sizeof(*pw.bounds) * (num_segments + 1));
+    pw.walked = calloc(num_segments, sizeof(*pw.walked));
+    if (!pw.bounds || !pw.walked) {
+        SET_ERRNO(ENOMEM);
+        goto out;
+    }
+    if (cut_segments(ttree, pw.bounds, num_segments)) {
+        goto out;
+    }
+    if (num_threads > num_segments) {
+        num_threads = num_segments;
+    }
+    if (num_threads > 1) {
+        pool = ttree_pool_create(num_threads - 1);
+    }
 
-            ttree_cursor_copy(&tmp_cursor, cursor);
-            cursor = &tmp_cursor;
+    ttree_pool_run(pool, walk_segment, &pw, num_segments);
+    for (i = 0, walked = 0; i < num_segments; i++) {
+        walked += pw.walked[i];
+    }
+    if (pool) {
+        ttree_pool_destroy(pool);
+    }
 
-            /*
-             * If current node hasn't successor and right child
-             * New node have to be created. It'll become the right child
-             * of the current node.
-             */
-            if (!n->successor || !n->right) {
-                cursor->side = TNODE_RIGHT;
-                cursor->idx = first_tnode_idx(ttree);
-                goto create_new_node;
-            }
+out:
+    free(pw.walked);
+    free(pw.bounds);
+    return walked;
+}
 
-            at_node = n->successor;
-            /*
-             * If successor hasn't any free rooms, new value is inserted
-             * into newly created node that becomes left child of the current
-             * node's successor.
-             */
-            if (tnode_is_full(ttree, at_node)) {
-                cursor->side = TNODE_LEFT;
-                cursor->idx = first_tnode_idx(ttree);
-                goto create_new_node;
+/*
+ * Nodes of trees having the same allocator are moved between them
+ * as they are. Otherwise each node is copied into a new node of @dst
+ * and the original one is freed. Either all nodes are moved or,
+ * if there is no memory, none of them.
+ */
+static int move_tnodes(Ttree *dst, Ttree *src, TtreeNode **nodes, size_t num)
+{
+    TtreeNode **copies;
+    size_t i;
+
+    if ((dst->allocator == src->allocator) &&
+        (dst->alloc_ctx == src->alloc_ctx)) {
+        /* Snapshots of @src keep seeing the nodes as they were. */
+        for (i = 0; i < num; i++) {
+            snapshot_preserve(src, nodes[i]);
+        }
+
+        return 0;
+    }
+
+    copies = malloc(sizeof(*copies) * (num ? num : 1));
+    if (!copies) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        copies[i] = allocate_ttree_node(dst);
+        if (!copies[i]) {
+            while (i--) {
+                free_ttree_node(dst, copies[i]);
             }
 
-            /*
-             * If we're here, then successor has free rooms and key
-             * will be inserted to one of them.
-             */
-            cursor->idx = at_node->min_idx;
-            cursor->tnode = at_node;
+            free(copies);
+            SET_ERRNO(ENOMEM);
+            return -1;
         }
-
-        increase_tnode_window(ttree, at_node, &cursor->idx);
-        at_node->keys[cursor->idx] = key;
-        cursor->state = CURSOR_OPENED;
-        return;
+    }
+    for (i = 0; i < num; i++) {
+        memcpy((char *)copies[i] - dst->tnode_hot,
+               (char *)nodes[i] - src->tnode_hot,
+               dst->tnode_hot + tnode_size(dst));
+        free_ttree_node(src, nodes[i]);
+        nodes[i] = copies[i];
     }
 
-create_new_node:
-    n = allocate_ttree_node(ttree);
-    n->keys[cursor->idx] = key;
-    n->min_idx = n->max_idx = cursor->idx;
-    n->parent = at_node;
-    at_node->sides[cursor->side] = n;
-    tnode_set_side(n, cursor->side);
-    cursor->tnode = n;
-    cursor->state = CURSOR_OPENED;
-    fixup_after_insertion(ttree, n, cursor);
+    free(copies);
+    return 0;
 }
 
-void *ttree_delete(Ttree *ttree, void *key)
+/*
+ * Trees can exchange nodes only if nodes of both have the same
+ * layout and keys are compared the same way.
+ */
+static bool ttrees_are_compatible(Ttree *t1, Ttree *t2)
 {
-    TtreeCursor cursor;
-    void *ret;
-
-    ret = ttree_lookup(ttree, key, &cursor);
-    if (!ret) {
-        return ret;
-    }
-
-    ttree_delete_at_cursor(&cursor);
-    return ret;
+    return ((t1 != t2) && !is_concurrent(t1) && !is_concurrent(t2) &&
+            !is_gapped(t1) && !is_gapped(t2) &&
+            !is_indexed(t1) && !is_indexed(t2) &&
+            (t1->keys_per_tnode == t2->keys_per_tnode) &&
+            (t1->cmp_func == t2->cmp_func) &&
+            (t1->key_offs == t2->key_offs) &&
+            (t1->keys_are_unique == t2->keys_are_unique) &&
+            (t1->key_width == t2->key_width) &&
+            (t1->str_keys == t2->str_keys) &&
+            (t1->tnode_bytes == t2->tnode_bytes) &&
+            (t1->tnode_hot == t2->tnode_hot) &&
+            (t1->count_offs == t2->count_offs));
 }
 
-void *ttree_delete_at_cursor(TtreeCursor *cursor)
+ssize_t ttree_delete_range(Ttree *ttree, void *lo, void *hi,
+                           ttree_item_fn free_cb, void *arg)
 {
-    Ttree *ttree = cursor->ttree;
-    TtreeNode *tnode, *n;
-    void *ret;
+    TtreeCursor cursor;
+    TtreeNode **nodes = NULL, *tnode, *next;
+    size_t removed = 0, num = 0;
+    int idx, end, max_idx, gaps, i;
 
-    TTREE_ASSERT(cursor->ttree != NULL);
-    TTREE_ASSERT(cursor->state == CURSOR_OPENED);
-    tnode = cursor->tnode;
-    ret = ttree_key2item(ttree, tnode->keys[cursor->idx]);
-    decrease_tnode_window(ttree, tnode, &cursor->idx);
-    cursor->state = CURSOR_CLOSED;
-    if (UNLIKELY(cursor->idx > tnode->max_idx)) {
-        cursor->idx = tnode->max_idx;
+    if (!ttree || is_concurrent(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (lo) {
+        if (ttree_cursor_seek_ge(&cursor, ttree, lo) != TCSR_OK) {
+            return 0;
+        }
+    }
+    else {
+        ttree_cursor_open(&cursor, ttree);
+        if (ttree_cursor_first(&cursor) != TCSR_OK) {
+            return 0;
+        }
     }
 
     /*
-     * If after a key was removed, T*-tree node contains more than
-     * minimum allowed number of items, the proccess is completed.
+     * Only the first and the last nodes of the range may keep some
+     * of their keys. If any node between them is left without keys,
+     * the tree is relinked at the end, so space for the list of nodes
+     * is taken before anything is removed.
      */
-    if (tnode_num_keys(tnode) > min_tnode_entries(ttree)) {
-        return ret;
-    }
-    if (is_internal_node(tnode)) {
-        int idx;
+    for (tnode = cursor.tnode, idx = cursor.idx; tnode;
+         tnode = tnode_link(ttree, tnode, successor),
+             idx = tnode ? tnode->min_idx : 0) {
+        end = tnode_range_end(ttree, tnode, idx, hi);
+        if ((idx == tnode->min_idx) && (end > tnode->max_idx)) {
+            num = count_tnodes(ttree);
+            nodes = malloc(sizeof(*nodes) * num);
+            if (!nodes) {
+                SET_ERRNO(ENOMEM);
+                return -1;
+            }
 
-        /*
-         * If it is an internal node, we have to recover number
-         * of items from it by moving one item from its successor.
-         */
-        n = tnode->successor;
-        idx = tnode->max_idx + 1;
-        increase_tnode_window(ttree, tnode, &idx);
-        tnode->keys[idx] = n->keys[n->min_idx++];
-        if (UNLIKELY(cursor->idx > tnode->max_idx)) {
-            cursor->idx = tnode->max_idx;
+            break;
         }
-        if (!tnode_is_empty(n) && is_leaf_node(n)) {
-            return ret;
+        if (end <= tnode->max_idx) {
+            break;
         }
-
-        /*
-         * If we're here, then successor is either a half-leaf
-         * or an empty leaf.
-         */
-        tnode = n;
     }
-    if (!is_leaf_node(tnode)) {
-        int items, diff;
 
-        n = tnode->left ? tnode->left : tnode->right;
-        items = tnode_num_keys(n);
+    for (tnode = cursor.tnode, idx = cursor.idx; tnode;
+         tnode = next, idx = tnode ? tnode->min_idx : 0) {
+        next = tnode_link(ttree, tnode, successor);
+        end = tnode_range_end(ttree, tnode, idx, hi);
+        if (end <= idx) {
+            break;
+        }
+        for (i = idx, gaps = 0; (free_cb || is_gapped(ttree)) && (i < end);
+             i++) {
+            if (tnode_is_gap(ttree, tnode, i)) {
+                gaps++;
+            }
+            else if (free_cb) {
+                free_cb(ttree_key2item(ttree, tnode_key(tnode, i)), arg);
+            }
+        }
 
-        /*
-         * If half-leaf can not be merged with a leaf,
-         * the proccess is completed.
-         */
-        if (items > (ttree->keys_per_tnode - tnode_num_keys(tnode))) {
-            return ret;
+        removed += end - idx - gaps;
+        max_idx = tnode->max_idx;
+        if ((idx == tnode->min_idx) && (end > max_idx)) {
+            /* The node is freed when the tree is relinked */
+            snapshot_preserve(ttree, tnode);
+            tnode->max_idx = tnode->min_idx - 1;
+            continue;
         }
 
-        if (tnode_get_side(n) == TNODE_RIGHT) {
-            /*
-             * Merge current node with its right leaf. Items from the leaf
-             * are placed after the maximum item in a node.
-             */
-            diff = (ttree->keys_per_tnode - tnode->max_idx - items) - 1;
-            if (diff < 0) {
-                memcpy(tnode->keys + tnode->min_idx + diff,
-                       tnode->keys + tnode->min_idx, sizeof(void *) *
-                       tnode_num_keys(tnode));
-                tnode->min_idx += diff;
-                tnode->max_idx += diff;
-                if (cursor->tnode == tnode) {
-                    cursor->idx += diff;
-                }
-            }
-            memcpy(tnode->keys + tnode->max_idx + 1, n->keys + n->min_idx,
-                   sizeof(void *) * items);
-            tnode->max_idx += items;
+        tnode_write_begin(ttree, tnode);
+        if (idx == tnode->min_idx) {
+            tnode->min_idx = end;
         }
         else {
-            /*
-             * Merge current node with its left leaf. Items the leaf
-             * are placed before the minimum item in a node.
-             */
-            diff = tnode->min_idx - items;
-            if (diff < 0) {
-                register int i;
+            tnode_move_keys(ttree, tnode, idx, tnode, end, max_idx + 1 - end);
+            tnode->max_idx -= end - idx;
+        }
+        if (is_gapped(ttree)) {
+            tnode->num_gaps -= gaps;
+            tnode_trim_max(ttree, tnode);
+        }
 
-                for (i = tnode->max_idx; i >= tnode->min_idx; i--) {
-                    tnode->keys[i - diff] = tnode->keys[i];
-                }
+        tnode_count_add(ttree, tnode, -(long)(end - idx));
+        if (end <= max_idx) {
+            break;
+        }
+    }
 
-                tnode->min_idx -= diff;
-                tnode->max_idx -= diff;
-                if (cursor->tnode == tnode) {
-                    cursor->idx -= diff;
-                }
+    ttree->num_items -= removed;
+    if (nodes) {
+        num = 0;
+        for (tnode = tnode_leftmost(ttree, ttree->root); tnode; tnode = next) {
+            next = tnode_link(ttree, tnode, successor);
+            if (tnode_is_empty(tnode)) {
+                retire_ttree_node(ttree, tnode);
             }
+            else {
+                nodes[num++] = tnode;
+            }
+        }
+
+        relink_tree(ttree, nodes, num);
+        free(nodes);
+    }
+
+    write_end(ttree);
+    return removed;
+}
+
+ssize_t ttree_split_at(Ttree *ttree, void *key, Ttree *right)
+{
+    TtreeCursor cursor;
+    TtreeNode **nodes, *tnode, *half = NULL;
+    size_t num, split, i, moved = 0;
+    int idx;
+
+    if (!ttree || !key || !right || !ttrees_are_compatible(ttree, right)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(right)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (ttree_cursor_seek_ge(&cursor, ttree, key) != TCSR_OK) {
+        return 0;
+    }
+
+    /* One more node is needed if the split goes through a node. */
+    num = count_tnodes(ttree);
+    nodes = malloc(sizeof(*nodes) * (num + 1));
+    if (!nodes) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    list_tnodes(ttree, nodes);
+    for (split = 0; nodes[split] != cursor.tnode; split++);
+    if (cursor.idx > cursor.tnode->min_idx) {
+        half = allocate_ttree_node(right);
+        if (!half) {
+            free(nodes);
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+
+        split++;
+    }
+    if (move_tnodes(right, ttree, nodes + split, num - split) < 0) {
+        if (half) {
+            free_ttree_node(right, half);
+        }
+
+        free(nodes);
+        return -1;
+    }
+    if (half) {
+        /* Keys starting from the cursor go to the new node. */
+        tnode = cursor.tnode;
+        for (idx = cursor.idx; idx <= tnode->max_idx; idx++) {
+            tnode_fill_key(right, half, idx, tnode_key(tnode, idx));
+        }
 
-            memcpy(tnode->keys + tnode->min_idx - items, n->keys + n->min_idx,
-                   sizeof(void *) * items);
-            tnode->min_idx -= items;
+        half->min_idx = cursor.idx;
+        half->max_idx = tnode->max_idx;
+        snapshot_preserve(ttree, tnode);
+        tnode->max_idx = cursor.idx - 1;
+        if (has_hot_keys(right)) {
+            tnode_refresh_hot(right, half);
         }
 
-        n->min_idx = 1;
-        n->max_idx = 0;
-        tnode = n;
+        memmove(nodes + split + 1, nodes + split,
+                sizeof(*nodes) * (num - split));
+        nodes[split] = half;
+        num++;
     }
-    if (!tnode_is_empty(tnode)) {
-        return ret;
-    }
-
-    /* if we're here, then current node will be removed from the tree. */
-    n = tnode->parent;
-    if (!n) {
-        ttree->root = NULL;
-        free(tnode);
-        return ret;
+    for (i = split; i < num; i++) {
+        moved += tnode_num_keys(nodes[i]);
     }
 
-    n->sides[tnode_get_side(tnode)] = NULL;
-    fixup_after_deletion(ttree, tnode, NULL);
-    free(tnode);
-    return ret;
+    relink_tree(ttree, nodes, split);
+    relink_tree(right, nodes + split, num - split);
+    ttree->num_items -= moved;
+    right->num_items = moved;
+    free(nodes);
+    return moved;
 }
 
-int ttree_replace(Ttree *ttree, void *key, void *new_item)
+int ttree_join(Ttree *ttree, Ttree *other)
 {
-    TtreeCursor cursor;
+    TtreeNode **nodes;
+    size_t num, num_other;
+    int cmp_res;
+
+    if (!ttree || !other || !ttrees_are_compatible(ttree, other)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (ttree_is_empty(other)) {
+        return 0;
+    }
+    if (!ttree_is_empty(ttree)) {
+        cmp_res = ttree->cmp_func(
+            tnode_key_max(tnode_rightmost(ttree, ttree->root)),
+            tnode_key_min(tnode_leftmost(other, other->root)));
+        if ((cmp_res > 0) || (!cmp_res && ttree->keys_are_unique)) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+    }
+
+    num = count_tnodes(ttree);
+    num_other = count_tnodes(other);
+    nodes = malloc(sizeof(*nodes) * (num + num_other));
+    if (!nodes) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
 
-    if (!ttree_lookup(ttree, &cursor, key))
+    list_tnodes(ttree, nodes);
+    list_tnodes(other, nodes + num);
+    if (move_tnodes(ttree, other, nodes + num, num_other) < 0) {
+        free(nodes);
         return -1;
+    }
 
-    cursor.tnode->keys[cursor.idx] = ttree_item2key(ttree, new_item);
+    relink_tree(ttree, nodes, num + num_other);
+    ttree->num_items += other->num_items;
+    other->root = NULL;
+    other->num_items = 0;
+    free(nodes);
     return 0;
 }
 
-int ttree_cursor_open_on_node(TtreeCursor *cursor, Ttree *tree,
-                              TtreeNode *tnode, enum tnode_seek seek)
+TtreeSnapshot *ttree_snapshot(Ttree *ttree)
 {
-    TTREE_ASSERT(cursor != NULL);
-    TTREE_ASSERT(tree != NULL);
+    TtreeSnapshot *snap;
 
-    memset(cursor, 0, sizeof(*cursor));
-    cursor->ttree = tree;
-    cursor->tnode = tnode;
+    if (!ttree || is_concurrent(ttree) || is_gapped(ttree) ||
+        is_indexed(ttree)) {
+        SET_ERRNO(EINVAL);
+        return NULL;
+    }
 
-    /*
-     * If T*-tree node was specified, the cursor becomes
-     * ready for iteration. Otherwise we suppose that T*-tree
-     * is completely empty, so it becomes ready for insertion.
-     * In second case seek argument is ignored.
-     */
-    if (tnode) {
-        switch (seek) {
-            case TNODE_SEEK_START:
-                cursor->idx = tnode->min_idx;
-                break;
-            case TNODE_SEEK_END:
-                cursor->idx = tnode->max_idx;
-                break;
-            default:
-                SET_ERRNO(EINVAL);
-                return -1;
+    snap = calloc(1, sizeof(*snap));
+    if (snap) {
+        snap->entries = calloc(TTREE_SNAPSHOT_ENTRIES, sizeof(*snap->entries));
+    }
+    if (!snap || !snap->entries) {
+        free(snap);
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+
+    snap->ttree = ttree;
+    snap->root = ttree->root;
+    snap->num_items = ttree->num_items;
+    snap->mask = TTREE_SNAPSHOT_ENTRIES - 1;
+    snap->older = ttree->snapshot;
+    if (snap->older) {
+        snap->older->newer = snap;
+    }
+
+    ttree->snapshot = snap;
+    return snap;
+}
+
+/*
+ * A copy held by a snapshot is the state of the node at the time
+ * the snapshot was taken. If the older snapshot has no copy of its own,
+ * the node wasn't changed between the two snapshots, so the older one
+ * takes the copy over.
+ */
+void ttree_snapshot_release(TtreeSnapshot *snap)
+{
+    TtreeSnapshot *older = snap->older;
+    struct ttree_snapshot_entry *e;
+    size_t i;
+
+    for (i = 0; older && (i <= snap->mask); i++) {
+        e = &snap->entries[i];
+        if (!e->tnode || older->lost || snapshot_find(older, e->tnode)) {
+            continue;
+        }
+        if (snapshot_insert(older, e->tnode, e->copy) < 0) {
+            if (e->copy) {
+                snapshot_lose(older);
+            }
+
+            continue;
         }
 
-        cursor->state = CURSOR_OPENED;
+        e->copy = NULL;
+    }
+
+    if (older) {
+        older->newer = snap->newer;
+    }
+    if (snap->newer) {
+        snap->newer->older = older;
     }
     else {
-        TTREE_ASSERT(cursor->ttree->root == NULL);
-        cursor->idx = first_tnode_idx(cursor->ttree);
-        cursor->state = CURSOR_PENDING;
+        snap->ttree->snapshot = older;
     }
 
-    cursor->side = TNODE_BOUND;
-    return 0;
+    free_snapshot(snap);
 }
 
-int ttree_cursor_open(TtreeCursor *cursor, Ttree *ttree)
+/* The state of a node a snapshot sees. */
+static TtreeNode *snapshot_tnode(TtreeSnapshot *snap, TtreeNode *tnode)
 {
-    return ttree_cursor_open_on_node(cursor, ttree, ttree->root,
-                                     TNODE_SEEK_START);
+    struct ttree_snapshot_entry *e;
+
+    for (; snap; snap = snap->newer) {
+        e = snapshot_find(snap, tnode);
+        if (e) {
+            TTREE_ASSERT(e->copy != NULL);
+            return e->copy;
+        }
+    }
+
+    return tnode;
 }
 
-int ttree_cursor_first(TtreeCursor *cursor)
+void *ttree_snapshot_lookup(TtreeSnapshot *snap, void *key)
 {
-    TtreeNode *tnode;
-    int ret = 0;
+    Ttree *ttree = snap->ttree;
+    struct tnode_lookup tnl;
+    TtreeNode *n;
+    int idx;
 
-    TTREE_ASSERT(cursor != NULL);
-    TTREE_ASSERT(cursor->ttree != NULL);
-    cursor->side = TNODE_BOUND;
-    cursor->state = CURSOR_OPENED;
-    tnode = ttree_node_leftmost(cursor->ttree->root);
-    if (UNLIKELY(tnode == NULL)) {
-        if (LIKELY(cursor->ttree->root != NULL)) {
-            cursor->idx = cursor->ttree->root->min_idx;
-            cursor->tnode = cursor->ttree->root;
+    if (snap->lost) {
+        SET_ERRNO(ESTALE);
+        return NULL;
+    }
+    for (n = snap->root; n; ) {
+        n = snapshot_tnode(snap, n);
+        if (tnode_cmp(ttree, key, n, n->min_idx) < 0) {
+            n = n->left;
+        }
+        else if (tnode_cmp(ttree, key, n, n->max_idx) > 0) {
+            n = n->right;
         }
         else {
-            cursor->idx = first_tnode_idx(cursor->ttree);
-            cursor->state = CURSOR_PENDING;
-            cursor->tnode = NULL;
-            ret = -1;
+            tnl.key = key;
+            tnl.low_bound = n->min_idx;
+            tnl.high_bound = n->max_idx;
+            tnl.cmps = 0;
+            return lookup_inside_tnode(ttree, n, &tnl, &idx);
         }
     }
-    else {
-        cursor->tnode = tnode;
-        cursor->idx = tnode->min_idx;
-    }
 
-    return ret;
+    return NULL;
 }
 
-int ttree_cursor_last(TtreeCursor *cursor)
+/*
+ * Descent keeps the path to the node holding the first key not less
+ * than the search one. Such node is the last one on the way whose
+ * maximum key isn't less than the search key, equal keys may be on
+ * the left of it.
+ */
+int ttree_snapshot_cursor_open(TtreeSnapshotCursor *cursor,
+                               TtreeSnapshot *snap, void *key)
 {
-    TtreeNode *tnode;
-    int ret = 0;
-
-    TTREE_ASSERT(cursor != NULL);
-    TTREE_ASSERT(cursor->ttree != NULL);
+    Ttree *ttree = snap->ttree;
+    TtreeNode *n, *t;
+    int depth = 0, floor, ceil, mid;
+
+    cursor->snap = snap;
+    cursor->depth = 0;
+    if (snap->lost) {
+        SET_ERRNO(ESTALE);
+        return -1;
+    }
+    for (t = snap->root; t; ) {
+        TTREE_ASSERT(depth < TTREE_SNAPSHOT_MAX_DEPTH);
+        cursor->path[depth++] = t;
+        n = snapshot_tnode(snap, t);
+        if (key && (tnode_cmp(ttree, key, n, n->max_idx) > 0)) {
+            t = n->right;
+            continue;
+        }
 
-    cursor->state = CURSOR_OPENED;
-    cursor->side = TNODE_BOUND;
-    tnode = ttree_node_rightmost(cursor->ttree->root);
-    if (UNLIKELY(tnode == NULL)) {
-        if (LIKELY(cursor->ttree->root != NULL)) {
-            cursor->tnode = cursor->ttree->root;
-            cursor->idx = cursor->tnode->max_idx;
+        cursor->depth = depth;
+        floor = n->min_idx;
+        for (ceil = n->max_idx; key && (floor < ceil); ) {
+            mid = (floor + ceil) >> 1;
+            if (tnode_cmp(ttree, key, n, mid) > 0) {
+                floor = mid + 1;
+            }
+            else {
+                ceil = mid;
+            }
         }
-        else {
-            cursor->idx = first_tnode_idx(cursor->ttree);
-            cursor->state = CURSOR_PENDING;
-            cursor->tnode = NULL;
-            ret = -1;
+
+        cursor->idx = floor;
+        if (floor > n->min_idx) {
+            break;
         }
-    }
-    else {
-        cursor->tnode = tnode;
-        cursor->idx = tnode->max_idx;
+
+        t = n->left;
     }
 
-    return ret;
+    return cursor->depth ? 0 : -1;
 }
 
-int ttree_cursor_next(TtreeCursor *cursor)
+int ttree_snapshot_cursor_next(TtreeSnapshotCursor *cursor)
 {
-    TTREE_ASSERT(cursor != NULL);
-    TTREE_ASSERT(cursor->ttree != NULL);
-    TTREE_ASSERT(cursor->tnode != NULL);
+    TtreeSnapshot *snap = cursor->snap;
+    TtreeNode *n, *t;
 
-    if (UNLIKELY(cursor->state == CURSOR_CLOSED)) {
+    if (UNLIKELY(snap->lost)) {
+        SET_ERRNO(ESTALE);
+        cursor->depth = 0;
+    }
+    if (!cursor->depth) {
         return TCSR_END;
     }
-    if (UNLIKELY(cursor->state == CURSOR_PENDING)) {
-        cursor->state = CURSOR_OPENED;
-        if ((cursor->side == TNODE_LEFT) ||
-            (cursor->idx < cursor->tnode->min_idx)) {
-            cursor->side = TNODE_BOUND;
-            cursor->idx = cursor->tnode->min_idx;
-            return TCSR_OK;
-        }
-        else if (cursor->side == TNODE_BOUND) {
-            return TCSR_OK;
-        }
-        else if ((cursor->side == TNODE_RIGHT) ||
-                 (cursor->idx > cursor->tnode->max_idx)) {
-            cursor->idx = cursor->tnode->max_idx;
+
+    n = snapshot_tnode(snap, cursor->path[cursor->depth - 1]);
+    if (cursor->idx < n->max_idx) {
+        cursor->idx++;
+        return TCSR_OK;
+    }
+    if (n->right) {
+        for (t = n->right; t; t = n->left) {
+            TTREE_ASSERT(cursor->depth < TTREE_SNAPSHOT_MAX_DEPTH);
+            cursor->path[cursor->depth++] = t;
+            n = snapshot_tnode(snap, t);
         }
+
+        cursor->idx = n->min_idx;
+        return TCSR_OK;
     }
 
-    /*
-     * In case when maximum key of the T*-tree node is reached,
-     * the next item will be the very first(minumum) kery of
-     * its successor node. Because of nature of T*-tree we always
-     * has direct access to successor of each tree node.
-     */
-    cursor->side = TNODE_BOUND;
-    if (cursor->idx == cursor->tnode->max_idx) {
-        if (cursor->tnode->successor) {
-            cursor->tnode = cursor->tnode->successor;
-            cursor->idx = cursor->tnode->min_idx;
-            return TCSR_OK;
+    /* The next node is the nearest ancestor reached from its left child */
+    for (;;) {
+        t = cursor->path[--cursor->depth];
+        if (!cursor->depth) {
+            return TCSR_END;
         }
 
-        return TCSR_END;
+        n = snapshot_tnode(snap, cursor->path[cursor->depth - 1]);
+        if (n->left == t) {
+            break;
+        }
     }
 
-    cursor->idx++;
+    cursor->idx = n->min_idx;
     return TCSR_OK;
 }
 
-int ttree_cursor_prev(TtreeCursor *cursor)
+void *ttree_snapshot_cursor_item(TtreeSnapshotCursor *cursor)
 {
-    TTREE_ASSERT(cursor != NULL);
-    TTREE_ASSERT(cursor->ttree != NULL);
+    TtreeNode *n;
 
-    if (UNLIKELY(cursor->state == CURSOR_CLOSED)) {
-        return TCSR_END;
+    TTREE_ASSERT(cursor->depth > 0);
+    n = snapshot_tnode(cursor->snap, cursor->path[cursor->depth - 1]);
+    return ttree_key2item(cursor->snap->ttree, n->keys[cursor->idx]);
+}
+
+ssize_t ttree_rank(Ttree *ttree, void *key)
+{
+    TtreeNode *n;
+    size_t rank = 0;
+
+    if (!ttree || !has_order_stats(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
     }
-    if (UNLIKELY(cursor->state == CURSOR_PENDING)) {
-        cursor->state = CURSOR_OPENED;
-        if ((cursor->side == TNODE_RIGHT) ||
-            (cursor->idx > cursor->tnode->max_idx)) {
-            cursor->side = TNODE_BOUND;
-            cursor->idx = cursor->tnode->max_idx;
-            return TCSR_OK;
+
+    /*
+     * All keys of the left subtree and of the node itself are
+     * less than keys of its right subtree, so nodes that are passed
+     * on the right side are counted entirely.
+     */
+    for (n = ttree->root; n; ) {
+        if (tnode_cmp(ttree, key, n, n->min_idx) <= 0) {
+            n = tnode_link(ttree, n, left);
         }
-        else if ((cursor->side == TNODE_LEFT) ||
-                 (cursor->idx < cursor->tnode->min_idx)) {
-            cursor->side = TNODE_BOUND;
-            cursor->idx = cursor->tnode->min_idx;
+        else if (tnode_cmp(ttree, key, n, n->max_idx) > 0) {
+            rank += subtree_count(ttree, tnode_link(ttree, n, left)) +
+                tnode_num_keys(n);
+            n = tnode_link(ttree, n, right);
+        }
+        else {
+            int floor = n->min_idx + 1, ceil = n->max_idx, mid;
+
+            /* Lower bound of the key inside the node */
+            while (floor < ceil) {
+                mid = (floor + ceil) >> 1;
+                if (tnode_cmp(ttree, key, n, mid) > 0)
+                    floor = mid + 1;
+                else
+                    ceil = mid;
+            }
+
+            rank += subtree_count(ttree, tnode_link(ttree, n, left)) +
+                (floor - n->min_idx);
+            break;
         }
     }
 
-    cursor->side = TNODE_BOUND;
-    if (cursor->idx == cursor->tnode->min_idx) {
-        /*
-         * When cursor reaches the minimum index in a T*-tree
-         * node, a previous item would be the very last(maximum)
-         * key in the greatest lower bound of given node.
-         */
-        TtreeNode *n = ttree_node_glb(cursor->tnode);
+    return rank;
+}
 
-        if (n == NULL) {
-            /*
-             * If given node has not greatest lower bound(I.e. it hasn't
-             * even its left child), we have to determine an accestor
-             * of given node such that it's a right child of its parent.
-             * The parent of accestor we found will be the previous node
-             * of given one.
-             */
-            for (n = cursor->tnode; n->parent &&
-                     n->parent->left == n; n = n->parent);
-            if (!n->parent) {
-                return TCSR_END;
-            }
+ssize_t ttree_count_range(Ttree *ttree, void *lo, void *hi)
+{
+    ssize_t lo_rank, hi_rank;
+
+    lo_rank = ttree_rank(ttree, lo);
+    if (lo_rank < 0) {
+        return -1;
+    }
+
+    hi_rank = ttree_rank(ttree, hi);
+    return (hi_rank > lo_rank) ? (hi_rank - lo_rank) : 0;
+}
 
+void *ttree_select(Ttree *ttree, size_t k, TtreeCursor *cursor)
+{
+    TtreeNode *n;
+    size_t left;
+
+    if (!ttree || !has_order_stats(ttree)) {
+        SET_ERRNO(EINVAL);
+        return NULL;
+    }
+    if (k >= ttree->num_items) {
+        return NULL;
+    }
 
-            n = n->parent;
+    for (n = ttree->root; n; ) {
+        left = subtree_count(ttree, tnode_link(ttree, n, left));
+        if (k < left) {
+            n = tnode_link(ttree, n, left);
         }
+        else if (k < left + tnode_num_keys(n)) {
+            int idx = n->min_idx + (int)(k - left);
 
-        cursor->tnode = n;
-        cursor->idx = cursor->tnode->max_idx;
-        return TCSR_OK;
+            if (cursor) {
+                __cursor_open_on_node(cursor, ttree, n, TNODE_SEEK_START);
+                cursor->idx = idx;
+            }
+
+            return ttree_key2item(ttree, tnode_key(n, idx));
+        }
+        else {
+            k -= left + tnode_num_keys(n);
+            n = tnode_link(ttree, n, right);
+        }
     }
 
-    cursor->state = CURSOR_OPENED;
-    cursor->idx--;
-    return TCSR_OK;
+    TTREE_ASSERT(0); /* counters are broken */
+    return NULL;
 }
 
-static void __print_tree(TtreeNode *tnode, int offs,
+static void __print_tree(Ttree *ttree, TtreeNode *tnode, int offs,
                          void (*fn)(TtreeNode *tnode))
 {
     int i;
@@ -1189,24 +6594,27 @@ static void __print_tree(TtreeNode *tnode, int offs,
         fn(tnode);
     }
 
-    __print_tree(tnode->left, offs + 1, fn);
-    __print_tree(tnode->right, offs + 1, fn);
+    __print_tree(ttree, tnode_link(ttree, tnode, left), offs + 1, fn);
+    __print_tree(ttree, tnode_link(ttree, tnode, right), offs + 1, fn);
 }
 
-static int __ttree_get_depth(TtreeNode *tnode)
+static int __ttree_get_depth(Ttree *ttree, TtreeNode *tnode)
 {
+   TtreeNode *left, *right;
    int l, r;
 
    if (!tnode) {
         return 0;
    }
 
-   l = __ttree_get_depth(tnode->left);
-   r = __ttree_get_depth(tnode->right);
-   if (tnode->left) {
+   left = tnode_link(ttree, tnode, left);
+   right = tnode_link(ttree, tnode, right);
+   l = __ttree_get_depth(ttree, left);
+   r = __ttree_get_depth(ttree, right);
+   if (left) {
        l++;
    }
-   if (tnode->right) {
+   if (right) {
        r++;
    }
 
@@ -1215,11 +6623,144 @@ static int __ttree_get_depth(TtreeNode *tnode)
 
 int ttree_get_depth(Ttree *ttree)
 {
-    return __ttree_get_depth(ttree->root);
+    return __ttree_get_depth(ttree, ttree->root);
 }
 
 void ttree_print(Ttree *ttree, void (*fn)(TtreeNode *tnode))
 {
-    __print_tree(ttree->root, 0, fn);
+    __print_tree(ttree, ttree->root, 0, fn);
+}
+
+void ttree_stats(Ttree *ttree, struct ttree_stats *stats)
+{
+    TtreeNode *tnode;
+    int bucket;
+
+    TTREE_ASSERT(ttree != NULL);
+    TTREE_ASSERT(stats != NULL);
+    memset(stats, 0, sizeof(*stats));
+    memcpy(&stats->counters, &ttree->counters, sizeof(stats->counters));
+#ifdef TTREE_STATS
+    stats->counters_enabled = true;
+#endif /* TTREE_STATS */
+    stats->num_items = ttree->num_items;
+    stats->depth = ttree_get_depth(ttree);
+    stats->keys_per_tnode = ttree->keys_per_tnode;
+    stats->mapped_bytes = ttree->slab.mapped_bytes;
+    stats->hugetlb_bytes = ttree->slab.hugetlb_bytes;
+    stats->thp_bytes = ttree->slab.thp_bytes;
+    stats->numa_bytes = ttree->slab.numa_bytes;
+    for (tnode = tnode_leftmost(ttree, ttree->root); tnode;
+         tnode = tnode_link(ttree, tnode, successor)) {
+        bucket = (tnode_num_items(ttree, tnode) * TTREE_FILL_BUCKETS - 1) /
+            ttree->keys_per_tnode;
+        stats->fill_histogram[(bucket < 0) ? 0 : bucket]++;
+        stats->num_tnodes++;
+    }
+}
+
+void ttree_stats_reset(Ttree *ttree)
+{
+    TTREE_ASSERT(ttree != NULL);
+    memset(&ttree->counters, 0, sizeof(ttree->counters));
+}
+
+static int dump_stats(Ttree *ttree, FILE *out)
+{
+    struct ttree_stats stats;
+    const struct ttree_counters *c = &stats.counters;
+    int i;
+
+    ttree_stats(ttree, &stats);
+    fprintf(out, "{\"items\":%zu,\"tnodes\":%zu,\"depth\":%d,"
+            "\"keys_per_tnode\":%d,\"fill_histogram\":[",
+            stats.num_items, stats.num_tnodes, stats.depth,
+            stats.keys_per_tnode);
+    for (i = 0; i < TTREE_FILL_BUCKETS; i++) {
+        fprintf(out, "%s%zu", i ? "," : "", stats.fill_histogram[i]);
+    }
+
+    fprintf(out, "],\"mapped_bytes\":%zu,\"hugetlb_bytes\":%zu,"
+            "\"thp_bytes\":%zu,\"numa_bytes\":%zu", stats.mapped_bytes,
+            stats.hugetlb_bytes, stats.thp_bytes, stats.numa_bytes);
+    fprintf(out, ",\"counters_enabled\":%s,\"counters\":{"
+            "\"lookups\":%" PRIu64 ",\"lookup_cmps\":%" PRIu64 ","
+            "\"lookup_depth\":%" PRIu64 ",\"splits\":%" PRIu64 ","
+            "\"overflows\":%" PRIu64 ",\"single_rotations\":%" PRIu64 ","
+            "\"double_rotations\":%" PRIu64 ",\"merges\":%" PRIu64 ","
+            "\"rebuilds\":%" PRIu64 ",\"tnode_allocs\":%" PRIu64 ","
+            "\"tnode_frees\":%" PRIu64 ",\"moved_keys\":%" PRIu64 ","
+            "\"scans\":%" PRIu64 ",\"scan_keys\":%" PRIu64 "}}\n",
+            stats.counters_enabled ? "true" : "false",
+            c->lookups, c->lookup_cmps, c->lookup_depth, c->splits,
+            c->overflows, c->single_rotations, c->double_rotations,
+            c->merges, c->rebuilds, c->tnode_allocs, c->tnode_frees,
+            c->moved_keys, c->scans, c->scan_keys);
+    return ferror(out) ? -1 : 0;
+}
+
+int ttree_dump(Ttree *ttree, FILE *out)
+{
+    static const char *side_names[] = { "root", "left", "right" };
+    struct image_tnode *tnodes, key, *found;
+    TtreeNode *tnode, *n;
+    size_t num = 0, i;
+    long parent;
+    int depth;
+
+    if (!ttree || !out) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (dump_stats(ttree, out) < 0) {
+        return -1;
+    }
+    for (tnode = tnode_leftmost(ttree, ttree->root); tnode;
+         tnode = tnode_link(ttree, tnode, successor)) {
+        num++;
+    }
+    if (!num) {
+        return 0;
+    }
+
+    /* Node numbers are looked up by addresses of parents. */
+    tnodes = malloc(sizeof(*tnodes) * num);
+    if (!tnodes) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    tnode = tnode_leftmost(ttree, ttree->root);
+    for (i = 0; i < num;
+         i++, tnode = tnode_link(ttree, tnode, successor)) {
+        tnodes[i].tnode = tnode;
+        tnodes[i].idx = i;
+    }
+
+    qsort(tnodes, num, sizeof(*tnodes), cmp_image_tnodes);
+    tnode = tnode_leftmost(ttree, ttree->root);
+    for (i = 0; i < num;
+         i++, tnode = tnode_link(ttree, tnode, successor)) {
+        parent = -1;
+        key.tnode = tnode_link(ttree, tnode, parent);
+        if (key.tnode) {
+            found = bsearch(&key, tnodes, num, sizeof(*tnodes),
+                            cmp_image_tnodes);
+            TTREE_ASSERT(found != NULL);
+            parent = (long)found->idx;
+        }
+        for (depth = 0, n = tnode; (n = tnode_link(ttree, n, parent)); ) {
+            depth++;
+        }
+
+        fprintf(out, "{\"node\":%zu,\"parent\":%ld,\"side\":\"%s\","
+                "\"depth\":%d,\"keys\":%d,\"bfc\":%d}\n",
+                i, parent, side_names[(parent >= 0) ?
+                                      tnode_get_side(tnode) + 1 : 0],
+                depth, tnode_num_items(ttree, tnode), tnode->bfc);
+    }
+
+    free(tnodes);
+    return ferror(out) ? -1 : 0;
 }
 
@@ -43,9 +43,15 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include "ttree_defs.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
 #define TCSR_END -1
 #define TCSR_OK   0
 
@@ -93,6 +99,11 @@ enum ttree_cursor_state {
  * 3) Finally, node that has both left and right childs
  *    is called "internal node"
  *
+ * Nodes of TTREE_INDEX_LINKS trees have no parent and successor
+ * pointers: their memory starts at @a sides, which holds 32-bit links
+ * to all four nodes instead. Links of such nodes can't be read through
+ * the fields of TtreeNode.
+ *
  * @see Ttree
  */
 typedef struct ttree_node {
@@ -115,6 +126,15 @@ typedef struct ttree_node {
         };
     };
 
+    union {
+        /**
+         * Node version. It's odd while a writer modifies the node.
+         * Used only by trees in concurrent mode.
+         */
+        uint32_t version;
+        uint32_t num_gaps; /**< Number of gaps in node of TTREE_GAPPED tree */
+    };
+
     /**
      * First two items of T*-tree node keys array
      */
@@ -124,6 +144,127 @@ typedef struct ttree_node {
 typedef int (*ttree_cmp_func_fn)(void *key1, void *key2);
 typedef void (*ttree_callback_fn)(TtreeNode *tnode, void *arg);
 
+/**
+ * Range scan callback. Gets @a num contiguous keys of one node,
+ * returns non-zero value to stop the scan.
+ */
+typedef int (*ttree_range_fn)(void **keys, int num, void *arg);
+
+/**
+ * Parallel walk callback. Gets @a num contiguous keys of one node
+ * of the @a segment, returns non-zero value to stop the walk of
+ * the segment.
+ */
+typedef int (*ttree_segment_fn)(int segment, void **keys, int num,
+                                void *arg);
+
+/**
+ * Item serializer used by ttree_save. Fills a record of fixed size
+ * the @a item is saved as.
+ */
+typedef void (*ttree_serialize_fn)(void *item, void *record, void *arg);
+
+/**
+ * Callback getting each item removed by ttree_delete_range.
+ */
+typedef void (*ttree_item_fn)(void *item, void *arg);
+
+/**
+ * Merge callback used by ttree_upsert. Gets the @a old_item saved in
+ * the tree and the @a new_item having the same key, returns the item
+ * the tree keeps: either one of them or another item with the same key.
+ */
+typedef void *(*ttree_merge_fn)(void *old_item, void *new_item, void *arg);
+
+/**
+ * @brief T*-tree nodes allocator.
+ *
+ * Every T*-tree node is allocated and freed through the allocator
+ * hooks of its tree. By default nodes are taken from malloc, but
+ * a tree may be switched to another allocator while it is empty.
+ * @see ttree_set_allocator
+ */
+typedef struct ttree_node_allocator {
+    /**
+     * Allocate @a size bytes aligned at least to @a align bytes.
+     * Returns NULL if there is no memory.
+     */
+    void *(*alloc)(void *ctx, size_t size, size_t align);
+
+    /** Free a block previously returned by alloc. */
+    void (*free)(void *ctx, void *ptr);
+
+    /**
+     * Free all blocks allocated from the allocator at once (may be NULL).
+     * If specified, ttree_destroy uses it instead of freeing nodes
+     * one by one.
+     */
+    void (*release)(void *ctx);
+} TtreeNodeAllocator;
+
+/**
+ * @brief Built-in slab allocator state.
+ *
+ * Slab hands out fixed-size node blocks from large chunks.
+ * Freed blocks are kept in a per-tree free list and reused
+ * by subsequent allocations.
+ */
+struct ttree_slab {
+    void *chunks;          /**< List of allocated chunks */
+    void *free_list;       /**< List of free node blocks */
+    char *bump;            /**< Next never used block in the last chunk */
+    char *bump_end;        /**< End of the last chunk */
+    size_t block_size;     /**< Size of one block in bytes */
+    int tnodes_per_chunk;  /**< Number of blocks per each chunk */
+    void *image;           /**< Mapped tree image, see ttree_open_mmap */
+    size_t image_size;     /**< Size of the mapped image in bytes */
+    bool image_relocated;  /**< Links of the image were fixed up on open */
+    size_t page_size;      /**< Pages of mapped chunks, see ttree_use_pages */
+    int numa_node;         /**< NUMA policy of mapped chunks */
+    size_t mapped_bytes;   /**< Size of all mapped chunks */
+    size_t hugetlb_bytes;  /**< Mapped bytes backed by reserved huge pages */
+    size_t thp_bytes;      /**< Mapped bytes advised to be huge pages */
+    size_t numa_bytes;     /**< Mapped bytes bound to a NUMA node */
+    char *arena;           /**< Range nodes with index links are cut from */
+    size_t arena_size;     /**< Size of the reserved arena in bytes */
+    char *index_base;      /**< Address index links count 8-byte units from */
+};
+
+/**
+ * Number of epochs removed nodes are kept through, see ttree_read_enter.
+ */
+#define TTREE_EPOCHS 3
+
+/**
+ * Maximum number of readers registered in a tree at the same time.
+ */
+#define TTREE_MAX_READERS 64
+
+struct ttree_reader_slot;
+
+/**
+ * Operation counters of T*-tree. They're maintained only if the
+ * library is built with TTREE_STATS defined (WITH_STATS option of
+ * cmake), otherwise they stay zero.
+ * @see ttree_stats
+ */
+struct ttree_counters {
+    uint64_t lookups;          /**< Descents from the root by lookups */
+    uint64_t lookup_cmps;      /**< Key comparisons made by lookups */
+    uint64_t lookup_depth;     /**< Nodes visited by lookups */
+    uint64_t splits;           /**< Nodes created by insertions */
+    uint64_t overflows;        /**< Keys pushed out of full nodes */
+    uint64_t single_rotations; /**< Single rotations */
+    uint64_t double_rotations; /**< Double rotations */
+    uint64_t merges;           /**< Nodes merged into other nodes */
+    uint64_t rebuilds;         /**< Subtrees rebuilt by relaxed trees */
+    uint64_t tnode_allocs;     /**< Nodes allocated */
+    uint64_t tnode_frees;      /**< Nodes freed */
+    uint64_t moved_keys;       /**< Keys shifted inside nodes by writes */
+    uint64_t scans;            /**< Calls of ttree_range_scan */
+    uint64_t scan_keys;        /**< Keys handed out by range scans */
+};
+
 /**
  * @brief T*-tree structure
  */
@@ -137,24 +278,243 @@ typedef struct ttree {
      * The field is true if keys in a tree supposed to be unique
      */
     bool keys_are_unique;
+
+    /**
+     * Size of key copies stored inside nodes (0 if keys aren't inlined)
+     */
+    size_t key_width;
+
+    /**
+     * Kind of string keys (0 if keys aren't strings). Inline copies
+     * hold first @a key_width bytes of strings then.
+     */
+    int str_keys;
+
+    struct ttree_counters counters; /**< Operation counters */
+
+    const TtreeNodeAllocator *allocator; /**< T*-tree nodes allocator */
+    void *alloc_ctx;                     /**< Allocator private context */
+    struct ttree_slab slab;              /**< Built-in slab allocator state */
+
+    unsigned int flags;         /**< TTREE_* option flags */
+    size_t num_items;           /**< Total number of items in a tree */
+    size_t tnode_bytes;         /**< Size of each node in bytes */
+    size_t tnode_hot;           /**< Bytes reserved right before each node */
+    size_t count_offs;          /**< Offset of subtree items counter in a node */
+
+    TtreeNode **dirty;          /**< Nodes modified by current write */
+    int num_dirty;              /**< Number of nodes in @a dirty */
+
+    unsigned long epoch;        /**< Global reclamation epoch */
+    TtreeNode *limbo[TTREE_EPOCHS]; /**< Removed nodes by epoch of removal */
+    struct ttree_reader_slot *readers; /**< Slots of registered readers */
+    int latch;                  /**< Tree latch of multi-writer mode */
+    struct ttree_snapshot *snapshot; /**< The newest snapshot of a tree */
 } Ttree;
 
+/**
+ * Maintain number of items in each subtree. It makes rank and
+ * select operations logarithmic at cost of one more word per node.
+ * @see ttree_set_flags
+ */
+#define TTREE_ORDER_STATS 0x01
+
+/**
+ * Allow lookups and cursor iteration concurrently with a writer.
+ * Each write bumps versions of nodes it modifies, readers validate
+ * versions of all nodes they have visited and retry if any of them
+ * was changed. Writers still have to be serialized by the caller.
+ * Requires inline keys, so that readers never compare with an item
+ * that was removed from the tree. Readers must register and use
+ * the tree only between ttree_read_enter and ttree_read_exit: removed
+ * nodes are freed once every reader has left the epoch they were
+ * removed in. Removed items must not be freed while they may be in
+ * use by readers (including open cursors) either.
+ * @see ttree_reader_register
+ */
+#define TTREE_CONCURRENT 0x02
+
+/**
+ * Allow ttree_insert and ttree_delete to be called from several threads
+ * at once (requires TTREE_CONCURRENT). Writes changing a single node
+ * latch only that node, so writes to different nodes run in parallel.
+ * Writes which split, merge or rotate nodes latch the whole tree.
+ * All other modifications still need exclusive access to the tree.
+ */
+#define TTREE_MULTI_WRITER 0x04
+
+/**
+ * Allocate nodes aligned to cache lines and pad them to whole lines.
+ * A copy of the minimum key of each node (or a pointer to it if keys
+ * aren't inlined) is kept in the first line next to the links, so
+ * a descent doesn't touch other lines of the nodes it passes by.
+ * Requires inline keys no longer than TTREE_HOT_KEY_MAX bytes.
+ * @see ttree_fit_keys
+ */
+#define TTREE_CACHE_ALIGNED 0x08
+
+/** Maximum size of an inline key in trees with TTREE_CACHE_ALIGNED. */
+#define TTREE_HOT_KEY_MAX 16
+
+/**
+ * Don't rotate nodes on every insertion and deletion. The tree is
+ * let to get deeper, up to about 1.7 times the depth of a balanced
+ * one, and only the subtree that grows past that is relinked into
+ * a balanced one. Balance factors of nodes aren't maintained then.
+ * Can't be combined with TTREE_CONCURRENT.
+ * @see ttree_rebalance_all
+ */
+#define TTREE_RELAXED_BALANCE 0x10
+
+/**
+ * Leave a gap in place of a key deleted from the middle of a node and
+ * fill gaps by following insertions, so that a write moves only the
+ * keys between its position and the nearest gap. Once an insertion
+ * would move many keys, the node spreads its keys over free rooms
+ * leaving a gap every few keys, and a node which is half gaps is
+ * squeezed back. A gap holds a copy of the key before it, so keys
+ * of a node still form a sorted window searched as usual, only
+ * iteration skips gaps and range scans hand gap-free slices out.
+ * Gaps are marked in a bitmap at the end of each node, so several
+ * copies of the same item in a non-unique tree aren't taken for gaps.
+ * Can't be combined with TTREE_CONCURRENT, TTREE_ORDER_STATS or
+ * TTREE_CACHE_ALIGNED. Gapped trees can't be snapshotted, saved,
+ * split or joined.
+ */
+#define TTREE_GAPPED 0x20
+
+/**
+ * Link nodes by 32-bit indices instead of pointers, which cuts 16 bytes
+ * off each node. Nodes are carved from a single address range the slab
+ * reserves up front, and an index is the offset of a node in it.
+ * Requires the built-in slab set by ttree_use_slab (not by
+ * ttree_use_pages). Can't be combined with TTREE_CONCURRENT or
+ * TTREE_CACHE_ALIGNED. Trees with index links can't be snapshotted,
+ * saved, split, joined, switched to another allocator or resized by
+ * ttree_set_keys_per_tnode. ttree_node_leftmost and other helpers
+ * walking node links directly don't work for them either.
+ */
+#define TTREE_INDEX_LINKS 0x40
+
+#define TTREE_FLAGS_ALL                                                 \
+    (TTREE_ORDER_STATS | TTREE_CONCURRENT | TTREE_MULTI_WRITER |        \
+     TTREE_CACHE_ALIGNED | TTREE_RELAXED_BALANCE | TTREE_GAPPED |      \
+     TTREE_INDEX_LINKS)
+
+/**
+ * Default allocator: every node is allocated with malloc.
+ */
+extern const TtreeNodeAllocator ttree_malloc_allocator;
+
+/**
+ * Default number of T*-tree nodes per slab chunk.
+ */
+#define TTREE_SLAB_DEFAULT_TNODES 256
+
+/**
+ * Sizes of huge pages nodes may be carved from, see ttree_use_pages.
+ */
+#define TTREE_PAGE_2M ((size_t)2 << 20)
+#define TTREE_PAGE_1G ((size_t)1 << 30)
+
+/**
+ * NUMA policies of ttree_use_pages. Non-negative values are numbers
+ * of NUMA nodes, at most TTREE_NUMA_NODES_MAX - 1.
+ */
+#define TTREE_NUMA_ANY (-1)   /**< Memory is placed by the kernel */
+#define TTREE_NUMA_LOCAL (-2) /**< Node of the thread mapping a chunk */
+#define TTREE_NUMA_NODES_MAX 1024
+
+/**
+ * Maximum allowed size of a key copy stored inside T*-tree node.
+ */
+#define TTREE_INLINE_KEY_MAX 64
+
+/**
+ * Kinds of string keys (see ttree_init_str).
+ */
+#define TTREE_STR_PTR   1 /**< Key field is a pointer to a string */
+#define TTREE_STR_ARRAY 2 /**< Key field is an array holding a string */
+
 typedef struct ttree_cursor {
     Ttree *ttree;
     TtreeNode *tnode;     /**< A pointer to T*-tree node */
     int idx;              /**< Particular index in a T*-tree node array */
     int side;             /**< T*-tree node side. Used when item is inserted. */
     enum ttree_cursor_state state;
+    uint32_t version;     /**< Version of the node (only in concurrent mode) */
+    void *key;            /**< Key to recover position by (concurrent mode) */
+    bool after_key;       /**< Pending position is after the key */
 } TtreeCursor;
 
+/**
+ * A node of a tree together with its copy a snapshot sees.
+ * @see TtreeSnapshot
+ */
+struct ttree_snapshot_entry {
+    TtreeNode *tnode; /**< The node in the tree (NULL if entry is free) */
+    TtreeNode *copy;  /**< Copy of the node (NULL if the node is newer) */
+};
+
+/**
+ * @brief Read-only point-in-time view of T*-tree.
+ *
+ * Snapshot shares nodes with the tree. Before the tree changes a node
+ * for the first time after the newest snapshot was taken, the node is
+ * copied into a hash table of that snapshot. Only keys and links to
+ * children of copies are used, so parents and successors aren't copied:
+ * snapshot cursors keep paths from the root instead. A snapshot reads
+ * a node from the first table having the node, starting from its own
+ * one and going to newer snapshots. If there is no such table, the node
+ * wasn't changed since the snapshot was taken.
+ * @see ttree_snapshot
+ */
+typedef struct ttree_snapshot {
+    Ttree *ttree;                   /**< Tree the snapshot was taken of */
+    TtreeNode *root;                /**< Root of the tree at that time */
+    size_t num_items;               /**< Number of items at that time */
+    struct ttree_snapshot *older;   /**< Previous snapshot of the tree */
+    struct ttree_snapshot *newer;   /**< Next snapshot of the tree */
+    struct ttree_snapshot_entry *entries; /**< Copies of changed nodes */
+    size_t mask;                    /**< Size of @a entries minus 1 */
+    size_t num_entries;             /**< Number of used entries */
+    bool lost;                      /**< A node failed to be copied */
+} TtreeSnapshot;
+
+/**
+ * Maximum depth of a path snapshot cursor keeps. It's enough both
+ * for AVL trees and relaxed trees of any size fitting in memory.
+ */
+#define TTREE_SNAPSHOT_MAX_DEPTH 128
+
+/**
+ * @brief Cursor iterating over items of a snapshot in key order.
+ * @see ttree_snapshot_cursor_open
+ */
+typedef struct ttree_snapshot_cursor {
+    TtreeSnapshot *snap;  /**< Snapshot the cursor belongs to */
+    int depth;            /**< Length of @a path, 0 if cursor is closed */
+    int idx;              /**< Index of current item in the last node */
+    TtreeNode *path[TTREE_SNAPSHOT_MAX_DEPTH]; /**< Nodes from the root */
+} TtreeSnapshotCursor;
+
 /**
  * @brief Get size of T*-tree node in bytes.
+ *
+ * The size includes pointers to keys, inline key copies (if any)
+ * and optional per-node data enabled by tree flags.
  * @param ttree - a pointer to Ttree.
  * @return size of TtreeNode in a tree in bytes,
  */
-#define tnode_size(ttree)                                               \
-    (sizeof(TtreeNode) + (ttree->keys_per_tnode - \
-                          TNODE_ITEMS_MIN) * sizeof(uintptr_t))
+#define tnode_size(ttree)                       \
+    ((ttree)->tnode_bytes)
+
+/*
+ * Number of items in a subtree of the node.
+ * Valid only in trees with TTREE_ORDER_STATS flag.
+ */
+#define tnode_count(ttree, tnode)                               \
+    (*(size_t *)((char *)(tnode) + (ttree)->count_offs))
 
 #define tnode_num_keys(tnode)                   \
     (((tnode)->max_idx - (tnode)->min_idx) + 1)
@@ -178,6 +538,16 @@ typedef struct ttree_cursor {
 
 #define tnode_key_max(tnode) tnode_key(tnode, (tnode)->max_idx)
 
+/*
+ * If T*-tree stores keys inline, their copies are placed right after
+ * the node's keys array, in the same order as the keys are.
+ */
+#define tnode_inline_keys(ttree, tnode)                         \
+    ((char *)(tnode)->keys + (ttree)->keys_per_tnode * sizeof(void *))
+
+#define tnode_inline_key(ttree, tnode, idx)                             \
+    ((void *)(tnode_inline_keys(ttree, tnode) + (idx) * (ttree)->key_width))
+
 #define ttree_node_glb(tnode)                    \
     __tnode_get_bound(tnode, TNODE_LEFT)
 
@@ -207,6 +577,12 @@ static __inline int tnode_get_side(TtreeNode *tnode)
 #define ttree_is_empty(ttree)                   \
     (!(ttree)->root)
 
+/**
+ * @brief Get total number of items in a T*-tree.
+ */
+#define ttree_size(ttree)                       \
+    ((ttree)->num_items)
+
 /**
  * @brief Initialize new T*-tree.
  * @param ttree[out]  - A pointer to T*-tree structure for initialization
@@ -236,6 +612,252 @@ static __inline int tnode_get_side(TtreeNode *tnode)
 int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
                  ttree_cmp_func_fn cmpf, size_t key_offs);
 
+/**
+ * @brief Initialize new T*-tree storing copies of keys inside its nodes.
+ *
+ * Key copies are placed into nodes next to pointers to items' keys,
+ * so the search inside a node doesn't touch the items. The size of
+ * a copy is taken from the size of @a key_field.
+ *
+ * @param ttree[out]  - A pointer to T*-tree structure for initialization
+ * @param num_keys    - A number of keys per T*-tree node.
+ * @param is_unique   - A boolean to determine whether keys must be unique.
+ * @param cmpf        - A pointer to user-defined comparison function
+ * @param data_struct - Structure containing an item that will be
+ *                      used by T*-tree as a key.
+ * @param key_field   - Name of a key field in a @a data_struct.
+ * @return 0 on success, -1 on error.
+ * @see __ttree_init_inline
+ */
+#define ttree_init_inline(ttree, num_keys, is_unique, cmpf,             \
+                          data_struct, key_field)                       \
+    __ttree_init_inline(ttree, num_keys, is_unique, cmpf,               \
+                        offsetof(data_struct, key_field),               \
+                        sizeof(((data_struct *)0)->key_field))
+
+/**
+ * @brief Initialize new T*-tree with inline keys of given width.
+ *
+ * Comparison function gets pointers to key copies instead of
+ * pointers to keys inside items, so it must depend only on
+ * first @a key_width bytes of a key.
+ *
+ * @param ttree[out] - A pointer to T*-tree to initialize
+ * @param num_keys   - A number of keys per T*-tree node.
+ * @param is_unique  - A boolean to determine whether keys must be unique.
+ * @param cmpf       - User defined comparison function
+ * @param key_offs   - Offset from item structure start to its key field.
+ * @param key_width  - Size of a key copy in bytes
+ *                     (0 means keys aren't copied).
+ * @return 0 on success, -1 on error.
+ * @see ttree_init_inline
+ */
+int __ttree_init_inline(Ttree *ttree, int num_keys, bool is_unique,
+                        ttree_cmp_func_fn cmpf, size_t key_offs,
+                        size_t key_width);
+
+/**
+ * @brief Initialize new T*-tree with string keys behind pointers.
+ *
+ * Nodes keep first @a prefix_width bytes of each string inline, and
+ * strings are compared by strcmp. Most comparisons end inside the
+ * copies, so items are dereferenced only when strings share the
+ * whole prefix.
+ *
+ * @param ttree[out]   - A pointer to T*-tree structure for initialization
+ * @param num_keys     - A number of keys per T*-tree node.
+ * @param is_unique    - A boolean to determine whether keys must be unique.
+ * @param prefix_width - Number of leading bytes of strings kept in nodes.
+ * @param data_struct  - Structure containing an item.
+ * @param key_field    - Name of a char pointer field in a @a data_struct.
+ * @return 0 on success, -1 on error.
+ * @see __ttree_init_str
+ */
+#define ttree_init_str(ttree, num_keys, is_unique, prefix_width,        \
+                       data_struct, key_field)                          \
+    __ttree_init_str(ttree, num_keys, is_unique,                        \
+                     offsetof(data_struct, key_field), prefix_width,    \
+                     TTREE_STR_PTR)
+
+/**
+ * @brief Initialize new T*-tree with string keys stored in items.
+ *
+ * The same as ttree_init_str, but @a key_field is a char array
+ * holding a NUL-terminated string.
+ *
+ * @see ttree_init_str
+ */
+#define ttree_init_strbuf(ttree, num_keys, is_unique, prefix_width,     \
+                          data_struct, key_field)                       \
+    __ttree_init_str(ttree, num_keys, is_unique,                        \
+                     offsetof(data_struct, key_field), prefix_width,    \
+                     TTREE_STR_ARRAY)
+
+/**
+ * @brief Initialize new T*-tree with string keys.
+ *
+ * String trees can't be made TTREE_CONCURRENT or TTREE_CACHE_ALIGNED.
+ *
+ * @param ttree[out]   - A pointer to T*-tree to initialize
+ * @param num_keys     - A number of keys per T*-tree node.
+ * @param is_unique    - A boolean to determine whether keys must be unique.
+ * @param key_offs     - Offset from item structure start to its key field.
+ * @param prefix_width - Number of leading bytes of strings kept in nodes,
+ *                       in range [1, TTREE_INLINE_KEY_MAX].
+ * @param kind         - TTREE_STR_PTR or TTREE_STR_ARRAY.
+ * @return 0 on success, -1 on error.
+ * @see ttree_init_str
+ */
+int __ttree_init_str(Ttree *ttree, int num_keys, bool is_unique,
+                     size_t key_offs, size_t prefix_width, int kind);
+
+/**
+ * @brief Set allocator T*-tree nodes will be allocated with.
+ *
+ * Allocator may be changed only while the tree is empty.
+ * Memory allocated by the previous allocator is released.
+ * Trees with TTREE_INDEX_LINKS keep the slab their nodes are linked in.
+ *
+ * @param ttree     - A pointer to T*-tree.
+ * @param allocator - A pointer to allocator hooks.
+ * @param ctx       - Allocator private context passed to each hook.
+ * @return 0 on success, -1 on error. errno is set to EBUSY if the tree
+ *         is not empty and to EINVAL if it has TTREE_INDEX_LINKS.
+ * @see ttree_use_slab
+ */
+int ttree_set_allocator(Ttree *ttree, const TtreeNodeAllocator *allocator,
+                        void *ctx);
+
+/**
+ * @brief Switch T*-tree to the built-in slab allocator.
+ *
+ * Nodes are carved from chunks of @a tnodes_per_chunk nodes each,
+ * freed nodes are put into per-tree free list. All chunks are
+ * freed at once by ttree_destroy. The slab lets the tree be switched
+ * to TTREE_INDEX_LINKS afterwards.
+ *
+ * @param ttree            - A pointer to an empty T*-tree.
+ * @param tnodes_per_chunk - A number of nodes per chunk
+ *                           (0 means TTREE_SLAB_DEFAULT_TNODES).
+ * @return 0 on success, -1 on error.
+ * @see ttree_set_allocator
+ */
+int ttree_use_slab(Ttree *ttree, int tnodes_per_chunk);
+
+/**
+ * @brief Switch T*-tree to the slab allocator carving nodes from pages.
+ *
+ * Chunks of the slab are mapped directly, each of @a page_size bytes or
+ * of TTREE_PAGE_2M bytes if @a page_size is 0. Huge pages reserved with
+ * hugetlbfs are tried first, if there are none, the chunk is aligned to
+ * TTREE_PAGE_2M and advised to be backed by transparent huge pages.
+ * So a tree of N nodes takes about N / (number of nodes per page) TLB
+ * entries instead of one per few nodes. Note that each 1G chunk commits
+ * a gigabyte once it's touched.
+ * Unless @a numa_node is TTREE_NUMA_ANY, each chunk is bound to the NUMA
+ * node before it's touched: either to the given node or, with
+ * TTREE_NUMA_LOCAL, to the node of the thread allocating the chunk.
+ * Failures of binding and of huge pages don't fail allocations, see
+ * ttree_stats for the part of memory they've succeeded for.
+ *
+ * @param ttree     - A pointer to an empty T*-tree.
+ * @param page_size - 0, TTREE_PAGE_2M or TTREE_PAGE_1G.
+ * @param numa_node - A NUMA node, TTREE_NUMA_ANY or TTREE_NUMA_LOCAL.
+ * @return 0 on success, -1 on error.
+ * @see ttree_use_slab
+ */
+int ttree_use_pages(Ttree *ttree, size_t page_size, int numa_node);
+
+/**
+ * @brief Set T*-tree option flags.
+ *
+ * Flags change layout of T*-tree nodes, so they may be changed
+ * only while a tree is empty.
+ *
+ * @param ttree - A pointer to an empty tree.
+ * @param flags - A combination of TTREE_* flags (TTREE_ORDER_STATS,
+ *                TTREE_CONCURRENT, TTREE_MULTI_WRITER,
+ *                TTREE_CACHE_ALIGNED, TTREE_RELAXED_BALANCE,
+ *                TTREE_GAPPED, TTREE_INDEX_LINKS).
+ * @return 0 on success, -1 on error. errno is set to EBUSY if the tree
+ *         is not empty or has snapshots, to ENOMEM if the arena of
+ *         TTREE_INDEX_LINKS can't be reserved and to EINVAL if flags are
+ *         unknown, TTREE_CONCURRENT is requested for a tree without
+ *         inline keys, TTREE_MULTI_WRITER is requested without
+ *         TTREE_CONCURRENT, TTREE_CACHE_ALIGNED is requested for too long
+ *         inline keys, TTREE_GAPPED or TTREE_INDEX_LINKS is combined with
+ *         flags it can't go with or TTREE_INDEX_LINKS is requested for
+ *         a tree without the built-in slab.
+ */
+int ttree_set_flags(Ttree *ttree, unsigned int flags);
+
+/**
+ * @brief Get the largest number of keys per node fitting in cache lines.
+ *
+ * Helps to choose @a num_keys for a tree with TTREE_CACHE_ALIGNED flag,
+ * so that padding of nodes to whole cache lines isn't wasted.
+ *
+ * @param key_width - Size of inline key copies (0 if keys aren't inlined).
+ * @param flags     - Flags the tree will have.
+ * @param num_lines - Number of cache lines per node.
+ * @return Number of keys or -1 if even TNODE_ITEMS_MIN keys don't fit.
+ */
+int ttree_fit_keys(size_t key_width, unsigned int flags, int num_lines);
+
+/**
+ * @brief Register a reader of a tree in concurrent mode.
+ *
+ * Each thread reading the tree concurrently with a writer needs
+ * its own reader id.
+ *
+ * @param ttree - A pointer to a tree with TTREE_CONCURRENT flag.
+ * @return Reader id on success, -1 on error. errno is set to EINVAL
+ *         if the tree isn't concurrent and to EAGAIN if there are
+ *         TTREE_MAX_READERS readers registered already.
+ * @see ttree_read_enter
+ */
+int ttree_reader_register(Ttree *ttree);
+
+/**
+ * @brief Release reader id got by ttree_reader_register.
+ * @param ttree  - A pointer to a tree.
+ * @param reader - Id of a reader which is out of the tree.
+ */
+void ttree_reader_unregister(Ttree *ttree, int reader);
+
+/**
+ * @brief Start a read-side critical section.
+ *
+ * Nodes removed by a writer after the reader has entered aren't freed
+ * until it exits, so lookups and cursors are safe in between. Cursors
+ * must not be used after the reader exits. Reader neither takes locks
+ * nor writes to shared memory except its own slot.
+ *
+ * @param ttree  - A pointer to a tree.
+ * @param reader - Reader id.
+ * @see ttree_read_exit
+ */
+void ttree_read_enter(Ttree *ttree, int reader);
+
+/**
+ * @brief End a read-side critical section.
+ * @param ttree  - A pointer to a tree.
+ * @param reader - Reader id.
+ * @see ttree_read_enter
+ */
+void ttree_read_exit(Ttree *ttree, int reader);
+
+/**
+ * @brief Free all nodes removed from a tree in concurrent mode.
+ *
+ * Removed nodes are freed by writers as soon as all readers have
+ * moved on. This function frees them right away, so the caller must
+ * guarantee that no reader is inside the tree.
+ * @param ttree - A pointer to a tree.
+ * @see TTREE_CONCURRENT
+ */
+void ttree_reclaim(Ttree *ttree);
+
 /**
  * @brief Destroy whole T*-tree
  * @param ttree - A pointer to tree to destroy.
@@ -260,12 +882,116 @@ void ttree_destroy(Ttree *ttree);
  */
 void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor);
 
+/**
+ * @brief Find an item by its key starting from the position of a cursor.
+ *
+ * This is a finger search for lookups with locality: the search first
+ * checks the node @a cursor points to, then its successor or
+ * predecessor, and climbs to ancestors only as far as needed before
+ * descending again. A lookup of a key @a d nodes away from the cursor
+ * costs O(log d) instead of O(log N).
+ * On return the cursor is positioned exactly as ttree_lookup positions it,
+ * so it may be passed to this function again or to ttree_insert_at_cursor.
+ * In trees with duplicated keys a found key having equal neighbours is
+ * looked up again from the root, since which of equal keys a search
+ * lands on depends on its path.
+ * The search is correct from any node, but the node the cursor points to
+ * must still belong to the tree, i.e. mustn't be removed by deletions
+ * made after the cursor was positioned. Cursors of concurrent trees and
+ * closed cursors fall back to ttree_lookup.
+ *
+ * @param cursor - A pointer to the cursor to start from and to position.
+ * @param key    - A pointer to search key.
+ * @return A pointer to found item or NULL if item wasn't found.
+ * @see ttree_lookup
+ */
+void *ttree_lookup_from_cursor(TtreeCursor *cursor, void *key);
+
+/**
+ * @brief Typed lookups for trees storing integer keys inline.
+ *
+ * These functions work exactly like ttree_lookup, but compare keys
+ * directly instead of calling user-defined comparison function.
+ * The search inside a node is done with vectorized kernels
+ * (AVX2, SSE4.2 or NEON) selected at runtime.
+ * The tree must be initialized with ttree_init_inline for keys of
+ * the corresponding type, and its comparison function must keep
+ * keys in the natural integer order.
+ *
+ * @param ttree  - A pointer to T*-tree where to search.
+ * @param key    - A search key.
+ * @param cursor - A pointer to cursor to open on found position(may be NULL)
+ * @return A pointer to found item or NULL if item wasn't found.
+ * @see ttree_lookup
+ * @see ttree_init_inline
+ */
+void *ttree_lookup_u32(Ttree *ttree, uint32_t key, TtreeCursor *cursor);
+void *ttree_lookup_u64(Ttree *ttree, uint64_t key, TtreeCursor *cursor);
+void *ttree_lookup_i64(Ttree *ttree, int64_t key, TtreeCursor *cursor);
+
+/**
+ * @brief Find items by a batch of keys.
+ *
+ * ttree_lookup_batch is equal to calling ttree_lookup for each key,
+ * but descents of several keys are interleaved and each next node is
+ * prefetched, so cache misses of one lookup are hidden behind
+ * comparisons of the others.
+ *
+ * @param ttree          - A pointer to T*-tree where to search.
+ * @param keys           - An array of pointers to search keys.
+ * @param n              - Number of keys in @a keys.
+ * @param out_items[out] - An array of @a n found items (NULL for keys
+ *                         that weren't found).
+ * @return Number of found items.
+ * @see ttree_lookup
+ */
+size_t ttree_lookup_batch(Ttree *ttree, void **keys, size_t n,
+                          void **out_items);
+
+/**
+ * @brief State of a lookup descending a tree one step at a time.
+ * @see ttree_lookup_start
+ */
+typedef struct ttree_lookup_step {
+    void *key;            /**< Search key */
+    TtreeNode *tnode;     /**< Node to compare with on the next step */
+    TtreeNode *marked_tn; /**< The last node the search went right from */
+    void *item;           /**< Item found by the descent */
+    bool key_fetched;     /**< Key of the node was prefetched */
+} TtreeLookupStep;
+
+/**
+ * @brief Find an item by its key in several steps.
+ *
+ * These functions split ttree_lookup into steps, so a caller may
+ * interleave independent lookups the way ttree_lookup_batch does,
+ * doing other work between steps:
+ *  - ttree_lookup_start initializes lookup state @a ls.
+ *  - ttree_lookup_step makes one step of the descent and prefetches
+ *    the node (or the key) the next step compares with. It returns
+ *    false when the descent is over.
+ *  - ttree_lookup_finish gives the result once the descent is over.
+ * The tree mustn't change between the start and the finish of a lookup.
+ * Lookups in concurrent trees are done by ttree_lookup_start at once.
+ *
+ * @param ttree   - A pointer to T*-tree where to search.
+ * @param ls[out] - A pointer to lookup state.
+ * @param key     - A pointer to search key. It must stay valid until
+ *                  the lookup is finished.
+ * @return ttree_lookup_finish returns a pointer to found item
+ *         or NULL if item wasn't found.
+ * @see ttree_lookup_batch
+ */
+void ttree_lookup_start(Ttree *ttree, TtreeLookupStep *ls, void *key);
+bool ttree_lookup_step(Ttree *ttree, TtreeLookupStep *ls);
+void *ttree_lookup_finish(Ttree *ttree, TtreeLookupStep *ls);
+
 /**
  * @brief Insert an item @a item in the T*-tree @ttree
  *
  * ttree_insert function inserts given item @a item in the T*-tree.
- * If tree already contains a key euqual to the key of inserting item,
- * error is returned.
+ * If tree holds unique keys and already contains a key euqual to the
+ * key of inserting item, error is returned.
  *
  * @param ttree - A pointer to a tree.
  * @param item  - A pointer to item that will be inserted.
@@ -273,6 +999,220 @@ void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor);
  */
 int ttree_insert(Ttree *ttree, void *item);
 
+/**
+ * @brief Insert an item or merge it with the item having the same key.
+ *
+ * Unlike ttree_lookup followed by ttree_replace or ttree_insert,
+ * ttree_upsert descends the tree only once: the lookup leaves the cursor
+ * either at the item found or at the place for insertion.
+ * If the tree holds an item with the key of @a item, @a merge_cb decides
+ * which item stays in the tree. If @a merge_cb is NULL, @a item replaces
+ * the old one. In trees with duplicated keys the item found by
+ * ttree_lookup is merged.
+ * In multiple writers mode @a merge_cb is called with the node of
+ * the item latched, so it must not touch the tree.
+ *
+ * @param ttree    - A pointer to a tree.
+ * @param item     - A pointer to item to insert or merge.
+ * @param merge_cb - A function merging items (NULL to replace).
+ * @param arg      - An argument passed to @a merge_cb.
+ * @return 0 if @a item was inserted, 1 if it was merged.
+ * @see ttree_merge_fn
+ */
+int ttree_upsert(Ttree *ttree, void *item, ttree_merge_fn merge_cb,
+                 void *arg);
+
+/**
+ * @brief Insert an item unless the tree has an item with the same key.
+ *
+ * It's done with a single descent of the tree.
+ *
+ * @param ttree - A pointer to a tree.
+ * @param item  - A pointer to item to insert.
+ * @return The item with the key of @a item found in the tree, or
+ *         @a item itself if it was inserted.
+ */
+void *ttree_find_or_insert(Ttree *ttree, void *item);
+
+/**
+ * @brief Insert a batch of items in the T*-tree @a ttree.
+ *
+ * ttree_insert_batch is designed for sorted or nearly sorted batches.
+ * Each item is first tried against the node the previous item was
+ * inserted to and its successor, so consecutive keys don't pay a full
+ * lookup from the root. Rebalancing is done only when a new node has
+ * to be created, appending to a node with free rooms touches no other
+ * nodes.
+ * Items with duplicated keys are skipped if the tree holds unique keys.
+ *
+ * @param ttree - A pointer to a tree.
+ * @param items - An array of items to insert.
+ * @param n     - Number of items in @a items.
+ * @return Number of inserted items or negative value on error.
+ */
+ssize_t ttree_insert_batch(Ttree *ttree, void **items, size_t n);
+
+/**
+ * @brief Build a T*-tree from an array of items sorted by their keys.
+ *
+ * ttree_bulk_load fills an empty tree in O(N) without any lookups and
+ * rotations: items are packed into nodes in their order and the nodes
+ * are linked into a perfectly balanced tree.
+ * @a fill determines how many rooms of each node are used. 1.0 makes
+ * nodes fully packed which is the best for lookups, while smaller values
+ * leave free rooms for subsequent insertions.
+ *
+ * @param ttree        - A pointer to an empty tree.
+ * @param sorted_items - An array of items sorted by their keys.
+ * @param n            - Number of items in @a sorted_items.
+ * @param fill         - Part of node rooms to fill, in range (0, 1].
+ * @return 0 if all is ok, negative value on error. errno is set to
+ *         EBUSY if the tree is not empty, EINVAL if items aren't sorted
+ *         (or contain duplicates in a tree with unique keys) and ENOMEM
+ *         if there is no memory for nodes.
+ */
+int ttree_bulk_load(Ttree *ttree, void **sorted_items, size_t n, double fill);
+
+/**
+ * @brief Build a T*-tree from an array of items using several threads.
+ *
+ * The array is sorted in place by a parallel merge sort, then the tree
+ * is built the way ttree_bulk_load builds it: chunks of nodes are packed
+ * and their subtrees are linked by worker threads while the calling
+ * thread links the top levels above them. Nodes are allocated by
+ * the calling thread, so any allocator may be used. Equal keys keep
+ * the order they have in @a items.
+ * Trees having snapshots are built by the calling thread only.
+ *
+ * @param ttree       - A pointer to an empty tree.
+ * @param items       - An array of items in any order.
+ * @param n           - Number of items in @a items.
+ * @param fill        - Part of node rooms to fill, in range (0, 1].
+ * @param num_threads - Number of threads including the calling one.
+ * @return 0 if all is ok, negative value on error. errno is set to
+ *         EBUSY if the tree is not empty, EINVAL if keys of a tree with
+ *         unique keys have duplicates and ENOMEM if there is no memory.
+ *         @a items are sorted even if the tree wasn't built.
+ * @see ttree_bulk_load
+ */
+int ttree_bulk_load_parallel(Ttree *ttree, void **items, size_t n,
+                             double fill, int num_threads);
+
+/**
+ * @brief Relink all nodes of T*-tree into a perfectly balanced tree.
+ *
+ * Keys aren't moved between nodes, so it costs O(N) in number of
+ * nodes. It's meant to be called in quiet periods of trees with
+ * TTREE_RELAXED_BALANCE, but works for any tree that isn't
+ * TTREE_CONCURRENT. Open cursors stay valid.
+ *
+ * @param ttree - A pointer to a tree.
+ * @return 0 if all is ok, -1 on error.
+ */
+int ttree_rebalance_all(Ttree *ttree);
+
+/**
+ * @brief Repack keys of T*-tree into the least number of nodes.
+ *
+ * Keys are moved along the successor chain, so that each node holds
+ * @a fill part of rooms, nodes left without keys are freed and the
+ * rest are relinked into a perfectly balanced tree. It costs O(N) and
+ * is meant for long-running processes to give memory back after
+ * heavy deletes. Open cursors become invalid.
+ *
+ * @param ttree - A pointer to a tree that isn't TTREE_CONCURRENT.
+ * @param fill  - Part of node rooms to fill, in range (0, 1].
+ * @return Number of freed nodes, -1 on error.
+ */
+ssize_t ttree_compact(Ttree *ttree, double fill);
+
+/**
+ * @brief Change the number of keys per node of a non-empty T*-tree.
+ *
+ * The tree is rebuilt online: its keys are packed into new nodes of
+ * @a num_keys rooms, each filled to @a fill part of them, the nodes are
+ * linked into a perfectly balanced tree and the old ones are freed.
+ * Items stay where they are. It costs O(N) and needs memory for both
+ * sets of nodes for a while. Open cursors become invalid.
+ *
+ * @param ttree    - A pointer to a tree that isn't TTREE_CONCURRENT.
+ * @param num_keys - New number of keys per node, in range
+ *                   [TNODE_ITEMS_MIN, TNODE_ITEMS_MAX].
+ * @param fill     - Part of node rooms to fill, in range (0, 1].
+ * @return 0 if all is ok, -1 on error. errno is set to EBUSY if the
+ *         tree has snapshots, ENOMEM if new nodes can't be allocated
+ *         (the tree is left as it was) and EINVAL on invalid arguments
+ *         or if the tree has TTREE_INDEX_LINKS.
+ * @see ttree_autotune
+ */
+int ttree_set_keys_per_tnode(Ttree *ttree, int num_keys, double fill);
+
+/**
+ * @brief Pick the number of keys per node from the workload of T*-tree.
+ *
+ * Operation counters gathered since they were reset last time are fed
+ * to a cost model: larger nodes make lookups visit fewer nodes and let
+ * range scans hop between nodes less often, smaller nodes make writes
+ * shift fewer keys inside nodes. Capacity is doubled or halved while
+ * the model says it pays off, the tree is rebuilt by
+ * ttree_set_keys_per_tnode if capacity has changed, and counters are
+ * reset, so each call judges the workload since the previous one.
+ * Too few operations give no verdict and capacity is kept. Counters
+ * are maintained only with TTREE_STATS, without them capacity is
+ * never changed.
+ *
+ * @param ttree - A pointer to a tree that isn't TTREE_CONCURRENT.
+ * @return The number of keys per node the tree has, -1 on error.
+ * @see ttree_set_keys_per_tnode
+ */
+int ttree_autotune(Ttree *ttree);
+
+/**
+ * @brief Write an image of T*-tree to a file.
+ *
+ * Nodes are written in successor order followed by records of items
+ * in order of their keys. Links of nodes are resolved for an address
+ * range which is free at the time of saving, so the image is usually
+ * used by ttree_open_mmap as it is. Each record is @a item_size bytes
+ * long and
+ * must have the key at the same offset as items have, since records
+ * become items of a tree loaded from the image. The tree must not be
+ * modified while it's saved. Trees with TTREE_STR_PTR keys can't be
+ * saved since their strings aren't parts of items, TTREE_GAPPED and
+ * TTREE_INDEX_LINKS trees can't be saved either.
+ *
+ * @param ttree     - A pointer to a tree.
+ * @param fd        - File descriptor to write the image to.
+ * @param item_size - Size of an item record in bytes.
+ * @param serialize - Item serializer (NULL copies first @a item_size
+ *                    bytes of an item).
+ * @param arg       - An argument passed to the serializer.
+ * @return 0 if all is ok, -1 on error.
+ * @see ttree_open_mmap
+ */
+int ttree_save(Ttree *ttree, int fd, size_t item_size,
+               ttree_serialize_fn serialize, void *arg);
+
+/**
+ * @brief Initialize T*-tree from an image written by ttree_save.
+ *
+ * The image is mapped privately, so neither nodes nor items are
+ * allocated. It's mapped at the address ttree_save has resolved its
+ * links for if that range is free, and then opening doesn't touch
+ * nodes: their pages stay shared with the page cache until the tree
+ * modifies them. Otherwise links of all nodes are relocated in place.
+ * Items of the tree are records of the image, they live until the tree
+ * is destroyed. New nodes are taken from the built-in slab.
+ *
+ * @param ttree[out] - A pointer to T*-tree to initialize.
+ * @param fd         - File descriptor of the image.
+ * @param cmpf       - Comparison function the tree was built with
+ *                     (ignored for trees with string keys).
+ * @return 0 if all is ok, -1 on error. errno is set to EINVAL if
+ *         the file isn't a valid image for this platform.
+ */
+int ttree_open_mmap(Ttree *ttree, int fd, ttree_cmp_func_fn cmpf);
+
 /**
  * @brief Delete an item from a T*-tree by item's key.
  * @param ttree - A pointer to tree.
@@ -341,15 +1281,238 @@ int ttree_replace(Ttree *ttree, void *key, void *new_item);
 int ttree_cursor_open_on_node(TtreeCursor *cusrsor, Ttree *tree,
                               TtreeNode *tnode, enum tnode_seek seek);
 int ttree_cursor_open(TtreeCursor *cursor, Ttree *ttree);
+int ttree_cursor_first(TtreeCursor *cursor);
+int ttree_cursor_last(TtreeCursor *cursor);
 int ttree_cursor_next(TtreeCursor *cursor);
 int ttree_cursor_prev(TtreeCursor *cursor);
 
+/**
+ * @brief Open a cursor on a bound of given key.
+ *
+ * Unlike ttree_lookup, these functions always leave the cursor on
+ * an existing item, so iteration may be continued from it with
+ * ttree_cursor_next and ttree_cursor_prev:
+ *  - ttree_cursor_seek_ge - the first item with a key >= @a key
+ *  - ttree_cursor_seek_gt - the first item with a key > @a key
+ *  - ttree_cursor_seek_le - the last item with a key <= @a key
+ *  - ttree_cursor_seek_lt - the last item with a key < @a key
+ *
+ * @param cursor[out] - A pointer to cursor to open.
+ * @param ttree       - A pointer to a tree.
+ * @param key         - A pointer to search key.
+ * @return TCSR_OK if the bound exists, TCSR_END otherwise. In the last
+ *         case the cursor is closed.
+ */
+int ttree_cursor_seek_ge(TtreeCursor *cursor, Ttree *ttree, void *key);
+int ttree_cursor_seek_gt(TtreeCursor *cursor, Ttree *ttree, void *key);
+int ttree_cursor_seek_le(TtreeCursor *cursor, Ttree *ttree, void *key);
+int ttree_cursor_seek_lt(TtreeCursor *cursor, Ttree *ttree, void *key);
+
+/**
+ * @brief Walk through all items with keys in range [@a lo, @a hi].
+ *
+ * Items are handed to the callback not one by one but by contiguous
+ * slices of node key arrays, so the boundaries are compared only once
+ * per node. Keys may be translated to items with ttree_key2item.
+ *
+ * @param ttree    - A pointer to a tree.
+ * @param lo       - A pointer to the lower bound key (NULL for no bound).
+ * @param hi       - A pointer to the upper bound key (NULL for no bound).
+ * @param callback - A function called for each slice of keys.
+ * @param arg      - An argument passed to the callback.
+ * @return Number of keys handed to the callback or negative value on error.
+ * @see ttree_range_fn
+ */
+ssize_t ttree_range_scan(Ttree *ttree, void *lo, void *hi,
+                         ttree_range_fn callback, void *arg);
+
+/**
+ * @brief Walk through all items of a tree using several threads.
+ *
+ * The successor chain of the tree is cut into @a num_segments
+ * segments of about the same size, which are walked in parallel.
+ * Slices of keys of each segment are handed to the callback in order
+ * of keys, by one thread at a time, together with the number of
+ * the segment. Segments themselves are walked in any order, some of
+ * them may be empty. The tree mustn't be changed while it's walked.
+ *
+ * @param ttree        - A pointer to a tree.
+ * @param num_segments - Number of segments to cut the tree into.
+ * @param num_threads  - Number of threads including the calling one.
+ * @param callback     - A function called for each slice of keys.
+ * @param arg          - An argument passed to the callback.
+ * @return Number of keys handed to the callback or negative value on
+ *         error. errno is set to EINVAL for concurrent trees.
+ * @see ttree_segment_fn
+ */
+ssize_t ttree_for_each_parallel(Ttree *ttree, int num_segments,
+                                int num_threads, ttree_segment_fn callback,
+                                void *arg);
+
+/**
+ * @brief Remove all items with keys in range [@a lo, @a hi].
+ *
+ * Items are removed along the successor chain in a single pass
+ * without descents and rotations for each of them. Nodes left without
+ * keys are freed and the rest of the tree is relinked into a perfectly
+ * balanced one at the end, which costs O(N) in number of nodes.
+ * If the range is inside the boundary nodes, the tree isn't relinked.
+ * Open cursors become invalid.
+ *
+ * @param ttree   - A pointer to a tree that isn't TTREE_CONCURRENT.
+ * @param lo      - A pointer to the lower bound key (NULL for no bound).
+ * @param hi      - A pointer to the upper bound key (NULL for no bound).
+ * @param free_cb - A function called for each removed item (may be NULL).
+ * @param arg     - An argument passed to @a free_cb.
+ * @return Number of removed items or negative value on error.
+ */
+ssize_t ttree_delete_range(Ttree *ttree, void *lo, void *hi,
+                           ttree_item_fn free_cb, void *arg);
+
+/**
+ * @brief Move all items with keys not less than @a key to @a right.
+ *
+ * @a right must be an empty tree initialized the same way as
+ * @a ttree (keys, comparison function and flags changing node layout).
+ * Nodes are moved as they are, only the node @a key falls into is
+ * split in two, and both trees are relinked into balanced ones.
+ * If trees have different node allocators, the moved nodes are copied.
+ * Neither tree may be TTREE_CONCURRENT, TTREE_GAPPED or
+ * TTREE_INDEX_LINKS. Open cursors become invalid.
+ *
+ * @param ttree - A pointer to a tree to split.
+ * @param key   - A pointer to the first key going to @a right.
+ * @param right - A pointer to an empty tree receiving the items.
+ * @return Number of moved items or negative value on error. errno is
+ *         set to EBUSY if @a right isn't empty and to EINVAL if trees
+ *         aren't compatible.
+ * @see ttree_join
+ */
+ssize_t ttree_split_at(Ttree *ttree, void *key, Ttree *right);
+
+/**
+ * @brief Append all items of @a other to @a ttree.
+ *
+ * Every key of @a other must be greater than any key of @a ttree
+ * (or equal to the greatest one if keys aren't unique), and trees
+ * have to be compatible as for ttree_split_at. Nodes of @a other go
+ * to @a ttree and the result is relinked into a balanced tree, what
+ * costs O(N) in number of nodes. @a other becomes empty.
+ *
+ * @param ttree - A pointer to a tree to join to.
+ * @param other - A pointer to a tree with greater keys.
+ * @return 0 if all is ok, negative value on error. errno is set to
+ *         EINVAL if trees aren't compatible or their keys overlap.
+ * @see ttree_split_at
+ */
+int ttree_join(Ttree *ttree, Ttree *other);
+
+/**
+ * @brief Take a snapshot of T*-tree.
+ *
+ * Snapshot is a read-only view of items the tree holds at the moment.
+ * It costs O(1) to take: nodes are shared with the tree, and every
+ * following write copies nodes it's going to change once per snapshot
+ * generation, so a snapshot costs at most a copy of each node the tree
+ * has changed since then. Snapshots are read by ttree_snapshot_lookup
+ * and snapshot cursors while writes to the tree go on.
+ * Accesses to a snapshot have to be serialized with writes to its tree,
+ * as any access to a tree which isn't in concurrent mode, but a scan
+ * of a snapshot may let writes go between its steps.
+ * Items removed from the tree must stay valid while snapshots taken
+ * before their removal exist.
+ * If a copy of a node can't be allocated, the snapshots which need it
+ * are lost, and reading them fails with ESTALE.
+ * The tree can't change its flags while it has snapshots, ttree_destroy
+ * releases all of them.
+ *
+ * @param ttree - A pointer to a tree which isn't in concurrent mode.
+ * @return A pointer to the snapshot or NULL on error. errno is set
+ *         to EINVAL if the tree is concurrent, TTREE_GAPPED or
+ *         TTREE_INDEX_LINKS, ENOMEM if the snapshot can't be allocated.
+ * @see ttree_snapshot_release
+ */
+TtreeSnapshot *ttree_snapshot(Ttree *ttree);
+
+/**
+ * @brief Release a snapshot together with copies of nodes it holds.
+ *
+ * Copies an older snapshot sees as well are passed to that snapshot.
+ *
+ * @param snap - A pointer to a snapshot to release.
+ * @see ttree_snapshot
+ */
+void ttree_snapshot_release(TtreeSnapshot *snap);
+
+/**
+ * @brief Find an item by its key in a snapshot.
+ *
+ * @param snap - A pointer to a snapshot to search in.
+ * @param key  - A pointer to search key.
+ * @return A pointer to found item or NULL if item wasn't found or
+ *         the snapshot is lost (errno is set to ESTALE then).
+ */
+void *ttree_snapshot_lookup(TtreeSnapshot *snap, void *key);
+
+/**
+ * @brief Open a cursor at the first item of a snapshot not less than a key.
+ *
+ * A scan goes on with ttree_snapshot_cursor_next and sees exactly
+ * the items the tree held when the snapshot was taken, whatever was
+ * written to the tree between its steps.
+ *
+ * @param cursor - A pointer to a cursor to open.
+ * @param snap   - A pointer to a snapshot to scan.
+ * @param key    - A pointer to the least key (NULL to start from the first).
+ * @return 0 if the cursor points to an item, negative value otherwise.
+ *         errno is set to ESTALE if the snapshot is lost.
+ * @see ttree_snapshot_cursor_next
+ */
+int ttree_snapshot_cursor_open(TtreeSnapshotCursor *cursor,
+                               TtreeSnapshot *snap, void *key);
+
+/**
+ * @brief Move a snapshot cursor to the next item.
+ * @return TCSR_OK if the cursor points to the next item, TCSR_END if
+ *         there are no items left or the snapshot is lost.
+ */
+int ttree_snapshot_cursor_next(TtreeSnapshotCursor *cursor);
+
+/**
+ * @brief Get an item snapshot cursor points to.
+ */
+void *ttree_snapshot_cursor_item(TtreeSnapshotCursor *cursor);
+
+/**
+ * @brief Order statistics of T*-tree items.
+ *
+ * These functions require a tree with TTREE_ORDER_STATS flag
+ * and work in O(log N):
+ *  - ttree_rank returns number of items with keys less than @a key.
+ *  - ttree_count_range returns number of items with keys in [@a lo, @a hi).
+ *  - ttree_select returns an item at position @a k (starting from 0) in
+ *    key order and opens the cursor on it if the cursor is specified.
+ *
+ * @return ttree_rank and ttree_count_range return negative value if the
+ *         tree doesn't maintain order statistics. ttree_select
+ *         returns NULL if @a k is out of range or on error.
+ * @see ttree_set_flags
+ */
+ssize_t ttree_rank(Ttree *ttree, void *key);
+ssize_t ttree_count_range(Ttree *ttree, void *lo, void *hi);
+void *ttree_select(Ttree *ttree, size_t k, TtreeCursor *cursor);
+
 #define ttree_cursor_copy(csr_dst, csr_src)         \
     memcpy(csr_dst, csr_src, sizeof(*(csr_src)))
 
 static __inline void *ttree_key_from_cursor(TtreeCursor *cursor)
 {
     if (LIKELY(cursor->state == CURSOR_OPENED)) {
+        /* Node may be changed by a writer since cursor was positioned */
+        if (UNLIKELY(cursor->ttree->flags & TTREE_CONCURRENT)) {
+            return cursor->key;
+        }
+
         return tnode_key(cursor->tnode, cursor->idx);
     }
 
@@ -375,6 +1538,82 @@ static __inline void *ttree_item_from_cursor(TtreeCursor *cursor)
  */
 void ttree_print(Ttree *ttree, void (*fn)(TtreeNode *tnode));
 
+/**
+ * @brief Get the depth of T*-tree.
+ * @param ttree - A pointer to a T*-tree.
+ * @return Number of links on the longest path from the root
+ *         (0 if the tree has at most one node).
+ */
+int ttree_get_depth(Ttree *ttree);
+
+/**
+ * Number of buckets in the fill factor histogram of ttree_stats.
+ */
+#define TTREE_FILL_BUCKETS 10
+
+struct ttree_stats {
+    struct ttree_counters counters; /**< Copy of tree counters */
+    bool counters_enabled;          /**< Whether counters are maintained */
+    size_t num_items;               /**< Number of items */
+    size_t num_tnodes;              /**< Number of nodes */
+    int depth;                      /**< @see ttree_get_depth */
+    int keys_per_tnode;             /**< Number of rooms per node */
+
+    /**
+     * Number of nodes by part of rooms in use: bucket i counts nodes
+     * having more than i/TTREE_FILL_BUCKETS and at most
+     * (i + 1)/TTREE_FILL_BUCKETS of rooms filled.
+     */
+    size_t fill_histogram[TTREE_FILL_BUCKETS];
+
+    /**
+     * Memory of chunks mapped by ttree_use_pages and parts of it backed
+     * by reserved huge pages, advised to be transparent huge pages (the
+     * kernel may still back some of them by small pages) and bound
+     * to a NUMA node.
+     */
+    size_t mapped_bytes;
+    size_t hugetlb_bytes;
+    size_t thp_bytes;
+    size_t numa_bytes;
+};
+
+/**
+ * @brief Collect statistics of T*-tree.
+ *
+ * Counters are copied, the rest is computed by a walk over all nodes.
+ * The tree must not be modified meanwhile.
+ *
+ * @param ttree - A pointer to a tree.
+ * @param stats - Statistics to fill.
+ * @see ttree_stats_reset
+ */
+void ttree_stats(Ttree *ttree, struct ttree_stats *stats);
+
+/**
+ * @brief Reset operation counters of T*-tree to zero.
+ * @param ttree - A pointer to a tree.
+ */
+void ttree_stats_reset(Ttree *ttree);
+
+/**
+ * @brief Dump structure of T*-tree in machine-readable form.
+ *
+ * Output is JSON lines. The first line describes the whole tree
+ * with the same fields as struct ttree_stats has, each next line
+ * describes a node in key order:
+ * @code
+ * {"node":3,"parent":1,"side":"left","depth":2,"keys":7,"bfc":0}
+ * @endcode
+ * Nodes are numbered by their key order starting from 0, parent
+ * of the root is -1 and its side is "root".
+ *
+ * @param ttree - A pointer to a tree.
+ * @param out   - Stream to write to.
+ * @return 0 if all is ok, -1 on error.
+ */
+int ttree_dump(Ttree *ttree, FILE *out);
+
 /*
  * Internal T*-tree functions.
  * Not invented for public usage.
@@ -409,4 +1648,8 @@ static __inline TtreeNode *__tnode_get_bound(TtreeNode *tnode, int side)
     }
 }
 
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #endif /* !__TTREE_H__ */
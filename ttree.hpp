@@ -0,0 +1,545 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * @file ttree.hpp
+ * @brief C++ interface to T*-tree.
+ *
+ * tt::tree wraps Ttree into a class typed by an item type and its
+ * key field. The tree owns its nodes, but not items: items are linked
+ * into the tree by pointers and must outlive their presence in it.
+ * Iterators of the tree are cursors, so all standard algorithms and
+ * ranges working with bidirectional iterators may be used with it.
+ * Steps inside a node are done inline, only crossing a node boundary
+ * calls ttree_cursor_next or ttree_cursor_prev.
+ *
+ * With C++20 coroutines the tree also provides lookups that suspend
+ * after each step of the descent (see ttree_lookup_step). The node the
+ * next step compares with is prefetched before suspension, so resuming
+ * several lookups in turn hides memory latency of one lookup behind
+ * comparisons made by the others.
+ *
+ * Example:
+ * <pre>
+ *   struct item {
+ *       int key;
+ *       ...
+ *   };
+ *
+ *   tt::tree<item, &item::key> tree(16);
+ *
+ *   tree.insert(item);
+ *   for (item &i : tree) {
+ *       ...
+ *   }
+ *
+ *   auto it = std::find_if(tree.lower_bound(10), tree.end(), pred);
+ *   auto task = tree.lookup_async(10);
+ *   tt::run_interleaved(std::span(&task, 1));
+ *   item *found = task.get();
+ * </pre>
+ */
+
+#ifndef __TTREE_HPP__
+#define __TTREE_HPP__
+
+#include <cerrno>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "ttree.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <span>
+#define TTREE_HPP_COROUTINES 1
+#endif /* __cpp_impl_coroutine */
+
+namespace tt {
+
+template <typename T>
+struct member_traits;
+
+template <typename Item, typename Key>
+struct member_traits<Key Item::*> {
+    typedef Item item_type;
+    typedef Key key_type;
+};
+
+#ifdef TTREE_HPP_COROUTINES
+/**
+ * @brief Lookup suspending after each step of the descent.
+ *
+ * The task is created suspended. Each resume() makes one step of
+ * the descent and suspends with the node of the next step being
+ * prefetched. Once done() is true, get() returns found item.
+ * Awaiting the task from another coroutine runs it to completion
+ * without suspending the caller: lookups are interleaved only by
+ * resuming several tasks in turn, e.g. with run_interleaved.
+ * @see tree::lookup_async
+ */
+template <typename Item>
+class lookup_task {
+public:
+    struct promise_type {
+        Item *item = nullptr;
+
+        lookup_task get_return_object()
+        {
+            return lookup_task(handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(Item *found) noexcept { item = found; }
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    typedef std::coroutine_handle<promise_type> handle;
+
+    lookup_task() noexcept = default;
+    lookup_task(const lookup_task &) = delete;
+    lookup_task &operator=(const lookup_task &) = delete;
+
+    lookup_task(lookup_task &&other) noexcept
+        : coro(std::exchange(other.coro, nullptr))
+    {
+    }
+
+    lookup_task &operator=(lookup_task &&other) noexcept
+    {
+        if (this != &other) {
+            if (coro) {
+                coro.destroy();
+            }
+
+            coro = std::exchange(other.coro, nullptr);
+        }
+
+        return *this;
+    }
+
+    ~lookup_task()
+    {
+        if (coro) {
+            coro.destroy();
+        }
+    }
+
+    bool done() const noexcept { return !coro || coro.done(); }
+    void resume() { coro.resume(); }
+    Item *get() const noexcept { return coro.promise().item; }
+
+    bool await_ready() const noexcept { return done(); }
+
+    bool await_suspend(std::coroutine_handle<>)
+    {
+        while (!coro.done()) {
+            coro.resume();
+        }
+
+        return false;
+    }
+
+    Item *await_resume() const noexcept { return get(); }
+
+private:
+    explicit lookup_task(handle h) noexcept : coro(h) {}
+
+    handle coro;
+};
+
+/**
+ * @brief Resume tasks in turn until all of them are done.
+ *
+ * A task makes one step each time it is resumed, so a pass over all
+ * tasks gives memory prefetched by a task time to arrive before
+ * the task is resumed again.
+ */
+template <typename Task>
+void run_interleaved(std::span<Task> tasks)
+{
+    bool active = true;
+
+    while (active) {
+        active = false;
+        for (Task &task : tasks) {
+            if (!task.done()) {
+                task.resume();
+                active |= !task.done();
+            }
+        }
+    }
+}
+#endif /* TTREE_HPP_COROUTINES */
+
+/**
+ * @brief T*-tree of items of type @a Item ordered by their @a KeyField.
+ *
+ * Keys are ordered by @a Compare, which must be a strict weak order.
+ * The tree isn't copyable or movable: cursors and snapshots refer to
+ * the tree by its address. Errors of initialization are reported by
+ * std::system_error exceptions, other operations report failures by
+ * their return values as C API does.
+ *
+ * @param Item     - Type of items. It must have standard layout.
+ * @param KeyField - Pointer to the key member of @a Item.
+ * @param Compare  - Default constructible comparison of keys.
+ */
+template <typename Item, auto KeyField,
+          typename Compare = std::less<
+              typename member_traits<decltype(KeyField)>::key_type>>
+class tree {
+public:
+    typedef Item value_type;
+    typedef typename member_traits<decltype(KeyField)>::key_type key_type;
+    typedef Compare key_compare;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Item &reference;
+    typedef const Item &const_reference;
+
+    static_assert(std::is_same_v<
+                  typename member_traits<decltype(KeyField)>::item_type, Item>,
+                  "KeyField must be a member of Item");
+    static_assert(std::is_standard_layout_v<Item>,
+                  "Item must have standard layout");
+
+    /**
+     * @brief Bidirectional iterator over items of the tree.
+     *
+     * The iterator is a cursor positioned on an item, a past-the-end
+     * iterator has no node. Changes of the tree invalidate iterators
+     * like ttree_insert and ttree_delete invalidate cursors.
+     */
+    class iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef Item value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Item *pointer;
+        typedef Item &reference;
+
+        iterator() noexcept : cursor() {}
+
+        reference operator*() const noexcept
+        {
+            return *static_cast<Item *>(
+                ttree_item_from_cursor(const_cast<TtreeCursor *>(&cursor)));
+        }
+
+        pointer operator->() const noexcept { return &**this; }
+
+        iterator &operator++() noexcept
+        {
+            if (LIKELY(!(cursor.ttree->flags &
+                         (TTREE_CONCURRENT | TTREE_GAPPED))) &&
+                (cursor.idx < cursor.tnode->max_idx)) {
+                cursor.idx++;
+            }
+            else if (ttree_cursor_next(&cursor) != TCSR_OK) {
+                set_end();
+            }
+
+            return *this;
+        }
+
+        iterator &operator--() noexcept
+        {
+            if (!cursor.tnode) {
+                ttree_cursor_open(&cursor, cursor.ttree);
+                ttree_cursor_last(&cursor);
+            }
+            else if (LIKELY(!(cursor.ttree->flags &
+                              (TTREE_CONCURRENT | TTREE_GAPPED))) &&
+                     (cursor.idx > cursor.tnode->min_idx)) {
+                cursor.idx--;
+            }
+            else if (ttree_cursor_prev(&cursor) != TCSR_OK) {
+                set_end();
+            }
+
+            return *this;
+        }
+
+        iterator operator++(int) noexcept
+        {
+            iterator it = *this;
+
+            ++*this;
+            return it;
+        }
+
+        iterator operator--(int) noexcept
+        {
+            iterator it = *this;
+
+            --*this;
+            return it;
+        }
+
+        friend bool operator==(const iterator &a, const iterator &b) noexcept
+        {
+            return (a.cursor.tnode == b.cursor.tnode) &&
+                (a.cursor.idx == b.cursor.idx);
+        }
+
+        friend bool operator!=(const iterator &a, const iterator &b) noexcept
+        {
+            return !(a == b);
+        }
+
+        /** Cursor the iterator is, e.g. for ttree_delete_at_cursor. */
+        TtreeCursor *get_cursor() noexcept { return &cursor; }
+
+    private:
+        friend class tree;
+
+        /* Past-the-end iterator of a tree */
+        explicit iterator(Ttree *ttree) noexcept : cursor()
+        {
+            cursor.ttree = ttree;
+            set_end();
+        }
+
+        void set_end() noexcept
+        {
+            cursor.tnode = nullptr;
+            cursor.idx = 0;
+            cursor.state = CURSOR_CLOSED;
+        }
+
+        TtreeCursor cursor;
+    };
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    /**
+     * @brief Create an empty tree.
+     * @param num_keys    - Number of keys per T*-tree node.
+     * @param is_unique   - Whether keys must be unique.
+     * @param inline_keys - Store copies of keys inside nodes (see
+     *                      ttree_init_inline). Keys must be trivially
+     *                      copyable and not longer than
+     *                      TTREE_INLINE_KEY_MAX bytes.
+     */
+    explicit tree(int num_keys = TTREE_DEFAULT_NUMKEYS, bool is_unique = true,
+                  bool inline_keys = false)
+    {
+        size_t key_width = 0;
+
+        if (inline_keys) {
+            if (!std::is_trivially_copyable_v<key_type> ||
+                (sizeof(key_type) > TTREE_INLINE_KEY_MAX) ||
+                (alignof(key_type) > alignof(void *))) {
+                throw std::invalid_argument("Key can't be stored inline");
+            }
+
+            key_width = sizeof(key_type);
+        }
+        if (__ttree_init_inline(&ttree, num_keys, is_unique, compare,
+                                key_offset(), key_width)) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "ttree initialization");
+        }
+    }
+
+    tree(const tree &) = delete;
+    tree &operator=(const tree &) = delete;
+
+    ~tree() { ttree_destroy(&ttree); }
+
+    /** Underlying T*-tree for the rest of C API. */
+    Ttree *native_handle() noexcept { return &ttree; }
+
+    size_type size() const noexcept { return ttree_size(&ttree); }
+    bool empty() const noexcept { return ttree_is_empty(&ttree); }
+
+    /**
+     * @brief Insert an item.
+     * @return false if the tree is unique and has an item with
+     *         the same key.
+     */
+    bool insert(Item &item) noexcept { return !ttree_insert(&ttree, &item); }
+
+    /**
+     * @brief Remove an item by its key.
+     * @return removed item or nullptr if there's no such item.
+     */
+    Item *erase(const key_type &key) noexcept
+    {
+        return static_cast<Item *>(ttree_delete(&ttree, key_ptr(key)));
+    }
+
+    /** Find an item by its key, returns nullptr if there's no such item. */
+    Item *lookup(const key_type &key) noexcept
+    {
+        return static_cast<Item *>(ttree_lookup(&ttree, key_ptr(key), NULL));
+    }
+
+    iterator find(const key_type &key) noexcept
+    {
+        iterator it;
+
+        return iterator_on(it, ttree_lookup(&ttree, key_ptr(key),
+                                            &it.cursor) ? TCSR_OK : TCSR_END);
+    }
+
+    /** The first item with a key not less than @a key. */
+    iterator lower_bound(const key_type &key) noexcept
+    {
+        iterator it;
+
+        return iterator_on(it, ttree_cursor_seek_ge(&it.cursor, &ttree,
+                                                    key_ptr(key)));
+    }
+
+    /** The first item with a key greater than @a key. */
+    iterator upper_bound(const key_type &key) noexcept
+    {
+        iterator it;
+
+        return iterator_on(it, ttree_cursor_seek_gt(&it.cursor, &ttree,
+                                                    key_ptr(key)));
+    }
+
+    std::pair<iterator, iterator> equal_range(const key_type &key) noexcept
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    iterator begin() noexcept
+    {
+        iterator it;
+
+        if (ttree_cursor_open(&it.cursor, &ttree)) {
+            return end();
+        }
+
+        return iterator_on(it, ttree_cursor_first(&it.cursor));
+    }
+
+    iterator end() noexcept { return iterator(&ttree); }
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+
+#ifdef TTREE_HPP_COROUTINES
+    /**
+     * @brief Create a lookup suspending after each step of the descent.
+     *
+     * The key is copied into the coroutine frame. The tree mustn't
+     * change until the task is done.
+     * @see lookup_task
+     */
+    lookup_task<Item> lookup_async(key_type key)
+    {
+        TtreeLookupStep ls;
+
+        ttree_lookup_start(&ttree, &ls, &key);
+        while (ttree_lookup_step(&ttree, &ls)) {
+            co_await std::suspend_always();
+        }
+
+        co_return static_cast<Item *>(ttree_lookup_finish(&ttree, &ls));
+    }
+
+    /**
+     * @brief Find items by a sequence of keys with interleaved lookups.
+     *
+     * Lookups are run by groups of @a group_size tasks.
+     * @param out - Output iterator getting an item pointer (or nullptr)
+     *              for each key in order of keys.
+     * @return Number of found items.
+     */
+    template <typename KeyIt, typename OutIt>
+    size_type lookup_interleaved(KeyIt first, KeyIt last, OutIt out,
+                                 size_type group_size = 16)
+    {
+        std::vector<lookup_task<Item>> group;
+        size_type found = 0;
+
+        group.reserve(group_size);
+        while (first != last) {
+            group.clear();
+            for (; (first != last) && (group.size() < group_size); ++first) {
+                group.push_back(lookup_async(*first));
+            }
+
+            run_interleaved(std::span<lookup_task<Item>>(group));
+            for (lookup_task<Item> &task : group) {
+                found += (task.get() != nullptr);
+                *out++ = task.get();
+            }
+        }
+
+        return found;
+    }
+#endif /* TTREE_HPP_COROUTINES */
+
+private:
+    iterator iterator_on(const iterator &it, int ret) noexcept
+    {
+        return (ret == TCSR_OK) ? it : end();
+    }
+
+    static int compare(void *key1, void *key2)
+    {
+        const key_type &k1 = *static_cast<const key_type *>(key1);
+        const key_type &k2 = *static_cast<const key_type *>(key2);
+        Compare less;
+
+        return less(k1, k2) ? -1 : (less(k2, k1) ? 1 : 0);
+    }
+
+    static void *key_ptr(const key_type &key) noexcept
+    {
+        return const_cast<key_type *>(&key);
+    }
+
+    static size_t key_offset() noexcept
+    {
+        alignas(Item) unsigned char buf[sizeof(Item)];
+        const Item *item = reinterpret_cast<const Item *>(buf);
+
+        return reinterpret_cast<const unsigned char *>(&(item->*KeyField)) -
+            buf;
+    }
+
+    Ttree ttree;
+};
+
+} /* namespace tt */
+
+#endif /* !__TTREE_HPP__ */
@@ -66,6 +66,21 @@
 #define __inline
 #endif /* !__cplusplus && !__GNUC__ && !__INTEL_COMPILER */
 
+/**
+ * @brief Type of an expression
+ */
+#if defined(__GNUC__)
+#define TTREE_TYPEOF(expr) __typeof__(expr)
+#elif defined(__cplusplus)
+#define TTREE_TYPEOF(expr) decltype(expr)
+#endif /* __GNUC__ */
+
+#ifdef __GNUC__
+#define TTREE_ALWAYS_INLINE __inline __attribute__((always_inline))
+#else /* __GNUC__ */
+#define TTREE_ALWAYS_INLINE __inline
+#endif /* !__GNUC__ */
+
 #ifdef __GNUC__
 #if (__GNUC__ >= 3)
 #define LIKELY(cond)   __builtin_expect((cond), 1)
@@ -76,4 +91,53 @@
 #endif /* __GNUC__ < 3 */
 #endif /*__GNUC__ */
 
+/*
+ * Memory ordering primitives used by T*-trees in concurrent mode.
+ */
+#ifdef __GNUC__
+#define TTREE_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define TTREE_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define TTREE_STORE_RELEASE(ptr, val)                   \
+    __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define TTREE_STORE_RELAXED(ptr, val)                   \
+    __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define TTREE_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define TTREE_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define TTREE_FENCE_FULL() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define TTREE_FETCH_ADD(ptr, val)                       \
+    __atomic_fetch_add((ptr), (val), __ATOMIC_ACQ_REL)
+#define TTREE_FETCH_SUB(ptr, val)                       \
+    __atomic_fetch_sub((ptr), (val), __ATOMIC_ACQ_REL)
+#define TTREE_CAS(ptr, old, new)                                        \
+    __atomic_compare_exchange_n((ptr), &(old), (new), false,            \
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#if defined(__i386__) || defined(__x86_64__)
+#define TTREE_CPU_RELAX() __builtin_ia32_pause()
+#else /* __i386__ || __x86_64__ */
+#define TTREE_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif /* !__i386__ && !__x86_64__ */
+#else /* __GNUC__ */
+#define TTREE_LOAD_ACQUIRE(ptr) (*(ptr))
+#define TTREE_LOAD_RELAXED(ptr) TTREE_LOAD_ACQUIRE(ptr)
+#define TTREE_STORE_RELEASE(ptr, val) (*(ptr) = (val))
+#define TTREE_STORE_RELAXED(ptr, val) (*(ptr) = (val))
+#define TTREE_FENCE_ACQUIRE()
+#define TTREE_FENCE_RELEASE()
+#define TTREE_FENCE_FULL()
+#define TTREE_FETCH_ADD(ptr, val) (*(ptr) += (val))
+#define TTREE_FETCH_SUB(ptr, val) (*(ptr) -= (val))
+#define TTREE_CAS(ptr, old, new)                                \
+    ((*(ptr) == (old)) ? (*(ptr) = (new), true) : false)
+#define TTREE_CPU_RELAX()
+#endif /* !__GNUC__ */
+
+/**
+ * @brief Hint the CPU that memory at @a addr will be read soon.
+ */
+#ifdef __GNUC__
+#define TTREE_PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
+#else /* __GNUC__ */
+#define TTREE_PREFETCH(addr) ((void)(addr))
+#endif /* !__GNUC__ */
+
 #endif /* !__TTREE_DEFS_H__ */
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ttree_pool.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+struct ttree_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    ttree_pool_task_fn task_fn;
+    void *task_arg;
+    int num_tasks;
+    int next_task;
+    int pending;
+    bool stop;
+    int num_threads;
+    pthread_t threads[];
+};
+
+/* Called with the pool lock held, runs one task with the lock released. */
+static void pool_run_task(struct ttree_pool *pool)
+{
+    int task = pool->next_task++;
+
+    pthread_mutex_unlock(&pool->lock);
+    pool->task_fn(pool->task_arg, task);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+        pthread_cond_signal(&pool->done);
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    struct ttree_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && (pool->next_task >= pool->num_tasks)) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+
+        pool_run_task(pool);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void ttree_pool_destroy(struct ttree_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+struct ttree_pool *ttree_pool_create(int num_threads)
+{
+    struct ttree_pool *pool;
+
+    pool = calloc(1, sizeof(*pool) + num_threads * sizeof(pthread_t));
+    if (!pool) {
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (pool->num_threads = 0; pool->num_threads < num_threads;
+         pool->num_threads++) {
+        if (pthread_create(&pool->threads[pool->num_threads], NULL,
+                           pool_thread, pool)) {
+            ttree_pool_destroy(pool);
+            SET_ERRNO(EAGAIN);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void ttree_pool_run(struct ttree_pool *pool, ttree_pool_task_fn fn,
+                    void *arg, int num_tasks)
+{
+    int task;
+
+    if (pool && (num_tasks > 1)) {
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->num_tasks) {
+            pool->task_fn = fn;
+            pool->task_arg = arg;
+            pool->num_tasks = pool->pending = num_tasks;
+            pool->next_task = 0;
+            pthread_cond_broadcast(&pool->work);
+            while (pool->next_task < pool->num_tasks) {
+                pool_run_task(pool);
+            }
+            while (pool->pending) {
+                pthread_cond_wait(&pool->done, &pool->lock);
+            }
+
+            pool->num_tasks = pool->next_task = 0;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for (task = 0; task < num_tasks; task++) {
+        fn(arg, task);
+    }
+}
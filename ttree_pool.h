@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Internal interface of the fork-join pool of threads used by
+ * parallel operations on trees and on sharded trees. Not invented
+ * for public usage.
+ */
+
+#ifndef __TTREE_POOL_H__
+#define __TTREE_POOL_H__
+
+/*
+ * Tasks of one job are numbered from 0 to num_tasks - 1 and are
+ * taken one by one by pool threads and by the thread that has
+ * started the job.
+ */
+typedef void (*ttree_pool_task_fn)(void *arg, int task);
+
+struct ttree_pool;
+
+/*
+ * Start a pool of @num_threads threads. Returns NULL and sets errno
+ * if there is no memory or threads can't be created.
+ */
+struct ttree_pool *ttree_pool_create(int num_threads);
+
+/* Stop threads of the pool and free it. */
+void ttree_pool_destroy(struct ttree_pool *pool);
+
+/*
+ * Run tasks 0..@num_tasks - 1 of @fn and wait until all of them are
+ * done. Only one job runs at a time: a job started while the pool is
+ * busy, as well as a job given to NULL pool, is run in the calling
+ * thread.
+ */
+void ttree_pool_run(struct ttree_pool *pool, ttree_pool_task_fn fn,
+                    void *arg, int num_tasks);
+
+#endif /* !__TTREE_POOL_H__ */
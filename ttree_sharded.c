@@ -0,0 +1,729 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ttree_sharded.h"
+#include "ttree_pool.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+/* Part of node rooms filled when shards are rebuilt by repartitioning. */
+#define TTREE_SHARDED_REFILL 0.75
+
+#define splitter(st, i)                         \
+    ((void *)((st)->splitters + (i) * (st)->key_size))
+
+#define item_key(st, item)                      \
+    ((void *)((char *)(item) + (st)->key_offs))
+
+static int __route(TtreeSharded *st, char *splitters, void *key)
+{
+    int floor = 0, ceil = TTREE_LOAD_RELAXED(&st->num_splitters), mid;
+
+    /*
+     * The number of splitters less or equal to the key. Point
+     * operations read splitters while repartitioning may copy new ones
+     * over them. The race is deliberate: such a result is discarded
+     * by lock_shard, which sees the layout version changed.
+     */
+    while (floor < ceil) {
+        mid = (floor + ceil) >> 1;
+        if (st->cmp_func(key, splitters + mid * st->key_size) < 0) {
+            ceil = mid;
+        }
+        else {
+            floor = mid + 1;
+        }
+    }
+
+    return floor;
+}
+
+int ttree_sharded_route(TtreeSharded *st, void *key)
+{
+    return __route(st, st->splitters, key);
+}
+
+static Ttree *alloc_shard_tree(TtreeSharded *st, int shard, int num_keys,
+                               bool is_unique)
+{
+    Ttree *tree;
+
+    tree = malloc(sizeof(*tree));
+    if (!tree) {
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+    if ((__ttree_init(tree, num_keys, is_unique, st->cmp_func,
+                      st->key_offs) < 0) ||
+        ((st->use_pages ?
+          ttree_use_pages(tree, st->page_size, st->shards[shard].numa_node) :
+          ttree_use_slab(tree, 0)) < 0)) {
+        free(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+static void free_shard_tree(Ttree *tree)
+{
+    ttree_destroy(tree);
+    free(tree);
+}
+
+int __ttree_sharded_init(TtreeSharded *st, int num_shards, int num_threads,
+                         int num_keys, bool is_unique, ttree_cmp_func_fn cmpf,
+                         size_t key_offs, size_t key_size)
+{
+    int i;
+
+    if (!st || !cmpf || !key_size || (num_shards < 1) ||
+        (num_shards > TTREE_SHARDS_MAX) || (num_threads < 0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->num_shards = num_shards;
+    st->key_size = key_size;
+    st->key_offs = key_offs;
+    st->cmp_func = cmpf;
+    pthread_rwlock_init(&st->layout_lock, NULL);
+    st->shards = calloc(num_shards, sizeof(*st->shards));
+    st->splitters = malloc(num_shards * key_size);
+    if (!st->shards || !st->splitters) {
+        SET_ERRNO(ENOMEM);
+        goto fail;
+    }
+    for (i = 0; i < num_shards; i++) {
+        pthread_mutex_init(&st->shards[i].lock, NULL);
+        st->shards[i].numa_node = TTREE_NUMA_ANY;
+    }
+    for (i = 0; i < num_shards; i++) {
+        st->shards[i].tree = alloc_shard_tree(st, i, num_keys, is_unique);
+        if (!st->shards[i].tree) {
+            goto fail;
+        }
+    }
+    if (num_threads && !(st->pool = ttree_pool_create(num_threads))) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    ttree_sharded_destroy(st);
+    return -1;
+}
+
+void ttree_sharded_destroy(TtreeSharded *st)
+{
+    int i;
+
+    if (st->pool) {
+        ttree_pool_destroy(st->pool);
+    }
+    if (st->shards) {
+        for (i = 0; i < st->num_shards; i++) {
+            if (st->shards[i].tree) {
+                free_shard_tree(st->shards[i].tree);
+            }
+
+            pthread_mutex_destroy(&st->shards[i].lock);
+        }
+    }
+
+    pthread_rwlock_destroy(&st->layout_lock);
+    free(st->shards);
+    free(st->splitters);
+    memset(st, 0, sizeof(*st));
+}
+
+static void lock_all_shards(TtreeSharded *st)
+{
+    int i;
+
+    pthread_rwlock_wrlock(&st->layout_lock);
+    for (i = 0; i < st->num_shards; i++) {
+        pthread_mutex_lock(&st->shards[i].lock);
+    }
+}
+
+static void unlock_all_shards(TtreeSharded *st)
+{
+    int i;
+
+    for (i = st->num_shards - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&st->shards[i].lock);
+    }
+
+    pthread_rwlock_unlock(&st->layout_lock);
+}
+
+/*
+ * Point operations don't take the layout lock, so a shard found
+ * by splitters may lose the key while its lock is awaited. Since
+ * layout is changed only under all shard locks, it's enough to
+ * check that layout version stayed the same after the shard is locked.
+ */
+static TtreeShard *lock_shard(TtreeSharded *st, void *key)
+{
+    TtreeShard *shard;
+    unsigned long layout;
+
+    for (;;) {
+        layout = TTREE_LOAD_ACQUIRE(&st->layout);
+        shard = &st->shards[ttree_sharded_route(st, key)];
+        pthread_mutex_lock(&shard->lock);
+        if (!(layout & 1) && (TTREE_LOAD_RELAXED(&st->layout) == layout)) {
+            return shard;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Size of a shard is published separately from its tree: the tree
+ * is changed with plain stores under the shard lock and may even be
+ * replaced by repartitioning, while ttree_sharded_size takes no locks.
+ */
+static __inline void update_shard_size(TtreeShard *shard)
+{
+    TTREE_STORE_RELAXED(&shard->num_items, ttree_size(shard->tree));
+}
+
+static void set_layout(TtreeSharded *st, char *splitters, int num)
+{
+    TTREE_STORE_RELAXED(&st->layout, st->layout + 1);
+    TTREE_FENCE_RELEASE();
+    memcpy(st->splitters, splitters, num * st->key_size);
+    TTREE_STORE_RELAXED(&st->num_splitters, num);
+    TTREE_STORE_RELEASE(&st->layout, st->layout + 1);
+}
+
+size_t ttree_sharded_size(TtreeSharded *st)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < st->num_shards; i++) {
+        size += TTREE_LOAD_RELAXED(&st->shards[i].num_items);
+    }
+
+    return size;
+}
+
+int ttree_sharded_set_splitters(TtreeSharded *st, void **keys)
+{
+    char *splitters;
+    int i, ret = -1;
+
+    if (!st || (!keys && (st->num_shards > 1))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    for (i = 1; i < st->num_shards - 1; i++) {
+        if (st->cmp_func(keys[i - 1], keys[i]) > 0) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+    }
+
+    splitters = malloc(st->num_shards * st->key_size);
+    if (!splitters) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    for (i = 0; i < st->num_shards - 1; i++) {
+        memcpy(splitters + i * st->key_size, keys[i], st->key_size);
+    }
+
+    lock_all_shards(st);
+    if (ttree_sharded_size(st)) {
+        SET_ERRNO(EBUSY);
+    }
+    else {
+        set_layout(st, splitters, st->num_shards - 1);
+        ret = 0;
+    }
+
+    unlock_all_shards(st);
+    free(splitters);
+    return ret;
+}
+
+int ttree_sharded_use_pages(TtreeSharded *st, size_t page_size,
+                            const int *numa_nodes)
+{
+    int i, ret = 0;
+
+    if (!st || (page_size && (page_size != TTREE_PAGE_2M) &&
+                (page_size != TTREE_PAGE_1G))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    for (i = 0; numa_nodes && (i < st->num_shards); i++) {
+        if ((numa_nodes[i] < TTREE_NUMA_LOCAL) ||
+            (numa_nodes[i] >= TTREE_NUMA_NODES_MAX)) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+    }
+
+    lock_all_shards(st);
+    if (ttree_sharded_size(st)) {
+        SET_ERRNO(EBUSY);
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < st->num_shards; i++) {
+        st->shards[i].numa_node = numa_nodes ? numa_nodes[i] : TTREE_NUMA_ANY;
+        ret = ttree_use_pages(st->shards[i].tree, page_size,
+                              st->shards[i].numa_node);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    st->use_pages = true;
+    st->page_size = page_size;
+
+out:
+    unlock_all_shards(st);
+    return ret;
+}
+
+int ttree_sharded_insert(TtreeSharded *st, void *item)
+{
+    TtreeShard *shard;
+    int ret;
+
+    shard = lock_shard(st, item_key(st, item));
+    ret = ttree_insert(shard->tree, item);
+    update_shard_size(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+void *ttree_sharded_lookup(TtreeSharded *st, void *key)
+{
+    TtreeShard *shard;
+    void *item;
+
+    shard = lock_shard(st, key);
+    item = ttree_lookup(shard->tree, key, NULL);
+    pthread_mutex_unlock(&shard->lock);
+    return item;
+}
+
+void *ttree_sharded_delete(TtreeSharded *st, void *key)
+{
+    TtreeShard *shard;
+    void *item;
+
+    shard = lock_shard(st, key);
+    item = ttree_delete(shard->tree, key);
+    update_shard_size(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return item;
+}
+
+struct scan_job {
+    TtreeSharded *st;
+    void *lo, *hi;
+    ttree_range_fn callback;
+    void *arg;
+    int first_shard;
+    int stop;
+    struct scan_task {
+        struct scan_job *job;
+        ssize_t scanned;
+        int err;
+    } tasks[];
+};
+
+static int scan_slice(void **keys, int num, void *arg)
+{
+    struct scan_task *task = arg;
+    struct scan_job *job = task->job;
+
+    if (TTREE_LOAD_RELAXED(&job->stop)) {
+        return 1;
+    }
+
+    task->scanned += num;
+    if (job->callback(keys, num, job->arg)) {
+        TTREE_STORE_RELAXED(&job->stop, 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void scan_shard(void *arg, int idx)
+{
+    struct scan_job *job = arg;
+    struct scan_task *task = &job->tasks[idx];
+    TtreeShard *shard = &job->st->shards[job->first_shard + idx];
+
+    task->job = job;
+    pthread_mutex_lock(&shard->lock);
+    if (ttree_range_scan(shard->tree, job->lo, job->hi,
+                         scan_slice, task) < 0) {
+        task->err = errno;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+ssize_t ttree_sharded_range_scan(TtreeSharded *st, void *lo, void *hi,
+                                 ttree_range_fn callback, void *arg)
+{
+    struct scan_job *job;
+    ssize_t scanned = 0;
+    int i, num_tasks;
+
+    if (!st || !callback) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (lo && hi && (st->cmp_func(lo, hi) > 0)) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&st->layout_lock);
+    i = lo ? ttree_sharded_route(st, lo) : 0;
+    num_tasks = (hi ? ttree_sharded_route(st, hi) : st->num_shards - 1) - i + 1;
+    job = calloc(1, sizeof(*job) + num_tasks * sizeof(job->tasks[0]));
+    if (!job) {
+        pthread_rwlock_unlock(&st->layout_lock);
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    job->st = st;
+    job->lo = lo;
+    job->hi = hi;
+    job->callback = callback;
+    job->arg = arg;
+    job->first_shard = i;
+    ttree_pool_run(st->pool, scan_shard, job, num_tasks);
+    pthread_rwlock_unlock(&st->layout_lock);
+    for (i = 0; i < num_tasks; i++) {
+        if (job->tasks[i].err) {
+            SET_ERRNO(job->tasks[i].err);
+            scanned = -1;
+            break;
+        }
+
+        scanned += job->tasks[i].scanned;
+    }
+
+    free(job);
+    return scanned;
+}
+
+/*
+ * Rebuilding of shards. Items sorted by keys are divided into
+ * num_shards equal parts, and the first key of each part except
+ * the first one becomes a splitter. Since items with keys equal to
+ * a splitter belong to the right shard, parts are adjusted to
+ * begin with the first item having a key not less than the splitter.
+ * New trees are built aside and replace the old ones only if all of
+ * them were loaded successfully.
+ */
+struct rebuild_job {
+    TtreeSharded *st;
+    void **items;
+    size_t *bounds;
+    Ttree **trees;
+    double fill;
+    int *errs;
+};
+
+static size_t lower_bound(TtreeSharded *st, void **items, size_t n,
+                          void *key)
+{
+    size_t floor = 0, ceil = n, mid;
+
+    while (floor < ceil) {
+        mid = floor + ((ceil - floor) >> 1);
+        if (st->cmp_func(item_key(st, items[mid]), key) < 0) {
+            floor = mid + 1;
+        }
+        else {
+            ceil = mid;
+        }
+    }
+
+    return floor;
+}
+
+static void load_shard(void *arg, int idx)
+{
+    struct rebuild_job *job = arg;
+    size_t first = job->bounds[idx], n = job->bounds[idx + 1] - first;
+
+    if (ttree_bulk_load(job->trees[idx], job->items + first, n,
+                        job->fill) < 0) {
+        job->errs[idx] = errno;
+    }
+}
+
+static int rebuild_shards(TtreeSharded *st, void **items, size_t n,
+                          double fill)
+{
+    struct rebuild_job job;
+    char *splitters;
+    Ttree *tree;
+    int i, err = 0, num_splitters = st->num_shards - 1;
+
+    job.st = st;
+    job.items = items;
+    job.fill = fill;
+    job.bounds = malloc((st->num_shards + 1) * sizeof(*job.bounds));
+    job.trees = calloc(st->num_shards, sizeof(*job.trees));
+    job.errs = calloc(st->num_shards, sizeof(*job.errs));
+    splitters = malloc(st->num_shards * st->key_size);
+    if (!job.bounds || !job.trees || !job.errs || !splitters) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    job.bounds[0] = 0;
+    job.bounds[st->num_shards] = n;
+    for (i = 0; i < num_splitters; i++) {
+        void *key = splitter(st, i);
+
+        if (n) {
+            size_t part = n / st->num_shards * (i + 1) +
+                n % st->num_shards * (i + 1) / st->num_shards;
+
+            key = memcpy(splitters + i * st->key_size,
+                         item_key(st, items[part]), st->key_size);
+        }
+        else if (i < st->num_splitters) {
+            memcpy(splitters + i * st->key_size, key, st->key_size);
+        }
+
+        job.bounds[i + 1] = lower_bound(st, items, n, key);
+        if (job.bounds[i + 1] < job.bounds[i]) {
+            err = EINVAL;
+            goto out;
+        }
+    }
+    if (!n) {
+        num_splitters = st->num_splitters;
+    }
+
+    /*
+     * Every part is sorted as verified by ttree_bulk_load, so the whole
+     * array is sorted if the parts are ordered by the splitters too.
+     */
+    for (i = 0; i < st->num_shards; i++) {
+        size_t first = job.bounds[i], last = job.bounds[i + 1];
+
+        if ((i > 0) && (last > first) &&
+            (st->cmp_func(item_key(st, items[first]),
+                          splitters + (i - 1) * st->key_size) < 0)) {
+            err = EINVAL;
+            goto out;
+        }
+        if ((i < num_splitters) && (last > first) &&
+            (st->cmp_func(item_key(st, items[last - 1]),
+                          splitters + i * st->key_size) >= 0)) {
+            err = EINVAL;
+            goto out;
+        }
+
+        tree = st->shards[i].tree;
+        job.trees[i] = alloc_shard_tree(st, i, tree->keys_per_tnode,
+                                        tree->keys_are_unique);
+        if (!job.trees[i]) {
+            err = errno;
+            goto out;
+        }
+    }
+
+    ttree_pool_run(st->pool, load_shard, &job, st->num_shards);
+    for (i = 0; i < st->num_shards; i++) {
+        if (job.errs[i]) {
+            err = job.errs[i];
+            goto out;
+        }
+    }
+
+    set_layout(st, splitters, num_splitters);
+    for (i = 0; i < st->num_shards; i++) {
+        tree = st->shards[i].tree;
+        st->shards[i].tree = job.trees[i];
+        update_shard_size(&st->shards[i]);
+        job.trees[i] = tree;
+    }
+
+out:
+    if (job.trees) {
+        for (i = 0; i < st->num_shards; i++) {
+            if (job.trees[i]) {
+                free_shard_tree(job.trees[i]);
+            }
+        }
+    }
+
+    free(splitters);
+    free(job.errs);
+    free(job.trees);
+    free(job.bounds);
+    if (err) {
+        SET_ERRNO(err);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ttree_sharded_bulk_load(TtreeSharded *st, void **sorted_items,
+                            size_t n, double fill)
+{
+    int ret = -1;
+
+    if (!st || (!sorted_items && n) || !(fill > 0.0) || (fill > 1.0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    lock_all_shards(st);
+    if (ttree_sharded_size(st)) {
+        SET_ERRNO(EBUSY);
+    }
+    else {
+        ret = rebuild_shards(st, sorted_items, n, fill);
+    }
+
+    unlock_all_shards(st);
+    return ret;
+}
+
+struct collect_job {
+    TtreeSharded *st;
+    void **items;
+    size_t *offs;
+};
+
+struct collect_task {
+    TtreeSharded *st;
+    void **pos;
+};
+
+static int collect_slice(void **keys, int num, void *arg)
+{
+    struct collect_task *task = arg;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        *task->pos++ = (char *)keys[i] - task->st->key_offs;
+    }
+
+    return 0;
+}
+
+static void collect_shard(void *arg, int idx)
+{
+    struct collect_job *job = arg;
+    struct collect_task task;
+
+    task.st = job->st;
+    task.pos = job->items + job->offs[idx];
+    ttree_range_scan(job->st->shards[idx].tree, NULL, NULL,
+                     collect_slice, &task);
+}
+
+int ttree_sharded_repartition(TtreeSharded *st, double max_skew)
+{
+    struct collect_job job;
+    size_t total = 0, max_size = 0, size;
+    int i, ret = 0;
+
+    if (!st) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    lock_all_shards(st);
+    for (i = 0; i < st->num_shards; i++) {
+        size = ttree_size(st->shards[i].tree);
+        total += size;
+        if (size > max_size) {
+            max_size = size;
+        }
+    }
+
+    /* Shards as equal as possible can't be made any better. */
+    if ((max_size <= (total + st->num_shards - 1) / st->num_shards) ||
+        ((max_skew > 1.0) &&
+         ((double)max_size <= max_skew * total / st->num_shards))) {
+        goto out;
+    }
+
+    job.st = st;
+    job.items = malloc(total * sizeof(*job.items));
+    job.offs = malloc(st->num_shards * sizeof(*job.offs));
+    if (!job.items || !job.offs) {
+        free(job.items);
+        free(job.offs);
+        SET_ERRNO(ENOMEM);
+        ret = -1;
+        goto out;
+    }
+    for (i = 0, total = 0; i < st->num_shards; i++) {
+        job.offs[i] = total;
+        total += ttree_size(st->shards[i].tree);
+    }
+
+    /*
+     * Shards are ordered by their keys, so concatenation of their
+     * items is sorted. Skew is caused by insertions, so rebuilt nodes
+     * keep some free rooms for more of them.
+     */
+    ttree_pool_run(st->pool, collect_shard, &job, st->num_shards);
+    ret = (rebuild_shards(st, job.items, total,
+                          TTREE_SHARDED_REFILL) < 0) ? -1 : 1;
+    free(job.items);
+    free(job.offs);
+
+out:
+    unlock_all_shards(st);
+    return ret;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * @file ttree_sharded.h
+ * @brief Range-partitioned T*-tree built of several independent trees
+ *
+ * TtreeSharded splits the key space into ranges by splitter keys.
+ * Each range is served by its own T*-tree (shard) with its own lock
+ * and its own slab of nodes, so writers touching different ranges
+ * never contend. Range scans and bulk loads spanning several shards
+ * are run in parallel on a pool of threads.
+ */
+
+#ifndef __TTREE_SHARDED_H__
+#define __TTREE_SHARDED_H__
+
+#include <pthread.h>
+#include "ttree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define TTREE_SHARDS_MAX 1024  /**< Maximum number of shards */
+
+struct ttree_pool;
+
+/**
+ * @brief A shard of TtreeSharded: a T*-tree and its lock.
+ */
+typedef struct ttree_shard {
+    Ttree *tree;          /**< Items of the shard */
+    pthread_mutex_t lock; /**< Serializes operations on the tree */
+    int numa_node;        /**< NUMA policy of nodes, see ttree_use_pages */
+    size_t num_items;     /**< Size of the tree, may be read unlocked */
+} TtreeShard;
+
+/**
+ * @brief Range-partitioned T*-tree.
+ *
+ * Shard i holds items with keys in range [splitter(i - 1), splitter(i)),
+ * the first and the last shards are unbounded from the left and from
+ * the right respectively. Splitters are copies of keys, so they don't
+ * depend on lifetime of items. Layout of the key space changes only
+ * under all shard locks.
+ */
+typedef struct ttree_sharded {
+    TtreeShard *shards;         /**< Array of shards */
+    int num_shards;             /**< Number of shards */
+    int num_splitters;          /**< 0 until splitters are set */
+    char *splitters;            /**< num_shards - 1 copies of keys */
+    size_t key_size;            /**< Size of a key copy in bytes */
+    size_t key_offs;            /**< Offset from item to its key */
+    ttree_cmp_func_fn cmp_func; /**< User-defined key comparing function */
+
+    /**
+     * Layout version. It's odd while splitters are changed.
+     * Point operations recheck it after locking a shard.
+     */
+    unsigned long layout;
+
+    /**
+     * Taken for reading by operations spanning several shards
+     * and for writing while the key space is repartitioned.
+     */
+    pthread_rwlock_t layout_lock;
+    struct ttree_pool *pool;    /**< Threads running per-shard tasks */
+    bool use_pages;             /**< Shards carve nodes from pages */
+    size_t page_size;           /**< Page size of shard trees */
+} TtreeSharded;
+
+/**
+ * @brief Initialize new sharded T*-tree.
+ * @param st[out]     - A pointer to sharded T*-tree to initialize.
+ * @param num_shards  - Number of shards.
+ * @param num_threads - Number of pool threads (0 runs everything
+ *                      in the calling thread).
+ * @param num_keys    - A number of keys per T*-tree node.
+ * @param is_unique   - A boolean to determine whether keys must be unique.
+ * @param cmpf        - A pointer to user-defined comparison function.
+ * @param data_struct - Structure containing an item that will be
+ *                      used by T*-tree as a key.
+ * @param key_field   - Name of a key field in a @a data_struct.
+ * @return 0 on success, -1 on error.
+ * @see __ttree_sharded_init
+ */
+#define ttree_sharded_init(st, num_shards, num_threads, num_keys,       \
+                           is_unique, cmpf, data_struct, key_field)     \
+    __ttree_sharded_init(st, num_shards, num_threads, num_keys,         \
+                         is_unique, cmpf,                               \
+                         offsetof(data_struct, key_field),              \
+                         sizeof(((data_struct *)0)->key_field))
+
+/**
+ * @brief More detailed sharded T*-tree initialization.
+ *
+ * Until splitters are set by ttree_sharded_set_splitters,
+ * ttree_sharded_bulk_load or ttree_sharded_repartition, all items
+ * go to the first shard. Splitters are copies of first @a key_size
+ * bytes of keys, so like in trees with inline keys the comparison
+ * function must depend only on them.
+ *
+ * @param st[out]     - A pointer to sharded T*-tree to initialize.
+ * @param num_shards  - Number of shards, in range [1, TTREE_SHARDS_MAX].
+ * @param num_threads - Number of pool threads.
+ * @param num_keys    - A number of keys per T*-tree node.
+ * @param is_unique   - A boolean to determine whether keys must be unique.
+ * @param cmpf        - User defined comparison function.
+ * @param key_offs    - Offset from item structure start to its key field.
+ * @param key_size    - Size of a key in bytes.
+ * @return 0 on success, -1 on error.
+ */
+int __ttree_sharded_init(TtreeSharded *st, int num_shards, int num_threads,
+                         int num_keys, bool is_unique, ttree_cmp_func_fn cmpf,
+                         size_t key_offs, size_t key_size);
+
+/**
+ * @brief Destroy sharded T*-tree and stop its threads.
+ * Items are not freed.
+ */
+void ttree_sharded_destroy(TtreeSharded *st);
+
+/**
+ * @brief Set splitter keys of an empty sharded T*-tree.
+ * @param st   - A pointer to sharded T*-tree.
+ * @param keys - num_shards - 1 pointers to keys sorted in ascending order.
+ * @return 0 on success, -1 on error. errno is set to EBUSY if the tree
+ *         is not empty and EINVAL if the keys aren't sorted.
+ */
+int ttree_sharded_set_splitters(TtreeSharded *st, void **keys);
+
+/**
+ * @brief Place nodes of an empty sharded T*-tree on pages and NUMA nodes.
+ *
+ * The tree of each shard carves its nodes from pages the way
+ * ttree_use_pages describes, so nodes of a shard served by threads
+ * of one NUMA node may be put on that node. Trees built for shards
+ * by bulk loads and repartitioning get the same placement.
+ *
+ * @param st         - A pointer to sharded T*-tree.
+ * @param page_size  - 0, TTREE_PAGE_2M or TTREE_PAGE_1G.
+ * @param numa_nodes - NUMA policy for each shard: a node number,
+ *                     TTREE_NUMA_LOCAL or TTREE_NUMA_ANY. NULL means
+ *                     TTREE_NUMA_ANY for all shards.
+ * @return 0 on success, -1 on error. errno is set to EBUSY if the tree
+ *         is not empty and EINVAL if arguments are invalid.
+ * @see ttree_use_pages
+ */
+int ttree_sharded_use_pages(TtreeSharded *st, size_t page_size,
+                            const int *numa_nodes);
+
+/**
+ * @brief Get an index of the shard an item with a @a key belongs to.
+ */
+int ttree_sharded_route(TtreeSharded *st, void *key);
+
+/**
+ * @brief Get total number of items in all shards.
+ *
+ * Shards aren't locked, so while the tree is changed the result
+ * is a sum of sizes each shard had at some moment of the call.
+ */
+size_t ttree_sharded_size(TtreeSharded *st);
+
+/**
+ * @brief Insert an item into the shard its key belongs to.
+ * @return 0 if all is ok, -1 on error. errno is set as by ttree_insert.
+ * @see ttree_insert
+ */
+int ttree_sharded_insert(TtreeSharded *st, void *item);
+
+/**
+ * @brief Find an item by its key.
+ * @return A pointer to the item or NULL if the key wasn't found.
+ */
+void *ttree_sharded_lookup(TtreeSharded *st, void *key);
+
+/**
+ * @brief Delete an item by its key.
+ * @return A pointer to deleted item or NULL if the key wasn't found.
+ */
+void *ttree_sharded_delete(TtreeSharded *st, void *key);
+
+/**
+ * @brief Walk through all items with keys in range [@a lo, @a hi].
+ *
+ * Shards overlapping the range are scanned in parallel, so unlike
+ * ttree_range_scan the callback may be called from several threads
+ * at once. Slices of one shard are handed in order, and all of them
+ * are handed by the same thread. Non-zero value returned by
+ * the callback stops scans of all shards.
+ *
+ * @param st       - A pointer to sharded T*-tree.
+ * @param lo       - A pointer to the lower bound key (NULL for no bound).
+ * @param hi       - A pointer to the upper bound key (NULL for no bound).
+ * @param callback - A function called for each slice of keys.
+ * @param arg      - An argument passed to the callback.
+ * @return Number of keys handed to the callback or negative value on error.
+ * @see ttree_range_scan
+ */
+ssize_t ttree_sharded_range_scan(TtreeSharded *st, void *lo, void *hi,
+                                 ttree_range_fn callback, void *arg);
+
+/**
+ * @brief Build sharded T*-tree from an array of items sorted by their keys.
+ *
+ * Splitters are chosen so that shards get equal parts of the array,
+ * and the shards are loaded in parallel.
+ *
+ * @param st           - A pointer to an empty sharded T*-tree.
+ * @param sorted_items - An array of items sorted by their keys.
+ * @param n            - Number of items in @a sorted_items.
+ * @param fill         - Part of node rooms to fill, in range (0, 1].
+ * @return 0 if all is ok, -1 on error. errno is set as by ttree_bulk_load.
+ * @see ttree_bulk_load
+ */
+int ttree_sharded_bulk_load(TtreeSharded *st, void **sorted_items,
+                            size_t n, double fill);
+
+/**
+ * @brief Repartition the key space if shards became skewed.
+ *
+ * If the largest shard holds more than @a max_skew times the average
+ * number of items per shard, new splitters dividing items equally are
+ * chosen and all shards are rebuilt in parallel. All operations wait
+ * while the tree is repartitioned.
+ *
+ * @param st       - A pointer to sharded T*-tree.
+ * @param max_skew - Allowed skew (values <= 1.0 force repartitioning).
+ * @return 1 if the tree was repartitioned, 0 if it wasn't skewed
+ *         (or shards are already as equal as possible) and -1 on error.
+ */
+int ttree_sharded_repartition(TtreeSharded *st, double max_skew);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !__TTREE_SHARDED_H__ */
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ttree_defs.h"
+#include "ttree_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TTREE_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define TTREE_SIMD_NEON
+#include <arm_neon.h>
+#endif /* __x86_64__ || __i386__ */
+
+struct simd_kernels {
+    const char *name;
+    int (*rank_u32)(const uint32_t *keys, int num, uint32_t key);
+    int (*rank_u64)(const uint64_t *keys, int num, uint64_t key);
+    int (*rank_i64)(const int64_t *keys, int num, int64_t key);
+};
+
+/*
+ * All kernels use the same approach: keys are compared with
+ * the search key several at a time, and the number of keys less
+ * than the search key is accumulated. Since keys are sorted, the scan
+ * stops at the first vector having at least one key that is greater
+ * or equal to the search key.
+ */
+#define DEFINE_SCALAR_RANK(type)                                        \
+    static int rank_##type##_scalar(const type##_t *keys,               \
+                                    int num, type##_t key)              \
+    {                                                                   \
+        int i;                                                          \
+                                                                        \
+        for (i = 0; (i < num) && (keys[i] < key); i++);                 \
+        return i;                                                       \
+    }
+
+DEFINE_SCALAR_RANK(uint32)
+DEFINE_SCALAR_RANK(uint64)
+DEFINE_SCALAR_RANK(int64)
+
+static const struct simd_kernels scalar_kernels = {
+    .name = "scalar",
+    .rank_u32 = rank_uint32_scalar,
+    .rank_u64 = rank_uint64_scalar,
+    .rank_i64 = rank_int64_scalar,
+};
+
+#ifdef TTREE_SIMD_X86
+/*
+ * There are only signed integer comparisons in SSE and AVX,
+ * so unsigned keys are compared after their sign bits being flipped.
+ */
+__attribute__((target("sse4.2")))
+static int rank_u32_sse42(const uint32_t *keys, int num, uint32_t key)
+{
+    const __m128i sign = _mm_set1_epi32(INT32_MIN);
+    __m128i k = _mm_xor_si128(_mm_set1_epi32((int32_t)key), sign);
+    int i, mask;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+
+        v = _mm_xor_si128(v, sign);
+        mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, v)));
+        if (mask != 0xf) {
+            return i + __builtin_popcount(mask);
+        }
+    }
+
+    return i + rank_uint32_scalar(keys + i, num - i, key);
+}
+
+__attribute__((target("sse4.2")))
+static int rank_u64_sse42(const uint64_t *keys, int num, uint64_t key)
+{
+    const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+    __m128i k = _mm_xor_si128(_mm_set1_epi64x((int64_t)key), sign);
+    int i, mask;
+
+    for (i = 0; i + 2 <= num; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+
+        v = _mm_xor_si128(v, sign);
+        mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v)));
+        if (mask != 0x3) {
+            return i + __builtin_popcount(mask);
+        }
+    }
+
+    return i + rank_uint64_scalar(keys + i, num - i, key);
+}
+
+__attribute__((target("sse4.2")))
+static int rank_i64_sse42(const int64_t *keys, int num, int64_t key)
+{
+    __m128i k = _mm_set1_epi64x(key);
+    int i, mask;
+
+    for (i = 0; i + 2 <= num; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+
+        mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v)));
+        if (mask != 0x3) {
+            return i + __builtin_popcount(mask);
+        }
+    }
+
+    return i + rank_int64_scalar(keys + i, num - i, key);
+}
+
+__attribute__((target("avx2")))
+static int rank_u32_avx2(const uint32_t *keys, int num, uint32_t key)
+{
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    __m256i k = _mm256_xor_si256(_mm256_set1_epi32((int32_t)key), sign);
+    int i, mask;
+
+    for (i = 0; i + 8 <= num; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+
+        v = _mm256_xor_si256(v, sign);
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+                                      _mm256_cmpgt_epi32(k, v)));
+        if (mask != 0xff) {
+            return i + __builtin_popcount(mask);
+        }
+    }
+
+    return i + rank_u32_sse42(keys + i, num - i, key);
+}
+
+__attribute__((target("avx2")))
+static int rank_u64_avx2(const uint64_t *keys, int num, uint64_t key)
+{
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)key), sign);
+    int i, mask;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+
+        v = _mm256_xor_si256(v, sign);
+        mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+                                      _mm256_cmpgt_epi64(k, v)));
+        if (mask != 0xf) {
+            return i + __builtin_popcount(mask);
+        }
+    }
+
+    return i + rank_u64_sse42(keys + i, num - i, key);
+}
+
+__attribute__((target("avx2")))
+static int rank_i64_avx2(const int64_t *keys, int num, int64_t key)
+{
+    __m256i k = _mm256_set1_epi64x(key);
+    int i, mask;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+
+        mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+                                      _mm256_cmpgt_epi64(k, v)));
+        if (mask != 0xf) {
+            return i + __builtin_popcount(mask);
+        }
+    }
+
+    return i + rank_i64_sse42(keys + i, num - i, key);
+}
+
+static const struct simd_kernels sse42_kernels = {
+    .name = "sse4.2",
+    .rank_u32 = rank_u32_sse42,
+    .rank_u64 = rank_u64_sse42,
+    .rank_i64 = rank_i64_sse42,
+};
+
+static const struct simd_kernels avx2_kernels = {
+    .name = "avx2",
+    .rank_u32 = rank_u32_avx2,
+    .rank_u64 = rank_u64_avx2,
+    .rank_i64 = rank_i64_avx2,
+};
+#endif /* TTREE_SIMD_X86 */
+
+#ifdef TTREE_SIMD_NEON
+static int rank_u32_neon(const uint32_t *keys, int num, uint32_t key)
+{
+    uint32x4_t k = vdupq_n_u32(key);
+    int i, lt;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        uint32x4_t v = vcltq_u32(vld1q_u32(keys + i), k);
+
+        lt = vaddvq_u32(vshrq_n_u32(v, 31));
+        if (lt != 4) {
+            return i + lt;
+        }
+    }
+
+    return i + rank_uint32_scalar(keys + i, num - i, key);
+}
+
+static int rank_u64_neon(const uint64_t *keys, int num, uint64_t key)
+{
+    uint64x2_t k = vdupq_n_u64(key);
+    int i, lt;
+
+    for (i = 0; i + 2 <= num; i += 2) {
+        uint64x2_t v = vcltq_u64(vld1q_u64(keys + i), k);
+
+        lt = (int)vaddvq_u64(vshrq_n_u64(v, 63));
+        if (lt != 2) {
+            return i + lt;
+        }
+    }
+
+    return i + rank_uint64_scalar(keys + i, num - i, key);
+}
+
+static int rank_i64_neon(const int64_t *keys, int num, int64_t key)
+{
+    int64x2_t k = vdupq_n_s64(key);
+    int i, lt;
+
+    for (i = 0; i + 2 <= num; i += 2) {
+        uint64x2_t v = vcltq_s64(vld1q_s64(keys + i), k);
+
+        lt = (int)vaddvq_u64(vshrq_n_u64(v, 63));
+        if (lt != 2) {
+            return i + lt;
+        }
+    }
+
+    return i + rank_int64_scalar(keys + i, num - i, key);
+}
+
+static const struct simd_kernels neon_kernels = {
+    .name = "neon",
+    .rank_u32 = rank_u32_neon,
+    .rank_u64 = rank_u64_neon,
+    .rank_i64 = rank_i64_neon,
+};
+#endif /* TTREE_SIMD_NEON */
+
+static const struct simd_kernels *kernels = NULL;
+
+static const struct simd_kernels *find_kernels(const char *name)
+{
+    if (!strcmp(name, scalar_kernels.name)) {
+        return &scalar_kernels;
+    }
+#ifdef TTREE_SIMD_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, avx2_kernels.name) && __builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    if (!strcmp(name, sse42_kernels.name) &&
+        __builtin_cpu_supports("sse4.2")) {
+        return &sse42_kernels;
+    }
+#endif /* TTREE_SIMD_X86 */
+#ifdef TTREE_SIMD_NEON
+    if (!strcmp(name, neon_kernels.name)) {
+        return &neon_kernels;
+    }
+#endif /* TTREE_SIMD_NEON */
+
+    return NULL;
+}
+
+/*
+ * Kernels are selected once at the very first call. The selection
+ * is idempotent, so there is no problem if several threads do it
+ * simultaneously.
+ */
+static const struct simd_kernels *get_kernels(void)
+{
+    static const char *preferred[] = { "avx2", "sse4.2", "neon", NULL };
+    const struct simd_kernels *k;
+    int i;
+
+    if (LIKELY(kernels != NULL)) {
+        return kernels;
+    }
+    for (i = 0; preferred[i]; i++) {
+        if ((k = find_kernels(preferred[i]))) {
+            kernels = k;
+            return k;
+        }
+    }
+
+    kernels = &scalar_kernels;
+    return kernels;
+}
+
+int ttree_rank_u32(const uint32_t *keys, int num, uint32_t key)
+{
+    return get_kernels()->rank_u32(keys, num, key);
+}
+
+int ttree_rank_u64(const uint64_t *keys, int num, uint64_t key)
+{
+    return get_kernels()->rank_u64(keys, num, key);
+}
+
+int ttree_rank_i64(const int64_t *keys, int num, int64_t key)
+{
+    return get_kernels()->rank_i64(keys, num, key);
+}
+
+int ttree_simd_select(const char *name)
+{
+    const struct simd_kernels *k = find_kernels(name);
+
+    if (!k) {
+        return -1;
+    }
+
+    kernels = k;
+    return 0;
+}
+
+const char *ttree_simd_name(void)
+{
+    return get_kernels()->name;
+}
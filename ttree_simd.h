@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Internal interface of vectorized search kernels used by
+ * typed T*-tree lookups. Not invented for public usage.
+ */
+
+#ifndef __TTREE_SIMD_H__
+#define __TTREE_SIMD_H__
+
+#include <stdint.h>
+
+/*
+ * Each function returns the number of elements of sorted
+ * array @keys (of @num elements) that are less than @key.
+ * So the result is an index of the first element that is
+ * greater or equal to @key.
+ */
+int ttree_rank_u32(const uint32_t *keys, int num, uint32_t key);
+int ttree_rank_u64(const uint64_t *keys, int num, uint64_t key);
+int ttree_rank_i64(const int64_t *keys, int num, int64_t key);
+
+/*
+ * Select kernels by name ("scalar", "sse4.2", "avx2" or "neon").
+ * By default the best kernels supported by CPU are selected at the
+ * first call. Returns 0 on success or -1 if the kernels are not
+ * supported.
+ */
+int ttree_simd_select(const char *name);
+
+/* Name of currently selected kernels. */
+const char *ttree_simd_name(void);
+
+#endif /* !__TTREE_SIMD_H__ */
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * @file ttree_typed.h
+ * @brief Statically typed T*-tree specializations.
+ *
+ * TTREE_DEFINE macro generates a set of functions working with
+ * T*-trees of particular item type. Unlike generic T*-tree API,
+ * generated functions know the key type, the comparison and the number
+ * of keys per node at compile time, so comparisons are inlined into
+ * the search loop. Only lookups are specialized: insertion and deletion
+ * at cursor don't compare keys at all, so generated functions reuse
+ * ttree_insert_at_cursor and ttree_delete_at_cursor.
+ *
+ * Example:
+ * <pre>
+ *   struct item {
+ *       int key;
+ *       ...
+ *   };
+ *
+ *   TTREE_DEFINE(itree, struct item, key, TTREE_NUM_CMP, 16)
+ *
+ *   Ttree tree;
+ *   struct item *item;
+ *
+ *   itree_init(&tree, true);
+ *   itree_insert(&tree, item);
+ *   item = itree_lookup(&tree, 10, NULL);
+ * </pre>
+ *
+ * The following functions are generated(where "prefix" is the first
+ * argument of TTREE_DEFINE):
+ *  - int prefix_init(Ttree *ttree, bool is_unique)
+ *  - item_type *prefix_lookup(Ttree *ttree, prefix_key_t key,
+ *                             TtreeCursor *cursor)
+ *  - int prefix_insert(Ttree *ttree, item_type *item)
+ *  - item_type *prefix_delete(Ttree *ttree, prefix_key_t key)
+ *  - item_type *prefix_cursor_item(TtreeCursor *cursor)
+ *  - item_type *prefix_first(Ttree *ttree, TtreeCursor *cursor)
+ *  - item_type *prefix_last(Ttree *ttree, TtreeCursor *cursor)
+ *  - item_type *prefix_next(TtreeCursor *cursor)
+ *  - item_type *prefix_prev(TtreeCursor *cursor)
+ */
+
+#ifndef __TTREE_TYPED_H__
+#define __TTREE_TYPED_H__
+
+#include "ttree.h"
+
+/**
+ * @brief Comparison of numeric keys suitable for TTREE_DEFINE.
+ */
+#define TTREE_NUM_CMP(a, b)                     \
+    (((a) > (b)) - ((a) < (b)))
+
+/**
+ * @brief Define typed T*-tree functions.
+ *
+ * @param prefix    - Prefix of generated functions and types.
+ * @param item_type - Type of items stored in a tree.
+ * @param key_field - Name of a key field in an @a item_type.
+ * @param cmp_expr  - Function or function-like macro comparing two keys
+ *                    passed by value. It must return negative value, 0 or
+ *                    positive value like user-defined comparison
+ *                    function does.
+ * @param nkeys     - Number of keys per T*-tree node.
+ * @see TTREE_DEFINE_INLINE
+ */
+#define TTREE_DEFINE(prefix, item_type, key_field, cmp_expr, nkeys)     \
+    __TTREE_DEFINE(prefix, item_type, key_field, cmp_expr, nkeys,       \
+                   __TTREE_KEY_BY_PTR, 0)
+
+/**
+ * @brief Define typed T*-tree functions for a tree storing keys inline.
+ *
+ * The same as TTREE_DEFINE, but nodes of a tree keep copies of keys
+ * (see ttree_init_inline), so the search never touches the items.
+ * @see TTREE_DEFINE
+ */
+#define TTREE_DEFINE_INLINE(prefix, item_type, key_field, cmp_expr, nkeys) \
+    __TTREE_DEFINE(prefix, item_type, key_field, cmp_expr, nkeys,       \
+                   __TTREE_KEY_INLINE, sizeof(prefix##_key_t))
+
+/* Get a key by its index in a node */
+#define __TTREE_KEY_BY_PTR(key_type, nkeys, tnode, idx)    \
+    (*(key_type *)tnode_key(tnode, idx))
+#define __TTREE_KEY_INLINE(key_type, nkeys, tnode, idx)                 \
+    (((key_type *)(void *)((char *)(tnode)->keys +                      \
+                           (nkeys) * sizeof(void *)))[(idx)])
+
+#define __TTREE_DEFINE(prefix, item_type, key_field, cmp_expr, nkeys,   \
+                       key_get, key_width)                              \
+    typedef TTREE_TYPEOF(((item_type *)0)->key_field) prefix##_key_t;   \
+                                                                        \
+    static __inline item_type *                                         \
+    prefix##__key2item(void *key)                                       \
+    {                                                                   \
+        return (item_type *)((char *)key - offsetof(item_type, key_field)); \
+    }                                                                   \
+                                                                        \
+    static int prefix##__cmp(void *key1, void *key2)                    \
+    {                                                                   \
+        return cmp_expr(*(prefix##_key_t *)key1, *(prefix##_key_t *)key2); \
+    }                                                                   \
+                                                                        \
+    static __inline int prefix##_init(Ttree *ttree, bool is_unique)     \
+    {                                                                   \
+        TTREE_CT_ASSERT(((nkeys) >= TNODE_ITEMS_MIN) &&                 \
+                        ((nkeys) <= TNODE_ITEMS_MAX));                  \
+        return __ttree_init_inline(ttree, (nkeys), is_unique,           \
+                                   prefix##__cmp,                       \
+                                   offsetof(item_type, key_field),      \
+                                   (key_width));                        \
+    }                                                                   \
+                                                                        \
+    /* Binary search inside a node, see lookup_inside_tnode */          \
+    static __inline item_type *                                         \
+    prefix##__lookup_inside(TtreeNode *tnode, prefix##_key_t key,       \
+                            int floor, int ceil, int *out_idx)          \
+    {                                                                   \
+        int mid, cmp_res;                                               \
+                                                                        \
+        while (floor <= ceil) {                                         \
+            mid = (floor + ceil) >> 1;                                  \
+            cmp_res = cmp_expr(key, key_get(prefix##_key_t, nkeys,      \
+                                            tnode, mid));               \
+            if (cmp_res < 0)                                            \
+                ceil = mid - 1;                                         \
+            else if (cmp_res > 0)                                       \
+                floor = mid + 1;                                        \
+            else {                                                      \
+                *out_idx = mid;                                         \
+                return prefix##__key2item(tnode_key(tnode, mid));       \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        *out_idx = floor;                                               \
+        return NULL;                                                    \
+    }                                                                   \
+                                                                        \
+    /* The same algorithm ttree_lookup uses */                          \
+    static __inline item_type *                                         \
+    prefix##_lookup(Ttree *ttree, prefix##_key_t key, TtreeCursor *cursor) \
+    {                                                                   \
+        TtreeNode *n, *marked_tn = NULL, *target;                       \
+        int side = TNODE_BOUND, cmp_res = 0, idx = ((nkeys) >> 1) - 1;  \
+        item_type *item = NULL;                                         \
+        enum ttree_cursor_state st = CURSOR_PENDING;                    \
+                                                                        \
+        TTREE_ASSERT(ttree->keys_per_tnode == (nkeys));                 \
+        if (UNLIKELY(ttree->flags & TTREE_CONCURRENT)) {                \
+            /* Concurrent readers have to validate their path */        \
+            return (item_type *)ttree_lookup(ttree, &key, cursor);      \
+        }                                                               \
+                                                                        \
+        target = n = ttree->root;                                       \
+        while (n) {                                                     \
+            target = n;                                                 \
+            cmp_res = cmp_expr(key, key_get(prefix##_key_t, nkeys,      \
+                                            n, n->min_idx));            \
+            if (cmp_res < 0)                                            \
+                side = TNODE_LEFT;                                      \
+            else if (cmp_res > 0) {                                     \
+                marked_tn = n;                                          \
+                side = TNODE_RIGHT;                                     \
+            }                                                           \
+            else {                                                      \
+                side = TNODE_BOUND;                                     \
+                idx = n->min_idx;                                       \
+                item = prefix##__key2item(tnode_key_min(n));            \
+                st = CURSOR_OPENED;                                     \
+                goto out;                                               \
+            }                                                           \
+                                                                        \
+            n = n->sides[side];                                         \
+        }                                                               \
+        if (marked_tn) {                                                \
+            int c = cmp_expr(key, key_get(prefix##_key_t, nkeys,        \
+                                          marked_tn, marked_tn->max_idx)); \
+                                                                        \
+            if (c <= 0) {                                               \
+                side = TNODE_BOUND;                                     \
+                target = marked_tn;                                     \
+                if (!c) {                                               \
+                    item = prefix##__key2item(tnode_key_max(target));   \
+                    idx = target->max_idx;                              \
+                    st = CURSOR_OPENED;                                 \
+                }                                                       \
+                else {                                                  \
+                    item = prefix##__lookup_inside(target, key,         \
+                                                   target->min_idx + 1, \
+                                                   target->max_idx - 1, \
+                                                   &idx);               \
+                    st = item ? CURSOR_OPENED : CURSOR_PENDING;         \
+                }                                                       \
+                                                                        \
+                goto out;                                               \
+            }                                                           \
+        }                                                               \
+        if (target && (tnode_num_keys(target) < (nkeys))) {             \
+            side = TNODE_BOUND;                                         \
+            idx = ((marked_tn != target) || (cmp_res < 0)) ?            \
+                target->min_idx : (target->max_idx + 1);                \
+            st = CURSOR_PENDING;                                        \
+        }                                                               \
+                                                                        \
+    out:                                                                \
+        if (cursor) {                                                   \
+            ttree_cursor_open_on_node(cursor, ttree, target,            \
+                                      TNODE_SEEK_START);                \
+            cursor->side = side;                                        \
+            cursor->idx = idx;                                          \
+            cursor->state = st;                                         \
+        }                                                               \
+                                                                        \
+        return item;                                                    \
+    }                                                                   \
+                                                                        \
+    static __inline int prefix##_insert(Ttree *ttree, item_type *item)  \
+    {                                                                   \
+        TtreeCursor cursor;                                             \
+                                                                        \
+        if (prefix##_lookup(ttree, item->key_field, &cursor) &&         \
+            ttree->keys_are_unique) {                                   \
+            return -1;                                                  \
+        }                                                               \
+                                                                        \
+        ttree_insert_at_cursor(&cursor, item);                          \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    static __inline item_type *                                         \
+    prefix##_delete(Ttree *ttree, prefix##_key_t key)                   \
+    {                                                                   \
+        TtreeCursor cursor;                                             \
+                                                                        \
+        if (!prefix##_lookup(ttree, key, &cursor)) {                    \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        return (item_type *)ttree_delete_at_cursor(&cursor);            \
+    }                                                                   \
+                                                                        \
+    static __inline item_type *prefix##_cursor_item(TtreeCursor *cursor) \
+    {                                                                   \
+        return (item_type *)ttree_item_from_cursor(cursor);             \
+    }                                                                   \
+                                                                        \
+    static __inline item_type *                                         \
+    prefix##_first(Ttree *ttree, TtreeCursor *cursor)                   \
+    {                                                                   \
+        ttree_cursor_open(cursor, ttree);                               \
+        if (ttree_cursor_first(cursor) != TCSR_OK) {                    \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        return prefix##_cursor_item(cursor);                            \
+    }                                                                   \
+                                                                        \
+    static __inline item_type *                                         \
+    prefix##_last(Ttree *ttree, TtreeCursor *cursor)                    \
+    {                                                                   \
+        ttree_cursor_open(cursor, ttree);                               \
+        if (ttree_cursor_last(cursor) != TCSR_OK) {                     \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        return prefix##_cursor_item(cursor);                            \
+    }                                                                   \
+                                                                        \
+    static __inline item_type *prefix##_next(TtreeCursor *cursor)       \
+    {                                                                   \
+        if (ttree_cursor_next(cursor) != TCSR_OK) {                     \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        return prefix##_cursor_item(cursor);                            \
+    }                                                                   \
+                                                                        \
+    static __inline item_type *prefix##_prev(TtreeCursor *cursor)       \
+    {                                                                   \
+        if (ttree_cursor_prev(cursor) != TCSR_OK) {                     \
+            return NULL;                                                \
+        }                                                               \
+                                                                        \
+        return prefix##_cursor_item(cursor);                            \
+    }
+
+#endif /* !__TTREE_TYPED_H__ */